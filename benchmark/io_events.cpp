@@ -0,0 +1,356 @@
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+#include <getopt.h>
+
+#include "io.hpp"
+#include "io_ring.hpp"
+#include "uring_io.hpp"
+#include "udp_sock.hpp"
+#include "burst_read.hpp"
+#include "burst_write.hpp"
+#include "buffer_pkt.hpp"
+#include "buffer_pool.hpp"
+#include "final_layer.hpp"
+
+/* Events per second dispatched by io for a number of always ready
+ * eventfds, comparing backends, batch sizes, level and edge triggering,
+ * and std::function against function pointer callbacks.
+ *
+ * With -udp, packets per second echoed over loopback UDP by the stacks
+ * of udp_tap_rlnc instead, which io_ring receives and sends with its own
+ * requests (uring_io). Run one backend under strace -c -f to compare the
+ * system calls per packet:
+ *
+ *     strace -c -f io_events -udp -backend uring */
+
+struct args {
+    /* milliseconds to run each configuration */
+    size_t duration = 500;
+
+    /* largest number of file descriptors */
+    size_t fds = 4096;
+
+    /* echo UDP packets instead of dispatching eventfd events */
+    bool udp = false;
+
+    /* run only this backend (epoll or uring) */
+    std::string backend;
+
+    /* UDP packets in flight */
+    size_t window = 64;
+
+    /* local UDP port of the echo server */
+    std::string port = "18940";
+};
+
+struct option options[] = {
+    {"duration", required_argument, NULL, 1},
+    {"fds",      required_argument, NULL, 2},
+    {"udp",      no_argument,       NULL, 3},
+    {"backend",  required_argument, NULL, 4},
+    {"window",   required_argument, NULL, 5},
+    {"port",     required_argument, NULL, 6},
+    {0}
+};
+
+typedef uring_io<
+        burst_read<
+        burst_write<
+        udp_sock_client<
+        buffer_pool<buffer_pkt,
+        final_layer
+        >>>>> client_stack;
+
+typedef uring_io<
+        burst_read<
+        udp_sock_server<
+        buffer_pool<buffer_pkt,
+        final_layer
+        >>>> server_stack;
+
+template<class reactor>
+class bench
+{
+    reactor m_io;
+    std::vector<int> m_fds;
+    bool m_edge;
+    size_t m_events = 0;
+
+    void read_fd(int fd)
+    {
+        uint64_t val;
+
+        /* edge triggered fds are drained until EAGAIN */
+        while (read(fd, &val, sizeof(val)) > 0 && m_edge)
+            ;
+
+        val = 1;
+
+        if (write(fd, &val, sizeof(val)) < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to write eventfd");
+
+        m_events++;
+    }
+
+  public:
+    bench(size_t fds, size_t batch, bool edge, bool function)
+        : m_io(batch),
+          m_edge(edge)
+    {
+        using std::placeholders::_1;
+
+        uint32_t flags = edge ? reactor::edge_triggered : 0;
+        auto rf = std::bind(&bench::read_fd, this, _1);
+        uint64_t val = 1;
+
+        for (size_t i = 0; i < fds; ++i) {
+            int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+            if (fd < 0)
+                throw std::system_error(errno, std::system_category(),
+                                        "unable to create eventfd");
+
+            m_fds.push_back(fd);
+
+            if (function)
+                m_io.add_cb(fd, rf, NULL, flags);
+            else
+                m_io.template add_cb<bench, &bench::read_fd>(fd, this, flags);
+
+            if (write(fd, &val, sizeof(val)) < 0)
+                throw std::system_error(errno, std::system_category(),
+                                        "unable to write eventfd");
+        }
+    }
+
+    ~bench()
+    {
+        for (int fd : m_fds) {
+            m_io.del_cb(fd);
+            close(fd);
+        }
+    }
+
+    double run(size_t ms)
+    {
+        auto start = std::chrono::steady_clock::now();
+        auto end = start + std::chrono::milliseconds(ms);
+        std::chrono::duration<double> elapsed;
+
+        do {
+            for (size_t i = 0; i < 64; ++i)
+                m_io.wait(0);
+        } while (std::chrono::steady_clock::now() < end);
+
+        elapsed = std::chrono::steady_clock::now() - start;
+
+        return m_events/elapsed.count();
+    }
+};
+
+/* a client keeping a window of packets in flight to a server sending
+ * them back */
+template<class reactor>
+class udp_bench
+{
+    static constexpr size_t m_size = 1400;
+
+    reactor m_io;
+    server_stack m_srv;
+    client_stack m_cli;
+    size_t m_window;
+    size_t m_sent = 0;
+    size_t m_echoes = 0;
+
+    void send()
+    {
+        auto buf = m_cli.buffer();
+
+        memset(buf->data_put(m_size), 0x5a, m_size);
+
+        if (m_cli.write_pkt(buf))
+            m_sent++;
+    }
+
+    void srv_read(int)
+    {
+        auto buf = m_srv.buffer();
+
+        while (m_srv.read_pkt(buf)) {
+            m_srv.write_pkt(buf);
+            buf->reset();
+        }
+    }
+
+    void cli_read(int)
+    {
+        auto buf = m_cli.buffer();
+
+        while (m_cli.read_pkt(buf)) {
+            m_echoes++;
+            buf->reset();
+        }
+    }
+
+  public:
+    udp_bench(const struct args &args)
+        : m_srv(server_stack::local_address="127.0.0.1",
+                server_stack::port=args.port.c_str(),
+                server_stack::uring=uring_of(m_io)),
+          m_cli(client_stack::remote_address="127.0.0.1",
+                client_stack::port=args.port.c_str(),
+                client_stack::uring=uring_of(m_io)),
+          m_window(args.window)
+    {
+        m_io.template add_cb<udp_bench, &udp_bench::srv_read>(m_srv.fd(),
+                                                               this);
+        m_io.template add_cb<udp_bench, &udp_bench::cli_read>(m_cli.fd(),
+                                                               this);
+        m_io.add_flush_cb([this]() { m_cli.flush(); });
+    }
+
+    ~udp_bench()
+    {
+        m_io.del_cb(m_srv.fd());
+        m_io.del_cb(m_cli.fd());
+    }
+
+    size_t echoes() const
+    {
+        return m_echoes;
+    }
+
+    double run(size_t ms)
+    {
+        auto start = std::chrono::steady_clock::now();
+        auto end = start + std::chrono::milliseconds(ms);
+        std::chrono::duration<double> elapsed;
+
+        do {
+            while (m_sent - m_echoes < m_window)
+                send();
+
+            /* packets dropped on the way are given up on */
+            if (m_io.wait(10) == 0)
+                m_sent = m_echoes;
+        } while (std::chrono::steady_clock::now() < end);
+
+        elapsed = std::chrono::steady_clock::now() - start;
+
+        return m_echoes/elapsed.count();
+    }
+};
+
+template<class reactor>
+static void udp(const char *name, const struct args &args)
+{
+    udp_bench<reactor> b(args);
+    double rate = b.run(args.duration);
+
+    printf("%7s %6zu %10zu %14.0f\n", name, args.window, b.echoes(), rate);
+}
+
+static void raise_fd_limit(size_t fds)
+{
+    struct rlimit lim;
+
+    if (getrlimit(RLIMIT_NOFILE, &lim) < 0)
+        return;
+
+    if (lim.rlim_cur >= fds + 64)
+        return;
+
+    lim.rlim_cur = std::min<rlim_t>(fds + 64, lim.rlim_max);
+    setrlimit(RLIMIT_NOFILE, &lim);
+}
+
+template<class reactor>
+static void sweep(const char *name, const struct args &args)
+{
+    for (size_t fds = 1; fds <= args.fds; fds *= 16) {
+        for (size_t batch : {2, 64}) {
+            for (bool edge : {false, true}) {
+                for (bool function : {true, false}) {
+                    bench<reactor> b(fds, batch, edge, function);
+
+                    printf("%7s %6zu %6zu %5s %9s %14.0f\n", name, fds,
+                           batch, edge ? "et" : "lt",
+                           function ? "function" : "template",
+                           b.run(args.duration));
+                }
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct args args;
+    signed char a;
+
+    while ((a = getopt_long_only(argc, argv, "", options, NULL)) != -1) {
+        switch (a) {
+            case 1:
+                args.duration = atoi(optarg);
+                break;
+
+            case 2:
+                args.fds = atoi(optarg);
+                break;
+
+            case 3:
+                args.udp = true;
+                break;
+
+            case 4:
+                args.backend = optarg;
+                break;
+
+            case 5:
+                args.window = atoi(optarg);
+                break;
+
+            case 6:
+                args.port = optarg;
+                break;
+
+            case '?':
+                return 1;
+                break;
+        }
+    }
+
+    if (args.udp) {
+        printf("%7s %6s %10s %14s\n", "backend", "window", "packets",
+               "packets/s");
+
+        if (args.backend.empty() || args.backend == "epoll")
+            udp<io>("epoll", args);
+
+        if (args.backend.empty() || args.backend == "uring")
+            udp<io_ring>("uring", args);
+
+        return EXIT_SUCCESS;
+    }
+
+    raise_fd_limit(args.fds);
+    printf("%7s %6s %6s %5s %9s %14s\n",
+           "backend", "fds", "batch", "mode", "callback", "events/s");
+
+    if (args.backend.empty() || args.backend == "epoll")
+        sweep<io>("epoll", args);
+
+    if (args.backend.empty() || args.backend == "uring")
+        sweep<io_ring>("uring", args);
+
+    return EXIT_SUCCESS;
+}
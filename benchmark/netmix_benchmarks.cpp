@@ -0,0 +1,504 @@
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <gauge/gauge.hpp>
+
+#include "rlnc_codes.hpp"
+#include "len_hdr.hpp"
+#include "rlnc_data_enc.hpp"
+#include "rlnc_data_dec.hpp"
+#include "rlnc_data_rec.hpp"
+#include "rlnc_data_hlp.hpp"
+#include "rlnc_hdr.hpp"
+#include "timers.hpp"
+#include "budgets.hpp"
+#include "loss.hpp"
+#include "eth_hdr.hpp"
+#include "eth_topology.hpp"
+#include "loopback.hpp"
+#include "error_info.hpp"
+#include "rlnc_info.hpp"
+#include "buffer_pkt.hpp"
+#include "slab_pool.hpp"
+#include "final_layer.hpp"
+
+/* Throughput of the encoder, decoder, recoder and helper stacks, wired
+ * together on a loopback_wire instead of sockets. Each benchmark moves
+ * a number of blocks from the encoder to the decoder and only counts
+ * the time spent inside the stack it is named after; the others run on
+ * the same thread but are left out. The result is MB of source data
+ * delivered per second of that time, or the packets the stack sent (or,
+ * for the decoder, received) per second with --unit=packets/s.
+ *
+ * Synthetic loss is applied to every link by loss_dec and loss_hlp, with
+ * the same probability for e1 to e4. There is no timer wheel: when no
+ * stack has anything left to do, their timer() is called, as the apps do
+ * when the io loop times out. */
+
+template<class codes>
+using enc_stack = len_hdr<
+        rlnc_data_enc<typename codes::encoder,
+        rlnc_hdr<
+        timers<
+        source_budgets<
+        eth_hdr<
+        eth_topology<
+        loopback<
+        error_info<
+        rlnc_info<
+        slab_pool<buffer_pkt,
+        final_layer
+        >>>>>>>>>>>;
+
+template<class codes>
+using dec_stack = len_hdr<
+        rlnc_data_dec<typename codes::decoder,
+        rlnc_hdr<
+        timers<
+        eth_hdr<
+        loss_dec<
+        eth_topology<
+        loopback<
+        error_info<
+        rlnc_info<
+        slab_pool<buffer_pkt,
+        final_layer
+        >>>>>>>>>>>;
+
+template<class codes>
+using rec_stack = rlnc_data_rec<typename codes::decoder,
+        rlnc_hdr<
+        timers<
+        relay_budgets<
+        eth_hdr<
+        loss_dec<
+        eth_topology<
+        loopback<
+        error_info<
+        rlnc_info<
+        slab_pool<buffer_pkt,
+        final_layer
+        >>>>>>>>>>>;
+
+template<class codes>
+using hlp_stack = rlnc_data_hlp<typename codes::decoder,
+        rlnc_hdr<
+        helper_budgets<
+        eth_hdr<
+        loss_hlp<
+        eth_topology<
+        loopback<
+        error_info<
+        rlnc_info<
+        slab_pool<buffer_pkt,
+        final_layer
+        >>>>>>>>>>;
+
+enum stage {
+    stage_enc,
+    stage_dec,
+    stage_rec,
+    stage_hlp,
+    stage_max
+};
+
+/* addresses on the wire */
+static const char *enc_address   = "02:00:00:00:00:01";
+static const char *dec_address   = "02:00:00:00:00:02";
+static const char *rec_a_address = "02:00:00:00:00:03";
+static const char *rec_b_address = "02:00:00:00:00:04";
+static const char *hlp_address   = "02:00:00:00:00:05";
+
+/* rounds in a row without progress before a transfer is given up */
+static const size_t idle_max = 10000;
+
+template<class codes, stage measured>
+class rlnc_throughput : public gauge::time_benchmark
+{
+    typedef ::enc_stack<codes> enc_stack;
+    typedef ::dec_stack<codes> dec_stack;
+    typedef ::rec_stack<codes> rec_stack;
+    typedef ::hlp_stack<codes> hlp_stack;
+    typedef std::chrono::steady_clock clock;
+
+    std::unique_ptr<loopback_wire> m_wire;
+    std::unique_ptr<enc_stack> m_enc;
+    std::unique_ptr<dec_stack> m_dec;
+    std::unique_ptr<rec_stack> m_rec_a;
+    std::unique_ptr<rec_stack> m_rec_b;
+    std::unique_ptr<hlp_stack> m_hlp;
+
+    clock::duration m_time[stage_max];
+    size_t m_blocks = 0;
+    size_t m_symbols = 0;
+    size_t m_bytes = 0;
+    size_t m_delivered = 0;
+    bool m_packets_unit = false;
+
+    template<class F>
+    auto timed(stage s, F f) -> decltype(f())
+    {
+        auto start = clock::now();
+        auto res = f();
+
+        m_time[s] += clock::now() - start;
+
+        return res;
+    }
+
+    template<class F>
+    void timed_void(stage s, F f)
+    {
+        timed(s, [&f]() { f(); return true; });
+    }
+
+    void write_source(uint8_t fill)
+    {
+        auto buf = m_enc->buffer();
+        size_t len = m_enc->data_size_max();
+
+        memset(buf->data_put(len), fill, len);
+        timed(stage_enc, [&]() { return m_enc->write_pkt(buf); });
+    }
+
+    void read_enc()
+    {
+        auto buf = m_enc->buffer();
+
+        while (m_enc->read_pending()) {
+            timed(stage_enc, [&]() { return m_enc->read_pkt(buf); });
+            buf->reset();
+        }
+    }
+
+    void read_dec()
+    {
+        auto buf = m_dec->buffer();
+
+        while (timed(stage_dec, [&]() { return m_dec->read_pkt(buf); })) {
+            m_bytes += buf->len();
+            m_delivered++;
+            buf->reset();
+        }
+    }
+
+    /* the glue of rlnc_recoder, between its two sides */
+    void read_rec(rec_stack &from, rec_stack &to)
+    {
+        auto buf = from.buffer();
+
+        while (from.read_pending()) {
+            if (timed(stage_rec, [&]() { return from.read_pkt(buf); }))
+                timed(stage_rec, [&]() { return to.write_pkt(buf); });
+
+            buf->reset();
+        }
+    }
+
+    void read_hlp()
+    {
+        auto buf = m_hlp->buffer();
+
+        while (m_hlp->read_pending()) {
+            if (timed(stage_hlp, [&]() { return m_hlp->read_pkt(buf); }))
+                timed(stage_hlp, [&]() { return m_hlp->write_pkt(buf); });
+
+            buf->reset();
+        }
+    }
+
+    void timer()
+    {
+        timed_void(stage_enc, [this]() { m_enc->timer(); });
+        timed_void(stage_dec, [this]() { m_dec->timer(); });
+
+        if (m_rec_a) {
+            timed_void(stage_rec, [this]() { m_rec_a->timer(); });
+            timed_void(stage_rec, [this]() { m_rec_b->timer(); });
+        }
+    }
+
+    void transfer()
+    {
+        size_t total = m_blocks*m_symbols;
+        size_t end = m_delivered + total;
+        size_t sent = 0, idle = 0, progress;
+
+        while (m_delivered < end) {
+            progress = m_wire->packets() + m_delivered;
+
+            if (sent < total && !m_enc->is_full())
+                write_source(sent++);
+
+            if (m_rec_a) {
+                read_rec(*m_rec_a, *m_rec_b);
+                read_rec(*m_rec_b, *m_rec_a);
+            }
+
+            if (m_hlp)
+                read_hlp();
+
+            read_dec();
+            read_enc();
+
+            if (progress != m_wire->packets() + m_delivered) {
+                idle = 0;
+                continue;
+            }
+
+            if (++idle > idle_max)
+                throw std::runtime_error("transfer stalled");
+
+            timer();
+        }
+    }
+
+    /* packets handled by the measured stack */
+    size_t packets() const
+    {
+        switch (measured) {
+            case stage_enc:
+                return m_enc->packets_written();
+
+            case stage_dec:
+                return m_dec->packets_read();
+
+            case stage_rec:
+                return m_rec_a->packets_written() +
+                       m_rec_b->packets_written();
+
+            default:
+                return m_hlp->packets_written();
+        }
+    }
+
+  public:
+    void get_options(gauge::po::variables_map &options)
+    {
+        auto symbols = options["symbols"].as<std::vector<uint32_t>>();
+        auto symbol_size = options["symbol_size"].as<std::vector<uint32_t>>();
+        auto loss = options["loss"].as<std::vector<double>>();
+
+        m_blocks = options["blocks"].as<uint32_t>();
+        m_packets_unit = options["unit"].as<std::string>() == "packets/s";
+
+        for (auto s : symbols) {
+            for (auto z : symbol_size) {
+                for (auto l : loss) {
+                    gauge::config_set cs;
+
+                    cs.set_value<uint32_t>("symbols", s);
+                    cs.set_value<uint32_t>("symbol_size", z);
+                    cs.set_value<double>("loss", l);
+                    add_configuration(cs);
+                }
+            }
+        }
+    }
+
+    void setup()
+    {
+        const gauge::config_set &cs = get_current_configuration();
+        size_t symbols = cs.get_value<uint32_t>("symbols");
+        size_t symbol_size = cs.get_value<uint32_t>("symbol_size");
+        double loss = cs.get_value<double>("loss");
+        std::vector<double> errors = {loss, loss, loss, loss};
+        bool rec = measured == stage_rec;
+        bool hlp = measured == stage_hlp;
+
+        m_wire.reset(new loopback_wire);
+
+        m_enc.reset(new enc_stack(
+                enc_stack::wire=m_wire.get(),
+                enc_stack::wire_address=enc_address,
+                enc_stack::neighbor=(rec ? rec_a_address : dec_address),
+                enc_stack::helper=(hlp ? hlp_address : NULL),
+                enc_stack::symbols=symbols,
+                enc_stack::symbol_size=symbol_size,
+                enc_stack::errors=errors
+        ));
+
+        m_dec.reset(new dec_stack(
+                dec_stack::wire=m_wire.get(),
+                dec_stack::wire_address=dec_address,
+                dec_stack::neighbor=(rec ? rec_b_address : enc_address),
+                dec_stack::helper=(hlp ? hlp_address : NULL),
+                dec_stack::two_hop=(rec ? enc_address : NULL),
+                dec_stack::symbols=symbols,
+                dec_stack::symbol_size=symbol_size,
+                dec_stack::errors=errors
+        ));
+
+        if (rec) {
+            m_rec_a.reset(new rec_stack(
+                    rec_stack::wire=m_wire.get(),
+                    rec_stack::wire_address=rec_a_address,
+                    rec_stack::neighbor=enc_address,
+                    rec_stack::symbols=symbols,
+                    rec_stack::symbol_size=symbol_size,
+                    rec_stack::errors=errors
+            ));
+
+            m_rec_b.reset(new rec_stack(
+                    rec_stack::wire=m_wire.get(),
+                    rec_stack::wire_address=rec_b_address,
+                    rec_stack::neighbor=dec_address,
+                    rec_stack::symbols=symbols,
+                    rec_stack::symbol_size=symbol_size,
+                    rec_stack::errors=errors
+            ));
+        }
+
+        if (hlp) {
+            m_hlp.reset(new hlp_stack(
+                    hlp_stack::wire=m_wire.get(),
+                    hlp_stack::wire_address=hlp_address,
+                    hlp_stack::neighbor=dec_address,
+                    hlp_stack::source=enc_address,
+                    hlp_stack::destination=dec_address,
+                    hlp_stack::symbols=symbols,
+                    hlp_stack::symbol_size=symbol_size,
+                    hlp_stack::errors=errors,
+                    hlp_stack::promisc=1
+            ));
+        }
+
+        for (auto &t : m_time)
+            t = clock::duration::zero();
+
+        m_symbols = symbols;
+        m_bytes = 0;
+        m_delivered = 0;
+    }
+
+    void tear_down()
+    {
+        m_hlp.reset();
+        m_rec_b.reset();
+        m_rec_a.reset();
+        m_dec.reset();
+        m_enc.reset();
+        m_wire.reset();
+    }
+
+    double measurement()
+    {
+        std::chrono::duration<double> time = m_time[measured];
+
+        if (time.count() <= 0)
+            return 0;
+
+        if (m_packets_unit)
+            return packets()/time.count();
+
+        return m_bytes/time.count()/1e6;
+    }
+
+    std::string unit_text() const
+    {
+        return m_packets_unit ? "packets/s" : "MB/s";
+    }
+
+    void run()
+    {
+        RUN {
+            transfer();
+        }
+    }
+};
+
+BENCHMARK_OPTION(throughput_options)
+{
+    gauge::po::options_description options;
+
+    std::vector<uint32_t> symbols = {16, 64, 128};
+    std::vector<uint32_t> symbol_size = {500, 1450};
+    std::vector<double> loss = {0, 0.1, 0.3};
+
+    options.add_options()
+        ("symbols",
+         gauge::po::value<std::vector<uint32_t>>()->default_value(
+             symbols, "")->multitoken(),
+         "Set the number of symbols in a block")
+        ("symbol_size",
+         gauge::po::value<std::vector<uint32_t>>()->default_value(
+             symbol_size, "")->multitoken(),
+         "Set the symbol size in bytes, at most 1450")
+        ("loss",
+         gauge::po::value<std::vector<double>>()->default_value(
+             loss, "")->multitoken(),
+         "Set the synthetic loss probability of every link")
+        ("blocks",
+         gauge::po::value<uint32_t>()->default_value(20),
+         "Set the number of blocks transferred in a run")
+        ("unit",
+         gauge::po::value<std::string>()->default_value("MB/s"),
+         "Report MB/s of source data or packets/s of the measured stack");
+
+    gauge::runner::instance().register_options(options);
+}
+
+typedef rlnc_throughput<kodo_codes, stage_enc> kodo_enc;
+typedef rlnc_throughput<kodo_codes, stage_dec> kodo_dec;
+typedef rlnc_throughput<kodo_codes, stage_rec> kodo_rec;
+typedef rlnc_throughput<kodo_codes, stage_hlp> kodo_hlp;
+
+typedef rlnc_throughput<gf_codes<gf_binary8>, stage_enc> binary8_enc;
+typedef rlnc_throughput<gf_codes<gf_binary8>, stage_dec> binary8_dec;
+typedef rlnc_throughput<gf_codes<gf_binary8>, stage_rec> binary8_rec;
+typedef rlnc_throughput<gf_codes<gf_binary8>, stage_hlp> binary8_hlp;
+
+BENCHMARK_F(kodo_enc, Kodo, Encode, 5)
+{
+    run();
+}
+
+BENCHMARK_F(kodo_dec, Kodo, Decode, 5)
+{
+    run();
+}
+
+BENCHMARK_F(kodo_rec, Kodo, Recode, 5)
+{
+    run();
+}
+
+BENCHMARK_F(kodo_hlp, Kodo, Help, 5)
+{
+    run();
+}
+
+BENCHMARK_F(binary8_enc, Binary8, Encode, 5)
+{
+    run();
+}
+
+BENCHMARK_F(binary8_dec, Binary8, Decode, 5)
+{
+    run();
+}
+
+BENCHMARK_F(binary8_rec, Binary8, Recode, 5)
+{
+    run();
+}
+
+BENCHMARK_F(binary8_hlp, Binary8, Help, 5)
+{
+    run();
+}
+
+int main(int argc, const char *argv[])
+{
+    srand(static_cast<uint32_t>(time(0)));
+
+    gauge::runner::add_default_printers();
+    gauge::runner::run_benchmarks(argc, argv);
+
+    return 0;
+}
@@ -3,10 +3,13 @@
 #include <cstring>
 #include <vector>
 #include <memory>
+#include <thread>
 #include <functional>
 #include <endian.h>
 
 #include "io.hpp"
+#include "io_ring.hpp"
+#include "uring_io.hpp"
 #include "signal.hpp"
 #include "rlnc_codes.hpp"
 #include "counters.hpp"
@@ -51,6 +54,13 @@ struct args {
 
     /* ratio of extra packets distributed on each connection */
     double overshoot         = 1.2;
+
+    /* wait for the sockets with io_uring, and receive and send on the
+     * tun device with it */
+    bool io_uring            = false;
+
+    /* number of queues on the tun device, each with its own worker */
+    size_t queues            = 1;
 };
 
 struct option options[] = {
@@ -65,13 +75,16 @@ struct option options[] = {
     {"send_buf",        required_argument, NULL, 9},
     {"overshoot",       required_argument, NULL, 10},
     {"status_interval", required_argument, NULL, 11},
+    {"io_uring",        no_argument,       NULL, 12},
+    {"queues",          required_argument, NULL, 13},
     {0}
 };
 
-typedef tun<
+typedef uring_io<
+        tun<
         buffer_pool<buffer_pkt,
         final_layer
-        >> tun_stack;
+        >>> tun_stack;
 
 typedef counters<
         tcp_hdr<
@@ -92,7 +105,7 @@ typedef tcp_sock_server<
         final_layer
         >> srv_stack;
 
-template<class stack>
+template<class stack, class reactor>
 class coder
 {
     typedef fifi::binary field;
@@ -102,7 +115,7 @@ class coder
 
   public:
     typedef std::unique_ptr<stack> peer_ptr;
-    io m_io;
+    reactor m_io;
 
   private:
     enum rlnc_type : uint8_t {
@@ -553,33 +566,28 @@ class coder
           m_dec_factory(args.symbols, args.symbol_size),
           m_enc(m_enc_factory.build()),
           m_dec(m_dec_factory.build()),
-          m_tun(tun_stack::interface=args.interface),
+          m_tun(tun_stack::interface=args.interface,
+                tun_stack::multi_queue=static_cast<int>(args.queues > 1),
+                tun_stack::uring=uring_of(m_io)),
           m_max(args.symbols * args.overshoot),
           m_send_buf(args.send_buf),
           m_status_interval(args.status_interval)
     {
-        using std::placeholders::_1;
-
-        auto rt = std::bind(&coder::recv_tun, this, _1);
-
-        m_io.add_cb(m_tun.fd(), rt, NULL);
+        m_io.template add_cb<coder, &coder::recv_tun>(m_tun.fd(), this);
         std::cout << "payload size: " << m_enc->payload_size() << std::endl;
         std::cout << "max: " << m_max << std::endl;
     }
 
     void add_peer(peer_ptr p)
     {
-        using std::placeholders::_1;
-
         size_t max = p->fd() + 1;
-        auto rp = std::bind(&coder::recv_peer, this, _1);
-        auto sp = std::bind(&coder::send_peer, this, _1);
 
         if (m_peers.size() < max)
             m_peers.resize(max);
 
         p->sock_send_buf(m_send_buf);
-        m_io.add_cb(p->fd(), rp, sp);
+        m_io.template add_cb<coder, &coder::recv_peer, &coder::send_peer>(
+                p->fd(), this);
         m_io.disable_write(p->fd());
         m_peers[p->fd()] = std::move(p);
         m_peers_count++;
@@ -591,7 +599,9 @@ class coder
         int res;
 
         while (m_sig.running()) {
-            res = m_io.wait();
+            /* wake up now and then to see a signal taken by another
+             * worker */
+            res = m_io.wait(100);
 
             if (res < 0)
                 break;
@@ -602,11 +612,15 @@ class coder
     }
 };
 
-class client : public coder<client_stack>
+template<class reactor>
+class client : public coder<client_stack, reactor>
 {
+    typedef coder<client_stack, reactor> base;
+    typedef typename base::peer_ptr peer_ptr;
+
   public:
     client(const struct args &args)
-        : coder(args)
+        : base(args)
     {
         client_stack *c;
 
@@ -617,7 +631,7 @@ class client : public coder<client_stack>
                 client_stack::remote_address=args.address,
                 client_stack::port=args.port
                 );
-        coder::add_peer(coder::peer_ptr(c));
+        base::add_peer(peer_ptr(c));
 
         c = new client_stack(
                 client_stack::redundancy=(args.overshoot - 1),
@@ -626,12 +640,16 @@ class client : public coder<client_stack>
                 client_stack::remote_address=args.address,
                 client_stack::port=args.port
                 );
-        coder::add_peer(coder::peer_ptr(c));
+        base::add_peer(peer_ptr(c));
     }
 };
 
-class server : public coder<peer_stack>
+template<class reactor>
+class server : public coder<peer_stack, reactor>
 {
+    typedef coder<peer_stack, reactor> base;
+    typedef typename base::peer_ptr peer_ptr;
+
     srv_stack m_srv;
     double m_overshoot;
     size_t m_symbols;
@@ -646,24 +664,58 @@ class server : public coder<peer_stack>
                 peer_stack::symbols=m_symbols,
                 peer_stack::file_descriptor=fd
                 );
-        coder::add_peer(coder::peer_ptr(p));
+        base::add_peer(peer_ptr(p));
     }
 
   public:
     server(const struct args &args)
-        : coder(args),
+        : base(args),
           m_srv(srv_stack::local_address=args.address,
                 srv_stack::port=args.port),
           m_overshoot(args.overshoot - 1),
           m_symbols(args.symbols)
     {
-        using std::placeholders::_1;
+        base::m_io.template add_cb<server, &server::accept_peer>(m_srv.fd(),
+                                                                 this);
+    }
+};
 
-        auto ap = std::bind(&server::accept_peer, this, _1);
+/* one worker per tun queue, each with its own coder, io loop and sockets
+ * on the port plus the number of the queue */
+template<class worker>
+static void run_queues(const struct args &args)
+{
+    std::vector<std::unique_ptr<worker>> workers;
+    std::vector<std::thread> threads;
 
-        m_io.add_cb(m_srv.fd(), ap, NULL);
+    if (args.queues <= 1) {
+        worker w(args);
+        w.run();
+        return;
     }
-};
+
+    for (size_t i = 0; i < args.queues; ++i) {
+        struct args a = args;
+
+        snprintf(a.port, sizeof(a.port), "%zu", atoi(args.port) + i);
+        workers.emplace_back(new worker(a));
+    }
+
+    for (auto &w : workers)
+        threads.emplace_back(&worker::run, w.get());
+
+    for (auto &t : threads)
+        t.join();
+}
+
+template<class reactor>
+static void run(const struct args &args)
+{
+    if (args.server)
+        run_queues<server<reactor>>(args);
+    else
+        run_queues<client<reactor>>(args);
+}
 
 int main(int argc, char **argv)
 {
@@ -705,19 +757,22 @@ int main(int argc, char **argv)
             case 11:
                 args.status_interval = atoi(optarg);
                 break;
+            case 12:
+                args.io_uring = true;
+                break;
+            case 13:
+                args.queues = atoi(optarg);
+                break;
             case '?':
                 return 1;
                 break;
         }
     }
 
-    if (args.server) {
-        server s(args);
-        s.run();
-    } else {
-        client c(args);
-        c.run();
-    }
+    if (args.io_uring)
+        run<io_ring>(args);
+    else
+        run<io>(args);
 
     return 0;
 }
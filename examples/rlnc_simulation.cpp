@@ -0,0 +1,791 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <getopt.h>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "io.hpp"
+#include "signal.hpp"
+#include "stat_counter.hpp"
+#include "rlnc_codes.hpp"
+#include "len_hdr.hpp"
+#include "rlnc_data_enc.hpp"
+#include "rlnc_data_dec.hpp"
+#include "rlnc_data_rec.hpp"
+#include "rlnc_data_hlp.hpp"
+#include "rlnc_hdr.hpp"
+#include "timers.hpp"
+#include "budgets.hpp"
+#include "loss.hpp"
+#include "eth_hdr.hpp"
+#include "error_estimator.hpp"
+#include "eth_topology.hpp"
+#include "burst_read.hpp"
+#include "burst_write.hpp"
+#include "netem.hpp"
+#include "mem_sock.hpp"
+#include "error_info.hpp"
+#include "rlnc_info.hpp"
+#include "buffer_pkt.hpp"
+#include "slab_pool.hpp"
+#include "final_layer.hpp"
+#include "flight_recorder.hpp"
+#include "profile.hpp"
+
+/* The encoder, recoder, helper and decoder of the apps, each in its own
+ * thread and io loop, on one mem_segment instead of interfaces:
+ *
+ *   enc --> rec (a|b) --> dec
+ *     `--> hlp ---------'
+ *
+ * The helper overhears the encoder and helps the decoder. The encoder
+ * sends the given number of packets, each stamped with a sequence number
+ * and the time it was written; the decoder checks the order and records
+ * the latency. Synthetic loss comes from loss_dec and loss_hlp as in the
+ * apps, and the link each stack sends on can be shaped, delayed and made
+ * lossy with netem.
+ *
+ * Exits with failure unless every packet arrived in order, so that runs
+ * can be scripted as checks (scripts/sim_check.sh). */
+
+struct args
+{
+    /* packets to send through the topology */
+    size_t  packets             = 100000;
+
+    /* synthetic error probabilities, given to every stack; as each
+     * stack applies them to its own neighbors, losses compound per hop */
+    std::vector<double> errors  = {0, 0, 0, 0};
+
+    /* number of symbols in one block */
+    size_t  symbols             = 100;
+
+    /* size of each symbol */
+    size_t  symbol_size         = 1450;
+
+    /* milliseconds to wait for ACK */
+    ssize_t timeout             = 20;
+
+    /* ratio to multiply source budget with */
+    double  overshoot           = 1.05;
+
+    /* weight of the newest packet in the error estimates (0 keeps the
+     * error probabilities above) */
+    double  estimate            = .01;
+
+    /* carry ingress timestamps in the rlnc headers, for the decoder's
+     * latency histograms */
+    int     stamps              = 0;
+
+    /* blocks in flight at a time */
+    size_t  generations         = 1;
+
+    /* packets each link of the segment holds */
+    size_t  ring_size           = 1024;
+
+    /* coder to use (kodo, binary or binary8) */
+    char    coder[10]           = "kodo";
+
+    /* link emulated on the output of every stack (see netem) */
+
+    /* bits per second, 0 for no limit */
+    double  rate                = 0;
+
+    /* milliseconds of delay and of uniform jitter around it */
+    double  delay               = 0;
+    double  jitter              = 0;
+
+    /* probability of a packet overtaking the ones delayed */
+    double  reorder             = 0;
+
+    /* gilbert-elliott transition probabilities and bad state loss */
+    double  ge_p                = 0;
+    double  ge_r                = 1;
+    double  ge_loss             = 1;
+
+    /* good state loss of the links carrying only acks back to the
+     * encoder (decoder to relay, relay to encoder) */
+    double  ack_loss            = 0;
+
+    /* file to dump the flight recorder of all nodes to at the end (not
+     * recording if NULL) */
+    char    *flight             = NULL;
+};
+
+static struct option options[] = {
+    {"packets",     required_argument, NULL, 1},
+    {"symbols",     required_argument, NULL, 2},
+    {"symbol_size", required_argument, NULL, 3},
+    {"e1",          required_argument, NULL, 4},
+    {"e2",          required_argument, NULL, 5},
+    {"e3",          required_argument, NULL, 6},
+    {"e4",          required_argument, NULL, 7},
+    {"timeout",     required_argument, NULL, 8},
+    {"overshoot",   required_argument, NULL, 9},
+    {"generations", required_argument, NULL, 10},
+    {"ring_size",   required_argument, NULL, 11},
+    {"coder",       required_argument, NULL, 12},
+    {"rate",        required_argument, NULL, 13},
+    {"delay",       required_argument, NULL, 14},
+    {"jitter",      required_argument, NULL, 15},
+    {"reorder",     required_argument, NULL, 16},
+    {"ge_p",        required_argument, NULL, 17},
+    {"ge_r",        required_argument, NULL, 18},
+    {"ge_loss",     required_argument, NULL, 19},
+    {"estimate",    required_argument, NULL, 20},
+    {"stamps",      required_argument, NULL, 21},
+    {"flight",      required_argument, NULL, 22},
+    {"ack_loss",    required_argument, NULL, 23},
+    {0}
+};
+
+/* addresses on the segment */
+static const char *enc_address   = "02:00:00:00:00:01";
+static const char *rec_a_address = "02:00:00:00:00:02";
+static const char *rec_b_address = "02:00:00:00:00:03";
+static const char *hlp_address   = "02:00:00:00:00:04";
+static const char *dec_address   = "02:00:00:00:00:05";
+
+/* layers timed by profile, when built with NETMIX_PROFILE */
+static const char prof_enc_coder[] = "enc coder";
+static const char prof_enc_proto[] = "enc proto";
+static const char prof_enc_link[] = "enc link";
+static const char prof_dec_coder[] = "dec coder";
+static const char prof_dec_proto[] = "dec proto";
+static const char prof_dec_link[] = "dec link";
+
+template<class codes>
+using enc_stack = profile<prof_enc_coder,
+        len_hdr<
+        rlnc_data_enc<typename codes::encoder,
+        profile<prof_enc_proto,
+        rlnc_hdr<
+        timers<
+        source_budgets<
+        eth_hdr<
+        error_estimator<
+        eth_topology<
+        profile<prof_enc_link,
+        netem<
+        burst_read<
+        burst_write<
+        mem_sock<
+        error_info<
+        rlnc_info<
+        slab_pool<buffer_pkt,
+        final_layer
+        >>>>>>>>>>>>>>>>>>;
+
+template<class codes>
+using dec_stack = profile<prof_dec_coder,
+        len_hdr<
+        rlnc_data_dec<typename codes::decoder,
+        profile<prof_dec_proto,
+        rlnc_hdr<
+        timers<
+        eth_hdr<
+        loss_dec<
+        eth_topology<
+        profile<prof_dec_link,
+        netem<
+        burst_read<
+        mem_sock<
+        error_info<
+        rlnc_info<
+        slab_pool<buffer_pkt,
+        final_layer
+        >>>>>>>>>>>>>>>>;
+
+template<class codes>
+using rec_stack = rlnc_data_rec<typename codes::decoder,
+        rlnc_hdr<
+        timers<
+        relay_budgets<
+        eth_hdr<
+        error_estimator<
+        loss_dec<
+        eth_topology<
+        netem<
+        mem_sock<
+        error_info<
+        rlnc_info<
+        slab_pool<buffer_pkt,
+        final_layer
+        >>>>>>>>>>>>>;
+
+template<class codes>
+using hlp_stack = rlnc_data_hlp<typename codes::decoder,
+        rlnc_hdr<
+        helper_budgets<
+        eth_hdr<
+        error_estimator<
+        loss_hlp<
+        eth_topology<
+        netem<
+        mem_sock<
+        error_info<
+        rlnc_info<
+        slab_pool<buffer_pkt,
+        final_layer
+        >>>>>>>>>>>>;
+
+typedef std::chrono::steady_clock sim_clock;
+
+/* stamp written by the source at the start of each packet */
+struct stamp {
+    uint64_t seq;
+    uint64_t time;
+};
+
+static uint64_t now_ns()
+{
+    auto now = sim_clock::now().time_since_epoch();
+
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+template<class codes>
+class source_node : public io
+{
+    typedef ::enc_stack<codes> enc_stack;
+
+    int m_timeout;
+    size_t m_count;
+    size_t m_sent = 0;
+    enc_stack m_enc;
+
+    bool feeding()
+    {
+        return m_sent < m_count && !m_enc.is_full();
+    }
+
+    void feed()
+    {
+        size_t len = m_enc.data_size_max();
+
+        while (feeding()) {
+            typename enc_stack::buffer_ptr buf = m_enc.buffer();
+            uint8_t *data = buf->data_put(len);
+            struct stamp s = {m_sent, now_ns()};
+
+            memset(data, static_cast<uint8_t>(m_sent), len);
+            memcpy(data, &s, sizeof(s));
+
+            if (!m_enc.write_pkt(buf))
+                break;
+
+            m_sent++;
+        }
+    }
+
+    void read_enc(int fd)
+    {
+        typename enc_stack::buffer_ptr buf = m_enc.buffer();
+
+        while (m_enc.read_pkt(buf))
+            buf->reset();
+
+        /* acks left in the burst don't make the fd readable again */
+        if (m_enc.burst_pending())
+            io::pending(fd);
+    }
+
+    /* packets left queued by the last flush */
+    void write_enc(int fd)
+    {
+        if (m_enc.flush())
+            io::disable_write(fd);
+    }
+
+    void flush_enc()
+    {
+        if (!m_enc.flush())
+            io::enable_write(m_enc.fd());
+    }
+
+  public:
+    source_node(const struct args &args, mem_segment *segment)
+        : m_timeout(args.timeout),
+          m_count(args.packets),
+          m_enc(
+                enc_stack::segment=segment,
+                enc_stack::segment_address=enc_address,
+                enc_stack::neighbor=rec_a_address,
+                enc_stack::helper=hlp_address,
+                enc_stack::symbols=args.symbols,
+                enc_stack::hdr_stamps=args.stamps,
+                enc_stack::symbol_size=args.symbol_size,
+                enc_stack::generations=args.generations,
+                enc_stack::errors=args.errors,
+                enc_stack::estimate_weight=args.estimate,
+                enc_stack::overshoot=args.overshoot,
+                enc_stack::netem_rate=args.rate,
+                enc_stack::netem_delay=args.delay,
+                enc_stack::netem_jitter=args.jitter,
+                enc_stack::netem_reorder=args.reorder,
+                enc_stack::netem_ge_p=args.ge_p,
+                enc_stack::netem_ge_r=args.ge_r,
+                enc_stack::netem_ge_bad_loss=args.ge_loss,
+                enc_stack::wheel=io::timers(),
+                enc_stack::repair_timeout=static_cast<size_t>(args.timeout)
+          )
+    {
+        if (m_enc.data_size_max() < sizeof(struct stamp))
+            throw std::runtime_error("symbol size too small for stamp");
+
+        io::add_cb<source_node, &source_node::read_enc,
+                   &source_node::write_enc>(m_enc.fd(), this);
+        io::add_flush_cb(std::bind(&source_node::flush_enc, this));
+        io::disable_write(m_enc.fd());
+    }
+
+    void run()
+    {
+        int res;
+
+        while (signal::running()) {
+            feed();
+            res = io::wait(feeding() ? 0 : m_timeout);
+
+            if (res < 0)
+                break;
+
+            if (res > 0 || feeding())
+                continue;
+
+            m_enc.timer();
+        }
+    }
+};
+
+template<class codes>
+class relay_node : public io
+{
+    typedef ::rec_stack<codes> rec_stack;
+
+    int m_timeout;
+    rec_stack m_a;
+    rec_stack m_b;
+
+    /* the glue of rlnc_recoder */
+    void read_a(int)
+    {
+        typename rec_stack::buffer_ptr buf = m_a.buffer();
+
+        while (m_a.read_pkt(buf)) {
+            m_b.write_pkt(buf);
+            buf->reset();
+
+            if (m_b.is_full())
+                m_a.stop();
+        }
+    }
+
+    void read_b(int)
+    {
+        typename rec_stack::buffer_ptr buf(m_b.buffer());
+
+        while (m_b.read_pkt(buf)) {
+            m_a.write_pkt(buf);
+            buf->reset();
+
+            if (m_a.is_full()) {
+                m_b.stop();
+                break;
+            }
+        }
+    }
+
+  public:
+    relay_node(const struct args &args, mem_segment *segment)
+        : m_timeout(args.timeout),
+          m_a(
+              rec_stack::segment=segment,
+              rec_stack::segment_address=rec_a_address,
+              rec_stack::neighbor=enc_address,
+              rec_stack::symbols=args.symbols,
+              rec_stack::hdr_stamps=args.stamps,
+              rec_stack::symbol_size=args.symbol_size,
+              rec_stack::generations=args.generations,
+              rec_stack::errors=args.errors,
+              rec_stack::estimate_weight=args.estimate,
+              rec_stack::overshoot=args.overshoot,
+              rec_stack::netem_rate=args.rate,
+              rec_stack::netem_delay=args.delay,
+              rec_stack::netem_jitter=args.jitter,
+              rec_stack::netem_reorder=args.reorder,
+              rec_stack::netem_ge_p=args.ge_p,
+              rec_stack::netem_ge_r=args.ge_r,
+              rec_stack::netem_ge_bad_loss=args.ge_loss,
+              rec_stack::netem_ge_good_loss=args.ack_loss,
+              rec_stack::wheel=io::timers(),
+              rec_stack::repair_timeout=static_cast<size_t>(args.timeout)
+             ),
+          m_b(
+              rec_stack::segment=segment,
+              rec_stack::segment_address=rec_b_address,
+              rec_stack::neighbor=dec_address,
+              rec_stack::symbols=args.symbols,
+              rec_stack::hdr_stamps=args.stamps,
+              rec_stack::symbol_size=args.symbol_size,
+              rec_stack::generations=args.generations,
+              rec_stack::errors=args.errors,
+              rec_stack::estimate_weight=args.estimate,
+              rec_stack::overshoot=args.overshoot,
+              rec_stack::netem_rate=args.rate,
+              rec_stack::netem_delay=args.delay,
+              rec_stack::netem_jitter=args.jitter,
+              rec_stack::netem_reorder=args.reorder,
+              rec_stack::netem_ge_p=args.ge_p,
+              rec_stack::netem_ge_r=args.ge_r,
+              rec_stack::netem_ge_bad_loss=args.ge_loss,
+              rec_stack::wheel=io::timers(),
+              rec_stack::repair_timeout=static_cast<size_t>(args.timeout)
+             )
+    {
+        io::add_cb<relay_node, &relay_node::read_a>(m_a.fd(), this);
+        io::add_cb<relay_node, &relay_node::read_b>(m_b.fd(), this);
+    }
+
+    void run()
+    {
+        int res;
+
+        while (signal::running()) {
+            res = io::wait(m_timeout);
+
+            if (res < 0)
+                break;
+
+            if (res > 0)
+                continue;
+
+            m_a.timer();
+            m_b.timer();
+        }
+    }
+};
+
+template<class codes>
+class helper_node : public io
+{
+    typedef ::hlp_stack<codes> hlp_stack;
+
+    int m_timeout;
+    hlp_stack m_hlp;
+
+    void read_hlp(int)
+    {
+        typename hlp_stack::buffer_ptr buf = m_hlp.buffer();
+
+        while (m_hlp.read_pkt(buf)) {
+            m_hlp.write_pkt(buf);
+            buf->reset();
+        }
+    }
+
+  public:
+    helper_node(const struct args &args, mem_segment *segment)
+        : m_timeout(args.timeout),
+          m_hlp(
+                hlp_stack::segment=segment,
+                hlp_stack::segment_address=hlp_address,
+                hlp_stack::neighbor=dec_address,
+                hlp_stack::source=enc_address,
+                hlp_stack::destination=dec_address,
+                hlp_stack::symbols=args.symbols,
+                hlp_stack::hdr_stamps=args.stamps,
+                hlp_stack::symbol_size=args.symbol_size,
+                hlp_stack::generations=args.generations,
+                hlp_stack::errors=args.errors,
+                hlp_stack::estimate_weight=args.estimate,
+                hlp_stack::netem_rate=args.rate,
+                hlp_stack::netem_delay=args.delay,
+                hlp_stack::netem_jitter=args.jitter,
+                hlp_stack::netem_reorder=args.reorder,
+                hlp_stack::netem_ge_p=args.ge_p,
+                hlp_stack::netem_ge_r=args.ge_r,
+                hlp_stack::netem_ge_bad_loss=args.ge_loss,
+                hlp_stack::promisc=1,
+                timers_args::wheel=io::timers()
+               )
+    {
+        io::add_cb<helper_node, &helper_node::read_hlp>(m_hlp.fd(), this);
+    }
+
+    void run()
+    {
+        while (signal::running())
+            if (io::wait(m_timeout) < 0)
+                break;
+    }
+};
+
+template<class codes>
+class sink_node : public io
+{
+    typedef ::dec_stack<codes> dec_stack;
+
+    int m_timeout;
+    size_t m_count;
+    size_t m_received = 0;
+    size_t m_reordered = 0;
+    uint64_t m_next = 0;
+    uint64_t m_first = 0;
+    uint64_t m_last = 0;
+    size_t m_bytes = 0;
+    std::vector<uint64_t> m_latency;
+    dec_stack m_dec;
+
+    void receive(typename dec_stack::buffer_ptr &buf)
+    {
+        struct stamp s;
+        uint64_t now = now_ns();
+
+        memcpy(&s, buf->head(), sizeof(s));
+
+        if (s.seq != m_next)
+            m_reordered++;
+
+        if (!m_received)
+            m_first = s.time;
+
+        m_next = s.seq + 1;
+        m_last = now;
+        m_bytes += buf->len();
+        m_latency.push_back(now - s.time);
+
+        if (++m_received == m_count)
+            signal::stop();
+    }
+
+    void read_dec(int fd)
+    {
+        typename dec_stack::buffer_ptr buf = m_dec.buffer();
+
+        while (m_dec.read_pkt(buf)) {
+            receive(buf);
+            buf->reset();
+        }
+
+        if (m_dec.burst_pending())
+            io::pending(fd);
+    }
+
+  public:
+    sink_node(const struct args &args, mem_segment *segment)
+        : m_timeout(args.timeout),
+          m_count(args.packets),
+          m_dec(
+                dec_stack::segment=segment,
+                dec_stack::segment_address=dec_address,
+                dec_stack::neighbor=rec_b_address,
+                dec_stack::helper=hlp_address,
+                dec_stack::two_hop=enc_address,
+                dec_stack::symbols=args.symbols,
+                dec_stack::hdr_stamps=args.stamps,
+                dec_stack::symbol_size=args.symbol_size,
+                dec_stack::generations=args.generations,
+                dec_stack::errors=args.errors,
+                dec_stack::netem_rate=args.rate,
+                dec_stack::netem_delay=args.delay,
+                dec_stack::netem_jitter=args.jitter,
+                dec_stack::netem_reorder=args.reorder,
+                dec_stack::netem_ge_p=args.ge_p,
+                dec_stack::netem_ge_r=args.ge_r,
+                dec_stack::netem_ge_bad_loss=args.ge_loss,
+                dec_stack::netem_ge_good_loss=args.ack_loss,
+                dec_stack::wheel=io::timers(),
+                dec_stack::repair_timeout=static_cast<size_t>(args.timeout)
+          )
+    {
+        m_latency.reserve(m_count);
+        io::add_cb<sink_node, &sink_node::read_dec>(m_dec.fd(), this);
+    }
+
+    void run()
+    {
+        int res;
+
+        while (signal::running()) {
+            res = io::wait(m_timeout);
+
+            if (res < 0)
+                break;
+
+            if (res > 0)
+                continue;
+
+            m_dec.timer();
+        }
+    }
+
+    void report()
+    {
+        double secs = (m_last - m_first)/1e9;
+        auto &l = m_latency;
+
+        std::cout << "received " << m_received << "/" << m_count
+                  << " packets, " << m_reordered << " out of order"
+                  << std::endl;
+
+        if (l.empty() || secs <= 0)
+            return;
+
+        std::sort(l.begin(), l.end());
+
+        std::cout << "throughput " << m_bytes/secs/1e6 << " MB/s, "
+                  << m_received/secs << " packets/s" << std::endl;
+        std::cout << "latency us min " << l.front()/1e3
+                  << " p50 " << l[l.size()/2]/1e3
+                  << " p99 " << l[l.size()*99/100]/1e3
+                  << " max " << l.back()/1e3 << std::endl;
+    }
+
+    /* every packet arrived, in the order sent */
+    bool complete() const
+    {
+        return m_received == m_count && m_reordered == 0;
+    }
+};
+
+template<class node>
+static void run_node(node *n)
+{
+    try {
+        n->run();
+    } catch (const std::runtime_error &re) {
+        std::cout << re.what() << std::endl;
+    }
+
+    signal::stop();
+}
+
+template<class codes>
+static bool run(const struct args &args)
+{
+    mem_segment segment(args.ring_size);
+    source_node<codes> source(args, &segment);
+    relay_node<codes> relay(args, &segment);
+    helper_node<codes> helper(args, &segment);
+    sink_node<codes> sink(args, &segment);
+    std::vector<std::thread> nodes;
+
+    nodes.emplace_back(run_node<relay_node<codes>>, &relay);
+    nodes.emplace_back(run_node<helper_node<codes>>, &helper);
+    nodes.emplace_back(run_node<sink_node<codes>>, &sink);
+
+    run_node(&source);
+
+    for (auto &t : nodes)
+        t.join();
+
+    flight_recorder::recorder().dump();
+    sink.report();
+    std::cout << stat_counter::all << profile_report;
+
+    return sink.complete();
+}
+
+int main(int argc, char **argv)
+{
+    struct args args;
+    class signal sig;
+    bool complete;
+    signed char c;
+
+    while ((c = getopt_long_only(argc, argv, "", options, NULL)) != -1) {
+        switch (c) {
+            case 1:
+                args.packets = atoi(optarg);
+                break;
+            case 2:
+                args.symbols = atoi(optarg);
+                break;
+            case 3:
+                args.symbol_size = atoi(optarg);
+                break;
+            case 4:
+                args.errors[0] = strtod(optarg, NULL);
+                break;
+            case 5:
+                args.errors[1] = strtod(optarg, NULL);
+                break;
+            case 6:
+                args.errors[2] = strtod(optarg, NULL);
+                break;
+            case 7:
+                args.errors[3] = strtod(optarg, NULL);
+                break;
+            case 8:
+                args.timeout = atoi(optarg);
+                break;
+            case 9:
+                args.overshoot = strtod(optarg, NULL);
+                break;
+            case 10:
+                args.generations = atoi(optarg);
+                break;
+            case 11:
+                args.ring_size = atoi(optarg);
+                break;
+            case 12:
+                strncpy(args.coder, optarg, sizeof(args.coder) - 1);
+                break;
+            case 13:
+                args.rate = strtod(optarg, NULL);
+                break;
+            case 14:
+                args.delay = strtod(optarg, NULL);
+                break;
+            case 15:
+                args.jitter = strtod(optarg, NULL);
+                break;
+            case 16:
+                args.reorder = strtod(optarg, NULL);
+                break;
+            case 17:
+                args.ge_p = strtod(optarg, NULL);
+                break;
+            case 18:
+                args.ge_r = strtod(optarg, NULL);
+                break;
+            case 19:
+                args.ge_loss = strtod(optarg, NULL);
+                break;
+            case 20:
+                args.estimate = strtod(optarg, NULL);
+                break;
+            case 21:
+                args.stamps = atoi(optarg);
+                break;
+            case 22:
+                args.flight = optarg;
+                break;
+            case 23:
+                args.ack_loss = strtod(optarg, NULL);
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (args.flight)
+        flight_recorder::recorder().enable(args.flight);
+
+    if (strcmp(args.coder, "kodo") == 0) {
+        complete = run<kodo_codes>(args);
+    } else if (strcmp(args.coder, "binary") == 0) {
+        complete = run<gf_codes<gf_binary>>(args);
+    } else if (strcmp(args.coder, "binary8") == 0) {
+        complete = run<gf_codes<gf_binary8>>(args);
+    } else {
+        std::cerr << "unknown coder: " << args.coder << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return complete ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -8,6 +8,7 @@
 #include "len_hdr.hpp"
 #include "rlnc_data_enc.hpp"
 #include "rlnc_hdr.hpp"
+#include "timers.hpp"
 #include "budgets.hpp"
 #include "tcp_hdr.hpp"
 #include "tcp_sock.hpp"
@@ -52,6 +53,7 @@ typedef fifi::binary8 field;
 typedef len_hdr<
         rlnc_data_enc<kodo::sliding_window_encoder<fifi::binary8>,
         rlnc_hdr<
+        timers<
         source_budgets<
         tcp_hdr<
         tcp_sock_client<
@@ -59,7 +61,7 @@ typedef len_hdr<
         error_info<
         buffer_pool<buffer_pkt,
         final_layer
-        >>>>>>>>> client;
+        >>>>>>>>>> client;
 
 class tcp_client : public signal, public io
 {
@@ -9,6 +9,7 @@
 #include "len_hdr.hpp"
 #include "rlnc_data_dec.hpp"
 #include "rlnc_hdr.hpp"
+#include "timers.hpp"
 #include "rlnc_info.hpp"
 #include "loss.hpp"
 #include "tcp_hdr.hpp"
@@ -46,13 +47,14 @@ struct option options[] = {
 typedef len_hdr<
         rlnc_data_dec<kodo::sliding_window_decoder<fifi::binary8>,
         rlnc_hdr<
+        timers<
         loss<
         tcp_hdr<
         tcp_sock_peer<
         rlnc_info<
         buffer_pool<buffer_pkt,
         final_layer
-        >>>>>>>> peer;
+        >>>>>>>>> peer;
 
 typedef tcp_sock_server<
         buffer_pool<buffer_pkt,
@@ -4,14 +4,20 @@
 #include <ctime>
 #include <vector>
 #include <memory>
+#include <thread>
+#include <exception>
 #include <functional>
 #include <endian.h>
 
 #include "io.hpp"
+#include "io_ring.hpp"
+#include "uring_io.hpp"
 #include "signal.hpp"
 #include "counters.hpp"
 #include "rlnc_codes.hpp"
 #include "udp_sock.hpp"
+#include "burst_read.hpp"
+#include "burst_write.hpp"
 #include "tun.hpp"
 #include "buffer_pool.hpp"
 #include "buffer_pkt.hpp"
@@ -55,6 +61,18 @@ struct args
 
     /* ratio of extra packets distributed on a connection */
     double overshoot = 1.5;
+
+    /* receive and send on the socket and the tap device with io_uring */
+    bool io_uring = false;
+
+    /* number of queues on the tap device, each with its own worker */
+    size_t queues = 1;
+
+    /* read super packets from the tap device and segment them here */
+    bool vnet_hdr = false;
+
+    /* send coded packets with UDP segmentation offload (client only) */
+    bool udp_gso = false;
 };
 
 struct option options[] =
@@ -70,23 +88,33 @@ struct option options[] =
     {"overshoot",       required_argument, NULL, 9},
     {"type",            required_argument, NULL, 10},
     {"verbose",         no_argument,       NULL, 11},
+    {"io_uring",        no_argument,       NULL, 12},
+    {"queues",          required_argument, NULL, 13},
+    {"vnet_hdr",        no_argument,       NULL, 14},
+    {"udp_gso",         no_argument,       NULL, 15},
     {0}
 };
 
-typedef tuntap<
+typedef uring_io<
+        tuntap<
         buffer_pool<buffer_pkt,
         final_layer
-        >> tun_stack;
+        >>> tun_stack;
 
-typedef udp_sock_client<
+typedef uring_io<
+        burst_read<
+        burst_write<
+        udp_sock_client<
         buffer_pool<buffer_pkt,
         final_layer
-        >> client_stack;
+        >>>>> client_stack;
 
-typedef udp_sock_server<
+typedef uring_io<
+        burst_read<
+        udp_sock_server<
         buffer_pool<buffer_pkt,
         final_layer
-        >> server_stack;
+        >>>> server_stack;
 
 // typedef fifi::binary field;
 // typedef kodo::on_the_fly_encoder<field> kodo_encoder;
@@ -370,7 +398,7 @@ typedef udp_sock_server<
 // };
 
 
-template<class stack>
+template<class stack, class reactor>
 class coder
 {
     typedef fifi::binary field;
@@ -380,7 +408,11 @@ class coder
 
 public:
     typedef std::unique_ptr<stack> peer_ptr;
-    io m_io;
+    reactor m_io;
+
+    /* sends the packets queued by the peer, if it queues them; false
+     * while some are left */
+    std::function<bool()> m_peer_flush;
 
 private:
     enum rlnc_type : uint8_t
@@ -746,6 +778,17 @@ private:
 
     void send_peer(int fd)
     {
+        // Packets left queued by the last flush go first
+        if (m_peer_flush && !m_peer_flush())
+            return;
+
+        // Woken up for the flush only, with no block to send from
+        if (m_enc->symbols_initialized() == 0)
+        {
+            m_io.disable_write(fd);
+            return;
+        }
+
         // Can send multiple packets (if overshooting is enabled)
         while (send_enc_packet(fd))
         { }
@@ -773,7 +816,10 @@ public:
         m_enc(m_enc_factory.build()),
         m_dec(m_dec_factory.build()),
         m_tun(tun_stack::interface=args.interface,
-              tun_stack::type=args.type),
+              tun_stack::type=args.type,
+              tun_stack::multi_queue=static_cast<int>(args.queues > 1),
+              tun_stack::vnet_hdr=static_cast<int>(args.vnet_hdr),
+              tun_stack::uring=args.vnet_hdr ? NULL : uring_of(m_io)),
         m_max(args.symbols * (args.overshoot * 1.4)),
         m_overshoot(args.overshoot),
         m_send_buf(args.send_buf),
@@ -789,6 +835,14 @@ public:
         std::cout << "max: " << m_max << std::endl;
     }
 
+    /* flush once per loop iteration, waiting for the socket to take
+     * what is left */
+    void flush_peer()
+    {
+        if (!m_peer_flush())
+            m_io.enable_write(m_peer->fd());
+    }
+
     void add_peer(peer_ptr p)
     {
         using std::placeholders::_1;
@@ -810,7 +864,9 @@ public:
 
         while (m_sig.running())
         {
-            res = m_io.wait();
+            /* wake up now and then to see a signal taken by another
+             * worker */
+            res = m_io.wait(100);
 
             if (res < 0)
                 break;
@@ -821,37 +877,103 @@ public:
     }
 };
 
-class client : public coder<client_stack>
+template<class reactor>
+class client : public coder<client_stack, reactor>
 {
+    typedef coder<client_stack, reactor> base;
+    typedef typename base::peer_ptr peer_ptr;
+
   public:
     client(const struct args &args) :
-        coder(args)
+        base(args)
     {
         client_stack *c = new client_stack(
             client_stack::local_address=args.src,
             client_stack::remote_address=args.address,
-            client_stack::port=args.port
+            client_stack::port=args.port,
+            client_stack::udp_gso=static_cast<int>(args.udp_gso),
+            client_stack::uring=args.udp_gso ? NULL : uring_of(base::m_io)
         );
-        add_peer(peer_ptr(c));
+
+        /* coded packets are queued and leave once per loop iteration */
+        base::m_peer_flush = std::bind(&client_stack::flush, c);
+        base::m_io.add_flush_cb(std::bind(&base::flush_peer, this));
+        base::add_peer(peer_ptr(c));
     }
 
 };
 
-class server : public coder<server_stack>
+template<class reactor>
+class server : public coder<server_stack, reactor>
 {
+    typedef coder<server_stack, reactor> base;
+    typedef typename base::peer_ptr peer_ptr;
+
   public:
     server(const struct args &args) :
-        coder(args)
+        base(args)
     {
         server_stack *s = new server_stack(
             server_stack::local_address=args.address,
-            server_stack::port=args.port
+            server_stack::port=args.port,
+            server_stack::uring=uring_of(base::m_io)
         );
 
-        add_peer(peer_ptr(s));
+        base::add_peer(peer_ptr(s));
     }
 };
 
+/* one worker per tun queue, each with its own coder, io loop and sockets
+ * on the port plus the number of the queue; a worker failing stops the
+ * others, and its error is rethrown once they are done */
+template<class worker>
+static void run_queues(const struct args &args)
+{
+    std::vector<std::unique_ptr<worker>> workers;
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> errors(args.queues);
+
+    if (args.queues <= 1) {
+        worker w(args);
+        w.run();
+        return;
+    }
+
+    for (size_t i = 0; i < args.queues; ++i) {
+        struct args a = args;
+
+        snprintf(a.port, sizeof(a.port), "%zu", atoi(args.port) + i);
+        workers.emplace_back(new worker(a));
+    }
+
+    for (size_t i = 0; i < workers.size(); ++i) {
+        threads.emplace_back([&workers, &errors, i]() {
+            try {
+                workers[i]->run();
+            } catch (...) {
+                errors[i] = std::current_exception();
+                signal::stop();
+            }
+        });
+    }
+
+    for (auto &t : threads)
+        t.join();
+
+    for (auto &e : errors)
+        if (e)
+            std::rethrow_exception(e);
+}
+
+template<class reactor>
+static void run(const struct args &args)
+{
+    if (args.server)
+        run_queues<server<reactor>>(args);
+    else
+        run_queues<client<reactor>>(args);
+}
+
 int main(int argc, char **argv)
 {
     struct args args;
@@ -894,6 +1016,18 @@ int main(int argc, char **argv)
             case 11:
                 args.verbose = true;
                 break;
+            case 12:
+                args.io_uring = true;
+                break;
+            case 13:
+                args.queues = atoi(optarg);
+                break;
+            case 14:
+                args.vnet_hdr = true;
+                break;
+            case 15:
+                args.udp_gso = true;
+                break;
             case '?':
                 return 1;
                 break;
@@ -901,16 +1035,11 @@ int main(int argc, char **argv)
     }
 
     srand(static_cast<uint32_t>(time(0)));
-    if (args.server)
-    {
-        server s(args);
-        s.run();
-    }
+
+    if (args.io_uring)
+        run<io_ring>(args);
     else
-    {
-        client c(args);
-        c.run();
-    }
+        run<io>(args);
 
     return 0;
 }
@@ -0,0 +1,82 @@
+#!/usr/bin/env python
+
+# Convert a dump of the flight recorder (src/flight_recorder.hpp) to CSV,
+# one line per event in the order they were recorded:
+#
+#   time_us,seq,layer,event,block,rank,value
+#
+# with the time in microseconds since the first event in the dump.
+#
+#   flight_csv.py flight.bin > flight.csv
+
+import sys
+import struct
+
+layers = {
+        1: 'enc',
+        2: 'dec',
+        3: 'rec',
+        4: 'hlp',
+        }
+
+events = {
+        1: 'symbol',
+        2: 'rank',
+        3: 'linear',
+        4: 'ack_sent',
+        5: 'ack',
+        6: 'emergency',
+        7: 'retire',
+        8: 'increment',
+        9: 'timeout',
+        10: 'late',
+        11: 'ahead',
+        12: 'stop',
+        }
+
+# written in the byte order of the host; x86 and most arm are little endian
+header = struct.Struct('<4sIII')
+event = struct.Struct('<QQIIIBBH')
+
+if len(sys.argv) < 2:
+    print("please specify flight recorder dump to convert")
+    sys.exit(1)
+
+data = open(sys.argv[1], 'rb').read()
+magic, version, size, count = header.unpack_from(data, 0)
+
+if magic != b'NMFR' or version != 1 or size != event.size:
+    print("not a flight recorder dump (version 1): " + sys.argv[1])
+    sys.exit(1)
+
+# read records, leaving out empty slots and those caught being written
+records = []
+
+for i in range(count):
+    offset = header.size + i*size
+
+    if offset + size > len(data):
+        break
+
+    r = event.unpack_from(data, offset)
+
+    if r[1] == 0:
+        continue
+
+    records.append(r)
+
+records.sort(key=lambda r: r[1])
+
+if not records:
+    sys.exit(0)
+
+start = min(r[0] for r in records)
+out = sys.stdout
+
+out.write("time_us,seq,layer,event,block,rank,value\n")
+
+for time, seq, block, rank, value, layer, kind, pad in records:
+    out.write("%.3f,%d,%s,%s,%d,%d,%d\n" % ((time - start)/1e3, seq,
+                                            layers.get(layer, layer),
+                                            events.get(kind, kind),
+                                            block, rank, value))
@@ -0,0 +1,39 @@
+#!/bin/sh
+
+# Lossy runs of the in-process simulation (examples/rlnc_simulation.cpp),
+# each of which must deliver every packet in order within the time limit:
+#
+#   sim_check.sh build/x86_64-linux-gnu/examples/rlnc_simulation
+
+sim=$1
+limit=60
+fail=0
+
+if [ -z "$sim" ]; then
+    echo "please specify rlnc_simulation binary to run"
+    exit 1
+fi
+
+run() {
+    echo "rlnc_simulation $*"
+
+    if ! timeout $limit "$sim" -coder binary8 -packets 3000 "$@" \
+            > sim_check.log 2>&1; then
+        grep "^received" sim_check.log
+        echo "FAILED"
+        fail=1
+    fi
+}
+
+# one and several generations in flight over lossy, delayed links
+run -generations 1 -delay 10 -e3 0.1
+run -generations 4 -delay 10 -e3 0.1
+run -generations 4 -delay 10 -e3 0.2
+run -generations 4 -delay 10 -e1 0.1 -e2 0.1 -e3 0.2 -e4 0.3
+
+# acks lost on their way back, also the last one of a block
+run -generations 1 -delay 10 -ack_loss 0.3
+run -generations 4 -delay 10 -e3 0.1 -ack_loss 0.3
+
+rm -f sim_check.log
+exit $fail
@@ -1,8 +1,10 @@
 #pragma once
 
+#include <cstdint>
 #include <vector>
 
 #include "kwargs.hpp"
+#include "probes.hpp"
 
 template<typename errors_type>
 class budgets
@@ -97,6 +99,7 @@ class budgets_base : public budgets<errors_type>
     bool decrease_budget()
     {
         m_budget--;
+        NETMIX_PROBE1(budget_spend, static_cast<int64_t>(m_budget));
         return m_budget >= 1;
     }
 
@@ -130,6 +133,15 @@ class source_budgets : public super, public budgets_base<typename super::errors_
     template<typename... Args> explicit
     source_budgets(const Args&... args)
         : super(args...)
+    {
+        budgets_update();
+
+        std::cout << "enc budget: " << base::m_max << std::endl;
+        std::cout << "enc credit: " << base::m_credits << std::endl;
+    }
+
+    /* follow the error estimates, if the errors are estimated below */
+    void budgets_update()
     {
         base::m_credits = base::source_credits(super::rlnc_symbols(),
                                                super::errors_info(),
@@ -137,21 +149,20 @@ class source_budgets : public super, public budgets_base<typename super::errors_
         base::m_max = base::source_budget(super::rlnc_symbols(),
                                           super::errors_info(),
                                           super::overshoot_ratio());
-
-        std::cout << "enc budget: " << base::m_max << std::endl;
-        std::cout << "enc credit: " << base::m_credits << std::endl;
     }
 
     void increment()
     {
         super::increment();
         base::m_budget = 0;
+        budgets_update();
     }
 
     void increment(size_t b)
     {
         super::increment(b);
         base::m_budget = 0;
+        budgets_update();
     }
 };
 
@@ -164,6 +175,15 @@ class helper_budgets : public super, public budgets_base<typename super::errors_
     template<typename... Args> explicit
     helper_budgets(const Args&... args)
         : super(args...)
+    {
+        budgets_update();
+
+        std::cout << "hlp budget: " << base::m_max << std::endl;
+        std::cout << "hlp credit: " << base::m_credits << std::endl;
+        std::cout << "hlp threshold: " << base::m_threshold << std::endl;
+    }
+
+    void budgets_update()
     {
         base::m_credits = base::helper_credits(super::rlnc_symbols(),
                                                super::errors_info());
@@ -171,23 +191,20 @@ class helper_budgets : public super, public budgets_base<typename super::errors_
                                           super::errors_info());
         base::m_threshold = base::helper_threshold(super::rlnc_symbols(),
                                                    super::errors_info());
-
-        std::cout << "hlp budget: " << base::m_max << std::endl;
-        std::cout << "hlp credit: " << base::m_credits << std::endl;
-        std::cout << "hlp threshold: " << base::m_threshold << std::endl;
     }
 
     void increment()
     {
-        (void) b;
         super::increment();
         base::m_budget = 0;
+        budgets_update();
     }
 
     void increment(size_t b)
     {
         super::increment(b);
         base::m_budget = 0;
+        budgets_update();
     }
 };
 
@@ -200,27 +217,33 @@ class relay_budgets : public super, public budgets_base<typename super::errors_t
     template<typename... Args> explicit
     relay_budgets(const Args&... args)
         : super(args...)
+    {
+        budgets_update();
+
+        std::cout << "rec budget: " << base::m_max << std::endl;
+        std::cout << "rec credit: " << base::m_credits << std::endl;
+    }
+
+    void budgets_update()
     {
         base::m_credits = base::relay_credits(super::rlnc_symbols(),
                                               super::errors_info());
         base::m_max = base::relay_budget(super::rlnc_symbols(),
                                          super::errors_info(),
                                          super::overshoot_ratio());
-
-        std::cout << "rec budget: " << base::m_max << std::endl;
-        std::cout << "rec credit: " << base::m_credits << std::endl;
     }
 
     void increment()
     {
-        (void) b;
         super::increment();
         base::m_budget = 0;
+        budgets_update();
     }
 
     void increment(size_t b)
     {
         super::increment(b);
         base::m_budget = 0;
+        budgets_update();
     }
 };
@@ -7,31 +7,82 @@
 class buffer_pkt
 {
     static const size_t m_default_len = 2000;
-    static constexpr size_t m_headroom = 100;
+    static constexpr size_t m_headroom = 128;
     size_t m_buffer_len;
 
+    /* bytes from m_base to the end of the external memory attached to, 0
+     * if not attached */
+    size_t m_attached_len = 0;
+
     std::vector<uint8_t> m_buffer;
+    uint8_t *m_storage;
+    size_t m_capacity;
     size_t m_len = 0;
+    uint8_t *m_base;
     uint8_t *m_data;
     uint8_t *m_head;
 
+    /* pkt_clock time the packet entered the stacks, 0 if not stamped */
+    uint64_t m_stamp = 0;
+
   public:
     typedef std::shared_ptr<buffer_pkt> pointer;
 
     buffer_pkt(size_t buffer_len)
         : m_buffer_len(buffer_len),
           m_buffer(m_buffer_len + m_headroom),
-          m_data(&m_buffer[0] + m_headroom),
-          m_head(&m_buffer[0] + m_headroom)
+          m_storage(&m_buffer[0]),
+          m_capacity(m_buffer.size()),
+          m_base(m_storage),
+          m_data(m_storage + m_headroom),
+          m_head(m_storage + m_headroom)
     {
         assert(m_data);
         assert(m_head);
     }
 
+    /* use memory owned by someone else (e.g. a slab) as storage; capacity
+     * includes the headroom */
+    buffer_pkt(uint8_t *storage, size_t capacity, size_t buffer_len)
+        : m_buffer_len(buffer_len),
+          m_storage(storage),
+          m_capacity(capacity),
+          m_base(m_storage),
+          m_data(m_storage + m_headroom),
+          m_head(m_storage + m_headroom)
+    {
+        assert(buffer_len + m_headroom <= capacity);
+    }
+
     buffer_pkt()
         : buffer_pkt(m_default_len)
     {}
 
+    static size_t default_len()
+    {
+        return m_default_len;
+    }
+
+    /* bytes of storage needed for a buffer of the given length */
+    static size_t storage_len(size_t buffer_len)
+    {
+        return buffer_len + m_headroom;
+    }
+
+    uint8_t *storage() const
+    {
+        return m_storage;
+    }
+
+    void storage(uint8_t *storage, size_t capacity)
+    {
+        std::vector<uint8_t>().swap(m_buffer);
+        m_storage = storage;
+        m_capacity = capacity;
+        m_buffer_len = capacity - m_headroom;
+        reset();
+    }
+
     uint8_t *data() const
     {
         assert(m_data);
@@ -60,18 +111,53 @@ class buffer_pkt
 
     void reset()
     {
-        m_data = &m_buffer[0] + m_headroom;
-        m_head = &m_buffer[0] + m_headroom;
+        m_base = m_storage;
+        m_data = m_storage + m_headroom;
+        m_head = m_storage + m_headroom;
+        m_attached_len = 0;
         m_len = 0;
+        m_stamp = 0;
     }
 
+    /* external storage is only replaced if it is too small */
     void reset(size_t new_len)
     {
+        if (!m_buffer.empty() || new_len + m_headroom > m_capacity) {
+            m_buffer.resize(new_len + m_headroom);
+            m_storage = &m_buffer[0];
+            m_capacity = m_buffer.size();
+        }
+
         m_buffer_len = new_len;
-        m_buffer.resize(new_len + m_headroom);
         reset();
     }
 
+    void reset(const buffer_pkt &layout)
+    {
+        if (m_buffer_len != layout.m_buffer_len)
+            reset(layout.m_buffer_len);
+
+        m_base = m_storage;
+        m_head = m_storage + layout.max_head_len();
+        m_data = m_head + layout.head_len();
+        m_attached_len = 0;
+        m_len = layout.m_len;
+        m_stamp = 0;
+    }
+
+    /* point the buffer at external memory from base to end (e.g. a frame in
+     * a packet ring) until the next reset(); the current head/data layout is
+     * kept, and the max lengths are those of the frame */
+    void attach(uint8_t *base, uint8_t *head, uint8_t *end)
+    {
+        size_t head_len = m_data - m_head;
+
+        m_base = base;
+        m_head = head;
+        m_data = head + head_len;
+        m_attached_len = end - base;
+    }
+
     uint8_t *head_push(size_t size)
     {
         m_head -= size;
@@ -162,17 +248,17 @@ class buffer_pkt
 
     size_t max_head_len() const
     {
-        return m_head - &m_buffer[0];
+        return m_head - m_base;
     }
 
     size_t max_data_len() const
     {
-        return m_buffer_len - (m_data - &m_buffer[0]);
+        return max_len() - (m_data - m_base);
     }
 
     size_t max_len() const
     {
-        return m_buffer_len;
+        return m_attached_len ? m_attached_len : m_buffer_len;
     }
 
     size_t len() const
@@ -189,4 +275,14 @@ class buffer_pkt
     {
         return m_len - (m_data - m_head);
     }
+
+    uint64_t stamp() const
+    {
+        return m_stamp;
+    }
+
+    void stamp(uint64_t time)
+    {
+        m_stamp = time;
+    }
 };
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <vector>
+
+#include "kwargs.hpp"
+
+struct burst_read_args
+{
+    static const Kwarg<size_t> burst_size;
+};
+
+decltype(burst_read_args::burst_size) burst_read_args::burst_size;
+
+/* Receive packets from the socket below in bursts of up to burst_size
+ * packets per syscall and hand them to the layers above one at a time.
+ *
+ * Insert directly above a udp or eth socket layer. Packets are swapped into
+ * the buffer passed to read_pkt(), so the buffer layout (head reservations)
+ * of the caller is applied to the whole burst before receiving.
+ *
+ * Packets left in the burst when a caller stops reading early don't make
+ * the socket readable again, so such a caller checks burst_pending() and
+ * has its read callback run again (io::pending()) while it is non-zero. */
+template<class super>
+class burst_read : public super, public burst_read_args
+{
+    typedef typename super::buffer_ptr buf_ptr;
+
+    std::vector<buf_ptr> m_burst;
+    size_t m_count = 0;
+    size_t m_next = 0;
+
+    size_t read_burst(buf_ptr &layout)
+    {
+        for (auto &b : m_burst) {
+            /* don't reuse buffers still referenced by the layers above */
+            if (!b || b.use_count() > 1)
+                b = super::buffer();
+
+            b->reset(*layout);
+        }
+
+        m_next = 0;
+        m_count = super::read_pkts(m_burst, layout->max_len());
+
+        return m_count;
+    }
+
+  public:
+    template<typename... Args> explicit
+    burst_read(const Args&... args)
+        : super(args...),
+          m_burst(kwget(burst_size, 32, args...))
+    {}
+
+    size_t burst_pending() const
+    {
+        return m_count - m_next;
+    }
+
+    bool read_pkt(buf_ptr &buf)
+    {
+        if (!burst_pending() && !read_burst(buf))
+            return false;
+
+        buf.swap(m_burst[m_next++]);
+
+        return true;
+    }
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <vector>
+
+#include "kwargs.hpp"
+
+struct burst_write_args
+{
+    static const Kwarg<size_t> queue_size;
+};
+
+decltype(burst_write_args::queue_size) burst_write_args::queue_size;
+
+/* Queue packets written to the socket below and send them with a single
+ * syscall when the queue is full or when flush() is called, typically from
+ * io::add_flush_cb() once per event loop iteration.
+ *
+ * Insert directly above a udp or eth socket layer. Written buffers are
+ * swapped into the queue and the caller gets an empty buffer back, so it
+ * must not be used below layers that keep the sent buffer (plain_hdr) or
+ * on stream sockets. write_pkt() returns false only if the queue is full
+ * and the socket can't take any of it, like a failing sendto() would.
+ *
+ * flush() returns false while packets are left in the queue, e.g. when the
+ * socket returned EAGAIN; the caller then enables write interest on the fd
+ * and flushes again from its write callback. */
+template<class super>
+class burst_write : public super, public burst_write_args
+{
+    typedef typename super::buffer_ptr buf_ptr;
+
+    std::vector<buf_ptr> m_queue;
+    size_t m_count = 0;
+
+    bool is_queue_full() const
+    {
+        return m_count == m_queue.size();
+    }
+
+  public:
+    template<typename... Args> explicit
+    burst_write(const Args&... args)
+        : super(args...),
+          m_queue(kwget(queue_size, 32, args...))
+    {}
+
+    size_t queue_pending() const
+    {
+        return m_count;
+    }
+
+    bool flush()
+    {
+        size_t sent;
+
+        if (!m_count)
+            return true;
+
+        sent = super::write_pkts(m_queue, m_count);
+
+        /* keep unsent packets in order at the front of the queue */
+        for (size_t i = sent; i < m_count; ++i)
+            m_queue[i - sent].swap(m_queue[i]);
+
+        m_count -= sent;
+
+        return m_count == 0;
+    }
+
+    bool write_pkt(buf_ptr &buf)
+    {
+        if (is_queue_full())
+            flush();
+
+        if (is_queue_full())
+            return false;
+
+        buf.swap(m_queue[m_count++]);
+
+        /* don't reuse sent buffers still referenced elsewhere */
+        if (buf && buf.use_count() == 1)
+            buf->reset();
+        else
+            buf = super::buffer();
+
+        if (is_queue_full())
+            flush();
+
+        return true;
+    }
+};
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <linux/if_ether.h>
+#include <algorithm>
+#include <atomic>
+
+#include "kwargs.hpp"
+#include "metrics.hpp"
+#include "rlnc_hdr_base.hpp"
+#include "stat_counter.hpp"
+
+struct error_estimator_args
+{
+    static const Kwarg<double> estimate_weight;
+};
+
+decltype(error_estimator_args::estimate_weight)
+    error_estimator_args::estimate_weight;
+
+/* Estimate the error probabilities of the links into this node while
+ * running, and hand them to the budget layers above in place of the
+ * static ones from error_info.
+ *
+ * Every rlnc header carries the sender's sequence number, so a gap in the
+ * numbers seen from a peer is a loss on the link from it. Links are
+ * numbered by peer as in loss_dec and loss_hlp: the source is e1, the
+ * helper e2, the neighbor e3 and the two hop node e4. Each estimate is an
+ * exponentially weighted average over packets, lost ones counting 1 and
+ * received ones 0, with estimate_weight for the newest packet; 0 keeps
+ * the static errors. Links nothing is heard from keep their static error.
+ *
+ * Nodes that only send data (the source, the relay towards the decoder)
+ * hear from the neighbor through its acks only, so their estimate of e3
+ * is taken from the ack stream and assumes the link loses as much in
+ * both directions. Estimating from the rank in the acks instead would
+ * feed the budget back into itself, as the packets a larger budget sends
+ * after the decoder is full look lost.
+ *
+ * The budget layers pick up new estimates when they start a block. Insert
+ * between eth_hdr and eth_topology, above any synthetic loss; it may run
+ * in the I/O thread of a pipeline, as estimates are shared atomically. */
+template<class super>
+class error_estimator : public super, public error_estimator_args
+{
+    typedef typename super::buffer_ptr buf_ptr;
+    typedef rlnc_hdr_base<typename super::buffer_type> hdr;
+
+    enum {
+        e1 = 0,
+        e2,
+        e3,
+        e4,
+        e_max
+    };
+
+    /* the type byte tells the length of the rest of the header */
+    static constexpr size_t m_hdr_min = 1;
+
+    /* sequence numbers of the compact header are 16 bit */
+    static constexpr size_t m_seq_mask = UINT16_MAX;
+
+    /* a jump this large is a restarted peer, not a loss burst */
+    static constexpr size_t m_resync = 1024;
+
+    /* keep budgets finite on a dead link */
+    static constexpr double m_error_max = .9;
+
+    struct link {
+        std::atomic<double> estimate;
+        size_t last = 0;
+        bool synced = false;
+    };
+
+    struct link m_links[e_max];
+    typename super::errors_type m_errors;
+    double m_weight;
+
+    stat_counter m_lost[e_max] = {
+        {"est e1 lost"}, {"est e2 lost"}, {"est e3 lost"}, {"est e4 lost"}
+    };
+    stat_counter m_received[e_max] = {
+        {"est e1 received"}, {"est e2 received"},
+        {"est e3 received"}, {"est e4 received"}
+    };
+    metric_gauge m_permille[e_max] = {
+        {"est e1 permille"}, {"est e2 permille"},
+        {"est e3 permille"}, {"est e4 permille"}
+    };
+
+    bool peer(buf_ptr &buf, size_t &e)
+    {
+        if (super::is_source(buf))
+            e = e1;
+        else if (super::is_helper(buf))
+            e = e2;
+        else if (super::is_neighbor(buf))
+            e = e3;
+        else if (super::is_two_hop(buf))
+            e = e4;
+        else
+            return false;
+
+        return true;
+    }
+
+    void update(size_t e, size_t lost)
+    {
+        struct link &l = m_links[e];
+        double estimate = l.estimate.load(std::memory_order_relaxed);
+
+        for (size_t i = 0; i < lost; ++i)
+            estimate += m_weight*(1 - estimate);
+
+        estimate -= m_weight*estimate;
+        l.estimate.store(estimate, std::memory_order_relaxed);
+
+        m_lost[e] += lost;
+        ++m_received[e];
+        m_permille[e].set(estimate*1000);
+    }
+
+    void observe(buf_ptr &buf)
+    {
+        uint8_t *data = buf->head() + ETH_HLEN;
+        size_t e, seq, diff;
+
+        if (buf->len() < ETH_HLEN + m_hdr_min || !peer(buf, e))
+            return;
+
+        if (buf->len() < ETH_HLEN + hdr::header_len(data))
+            return;
+
+        struct link &l = m_links[e];
+
+        seq = hdr::sequence(data) & m_seq_mask;
+        diff = (seq - l.last) & m_seq_mask;
+
+        /* late packets were counted as lost; leave it to the average */
+        if (l.synced && diff > m_seq_mask/2)
+            return;
+
+        l.last = seq;
+
+        if (!l.synced || diff == 0 || diff > m_resync) {
+            l.synced = true;
+            return;
+        }
+
+        update(e, diff - 1);
+    }
+
+  protected:
+    template<typename... Args> explicit
+    error_estimator(const Args&... args)
+        : super(args...),
+          m_errors(super::errors_info()),
+          m_weight(kwget(estimate_weight, .01, args...))
+    {
+        for (size_t e = 0; e < e_max; ++e) {
+            m_links[e].estimate = e < m_errors.size() ? m_errors[e] : 0;
+            m_permille[e].set(m_links[e].estimate*1000);
+        }
+    }
+
+    /* the current estimates, in place of the static errors */
+    typename super::errors_type &errors_info()
+    {
+        for (size_t e = 0; e < e_max && e < m_errors.size(); ++e)
+            m_errors[e] = std::min(m_links[e].estimate.load(
+                                       std::memory_order_relaxed),
+                                   m_error_max);
+
+        return m_errors;
+    }
+
+  public:
+    double error_estimate(size_t e) const
+    {
+        return m_links[e].estimate.load(std::memory_order_relaxed);
+    }
+
+    bool read_pkt(buf_ptr &buf)
+    {
+        if (!super::read_pkt(buf))
+            return false;
+
+        if (m_weight > 0)
+            observe(buf);
+
+        return true;
+    }
+};
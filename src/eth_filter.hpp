@@ -2,6 +2,7 @@
 
 #include <system_error>
 #include <vector>
+#include <initializer_list>
 #include <cstdint>
 #include <cstdio>
 #include <linux/filter.h>
@@ -13,6 +14,7 @@
 class eth_filter_base
 {
     typedef std::vector<uint8_t> buf_type;
+    typedef std::vector<struct sock_filter> rule_type;
 
     struct eth_dual {
         uint16_t head;
@@ -22,6 +24,7 @@ class eth_filter_base
     int m_fd;
     buf_type m_buf;
     uint16_t m_default = 0xffff; /* accept by default */
+    uint8_t m_type_mask = 0xff;
 
   protected:
     enum payload_type : uint8_t {
@@ -71,176 +74,88 @@ class eth_filter_base
                                     "unable to attach packet filter");
     }
 
-    void filter_add(const uint8_t *src)
+    /* rule matching the address at offset off, followed by the rest of a
+     * rule len instructions long; jumps past the rule if not equal */
+    static void filter_addr(rule_type &bpf, const uint8_t *addr,
+                            uint32_t off, size_t len)
     {
-        auto s = reinterpret_cast<const struct eth_dual *>(src);
-
-        if (!src)
-            return;
-
-        struct sock_filter bpf[] = {
-            { BPF_LD + BPF_W + BPF_ABS, 0, 0, 8 },               /* 0: point to byte 8-11  */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 3, htonl(s->tail) }, /* 1: jump to next if not equal */
-            { BPF_LD + BPF_H + BPF_ABS, 0, 0, 6 },               /* 2: point to byte 6-7 */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 1, htons(s->head) }, /* 3: jump to next if not equal */
-            { BPF_RET + BPF_K, 0, 0, 0xffff},                    /* 4: accept packet */
-        };
-
-        filter_append(bpf, sizeof(bpf));
-        m_default = 0x0000; /* ignore by default */
+        auto a = reinterpret_cast<const struct eth_dual *>(addr);
+        uint8_t out;
+
+        bpf.push_back({ BPF_LD + BPF_W + BPF_ABS, 0, 0, off + 2 });    /* point to addr[2:6] */
+        out = len - bpf.size() - 1;
+        bpf.push_back({ BPF_JMP + BPF_JEQ + BPF_K, 0, out, htonl(a->tail) }); /* jump to next if not eq */
+        bpf.push_back({ BPF_LD + BPF_H + BPF_ABS, 0, 0, off });        /* point to addr[0:2] */
+        out = len - bpf.size() - 1;
+        bpf.push_back({ BPF_JMP + BPF_JEQ + BPF_K, 0, out, htons(a->head) }); /* jump to next if not eq */
     }
 
-    void filter_add(const uint8_t *src, uint8_t type)
+    /* accept packets from src, and to dst if given, and with one of types
+     * in the type byte if any are given; packets of the addresses with
+     * other types are ignored. Flag bits outside the type mask are left
+     * out of the comparison. */
+    void filter_rule(const uint8_t *src, const uint8_t *dst,
+                     std::initializer_list<uint8_t> types)
     {
-        auto s = reinterpret_cast<const struct eth_dual *>(src);
+        size_t len = (dst ? 8 : 4) + (types.size() ? types.size() + 4 : 1);
+        size_t left = types.size();
+        rule_type bpf;
 
-        if (!src)
-            return;
+        if (dst)
+            filter_addr(bpf, dst, 0, len);
 
-        struct sock_filter bpf[] = {
-            { BPF_LD + BPF_W + BPF_ABS, 0, 0, 8 },               /* 0: point to byte 8-11  */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 6, htonl(s->tail) }, /* 1: jump to next if not equal */
-            { BPF_LD + BPF_H + BPF_ABS, 0, 0, 6 },               /* 2: point to byte 6-7 */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 4, htons(s->head) }, /* 3: jump to next if not equal */
-            { BPF_LD + BPF_B + BPF_ABS, 0, 0, 14 },              /* 4: point to type byte */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 1, type },           /* 5: jump to ignore if not equal */
-            { BPF_RET + BPF_K, 0, 0, 0xffff},                    /* 6: accept packet */
-            { BPF_RET + BPF_K, 0, 0, 0x0000},                    /* 7: ignore packet */
-        };
+        filter_addr(bpf, src, 6, len);
 
-        filter_append(bpf, sizeof(bpf));
-        m_default = 0x0000; /* ignore by default */
-    }
+        if (left) {
+            bpf.push_back({ BPF_LD + BPF_B + BPF_ABS, 0, 0, 14 });       /* point to type byte */
+            bpf.push_back({ BPF_ALU + BPF_AND + BPF_K, 0, 0, m_type_mask }); /* leave out flags */
+        }
 
-    void filter_add(const uint8_t *src, uint8_t type1, uint8_t type2)
-    {
-        auto s = reinterpret_cast<const struct eth_dual *>(src);
+        for (uint8_t type : types) {
+            if (--left)
+                bpf.push_back({ BPF_JMP + BPF_JEQ + BPF_K, uint8_t(left), 0, type }); /* jump to accept if equal */
+            else
+                bpf.push_back({ BPF_JMP + BPF_JEQ + BPF_K, 0, 1, type });  /* jump to ignore if not eq */
+        }
 
-        if (!src)
-            return;
+        bpf.push_back({ BPF_RET + BPF_K, 0, 0, 0xffff });                /* accept packet */
 
-        struct sock_filter bpf[] = {
-            { BPF_LD + BPF_W + BPF_ABS, 0, 0, 8 },               /* 0: point to src[2:6] */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 7, htonl(s->tail) }, /* 1: jump to next if not equal */
-            { BPF_LD + BPF_H + BPF_ABS, 0, 0, 6 },               /* 2: point to src[0:2] */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 5, htons(s->head) }, /* 3: jump to next if not equal */
-            { BPF_LD + BPF_B + BPF_ABS, 0, 0, 14 },              /* 4: point to type byte */
-            { BPF_JMP + BPF_JEQ + BPF_K, 1, 0, type1 },          /* 5: jump to accept if equal */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 1, type2 },          /* 5: jump to ignore if not equal */
-            { BPF_RET + BPF_K, 0, 0, 0xffff},                    /* 6: accept packet */
-            { BPF_RET + BPF_K, 0, 0, 0x0000},                    /* 7: ignore packet */
-        };
+        if (types.size())
+            bpf.push_back({ BPF_RET + BPF_K, 0, 0, 0x0000 });            /* ignore packet */
 
-        filter_append(bpf, sizeof(bpf));
+        filter_append(&bpf[0], bpf.size()*sizeof(bpf[0]));
         m_default = 0x0000; /* ignore by default */
     }
 
-    void filter_add(const uint8_t *src, const uint8_t *dst)
+    /* bits of the type byte compared by the typed filters */
+    void filter_type_mask(uint8_t mask)
     {
-        auto s = reinterpret_cast<const struct eth_dual *>(src);
-        auto d = reinterpret_cast<const struct eth_dual *>(dst);
-
-        if (!src || !dst)
-            return;
-
-        struct sock_filter bpf[] = {
-            { BPF_LD + BPF_W + BPF_ABS, 0, 0, 2 },                /*  0: point to dst[2:6] */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 7, htonl(d->tail) }, /*  1: jump to next if not eq */
-            { BPF_LD + BPF_H + BPF_ABS, 0, 0, 0 },                /*  2: point to dst[0:2] */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 5, htons(d->head) },  /*  3: jump to next if not eq */
-            { BPF_LD + BPF_W + BPF_ABS, 0, 0, 8 },                /*  4: point to src[2:6] */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 3, htonl(s->tail) },  /*  5: jump to next if not eq */
-            { BPF_LD + BPF_H + BPF_ABS, 0, 0, 6 },                /*  6: point to src[0:2] */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 1, htons(s->head) },  /*  7: jump to next if not eq */
-            { BPF_RET + BPF_K, 0, 0, 0xffff},                     /* 10: accept packet */
-        };
-
-        filter_append(bpf, sizeof(bpf));
-        m_default = 0x0000; /* ignore by default */
+        m_type_mask = mask;
     }
 
-    void filter_add(const uint8_t *src, const uint8_t *dst, uint8_t type)
+    void filter_add(const uint8_t *src)
     {
-        auto s = reinterpret_cast<const struct eth_dual *>(src);
-        auto d = reinterpret_cast<const struct eth_dual *>(dst);
-
-        if (!src || !dst)
-            return;
-
-        struct sock_filter bpf[] = {
-            { BPF_LD + BPF_W + BPF_ABS, 0, 0, 2 },                /*  0: point to dst[2:6] */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 10, htonl(d->tail) }, /*  1: jump to next if not eq */
-            { BPF_LD + BPF_H + BPF_ABS, 0, 0, 0 },                /*  2: point to dst[0:2] */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 8, htons(d->head) },  /*  3: jump to next if not eq */
-            { BPF_LD + BPF_W + BPF_ABS, 0, 0, 8 },                /*  4: point to src[2:6] */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 6, htonl(s->tail) },  /*  5: jump to next if not eq */
-            { BPF_LD + BPF_H + BPF_ABS, 0, 0, 6 },                /*  6: point to src[0:2] */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 4, htons(s->head) },  /*  7: jump to next if not eq */
-            { BPF_LD + BPF_B + BPF_ABS, 0, 0, 14 },               /*  8: point to type byte */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 1, type },            /*  9: jump to ignore if not eq */
-            { BPF_RET + BPF_K, 0, 0, 0xffff},                     /* 10: accept packet */
-            { BPF_RET + BPF_K, 0, 0, 0x0000},                     /* 11: ignore packet */
-        };
-
-        filter_append(bpf, sizeof(bpf));
-        m_default = 0x0000; /* ignore by default */
+        if (src)
+            filter_rule(src, NULL, {});
     }
 
-    void filter_add(const uint8_t *src, const uint8_t *dst, uint8_t type1, uint8_t type2)
+    void filter_add(const uint8_t *src, std::initializer_list<uint8_t> types)
     {
-        auto s = reinterpret_cast<const struct eth_dual *>(src);
-        auto d = reinterpret_cast<const struct eth_dual *>(dst);
-
-        if (!src || !dst)
-            return;
-
-        struct sock_filter bpf[] = {
-            { BPF_LD + BPF_W + BPF_ABS, 0, 0, 2 },                /*  0: point to dst[2:6] */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 11, htonl(d->tail) }, /*  1: jump to next if not eq */
-            { BPF_LD + BPF_H + BPF_ABS, 0, 0, 0 },                /*  2: point to dst[0:2] */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 9, htons(d->head) },  /*  3: jump to next if not eq */
-            { BPF_LD + BPF_W + BPF_ABS, 0, 0, 8 },                /*  4: point to src[2:6] */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 7, htonl(s->tail) },  /*  5: jump to next if not eq */
-            { BPF_LD + BPF_H + BPF_ABS, 0, 0, 6 },                /*  6: point to src[0:2] */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 5, htons(s->head) },  /*  7: jump to next if not eq */
-            { BPF_LD + BPF_B + BPF_ABS, 0, 0, 14 },               /*  8: point to type byte */
-            { BPF_JMP + BPF_JEQ + BPF_K, 1, 0, type1 },           /*  9: jump to accept if equal */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 1, type2 },           /* 10: jump to ignore if not eq */
-            { BPF_RET + BPF_K, 0, 0, 0xffff},                     /* 11: accept packet */
-            { BPF_RET + BPF_K, 0, 0, 0x0000},                     /* 12: ignore packet */
-        };
-
-        filter_append(bpf, sizeof(bpf));
-        m_default = 0x0000; /* ignore by default */
+        if (src)
+            filter_rule(src, NULL, types);
     }
 
-    void filter_add(const uint8_t *src, const uint8_t *dst, uint8_t type1, uint8_t type2, uint8_t type3)
+    void filter_add(const uint8_t *src, const uint8_t *dst)
     {
-        auto s = reinterpret_cast<const struct eth_dual *>(src);
-        auto d = reinterpret_cast<const struct eth_dual *>(dst);
-
-        if (!src || !dst)
-            return;
-
-        struct sock_filter bpf[] = {
-            { BPF_LD + BPF_W + BPF_ABS, 0, 0, 2 },                /*  0: point to dst[2:6] */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 12, htonl(d->tail) }, /*  1: jump to next if not eq */
-            { BPF_LD + BPF_H + BPF_ABS, 0, 0, 0 },                /*  2: point to dst[0:2] */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 10, htons(d->head) },  /*  3: jump to next if not eq */
-            { BPF_LD + BPF_W + BPF_ABS, 0, 0, 8 },                /*  4: point to src[2:6] */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 8, htonl(s->tail) },  /*  5: jump to next if not eq */
-            { BPF_LD + BPF_H + BPF_ABS, 0, 0, 6 },                /*  6: point to src[0:2] */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 6, htons(s->head) },  /*  7: jump to next if not eq */
-            { BPF_LD + BPF_B + BPF_ABS, 0, 0, 14 },               /*  8: point to type byte */
-            { BPF_JMP + BPF_JEQ + BPF_K, 2, 0, type1 },           /*  9: jump to accept if equal */
-            { BPF_JMP + BPF_JEQ + BPF_K, 1, 0, type2 },           /* 10: jump to accept if equal */
-            { BPF_JMP + BPF_JEQ + BPF_K, 0, 1, type3 },           /* 11: jump to ignore if not eq */
-            { BPF_RET + BPF_K, 0, 0, 0xffff},                     /* 11: accept packet */
-            { BPF_RET + BPF_K, 0, 0, 0x0000},                     /* 12: ignore packet */
-        };
+        if (src && dst)
+            filter_rule(src, dst, {});
+    }
 
-        filter_append(bpf, sizeof(bpf));
-        m_default = 0x0000; /* ignore by default */
+    void filter_add(const uint8_t *src, const uint8_t *dst,
+                    std::initializer_list<uint8_t> types)
+    {
+        if (src && dst)
+            filter_rule(src, dst, types);
     }
 
     void filter_size_max(uint32_t size)
@@ -313,17 +228,19 @@ class eth_filter_dec :
         filter_size_min(kwget(filter_min_size, 0, args...));
         filter_size_max(kwget(filter_max_size, 0, args...));
 
-        /* filter encoded and recoded packets from neighbor to this host */
+        filter_type_mask(super::rlnc_type_mask);
+
+        /* filter encoded, recoded, and hello packets from neighbor to this host */
         filter_add(super::neighbor_addr(), super::interface_address(),
-                   super::rlnc_enc, super::rlnc_rec);
+                   {super::rlnc_enc, super::rlnc_rec, super::rlnc_hello});
 
         /* filter encoded and recoded packets from two-hop neighbor to neighbor */
         filter_add(super::two_hop_addr(), super::neighbor_addr(),
-                   super::rlnc_enc, super::rlnc_rec);
+                   {super::rlnc_enc, super::rlnc_rec});
 
-        /* filter helper packets from helper to this host */
+        /* filter helper and hello packets from helper to this host */
         filter_add(super::helper_addr(), super::interface_address(),
-                   super::rlnc_hlp);
+                   {super::rlnc_hlp, super::rlnc_hello});
 
         filter_apply();
     }
@@ -344,17 +261,20 @@ class eth_filter_rec :
         filter_size_min(kwget(filter_min_size, 0, args...));
         filter_size_max(kwget(filter_max_size, 0, args...));
 
-        /* filter encoded, recoded, and ack packets from neighbor to this host */
+        filter_type_mask(super::rlnc_type_mask);
+
+        /* filter encoded, recoded, ack, and hello packets from neighbor to this host */
         filter_add(super::neighbor_addr(), super::interface_address(),
-                   super::rlnc_enc, super::rlnc_rec, super::rlnc_ack);
+                   {super::rlnc_enc, super::rlnc_rec, super::rlnc_ack,
+                    super::rlnc_hello});
 
         /* filter encoded and recoded packets from two-hop neighbor to neighbor */
         filter_add(super::two_hop_addr(), super::neighbor_addr(),
-                   super::rlnc_enc, super::rlnc_rec);
+                   {super::rlnc_enc, super::rlnc_rec});
 
-        /* filter helper packets from helper to this host */
+        /* filter helper and hello packets from helper to this host */
         filter_add(super::helper_addr(), super::interface_address(),
-                   super::rlnc_hlp);
+                   {super::rlnc_hlp, super::rlnc_hello});
 
         filter_apply();
     }
@@ -369,8 +289,11 @@ class eth_filter_enc : public super, public eth_filter_base
         : super(args...),
           eth_filter_base(super::fd())
     {
+        filter_type_mask(super::rlnc_type_mask);
+
+        /* filter ack, stop, and hello packets from neighbor to this host */
         filter_add(super::neighbor_addr(), super::interface_address(),
-                   super::rlnc_ack, super::rlnc_stop);
+                   {super::rlnc_ack, super::rlnc_stop, super::rlnc_hello});
 
         filter_apply();
     }
@@ -385,13 +308,15 @@ class eth_filter_hlp : public super, public eth_filter_base
         : super(args...),
           eth_filter_base(super::fd())
     {
-        /* allow encoded and recoded packets sent from destination to source */
+        filter_type_mask(super::rlnc_type_mask);
+
+        /* allow encoded, recoded, and hello packets sent from destination to source */
         filter_add(super::destination_addr(), super::source_addr(),
-                   super::rlnc_enc, super::rlnc_rec);
+                   {super::rlnc_enc, super::rlnc_rec, super::rlnc_hello});
 
-        /* allow acks sent from source to destination */
+        /* allow acks and hellos sent from source to destination */
         filter_add(super::source_addr(), super::destination_addr(),
-                   super::rlnc_ack, super::rlnc_stop);
+                   {super::rlnc_ack, super::rlnc_stop, super::rlnc_hello});
 
         filter_apply();
     }
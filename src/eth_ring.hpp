@@ -0,0 +1,305 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstring>
+#include <system_error>
+
+#include "kwargs.hpp"
+
+struct eth_ring_args
+{
+    static const Kwarg<size_t> ring_blocks;
+    static const Kwarg<size_t> ring_block_size;
+    static const Kwarg<unsigned> ring_timeout;
+};
+
+decltype(eth_ring_args::ring_blocks) eth_ring_args::ring_blocks;
+decltype(eth_ring_args::ring_block_size) eth_ring_args::ring_block_size;
+decltype(eth_ring_args::ring_timeout) eth_ring_args::ring_timeout;
+
+/* Memory mapped packet rings on top of eth_sock.
+ *
+ * Received frames are read from a TPACKET_V3 ring on the eth_sock socket (so
+ * eth_filter_* still applies) and handed up without a copy: the buffer is
+ * attached to the frame in the ring and stays valid until the next
+ * read_pkt(). Written frames are copied into a TPACKET_V2 ring on a second
+ * socket and sent with one syscall per batch or when flush() is called from
+ * io::add_flush_cb().
+ *
+ * Frames the kernel could not take (EAGAIN, ENOBUFS) stay marked for sending
+ * and flush() returns false until they are taken; as with burst_write, the
+ * caller then enables write interest on fd() and flushes again from its write
+ * callback. The rx socket polls writable, so that retries once per loop
+ * iteration until the tx ring is drained. */
+template<class super>
+class eth_ring : public super, public eth_ring_args
+{
+    typedef typename super::buffer_ptr buf_ptr;
+
+    static constexpr size_t m_rx_reserve = 64;
+    static constexpr size_t m_tx_offset = TPACKET2_HDRLEN -
+                                          sizeof(struct sockaddr_ll);
+
+    size_t m_blocks;
+    size_t m_block_size;
+    unsigned m_timeout;
+
+    uint8_t *m_rx_ring = NULL;
+    size_t m_rx_block = 0;
+    size_t m_rx_left = 0;
+    bool m_rx_busy = false;
+    struct tpacket3_hdr *m_rx_pkt = NULL;
+
+    int m_tx_fd = -1;
+    uint8_t *m_tx_ring = NULL;
+    size_t m_tx_frame_size;
+    size_t m_tx_frames_per_block;
+    size_t m_tx_frames;
+    size_t m_tx_next = 0;
+    size_t m_tx_pending = 0;
+
+    static uint8_t *ring_map(int fd, size_t len)
+    {
+        void *ring = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+        if (ring == MAP_FAILED)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to map packet ring");
+
+        return reinterpret_cast<uint8_t *>(ring);
+    }
+
+    static void ring_opt(int fd, int opt, const void *val, socklen_t len)
+    {
+        if (setsockopt(fd, SOL_PACKET, opt, val, len) < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to configure packet ring");
+    }
+
+    void rx_setup()
+    {
+        int version = TPACKET_V3;
+        unsigned reserve = m_rx_reserve;
+        struct tpacket_req3 req;
+
+        memset(&req, 0, sizeof(req));
+        req.tp_block_size = m_block_size;
+        req.tp_block_nr = m_blocks;
+        req.tp_frame_size = TPACKET_ALIGN(TPACKET3_HDRLEN + m_rx_reserve +
+                                          super::data_size_max());
+        req.tp_frame_nr = m_block_size/req.tp_frame_size*m_blocks;
+        req.tp_retire_blk_tov = m_timeout;
+
+        ring_opt(super::fd(), PACKET_VERSION, &version, sizeof(version));
+        ring_opt(super::fd(), PACKET_RESERVE, &reserve, sizeof(reserve));
+        ring_opt(super::fd(), PACKET_RX_RING, &req, sizeof(req));
+
+        m_rx_ring = ring_map(super::fd(), m_block_size*m_blocks);
+    }
+
+    void tx_setup()
+    {
+        int version = TPACKET_V2;
+        struct tpacket_req req;
+        struct sockaddr_ll sa;
+
+        /* protocol 0 keeps received frames out of the tx socket */
+        m_tx_fd = socket(PF_PACKET, SOCK_RAW, 0);
+
+        if (m_tx_fd < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to open tx socket");
+
+        m_tx_frame_size = TPACKET_ALIGN(TPACKET2_HDRLEN +
+                                        super::data_size_max());
+        m_tx_frames_per_block = m_block_size/m_tx_frame_size;
+        m_tx_frames = m_tx_frames_per_block*m_blocks;
+
+        memset(&req, 0, sizeof(req));
+        req.tp_block_size = m_block_size;
+        req.tp_block_nr = m_blocks;
+        req.tp_frame_size = m_tx_frame_size;
+        req.tp_frame_nr = m_tx_frames;
+
+        ring_opt(m_tx_fd, PACKET_VERSION, &version, sizeof(version));
+        ring_opt(m_tx_fd, PACKET_TX_RING, &req, sizeof(req));
+
+        m_tx_ring = ring_map(m_tx_fd, m_block_size*m_blocks);
+
+        memcpy(&sa, super::sockaddr(), sizeof(sa));
+        sa.sll_protocol = 0;
+
+        if (bind(m_tx_fd, reinterpret_cast<struct sockaddr *>(&sa),
+                 sizeof(sa)) < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to bind tx socket");
+    }
+
+    struct tpacket_block_desc *rx_block(size_t b)
+    {
+        uint8_t *block = m_rx_ring + b*m_block_size;
+
+        return reinterpret_cast<struct tpacket_block_desc *>(block);
+    }
+
+    bool rx_block_acquire()
+    {
+        struct tpacket_block_desc *bd = rx_block(m_rx_block);
+        uint8_t *block = reinterpret_cast<uint8_t *>(bd);
+
+        if (!(bd->hdr.bh1.block_status & TP_STATUS_USER))
+            return false;
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        block += bd->hdr.bh1.offset_to_first_pkt;
+        m_rx_pkt = reinterpret_cast<struct tpacket3_hdr *>(block);
+        m_rx_left = bd->hdr.bh1.num_pkts;
+        m_rx_busy = true;
+
+        return true;
+    }
+
+    /* blocks are given back once every frame in them has been read and the
+     * layers above are done with the last one */
+    void rx_block_release()
+    {
+        if (!m_rx_busy)
+            return;
+
+        std::atomic_thread_fence(std::memory_order_release);
+        rx_block(m_rx_block)->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        m_rx_block = (m_rx_block + 1) % m_blocks;
+        m_rx_busy = false;
+    }
+
+    struct tpacket2_hdr *tx_frame(size_t f)
+    {
+        size_t block = f/m_tx_frames_per_block;
+        size_t frame = f % m_tx_frames_per_block;
+        uint8_t *ptr = m_tx_ring + block*m_block_size + frame*m_tx_frame_size;
+
+        return reinterpret_cast<struct tpacket2_hdr *>(ptr);
+    }
+
+    bool tx_available(struct tpacket2_hdr *hdr)
+    {
+        return hdr->tp_status == TP_STATUS_AVAILABLE ||
+               hdr->tp_status == TP_STATUS_WRONG_FORMAT;
+    }
+
+    /* hand the frames marked for sending to the kernel; false if it left
+     * some of them in the ring */
+    bool tx_kick()
+    {
+        int res = sendto(m_tx_fd, NULL, 0, MSG_DONTWAIT, super::sockaddr(),
+                         super::sockaddr_len());
+
+        if (res >= 0) {
+            m_tx_pending = 0;
+            return true;
+        }
+
+        if (errno == EAGAIN || errno == ENOBUFS)
+            return false;
+
+        throw std::system_error(errno, std::system_category(),
+                                "unable to send tx ring");
+    }
+
+  public:
+    template<typename... Args> explicit
+    eth_ring(const Args&... args)
+        : super(args...),
+          m_blocks(kwget(ring_blocks, 16, args...)),
+          m_block_size(kwget(ring_block_size, 1 << 18, args...)),
+          m_timeout(kwget(ring_timeout, 1, args...))
+    {
+        rx_setup();
+        tx_setup();
+    }
+
+    ~eth_ring()
+    {
+        if (m_rx_ring)
+            munmap(m_rx_ring, m_block_size*m_blocks);
+
+        if (m_tx_ring)
+            munmap(m_tx_ring, m_block_size*m_blocks);
+
+        if (m_tx_fd >= 0)
+            close(m_tx_fd);
+    }
+
+    bool flush()
+    {
+        return !m_tx_pending || tx_kick();
+    }
+
+    bool read_pkt(buf_ptr &buf)
+    {
+        struct tpacket3_hdr *pkt;
+        uint8_t *frame, *end;
+
+        if (!m_rx_left) {
+            rx_block_release();
+
+            if (!rx_block_acquire())
+                return false;
+        }
+
+        pkt = m_rx_pkt;
+        frame = reinterpret_cast<uint8_t *>(pkt);
+
+        /* frames are packed in the block, so the next one (or the end of
+         * the block for the last) bounds what may be written in place */
+        if (pkt->tp_next_offset)
+            end = frame + pkt->tp_next_offset;
+        else
+            end = reinterpret_cast<uint8_t *>(rx_block(m_rx_block)) +
+                  m_block_size;
+
+        buf->attach(frame + TPACKET3_HDRLEN, frame + pkt->tp_mac, end);
+        buf->push(pkt->tp_snaplen);
+
+        m_rx_pkt = reinterpret_cast<struct tpacket3_hdr *>(
+                        frame + pkt->tp_next_offset);
+        m_rx_left--;
+
+        return true;
+    }
+
+    bool write_pkt(buf_ptr &buf)
+    {
+        struct tpacket2_hdr *hdr = tx_frame(m_tx_next);
+        uint8_t *frame = reinterpret_cast<uint8_t *>(hdr);
+
+        if (!tx_available(hdr)) {
+            tx_kick();
+
+            if (!tx_available(hdr))
+                return false;
+        }
+
+        if (buf->len() > m_tx_frame_size - m_tx_offset)
+            throw std::runtime_error("packet too large for tx ring");
+
+        memcpy(frame + m_tx_offset, buf->head(), buf->len());
+        hdr->tp_len = buf->len();
+
+        std::atomic_thread_fence(std::memory_order_release);
+        hdr->tp_status = TP_STATUS_SEND_REQUEST;
+
+        m_tx_next = (m_tx_next + 1) % m_tx_frames;
+
+        /* don't let the kernel fall more than half a ring behind */
+        if (++m_tx_pending >= m_tx_frames/2)
+            tx_kick();
+
+        return true;
+    }
+};
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+
+#include "pkt_clock.hpp"
+
+/* Ring of the last protocol events of the rlnc_data layers, to see what
+ * led up to a stalled block or a failure after the fact.
+ *
+ * Events are fixed size binary records written by any thread with a
+ * relaxed add to take a slot, so recording never blocks; the newest
+ * events overwrite the oldest. Nothing is recorded, nor the ring
+ * allocated, until enable() is given the file to dump to, after which the
+ * ring is dumped
+ *
+ *     - on SIGUSR2, without stopping the program
+ *     - on an exception ending the program (std::terminate)
+ *     - whenever dump() is called, e.g. where an app catches an error
+ *
+ * The dump is a header (flight_recorder::file_header) followed by the
+ * records of the ring in slot order; scripts/flight_csv.py sorts them by
+ * sequence number and writes them as CSV. The dump is written as is from
+ * the signal handler, so a record being written at the time may come out
+ * torn; its sequence is cleared while it is written, and the script skips
+ * it. */
+class flight_recorder
+{
+  public:
+    enum layer_type : uint8_t {
+        enc_layer = 1,
+        dec_layer,
+        rec_layer,
+        hlp_layer
+    };
+
+    enum event_type : uint8_t {
+        /* symbol added to the encoder; value is its index */
+        symbol_event = 1,
+
+        /* coded packet received and its rank increase or not; value is
+         * the rank of the sender */
+        rank_event,
+        linear_event,
+
+        /* ack sent, and ack received with the rank in it */
+        ack_sent_event,
+        ack_event,
+
+        /* decoder acking on too many linear packets in a row */
+        emergency_event,
+
+        /* block done with, and next block started */
+        retire_event,
+        increment_event,
+
+        /* block not repaired in time; value is the packets resent */
+        timeout_event,
+
+        /* packet of a block too old or too far ahead */
+        late_event,
+        ahead_event,
+
+        /* peer asked to stop sending */
+        stop_event
+    };
+
+    struct event {
+        uint64_t time;
+        uint64_t seq;
+        uint32_t block;
+        uint32_t rank;
+        uint32_t value;
+        uint8_t layer;
+        uint8_t type;
+        uint16_t pad;
+    };
+
+    struct file_header {
+        char magic[4];
+        uint32_t version;
+        uint32_t event_size;
+        uint32_t events;
+    };
+
+    static constexpr size_t events = 1 << 16;
+    static constexpr uint32_t version = 1;
+
+  private:
+    static constexpr size_t m_mask = events - 1;
+    static constexpr size_t m_path_max = 256;
+
+    std::unique_ptr<struct event[]> m_events;
+    std::atomic<uint64_t> m_next;
+    std::atomic<bool> m_enabled;
+    char m_path[m_path_max];
+    std::terminate_handler m_terminate = NULL;
+
+    flight_recorder()
+        : m_next(1),
+          m_enabled(false)
+    {
+        m_path[0] = '\0';
+    }
+
+    static void dump_signal(int)
+    {
+        int err = errno;
+
+        recorder().dump();
+        errno = err;
+    }
+
+    static void dump_terminate()
+    {
+        flight_recorder &r = recorder();
+
+        r.dump();
+
+        if (r.m_terminate)
+            r.m_terminate();
+
+        abort();
+    }
+
+    static bool write_all(int fd, const void *data, size_t len)
+    {
+        const uint8_t *p = static_cast<const uint8_t *>(data);
+        ssize_t res;
+
+        while (len) {
+            res = write(fd, p, len);
+
+            if (res < 0 && errno == EINTR)
+                continue;
+
+            if (res <= 0)
+                return false;
+
+            p += res;
+            len -= res;
+        }
+
+        return true;
+    }
+
+  public:
+    flight_recorder(const flight_recorder &) = delete;
+    flight_recorder &operator=(const flight_recorder &) = delete;
+
+    /* never destroyed, so it can be dumped while exiting */
+    static flight_recorder &recorder()
+    {
+        static flight_recorder *r = new flight_recorder;
+
+        return *r;
+    }
+
+    /* record events from now on, dumping them to path */
+    void enable(const char *path)
+    {
+        struct sigaction act;
+
+        if (strlen(path) >= m_path_max)
+            throw std::runtime_error("flight recorder path too long");
+
+        strncpy(m_path, path, m_path_max - 1);
+
+        if (!m_events)
+            m_events.reset(new struct event[events]());
+
+        memset(&act, 0, sizeof(act));
+        act.sa_handler = &dump_signal;
+        act.sa_flags = SA_RESTART;
+
+        if (sigaction(SIGUSR2, &act, 0))
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to install signal");
+
+        /* only once, the handler would otherwise chain to itself */
+        if (std::get_terminate() != &dump_terminate)
+            m_terminate = std::set_terminate(&dump_terminate);
+
+        m_enabled.store(true, std::memory_order_release);
+    }
+
+    bool enabled() const
+    {
+        return m_enabled.load(std::memory_order_acquire);
+    }
+
+    static void record(layer_type layer, event_type type, size_t block,
+                       size_t rank, size_t value = 0)
+    {
+        flight_recorder &r = recorder();
+
+        if (r.enabled())
+            r.put(layer, type, block, rank, value);
+    }
+
+    void put(layer_type layer, event_type type, size_t block, size_t rank,
+             size_t value)
+    {
+        uint64_t seq = m_next.fetch_add(1, std::memory_order_relaxed);
+        struct event &e = m_events[seq & m_mask];
+
+        __atomic_store_n(&e.seq, 0, __ATOMIC_RELAXED);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        e.time = pkt_clock::now();
+        e.block = block;
+        e.rank = rank;
+        e.value = value;
+        e.layer = layer;
+        e.type = type;
+
+        __atomic_store_n(&e.seq, seq, __ATOMIC_RELEASE);
+    }
+
+    /* write the ring to the file given to enable(); only makes async
+     * signal safe calls, so it can run from a signal handler */
+    bool dump()
+    {
+        struct file_header hdr = {{'N', 'M', 'F', 'R'}, version,
+                                  sizeof(struct event), events};
+        bool res;
+        int fd;
+
+        if (!enabled())
+            return false;
+
+        fd = open(m_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+        if (fd < 0)
+            return false;
+
+        res = write_all(fd, &hdr, sizeof(hdr)) &&
+              write_all(fd, m_events.get(), sizeof(struct event)*events);
+        close(fd);
+
+        return res;
+    }
+
+    const char *path() const
+    {
+        return m_path;
+    }
+};
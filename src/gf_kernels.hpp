@@ -0,0 +1,342 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GF_KERNELS_X86
+#endif
+
+/* Region arithmetic over GF(2^8), polynomial 0x11d as in fifi::binary8.
+ *
+ * GF(2) is a subfield, so coding over it only ever multiplies by 0 or 1
+ * and runs on the same kernels: 1 is a plain add (xor).
+ *
+ * Multiplying a region by a constant splits every byte in two nibbles
+ * and looks both up in a 16 entry table of products, which pshufb does
+ * for 16 (SSSE3) or 32 (AVX2) bytes at once. The scalar kernel looks up
+ * whole bytes in a 256 entry row of the full multiplication table. The
+ * best kernel the CPU supports is picked at startup; the others can be
+ * selected by name, e.g. to compare them. */
+struct gf_kernel {
+    const char *name;
+
+    /* dst += src */
+    void (*add)(uint8_t *dst, const uint8_t *src, size_t len);
+
+    /* dst += c*src */
+    void (*mul_add)(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+
+    /* dst = c*dst */
+    void (*mul)(uint8_t *dst, uint8_t c, size_t len);
+};
+
+class gf256
+{
+    static constexpr unsigned m_poly = 0x11d;
+
+    struct tables {
+        uint8_t exp[512];
+        uint8_t log[256];
+        uint8_t mul[256][256];
+
+        /* products with the low and high nibble of a byte */
+        uint8_t nib_lo[256][16] __attribute__((aligned(16)));
+        uint8_t nib_hi[256][16] __attribute__((aligned(16)));
+
+        tables()
+        {
+            unsigned x = 1;
+
+            for (size_t i = 0; i < 255; ++i) {
+                exp[i] = exp[i + 255] = x;
+                log[x] = i;
+                x <<= 1;
+
+                if (x & 0x100)
+                    x ^= m_poly;
+            }
+
+            exp[510] = exp[511] = exp[0];
+            log[0] = 0;
+
+            for (size_t a = 0; a < 256; ++a)
+                for (size_t b = 0; b < 256; ++b)
+                    mul[a][b] = a && b ? exp[log[a] + log[b]] : 0;
+
+            for (size_t c = 0; c < 256; ++c) {
+                for (size_t n = 0; n < 16; ++n) {
+                    nib_lo[c][n] = mul[c][n];
+                    nib_hi[c][n] = mul[c][n << 4];
+                }
+            }
+        }
+    };
+
+    static const struct tables m_tables;
+    static std::vector<struct gf_kernel> m_kernels;
+    static const struct gf_kernel *m_kernel;
+
+    static void add_scalar(uint8_t *dst, const uint8_t *src, size_t len)
+    {
+        size_t i = 0;
+
+        for (; i + 8 <= len; i += 8) {
+            uint64_t d, s;
+
+            memcpy(&d, dst + i, 8);
+            memcpy(&s, src + i, 8);
+            d ^= s;
+            memcpy(dst + i, &d, 8);
+        }
+
+        for (; i < len; ++i)
+            dst[i] ^= src[i];
+    }
+
+    static void mul_add_scalar(uint8_t *dst, const uint8_t *src, uint8_t c,
+                               size_t len)
+    {
+        const uint8_t *row = m_tables.mul[c];
+
+        if (c == 0)
+            return;
+
+        if (c == 1)
+            return add_scalar(dst, src, len);
+
+        for (size_t i = 0; i < len; ++i)
+            dst[i] ^= row[src[i]];
+    }
+
+    static void mul_scalar(uint8_t *dst, uint8_t c, size_t len)
+    {
+        const uint8_t *row = m_tables.mul[c];
+
+        for (size_t i = 0; i < len; ++i)
+            dst[i] = row[dst[i]];
+    }
+
+#ifdef GF_KERNELS_X86
+    __attribute__((target("sse2")))
+    static void add_sse2(uint8_t *dst, const uint8_t *src, size_t len)
+    {
+        size_t i = 0;
+
+        for (; i + 16 <= len; i += 16) {
+            __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+            __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+
+            _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, s));
+        }
+
+        add_scalar(dst + i, src + i, len - i);
+    }
+
+    __attribute__((target("ssse3")))
+    static __m128i mul_ssse3(__m128i v, __m128i lo, __m128i hi, __m128i mask)
+    {
+        __m128i l = _mm_and_si128(v, mask);
+        __m128i h = _mm_and_si128(_mm_srli_epi64(v, 4), mask);
+
+        return _mm_xor_si128(_mm_shuffle_epi8(lo, l), _mm_shuffle_epi8(hi, h));
+    }
+
+    __attribute__((target("ssse3")))
+    static void mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c,
+                              size_t len)
+    {
+        __m128i lo = _mm_load_si128((const __m128i *)m_tables.nib_lo[c]);
+        __m128i hi = _mm_load_si128((const __m128i *)m_tables.nib_hi[c]);
+        __m128i mask = _mm_set1_epi8(0x0f);
+        size_t i = 0;
+
+        if (c == 0)
+            return;
+
+        if (c == 1)
+            return add_sse2(dst, src, len);
+
+        for (; i + 16 <= len; i += 16) {
+            __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+            __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+
+            d = _mm_xor_si128(d, mul_ssse3(s, lo, hi, mask));
+            _mm_storeu_si128((__m128i *)(dst + i), d);
+        }
+
+        mul_add_scalar(dst + i, src + i, c, len - i);
+    }
+
+    __attribute__((target("ssse3")))
+    static void mul_ssse3(uint8_t *dst, uint8_t c, size_t len)
+    {
+        __m128i lo = _mm_load_si128((const __m128i *)m_tables.nib_lo[c]);
+        __m128i hi = _mm_load_si128((const __m128i *)m_tables.nib_hi[c]);
+        __m128i mask = _mm_set1_epi8(0x0f);
+        size_t i = 0;
+
+        for (; i + 16 <= len; i += 16) {
+            __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+
+            _mm_storeu_si128((__m128i *)(dst + i), mul_ssse3(d, lo, hi, mask));
+        }
+
+        mul_scalar(dst + i, c, len - i);
+    }
+
+    __attribute__((target("avx2")))
+    static void add_avx2(uint8_t *dst, const uint8_t *src, size_t len)
+    {
+        size_t i = 0;
+
+        for (; i + 32 <= len; i += 32) {
+            __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+            __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+
+            _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, s));
+        }
+
+        add_sse2(dst + i, src + i, len - i);
+    }
+
+    __attribute__((target("avx2")))
+    static __m256i mul_avx2(__m256i v, __m256i lo, __m256i hi, __m256i mask)
+    {
+        __m256i l = _mm256_and_si256(v, mask);
+        __m256i h = _mm256_and_si256(_mm256_srli_epi64(v, 4), mask);
+
+        return _mm256_xor_si256(_mm256_shuffle_epi8(lo, l),
+                                _mm256_shuffle_epi8(hi, h));
+    }
+
+    __attribute__((target("avx2")))
+    static void mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c,
+                             size_t len)
+    {
+        __m256i lo = _mm256_broadcastsi128_si256(
+                        _mm_load_si128((const __m128i *)m_tables.nib_lo[c]));
+        __m256i hi = _mm256_broadcastsi128_si256(
+                        _mm_load_si128((const __m128i *)m_tables.nib_hi[c]));
+        __m256i mask = _mm256_set1_epi8(0x0f);
+        size_t i = 0;
+
+        if (c == 0)
+            return;
+
+        if (c == 1)
+            return add_avx2(dst, src, len);
+
+        for (; i + 32 <= len; i += 32) {
+            __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+            __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+
+            d = _mm256_xor_si256(d, mul_avx2(s, lo, hi, mask));
+            _mm256_storeu_si256((__m256i *)(dst + i), d);
+        }
+
+        mul_add_ssse3(dst + i, src + i, c, len - i);
+    }
+
+    __attribute__((target("avx2")))
+    static void mul_avx2(uint8_t *dst, uint8_t c, size_t len)
+    {
+        __m256i lo = _mm256_broadcastsi128_si256(
+                        _mm_load_si128((const __m128i *)m_tables.nib_lo[c]));
+        __m256i hi = _mm256_broadcastsi128_si256(
+                        _mm_load_si128((const __m128i *)m_tables.nib_hi[c]));
+        __m256i mask = _mm256_set1_epi8(0x0f);
+        size_t i = 0;
+
+        for (; i + 32 <= len; i += 32) {
+            __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+
+            _mm256_storeu_si256((__m256i *)(dst + i),
+                                mul_avx2(d, lo, hi, mask));
+        }
+
+        mul_ssse3(dst + i, c, len - i);
+    }
+#endif
+
+    /* kernels this CPU runs, the best one last */
+    static std::vector<struct gf_kernel> probe()
+    {
+        std::vector<struct gf_kernel> k;
+
+        k.push_back({"scalar", add_scalar, mul_add_scalar, mul_scalar});
+
+#ifdef GF_KERNELS_X86
+        __builtin_cpu_init();
+
+        if (__builtin_cpu_supports("ssse3"))
+            k.push_back({"ssse3", add_sse2, mul_add_ssse3, mul_ssse3});
+
+        if (__builtin_cpu_supports("avx2"))
+            k.push_back({"avx2", add_avx2, mul_add_avx2, mul_avx2});
+#endif
+
+        return k;
+    }
+
+  public:
+    static uint8_t mul(uint8_t a, uint8_t b)
+    {
+        return m_tables.mul[a][b];
+    }
+
+    static uint8_t inv(uint8_t a)
+    {
+        if (!a)
+            throw std::domain_error("inverse of zero in GF(2^8)");
+
+        return m_tables.exp[255 - m_tables.log[a]];
+    }
+
+    static const struct gf_kernel &kernel()
+    {
+        return *m_kernel;
+    }
+
+    static const std::vector<struct gf_kernel> &kernels()
+    {
+        return m_kernels;
+    }
+
+    /* use another of the supported kernels; not while coding */
+    static void select(const char *name)
+    {
+        for (const auto &k : m_kernels) {
+            if (strcmp(k.name, name) == 0) {
+                m_kernel = &k;
+                return;
+            }
+        }
+
+        throw std::runtime_error(std::string("unsupported gf kernel: ") + name);
+    }
+
+    static void add(uint8_t *dst, const uint8_t *src, size_t len)
+    {
+        m_kernel->add(dst, src, len);
+    }
+
+    static void mul_add(uint8_t *dst, const uint8_t *src, uint8_t c,
+                        size_t len)
+    {
+        m_kernel->mul_add(dst, src, c, len);
+    }
+
+    static void mul(uint8_t *dst, uint8_t c, size_t len)
+    {
+        m_kernel->mul(dst, c, len);
+    }
+};
+
+const struct gf256::tables gf256::m_tables;
+std::vector<struct gf_kernel> gf256::m_kernels = gf256::probe();
+const struct gf_kernel *gf256::m_kernel = &gf256::m_kernels.back();
@@ -1,31 +1,171 @@
 #pragma once
 
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <functional>
+#include <iostream>
+#include <memory>
 #include <system_error>
 #include <vector>
 
-class io
+#include "timer_wheel.hpp"
+
+/* Readiness notification with epoll. The event masks passed around use
+ * the epoll bits (EPOLLIN, EPOLLOUT, EPOLLET). */
+class epoll_backend
 {
-    typedef std::function<void(int)> io_cb;
+    std::vector<struct epoll_event> m_events;
+    int m_epoll;
 
-    struct epoll_info {
-        io_cb read = NULL;
-        io_cb write = NULL;
+    void ctl(int op, int fd, uint32_t events)
+    {
         struct epoll_event ev;
 
-        epoll_info() {}
-        epoll_info(io_cb r, io_cb w, struct epoll_event e)
-            : read(r), write(w), ev(e)
+        ev.data.fd = fd;
+        ev.events = events;
+
+        if (epoll_ctl(m_epoll, op, fd, &ev) < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to control file descriptor in epoll");
+    }
+
+  protected:
+    explicit epoll_backend(size_t max_events)
+        : m_events(max_events ? max_events : 1)
+    {
+        if ((m_epoll = epoll_create1(EPOLL_CLOEXEC)) < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to create epoll file descriptor");
+    }
+
+    ~epoll_backend()
+    {
+        close(m_epoll);
+    }
+
+    size_t backend_max_events() const
+    {
+        return m_events.size();
+    }
+
+    void backend_max_events(size_t max)
+    {
+        m_events.resize(max ? max : 1);
+    }
+
+    void backend_add(int fd, uint32_t events)
+    {
+        ctl(EPOLL_CTL_ADD, fd, events);
+    }
+
+    void backend_modify(int fd, uint32_t events)
+    {
+        ctl(EPOLL_CTL_MOD, fd, events);
+    }
+
+    void backend_del(int fd)
+    {
+        if (epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, NULL) < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to delete file descriptor from epoll");
+    }
+
+    /* wait for up to max_events ready fds and hand them to dispatch; -1
+     * if interrupted by a signal */
+    template<class dispatch_fn>
+    int backend_wait(int timeout, dispatch_fn dispatch)
+    {
+        int nfds = epoll_wait(m_epoll, m_events.data(), m_events.size(),
+                              timeout);
+
+        if (nfds == -1 && errno == EINTR)
+            return -1;
+
+        if (nfds == -1)
+            throw std::system_error(errno, std::system_category(),
+                                    "error from epoll_wait");
+
+        for (int n = 0; n < nfds; ++n)
+            dispatch(m_events[n].data.fd, m_events[n].events);
+
+        return nfds;
+    }
+};
+
+/* Reactor running callbacks for ready file descriptors, on top of a
+ * backend that does the waiting (epoll_backend, or uring_backend from
+ * io_ring.hpp). Programs pick one at compile time, through the io and
+ * io_ring typedefs.
+ *
+ * Callbacks are a plain function pointer and context, called without any
+ * allocation or type erasure. Member functions are registered with
+ *
+ *     add_cb<my_class, &my_class::read, &my_class::write>(fd, this);
+ *
+ * which instantiates a small trampoline for each of them. std::function
+ * callbacks are still accepted and called through such a trampoline.
+ *
+ * Up to max_events ready fds are handled per wait(). File descriptors
+ * added with edge_triggered are reported once per edge, so their
+ * callbacks have to read or write until EAGAIN; a callback that stops
+ * early (e.g. to be fair to other fds) calls pending() to be run again
+ * from the next wait() without waiting for a new edge. */
+template<class backend>
+class io_reactor : public backend
+{
+  public:
+    typedef void (*io_fn)(void *ctx, int fd);
+    typedef std::function<void(int)> io_cb;
+    typedef std::function<void()> flush_cb;
+
+    static constexpr uint32_t edge_triggered = EPOLLET;
+
+  private:
+    struct handler {
+        io_fn fn = NULL;
+        void *ctx = NULL;
+
+        handler() {}
+        handler(io_fn f, void *c)
+            : fn(f), ctx(c)
         {}
+        explicit operator bool() const { return fn != NULL; }
+        void operator()(int fd) const { fn(ctx, fd); }
+    };
+
+    struct fd_info {
+        handler read;
+        handler write;
+        uint32_t events = 0;
+        uint32_t ready = 0;
+
+        /* std::function callbacks, called through call_cb() */
+        std::unique_ptr<io_cb> read_cb;
+        std::unique_ptr<io_cb> write_cb;
+
         bool operator!() const { return !read && !write; }
     };
 
-    std::vector<struct epoll_info> m_epoll_info;
-    static const size_t MAX_EVENTS = 2;
-    struct epoll_event m_events[MAX_EVENTS], *m_event;
-    int m_epoll;
+    std::vector<struct fd_info> m_fd_info;
+    std::vector<flush_cb> m_flush_cbs;
+    std::vector<int> m_ready;
+    std::vector<std::unique_ptr<io_cb>> m_dead_cbs;
+    timer_wheel m_wheel;
+    int m_timer_fd;
+    uint64_t m_armed = timer_wheel::never;
+
+    template<class T, void (T::*method)(int)>
+    static void call(void *ctx, int fd)
+    {
+        (static_cast<T *>(ctx)->*method)(fd);
+    }
+
+    static void call_cb(void *ctx, int fd)
+    {
+        (*static_cast<io_cb *>(ctx))(fd);
+    }
 
     static void set_non_blocking(int fd)
     {
@@ -42,165 +182,350 @@ class io
                                     "unable to set file descriptor flags");
     }
 
-  public:
-    io()
+    struct fd_info *info(int fd)
     {
-        if ((m_epoll = epoll_create(1)) < 0)
-            throw std::system_error(errno, std::system_category(),
-                                    "unable to create epoll file descriptor");
+        size_t max = fd + 1;
+
+        if (fd < 0 || m_fd_info.size() < max || !m_fd_info[fd])
+            return NULL;
+
+        return &m_fd_info[fd];
     }
 
-    void disable_read(int fd)
+    void modify(int fd, uint32_t set, uint32_t clear)
     {
-        struct epoll_event *ev;
-        size_t max = fd + 1;
+        struct fd_info *i = info(fd);
+        uint32_t events;
 
-        if (m_epoll_info.size() < max || !m_epoll_info[fd]) {
-            std::cerr << "tried to disable unknown fd: " << fd << std::endl;
+        if (!i) {
+            std::cerr << "tried to modify unknown fd: " << fd << std::endl;
             return;
         }
 
-        ev = &m_epoll_info[fd].ev;
-        ev->events &= ~EPOLLIN;
+        events = (i->events | set) & ~clear;
 
-        if (epoll_ctl(m_epoll, EPOLL_CTL_MOD, fd, ev) < 0)
-            throw std::system_error(errno, std::system_category(),
-                                    "unable to modify file descriptor in epoll");
+        if (events == i->events)
+            return;
+
+        i->events = events;
+        backend::backend_modify(fd, events);
     }
 
-    void enable_read(int fd)
+    void add(int fd, handler read, handler write, uint32_t flags)
     {
-        struct epoll_event *ev;
         size_t max = fd + 1;
+        struct fd_info *i;
+
+        set_non_blocking(fd);
 
-        if (m_epoll_info.size() < max || !m_epoll_info[fd]) {
-            std::cerr << "tried to enable unknown fd: " << fd << std::endl;
+        if (m_fd_info.size() < max)
+            m_fd_info.resize(max);
+
+        i = &m_fd_info[fd];
+        i->read = read;
+        i->write = write;
+        i->ready = 0;
+        i->events = flags;
+        i->events |= read ? EPOLLIN : 0;
+        i->events |= write ? EPOLLOUT : 0;
+        backend::backend_add(fd, i->events);
+    }
+
+    /* callbacks may add and delete fds, so the info is looked up again
+     * after each call */
+    void dispatch(int fd, uint32_t events)
+    {
+        struct fd_info *i = info(fd);
+        handler h;
+
+        if (!i)
             return;
+
+        if (events & EPOLLIN && (h = i->read))
+            h(fd);
+
+        if (events & EPOLLOUT && (i = info(fd)) && (h = i->write))
+            h(fd);
+
+        if (events & EPOLLERR) {
+            std::cerr << "fd: " << fd << std::endl;
+            throw std::runtime_error("error on fd");
+        }
+
+        if (events & EPOLLHUP && info(fd)) {
+            std::cerr << "fd hangup: " << fd << std::endl;
+            del_cb(fd);
         }
+    }
 
-        ev = &m_epoll_info[fd].ev;
-        ev->events |= EPOLLIN;
+    size_t dispatch_ready()
+    {
+        std::vector<int> ready;
+        size_t count = 0;
 
-        if (epoll_ctl(m_epoll, EPOLL_CTL_MOD, fd, ev) < 0)
-            throw std::system_error(errno, std::system_category(),
-                                    "unable to modify file descriptor in epoll");
+        ready.swap(m_ready);
+
+        for (int fd : ready) {
+            struct fd_info *i = info(fd);
+            uint32_t events;
+
+            if (!i || !i->ready)
+                continue;
+
+            events = i->ready & i->events;
+            i->ready = 0;
+            dispatch(fd, events);
+            count++;
+        }
+
+        /* hand the storage back for the next round */
+        if (m_ready.empty()) {
+            ready.clear();
+            m_ready.swap(ready);
+        }
+
+        return count;
     }
 
-    void disable_write(int fd)
+    /* keep the timerfd armed for the next tick the wheel has work at */
+    void timers_arm()
     {
-        struct epoll_event *ev;
-        size_t max = fd + 1;
+        uint64_t next = m_wheel.next_expiry();
+        struct itimerspec its = {{0, 0}, {0, 0}};
 
-        if (m_epoll_info.size() < max || !m_epoll_info[fd]) {
-            std::cerr << "tried to disable unknown fd: " << fd << std::endl;
+        if (next == m_armed)
             return;
+
+        if (next != timer_wheel::never) {
+            its.it_value = m_wheel.start();
+            its.it_value.tv_sec += next/1000;
+            its.it_value.tv_nsec += (next % 1000)*1000000;
+
+            if (its.it_value.tv_nsec >= 1000000000) {
+                its.it_value.tv_sec++;
+                its.it_value.tv_nsec -= 1000000000;
+            }
         }
 
-        ev = &m_epoll_info[fd].ev;
-        ev->events &= ~EPOLLOUT;
+        if (timerfd_settime(m_timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to arm timer");
+
+        m_armed = next;
+    }
+
+    void timers_run(int fd)
+    {
+        uint64_t expirations;
+
+        if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to read timer");
+
+        m_armed = timer_wheel::never;
+        m_wheel.advance();
+    }
+
+  public:
+    explicit io_reactor(size_t max_events = 64)
+        : backend(max_events)
+    {
+        m_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
 
-        if (epoll_ctl(m_epoll, EPOLL_CTL_MOD, fd, ev) < 0)
+        if (m_timer_fd < 0)
             throw std::system_error(errno, std::system_category(),
-                                    "unable to modify file descriptor in epoll");
+                                    "unable to create timer file descriptor");
+
+        add_cb<io_reactor, &io_reactor::timers_run>(m_timer_fd, this);
+    }
+
+    ~io_reactor()
+    {
+        close(m_timer_fd);
+    }
+
+    /* number of ready fds handled per wait() */
+    size_t max_events() const
+    {
+        return backend::backend_max_events();
+    }
+
+    void max_events(size_t max)
+    {
+        backend::backend_max_events(max);
+    }
+
+    /* timers run from wait() when they are due */
+    timer_wheel *timers()
+    {
+        return &m_wheel;
+    }
+
+    void add_timer(wheel_timer &t, uint64_t ms)
+    {
+        m_wheel.schedule(t, ms);
+    }
+
+    void del_timer(wheel_timer &t)
+    {
+        t.cancel();
+    }
+
+    void disable_read(int fd)
+    {
+        modify(fd, 0, EPOLLIN);
+    }
+
+    void enable_read(int fd)
+    {
+        modify(fd, EPOLLIN, 0);
+    }
+
+    void disable_write(int fd)
+    {
+        modify(fd, 0, EPOLLOUT);
     }
 
     void enable_write(int fd)
     {
-        struct epoll_event *ev;
-        size_t max = fd + 1;
+        modify(fd, EPOLLOUT, 0);
+    }
+
+    /* run the callbacks for events (EPOLLIN, EPOLLOUT) of an edge
+     * triggered fd again from the next wait(), as if it was reported */
+    void pending(int fd, uint32_t events = EPOLLIN)
+    {
+        struct fd_info *i = info(fd);
 
-        if (m_epoll_info.size() < max || !m_epoll_info[fd]) {
-            std::cerr << "tried to enable unknown fd: " << fd << std::endl;
+        if (!i)
             return;
-        }
 
-        ev = &m_epoll_info[fd].ev;
-        ev->events |= EPOLLOUT;
+        if (!i->ready)
+            m_ready.push_back(fd);
 
-        if (epoll_ctl(m_epoll, EPOLL_CTL_MOD, fd, ev) < 0)
-            throw std::system_error(errno, std::system_category(),
-                                    "unable to modify file descriptor in epoll");
+        i->ready |= events;
     }
 
-    void add_cb(int fd, io_cb read, io_cb write)
+    void add_cb(int fd, io_fn read, io_fn write, void *ctx,
+                uint32_t flags = 0)
     {
-        struct epoll_event *ev;
-        size_t max = fd + 1;
+        add(fd, handler(read, ctx), handler(write, ctx), flags);
+    }
 
-        set_non_blocking(fd);
+    template<class T, void (T::*read)(int)>
+    void add_cb(int fd, T *obj, uint32_t flags = 0)
+    {
+        add(fd, handler(&call<T, read>, obj), handler(), flags);
+    }
 
-        if (m_epoll_info.size() < max)
-            m_epoll_info.resize(max);
+    template<class T, void (T::*read)(int), void (T::*write)(int)>
+    void add_cb(int fd, T *obj, uint32_t flags = 0)
+    {
+        add(fd, handler(&call<T, read>, obj), handler(&call<T, write>, obj),
+            flags);
+    }
 
-        m_epoll_info[fd] = {read, write, {0}};
-        ev = &m_epoll_info[fd].ev;
-        ev->data.fd = fd;
-        ev->events |= read ? EPOLLIN : 0;
-        ev->events |= write ? EPOLLOUT : 0;
+    void add_cb(int fd, io_cb read, io_cb write, uint32_t flags = 0)
+    {
+        std::unique_ptr<io_cb> r, w;
+        handler rh, wh;
 
-        if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, ev) < 0)
-            throw std::system_error(errno, std::system_category(),
-                                    "unable to add file descriptor to epoll");
+        if (read) {
+            r.reset(new io_cb(read));
+            rh = handler(&io_reactor::call_cb, r.get());
+        }
+
+        if (write) {
+            w.reset(new io_cb(write));
+            wh = handler(&io_reactor::call_cb, w.get());
+        }
+
+        add(fd, rh, wh, flags);
+        m_fd_info[fd].read_cb = std::move(r);
+        m_fd_info[fd].write_cb = std::move(w);
     }
 
     void del_cb(int fd)
     {
         size_t max = fd + 1;
+        struct fd_info *i;
 
-        if (m_epoll_info.size() < max) {
+        if (fd < 0 || m_fd_info.size() < max) {
             std::cerr << "tried to delete unknown fd: " << fd << std::endl;
             return;
         }
 
-        m_epoll_info[fd] = {NULL, NULL, {0}};
+        i = &m_fd_info[fd];
+        i->read = handler();
+        i->write = handler();
+        i->events = 0;
+        i->ready = 0;
 
-        if (epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, NULL) < 0)
-            throw std::system_error(errno, std::system_category(),
-                                    "unable to delete file descriptor from epoll");
+        /* the callback being run may be the one deleted */
+        if (i->read_cb)
+            m_dead_cbs.push_back(std::move(i->read_cb));
+
+        if (i->write_cb)
+            m_dead_cbs.push_back(std::move(i->write_cb));
+
+        backend::backend_del(fd);
     }
 
-    int wait(int timeout = -1)
+    void add_flush_cb(flush_cb cb)
     {
-        int nfds = epoll_wait(m_epoll, m_events, MAX_EVENTS, timeout);
+        m_flush_cbs.push_back(cb);
+    }
 
-        if (nfds == -1 && errno == EINTR)
-            return 1;
+    void flush()
+    {
+        for (auto &cb : m_flush_cbs)
+            cb();
+    }
 
-        if (nfds == 0)
-            return 0;
+    /* wait for and handle events; returns the number of fds handled, not
+     * counting the timerfd of the wheel, so 0 means nothing but timers ran
+     * and callers can do their idle work (legacy timer() paths) as on a
+     * plain timeout */
+    int wait(int timeout = -1)
+    {
+        int nfds, timer_events = 0;
 
-        if (nfds == -1)
-            throw std::system_error(errno, std::system_category(),
-                                    "error from epoll_wait");
+        /* send what was queued by callbacks and timers since last wait */
+        flush();
+        timers_arm();
+        m_dead_cbs.clear();
 
-        for (ssize_t n = 0; n < nfds; ++n) {
-            m_event = &m_events[n];
-            int fd = m_event->data.fd;
-            struct epoll_info *info = &m_epoll_info[fd];
+        /* don't sleep while edge triggered fds have work left */
+        if (!m_ready.empty())
+            timeout = 0;
 
-            try {
-                if (m_events->events & EPOLLIN && info->read)
-                    info->read(fd);
+        nfds = backend::backend_wait(timeout, [&](int fd, uint32_t events) {
+            struct fd_info *i = info(fd);
 
-                if (m_events->events & EPOLLOUT && info->write)
-                    info->write(fd);
+            if (!i)
+                return;
 
-            } catch (std::bad_function_call &e) {
-                std::cerr << "bad function ptr for fd: " << fd << std::endl;
-                return -1;
-            }
+            if (fd == m_timer_fd)
+                timer_events++;
 
-            if (m_events->events & EPOLLERR) {
-                std::cerr << "fd: " << fd << std::endl;
-                throw std::runtime_error("error on fd");
-            }
+            /* backends batching their changes may report events that
+             * were disabled since */
+            events &= i->events | EPOLLERR | EPOLLHUP;
 
-            if (m_events->events & EPOLLHUP) {
-                std::cerr << "fd hangup: " << fd << std::endl;
-                del_cb(fd);
-            }
-        }
+            /* reported by the backend, so no need to run it from the
+             * ready list */
+            i->ready &= ~events;
+            dispatch(fd, events);
+        });
 
-        return nfds;
+        if (nfds < 0)
+            return 1;
+
+        return nfds - timer_events + dispatch_ready();
     }
 };
+
+template<class backend>
+constexpr uint32_t io_reactor<backend>::edge_triggered;
+
+typedef io_reactor<epoll_backend> io;
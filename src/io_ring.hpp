@@ -0,0 +1,992 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <system_error>
+#include <vector>
+
+#include "io.hpp"
+
+/* Readiness notification with io_uring poll requests, for io_reactor.
+ *
+ * enable/disable and add/del only note the wanted events; the poll
+ * requests are (re)armed or removed in one batch, submitted by the same
+ * io_uring_enter() that waits for completions. Toggling write interest
+ * per packet thus costs no system call at all, where epoll needs an
+ * epoll_ctl() each time.
+ *
+ * Level triggered fds get one shot polls that are rearmed with the next
+ * submission; a fd still ready completes again right away. Edge
+ * triggered fds get a multishot poll that stays armed.
+ *
+ * Requests carry the fd and a per fd generation in their user data, so
+ * completions of requests replaced or removed in the meantime are told
+ * apart and dropped. The raw system calls are used, so no liburing is
+ * needed; kernels before 5.11 (no IORING_FEAT_EXT_ARG) are refused.
+ *
+ * Packets of a fd can also be moved by the ring itself (uring_open(), used
+ * by the uring_io layer): such fds get no poll requests, they are ready
+ * while received packets are queued or send slots are free. */
+class uring_backend;
+
+/* A fd whose packets are received and sent with io_uring requests instead
+ * of read() and write() calls after a poll.
+ *
+ * A multishot receive (a read on other files than sockets) fills the
+ * buffers of a ring provided to the kernel; recv() hands out one of them
+ * at a time and gives the last one back. send() copies the packet to a
+ * slot and queues the request, submitted in a batch with the next
+ * io_uring_enter() of the backend. The backend owns the files, as the
+ * kernel uses their memory until the requests are done. */
+class uring_file
+{
+    friend class uring_backend;
+
+  public:
+    struct pkt {
+        uint8_t *base;
+        uint8_t *data;
+        size_t len;
+        struct sockaddr *name;
+        uint32_t name_len;
+    };
+
+  private:
+    struct rx_pkt {
+        uint16_t bid;
+        int32_t res;
+    };
+
+    struct tx_slot {
+        std::vector<uint8_t> data;
+        struct msghdr msg;
+        struct iovec iov;
+        struct sockaddr_storage name;
+    };
+
+    /* IORING_OP_READ_MULTISHOT (6.7), missing from older headers */
+    static constexpr uint8_t m_op_read_multishot = 49;
+
+    uring_backend *m_ring;
+    uint32_t m_index;
+    int m_fd;
+    bool m_socket;
+    bool m_read_multishot = true;
+
+    /* provided buffers: headroom, then the packet; sockets receive a
+     * struct io_uring_recvmsg_out and the sender address in front of
+     * it, which are placed in the headroom */
+    uint16_t m_bgid;
+    unsigned m_count;
+    size_t m_headroom;
+    size_t m_len;
+    size_t m_stride;
+    size_t m_prefix;
+    uint32_t m_name_len;
+    uint8_t *m_bufs = static_cast<uint8_t *>(MAP_FAILED);
+    struct io_uring_buf_ring *m_br =
+        static_cast<struct io_uring_buf_ring *>(MAP_FAILED);
+    uint16_t m_br_tail = 0;
+    struct msghdr m_rx_msg;
+
+    std::deque<struct rx_pkt> m_rx;
+    int m_held = -1;
+    bool m_armed = false;
+    bool m_closed = false;
+    int m_error = 0;
+    int m_tx_error = 0;
+
+    std::vector<tx_slot> m_tx;
+    std::vector<uint16_t> m_tx_free;
+
+    /* requests the kernel still has */
+    size_t m_inflight = 0;
+
+    uring_file(uring_backend *ring, uint32_t index, int fd, size_t len,
+               size_t headroom, bool names, unsigned count);
+
+    uint8_t *buf(unsigned bid)
+    {
+        return m_bufs + static_cast<size_t>(bid)*m_stride;
+    }
+
+    void provide(unsigned bid)
+    {
+        /* not m_br->bufs, which C++ places after an empty struct */
+        struct io_uring_buf *b = reinterpret_cast<struct io_uring_buf *>(m_br) +
+                                 (m_br_tail & (m_count - 1));
+
+        b->addr = reinterpret_cast<uint64_t>(buf(bid) + m_headroom - m_prefix);
+        b->len = static_cast<uint32_t>(m_prefix + m_len);
+        b->bid = static_cast<uint16_t>(bid);
+        __atomic_store_n(&m_br->tail, ++m_br_tail, __ATOMIC_RELEASE);
+    }
+
+    void arm();
+    void recv_done(const struct io_uring_cqe &cqe);
+    void send_done(uint16_t slot, const struct io_uring_cqe &cqe);
+
+    void unmap()
+    {
+        if (m_bufs != MAP_FAILED)
+            munmap(m_bufs, m_count*m_stride);
+
+        if (m_br != MAP_FAILED)
+            munmap(m_br, m_count*sizeof(struct io_uring_buf));
+    }
+
+  public:
+    ~uring_file()
+    {
+        unmap();
+    }
+
+    int fd() const
+    {
+        return m_fd;
+    }
+
+    bool socket() const
+    {
+        return m_socket;
+    }
+
+    /* bytes from the base of a buffer handed out to its end */
+    size_t buf_len() const
+    {
+        return m_headroom + m_len;
+    }
+
+    uint32_t ready() const
+    {
+        uint32_t events = 0;
+
+        if (!m_rx.empty() || m_error)
+            events |= EPOLLIN;
+
+        if (!m_tx_free.empty())
+            events |= EPOLLOUT;
+
+        return events;
+    }
+
+    /* the next received packet, valid until the next call; false if none
+     * is queued */
+    bool recv(struct pkt *p);
+
+    /* give back the buffer of the last recv() */
+    void release();
+
+    /* queue a copy of the packet; false if all slots are in use */
+    bool send(const uint8_t *data, size_t len, const struct sockaddr *name,
+              uint32_t name_len);
+};
+
+class uring_backend
+{
+    friend class uring_file;
+
+    struct ring_fd {
+        uint32_t gen = 0;
+        uint32_t events = 0;
+        uint32_t armed = 0;
+        bool dirty = false;
+
+        /* index of its uring_file plus one, 0 if polled */
+        uint32_t file = 0;
+    };
+
+    /* user data of the file requests: the flag, the file index and the
+     * send slot, or m_recv_slot for the receive */
+    static constexpr uint64_t m_file_flag = 1ULL << 63;
+    static constexpr uint32_t m_recv_slot = 0xffff;
+
+    static constexpr uint32_t m_poll_events = EPOLLIN | EPOLLOUT;
+    static constexpr unsigned m_entries = 256;
+
+    std::vector<struct ring_fd> m_fds;
+    std::vector<int> m_dirty;
+    size_t m_max_events;
+    int m_ring;
+    std::vector<std::unique_ptr<uring_file>> m_files;
+    uint16_t m_bgid = 0;
+
+    struct io_uring_params m_params;
+    void *m_sq_map = MAP_FAILED;
+    void *m_cq_map = MAP_FAILED;
+    size_t m_sq_map_len = 0;
+    size_t m_cq_map_len = 0;
+    struct io_uring_sqe *m_sqes = static_cast<struct io_uring_sqe *>(MAP_FAILED);
+
+    unsigned *m_sq_head;
+    unsigned *m_sq_tail;
+    unsigned *m_sq_mask;
+    unsigned *m_sq_array;
+    unsigned *m_sq_flags;
+    unsigned m_sq_local;
+
+    unsigned *m_cq_head;
+    unsigned *m_cq_tail;
+    unsigned *m_cq_mask;
+    struct io_uring_cqe *m_cqes;
+
+    static uint64_t user_data(int fd, uint32_t gen)
+    {
+        return static_cast<uint64_t>(gen) << 32 | static_cast<uint32_t>(fd);
+    }
+
+    static uint64_t file_data(uint32_t index, uint32_t slot)
+    {
+        return m_file_flag | static_cast<uint64_t>(slot) << 32 | index;
+    }
+
+    int enter(unsigned submit, unsigned complete, unsigned flags,
+              void *arg, size_t arg_len)
+    {
+        return syscall(__NR_io_uring_enter, m_ring, submit, complete, flags,
+                       arg, arg_len);
+    }
+
+    unsigned sq_unsubmitted()
+    {
+        return m_sq_local - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+    }
+
+    void submit()
+    {
+        __atomic_store_n(m_sq_tail, m_sq_local, __ATOMIC_RELEASE);
+
+        if (enter(sq_unsubmitted(), 0, 0, NULL, 0) < 0 && errno != EINTR &&
+            errno != EAGAIN && errno != EBUSY)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to submit to io_uring");
+    }
+
+    struct io_uring_sqe *sqe()
+    {
+        struct io_uring_sqe *s;
+        unsigned idx;
+
+        while (sq_unsubmitted() >= m_params.sq_entries)
+            submit();
+
+        idx = m_sq_local & *m_sq_mask;
+        s = &m_sqes[idx];
+        memset(s, 0, sizeof(*s));
+        m_sq_array[idx] = idx;
+        m_sq_local++;
+
+        return s;
+    }
+
+    void poll_remove(int fd)
+    {
+        struct io_uring_sqe *s = sqe();
+
+        s->opcode = IORING_OP_POLL_REMOVE;
+        s->fd = -1;
+        s->addr = user_data(fd, m_fds[fd].gen);
+        m_fds[fd].armed = 0;
+    }
+
+    void poll_add(int fd)
+    {
+        struct ring_fd *r = &m_fds[fd];
+        struct io_uring_sqe *s = sqe();
+
+        /* generation 0 is never used, so user data 0 marks removals; the
+         * top bit is left for the file requests */
+        if (++r->gen >= 1U << 31)
+            r->gen = 1;
+
+        s->opcode = IORING_OP_POLL_ADD;
+        s->fd = fd;
+        s->poll32_events = r->events & m_poll_events;
+        s->len = r->events & EPOLLET ? IORING_POLL_ADD_MULTI : 0;
+        s->user_data = user_data(fd, r->gen);
+        r->armed = r->events;
+    }
+
+    void mark(int fd)
+    {
+        if (m_fds[fd].dirty)
+            return;
+
+        m_fds[fd].dirty = true;
+        m_dirty.push_back(fd);
+    }
+
+    /* queue the poll requests changed since the last submission */
+    void apply()
+    {
+        for (int fd : m_dirty) {
+            struct ring_fd *r = &m_fds[fd];
+
+            r->dirty = false;
+
+            /* the packets of files are moved without polls */
+            if (r->file) {
+                if (r->armed)
+                    poll_remove(fd);
+
+                continue;
+            }
+
+            if (r->armed == r->events)
+                continue;
+
+            if (r->armed)
+                poll_remove(fd);
+
+            if (r->events & m_poll_events)
+                poll_add(fd);
+        }
+
+        m_dirty.clear();
+    }
+
+    void unmap()
+    {
+        if (m_sqes != MAP_FAILED)
+            munmap(m_sqes, m_params.sq_entries*sizeof(*m_sqes));
+
+        if (m_cq_map != MAP_FAILED && m_cq_map != m_sq_map)
+            munmap(m_cq_map, m_cq_map_len);
+
+        if (m_sq_map != MAP_FAILED)
+            munmap(m_sq_map, m_sq_map_len);
+    }
+
+    void map()
+    {
+        uint8_t *sq, *cq;
+
+        m_sq_map_len = m_params.sq_off.array +
+                       m_params.sq_entries*sizeof(unsigned);
+        m_cq_map_len = m_params.cq_off.cqes +
+                       m_params.cq_entries*sizeof(struct io_uring_cqe);
+
+        if (m_params.features & IORING_FEAT_SINGLE_MMAP)
+            m_sq_map_len = m_cq_map_len = std::max(m_sq_map_len, m_cq_map_len);
+
+        m_sq_map = mmap(NULL, m_sq_map_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_SQ_RING);
+
+        if (m_sq_map == MAP_FAILED)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to map io_uring submission ring");
+
+        if (m_params.features & IORING_FEAT_SINGLE_MMAP)
+            m_cq_map = m_sq_map;
+        else
+            m_cq_map = mmap(NULL, m_cq_map_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, m_ring,
+                            IORING_OFF_CQ_RING);
+
+        if (m_cq_map == MAP_FAILED)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to map io_uring completion ring");
+
+        m_sqes = static_cast<struct io_uring_sqe *>(
+                    mmap(NULL, m_params.sq_entries*sizeof(*m_sqes),
+                         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         m_ring, IORING_OFF_SQES));
+
+        if (m_sqes == MAP_FAILED)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to map io_uring entries");
+
+        sq = static_cast<uint8_t *>(m_sq_map);
+        m_sq_head = reinterpret_cast<unsigned *>(sq + m_params.sq_off.head);
+        m_sq_tail = reinterpret_cast<unsigned *>(sq + m_params.sq_off.tail);
+        m_sq_mask = reinterpret_cast<unsigned *>(sq + m_params.sq_off.ring_mask);
+        m_sq_array = reinterpret_cast<unsigned *>(sq + m_params.sq_off.array);
+        m_sq_flags = reinterpret_cast<unsigned *>(sq + m_params.sq_off.flags);
+        m_sq_local = *m_sq_tail;
+
+        cq = static_cast<uint8_t *>(m_cq_map);
+        m_cq_head = reinterpret_cast<unsigned *>(cq + m_params.cq_off.head);
+        m_cq_tail = reinterpret_cast<unsigned *>(cq + m_params.cq_off.tail);
+        m_cq_mask = reinterpret_cast<unsigned *>(cq + m_params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<struct io_uring_cqe *>(cq + m_params.cq_off.cqes);
+    }
+
+    bool cq_empty()
+    {
+        return *m_cq_head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    /* completions that did not fit the ring are held by the kernel until
+     * an enter with IORING_ENTER_GETEVENTS moves them over */
+    bool cq_overflow()
+    {
+        return __atomic_load_n(m_sq_flags, __ATOMIC_RELAXED) &
+               IORING_SQ_CQ_OVERFLOW;
+    }
+
+    /* every fd has at most a poll and its removal completing at once, so
+     * the completion ring fits the fds the process may open; larger
+     * limits are clamped by the kernel */
+    static unsigned cq_entries(unsigned sq_entries)
+    {
+        struct rlimit lim;
+        rlim_t fds = 0;
+
+        if (getrlimit(RLIMIT_NOFILE, &lim) == 0)
+            fds = lim.rlim_cur;
+
+        if (fds == RLIM_INFINITY || fds > UINT32_MAX/2)
+            fds = UINT32_MAX/2;
+
+        return std::max<unsigned>(2*sq_entries, static_cast<unsigned>(2*fds));
+    }
+
+    /* the kernel has no requests of a closed file left, so its memory
+     * goes */
+    void file_gone(uring_file *f)
+    {
+        struct io_uring_buf_reg reg;
+        uint32_t index = f->m_index;
+
+        if (!f->m_closed || f->m_inflight)
+            return;
+
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = f->m_bgid;
+        syscall(__NR_io_uring_register, m_ring, IORING_UNREGISTER_PBUF_RING,
+                &reg, 1);
+        m_files[index].reset();
+    }
+
+    void file_complete(const struct io_uring_cqe &cqe)
+    {
+        uint32_t index = static_cast<uint32_t>(cqe.user_data);
+        uint32_t slot = (cqe.user_data >> 32) & 0xffff;
+        uring_file *f;
+
+        if (index >= m_files.size() || !(f = m_files[index].get()))
+            return;
+
+        if (slot == m_recv_slot)
+            f->recv_done(cqe);
+        else
+            f->send_done(static_cast<uint16_t>(slot), cqe);
+
+        file_gone(f);
+    }
+
+    /* events wanted for a file that it has now */
+    uint32_t file_events(const uring_file *f) const
+    {
+        if (f->m_closed)
+            return 0;
+
+        return f->ready() & m_fds[f->m_fd].events;
+    }
+
+    bool files_ready() const
+    {
+        for (auto &f : m_files)
+            if (f && file_events(f.get()))
+                return true;
+
+        return false;
+    }
+
+  public:
+    /* move the packets of fd with ring requests from now on, see
+     * uring_file; count buffers (rounded up to a power of two) of len
+     * bytes after the headroom, and as many send slots. With names, the
+     * sender address of each packet is kept. */
+    uring_file *uring_open(int fd, size_t len, size_t headroom, bool names,
+                           unsigned count)
+    {
+        uint32_t index = static_cast<uint32_t>(m_files.size());
+        size_t max = fd + 1;
+        uring_file *f;
+
+        for (uint32_t i = 0; i < m_files.size(); ++i) {
+            if (m_files[i])
+                continue;
+
+            index = i;
+            break;
+        }
+
+        if (index == m_files.size())
+            m_files.emplace_back();
+
+        f = new uring_file(this, index, fd, len, headroom, names, count);
+        m_files[index].reset(f);
+
+        if (m_fds.size() < max)
+            m_fds.resize(max);
+
+        m_fds[fd].file = index + 1;
+        mark(fd);
+        f->arm();
+
+        return f;
+    }
+
+    /* the fd goes back to polls; the receive is cancelled right away, as
+     * it holds on to the file even if the fd is closed */
+    void uring_close(uring_file *f)
+    {
+        struct io_uring_sqe *s;
+        int fd = f->m_fd;
+
+        m_fds[fd].file = 0;
+        mark(fd);
+        f->m_closed = true;
+
+        if (f->m_armed) {
+            s = sqe();
+            s->opcode = IORING_OP_ASYNC_CANCEL;
+            s->fd = -1;
+            s->addr = file_data(f->m_index, m_recv_slot);
+            submit();
+        }
+
+        file_gone(f);
+    }
+
+  protected:
+    explicit uring_backend(size_t max_events)
+        : m_max_events(max_events ? max_events : 1)
+    {
+        unsigned entries = static_cast<unsigned>(
+                std::max<size_t>(m_entries, m_max_events));
+
+        memset(&m_params, 0, sizeof(m_params));
+        m_params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+        m_params.cq_entries = cq_entries(entries);
+        m_ring = syscall(__NR_io_uring_setup, entries, &m_params);
+
+        if (m_ring < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to create io_uring");
+
+        if (!(m_params.features & IORING_FEAT_EXT_ARG)) {
+            close(m_ring);
+            throw std::system_error(ENOSYS, std::system_category(),
+                                    "io_uring without wait timeouts");
+        }
+
+        try {
+            map();
+        } catch (...) {
+            unmap();
+            close(m_ring);
+            throw;
+        }
+    }
+
+    ~uring_backend()
+    {
+        unmap();
+        close(m_ring);
+    }
+
+    size_t backend_max_events() const
+    {
+        return m_max_events;
+    }
+
+    void backend_max_events(size_t max)
+    {
+        m_max_events = max ? max : 1;
+    }
+
+    void backend_add(int fd, uint32_t events)
+    {
+        size_t max = fd + 1;
+
+        if (m_fds.size() < max)
+            m_fds.resize(max);
+
+        m_fds[fd].events = events;
+        mark(fd);
+    }
+
+    void backend_modify(int fd, uint32_t events)
+    {
+        m_fds[fd].events = events;
+        mark(fd);
+    }
+
+    /* the fd may be closed and its number reused right after, so the
+     * request on the old file is removed now rather than coalesced */
+    void backend_del(int fd)
+    {
+        size_t max = fd + 1;
+
+        if (m_fds.size() < max)
+            return;
+
+        if (m_fds[fd].armed)
+            poll_remove(fd);
+
+        m_fds[fd].events = 0;
+    }
+
+    template<class dispatch_fn>
+    int backend_wait(int timeout, dispatch_fn dispatch)
+    {
+        struct io_uring_getevents_arg arg;
+        struct __kernel_timespec ts;
+        unsigned flags = IORING_ENTER_GETEVENTS;
+        unsigned complete = 1;
+        void *argp = NULL;
+        size_t arg_len = 0;
+        int count = 0;
+
+        apply();
+        __atomic_store_n(m_sq_tail, m_sq_local, __ATOMIC_RELEASE);
+
+        /* completions left from the last round are handled first, as
+         * are packets left queued in files */
+        if (!cq_empty() || files_ready())
+            timeout = 0;
+
+        if (timeout == 0)
+            complete = 0;
+
+        if (timeout > 0) {
+            memset(&arg, 0, sizeof(arg));
+            ts.tv_sec = timeout/1000;
+            ts.tv_nsec = (timeout % 1000)*1000000;
+            arg.sigmask_sz = _NSIG/8;
+            arg.ts = reinterpret_cast<uint64_t>(&ts);
+            argp = &arg;
+            arg_len = sizeof(arg);
+            flags |= IORING_ENTER_EXT_ARG;
+        }
+
+        /* overflowed completions are flushed even when not waiting */
+        if ((complete || sq_unsubmitted() || cq_overflow()) &&
+            enter(sq_unsubmitted(), complete, flags, argp, arg_len) < 0) {
+            if (errno == EINTR)
+                return -1;
+
+            if (errno != ETIME && errno != EAGAIN && errno != EBUSY)
+                throw std::system_error(errno, std::system_category(),
+                                        "error from io_uring_enter");
+        }
+
+        while (!cq_empty() && static_cast<size_t>(count) < m_max_events) {
+            unsigned head = *m_cq_head;
+            struct io_uring_cqe cqe = m_cqes[head & *m_cq_mask];
+            int fd = static_cast<uint32_t>(cqe.user_data);
+            uint32_t gen = cqe.user_data >> 32;
+            size_t max = fd + 1;
+            uint32_t events;
+            struct ring_fd *r;
+
+            __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+
+            if (cqe.user_data & m_file_flag) {
+                file_complete(cqe);
+                continue;
+            }
+
+            /* removals, and requests replaced or removed since */
+            if (!gen || m_fds.size() < max)
+                continue;
+
+            r = &m_fds[fd];
+
+            if (r->gen != gen || !r->armed)
+                continue;
+
+            if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                r->armed = 0;
+                mark(fd);
+            }
+
+            if (cqe.res == -ECANCELED)
+                continue;
+
+            events = cqe.res < 0 ? static_cast<uint32_t>(EPOLLERR)
+                                 : static_cast<uint32_t>(cqe.res);
+            dispatch(fd, events);
+            count++;
+        }
+
+        /* files are ready as long as they have packets or free slots;
+         * callbacks may open and close files */
+        for (size_t i = 0; i < m_files.size(); ++i) {
+            uring_file *f = m_files[i].get();
+            uint32_t events;
+
+            if (!f || !(events = file_events(f)))
+                continue;
+
+            dispatch(f->m_fd, events);
+            count++;
+        }
+
+        return count;
+    }
+};
+
+inline uring_file::uring_file(uring_backend *ring, uint32_t index, int fd,
+                              size_t len, size_t headroom, bool names,
+                              unsigned count)
+    : m_ring(ring),
+      m_index(index),
+      m_fd(fd),
+      m_count(1),
+      m_len(len)
+{
+    struct io_uring_buf_reg reg;
+    struct stat st;
+    int err;
+
+    if (fstat(fd, &st) < 0)
+        throw std::system_error(errno, std::system_category(),
+                                "unable to stat file for io_uring");
+
+    /* a power of two, and buffer ids are 16 bit */
+    while (m_count < count && m_count < 1U << 15)
+        m_count <<= 1;
+
+    m_socket = S_ISSOCK(st.st_mode);
+    m_name_len = m_socket && names ? sizeof(struct sockaddr_in6) : 0;
+    m_prefix = m_socket ? sizeof(struct io_uring_recvmsg_out) + m_name_len
+                        : 0;
+    m_headroom = std::max(headroom, m_prefix);
+    m_stride = (m_headroom + m_len + 63) & ~static_cast<size_t>(63);
+
+    m_bufs = static_cast<uint8_t *>(
+            mmap(NULL, m_count*m_stride, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    m_br = static_cast<struct io_uring_buf_ring *>(
+            mmap(NULL, m_count*sizeof(struct io_uring_buf),
+                 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+
+    if (m_bufs == MAP_FAILED || m_br == MAP_FAILED) {
+        err = errno;
+        unmap();
+        throw std::system_error(err, std::system_category(),
+                                "unable to map io_uring buffers");
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(m_br);
+    reg.ring_entries = m_count;
+    reg.bgid = m_bgid = ring->m_bgid++;
+
+    if (syscall(__NR_io_uring_register, ring->m_ring,
+                IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        err = errno;
+        unmap();
+        throw std::system_error(err, std::system_category(),
+                                "unable to register io_uring buffers");
+    }
+
+    for (unsigned bid = 0; bid < m_count; ++bid)
+        provide(bid);
+
+    memset(&m_rx_msg, 0, sizeof(m_rx_msg));
+    m_rx_msg.msg_namelen = m_name_len;
+
+    m_tx.resize(m_count);
+
+    for (unsigned slot = m_count; slot > 0; --slot)
+        m_tx_free.push_back(static_cast<uint16_t>(slot - 1));
+}
+
+inline void uring_file::arm()
+{
+    struct io_uring_sqe *s = m_ring->sqe();
+
+    if (m_socket) {
+        s->opcode = IORING_OP_RECVMSG;
+        s->addr = reinterpret_cast<uint64_t>(&m_rx_msg);
+        s->len = 1;
+        s->ioprio = IORING_RECV_MULTISHOT;
+    } else {
+        s->opcode = m_read_multishot ? m_op_read_multishot : IORING_OP_READ;
+        s->off = static_cast<uint64_t>(-1);
+    }
+
+    s->fd = m_fd;
+    s->flags = IOSQE_BUFFER_SELECT;
+    s->buf_group = m_bgid;
+    s->user_data = uring_backend::file_data(m_index,
+                                            uring_backend::m_recv_slot);
+    m_armed = true;
+    m_inflight++;
+}
+
+inline void uring_file::recv_done(const struct io_uring_cqe &cqe)
+{
+    unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        m_armed = false;
+        m_inflight--;
+    }
+
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+        if (cqe.res > 0 && !m_closed)
+            m_rx.push_back({static_cast<uint16_t>(bid), cqe.res});
+        else
+            provide(bid);
+    } else if (cqe.res == -EINVAL && !m_socket && m_read_multishot) {
+        /* kernels before 6.7 read one packet per request */
+        m_read_multishot = false;
+    } else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED &&
+               cqe.res != -EAGAIN && cqe.res != -EINTR) {
+        m_error = -cqe.res;
+    }
+
+    /* out of buffers, armed again when one is given back */
+    if (m_armed || m_closed || m_error || cqe.res == -ENOBUFS)
+        return;
+
+    arm();
+}
+
+inline void uring_file::send_done(uint16_t slot, const struct io_uring_cqe &cqe)
+{
+    m_tx_free.push_back(slot);
+    m_inflight--;
+
+    /* lost like on a congested link, as the socket would have refused
+     * them; anything else is raised by the next send() */
+    switch (-cqe.res) {
+    case EAGAIN:
+    case ENOBUFS:
+    case ECONNREFUSED:
+    case EHOSTUNREACH:
+    case ENETUNREACH:
+    case ECANCELED:
+        return;
+    }
+
+    if (cqe.res < 0)
+        m_tx_error = -cqe.res;
+}
+
+inline bool uring_file::recv(struct pkt *p)
+{
+    struct io_uring_recvmsg_out *out;
+    struct rx_pkt rx;
+    int err = m_error;
+
+    release();
+
+    if (err) {
+        m_error = 0;
+        throw std::system_error(err, std::system_category(),
+                                "unable to receive packet");
+    }
+
+    if (m_rx.empty())
+        return false;
+
+    rx = m_rx.front();
+    m_rx.pop_front();
+    m_held = rx.bid;
+
+    p->base = buf(rx.bid);
+    p->data = p->base + m_headroom;
+    p->len = static_cast<size_t>(rx.res);
+    p->name = NULL;
+    p->name_len = 0;
+
+    if (!m_socket)
+        return true;
+
+    out = reinterpret_cast<struct io_uring_recvmsg_out *>(p->data - m_prefix);
+    p->len = std::min<size_t>(out->payloadlen, m_len);
+
+    if (m_name_len) {
+        p->name = reinterpret_cast<struct sockaddr *>(out + 1);
+        p->name_len = std::min(out->namelen, m_name_len);
+    }
+
+    return true;
+}
+
+inline void uring_file::release()
+{
+    if (m_held < 0)
+        return;
+
+    provide(static_cast<unsigned>(m_held));
+    m_held = -1;
+
+    if (!m_armed && !m_closed && !m_error)
+        arm();
+}
+
+inline bool uring_file::send(const uint8_t *data, size_t len,
+                             const struct sockaddr *name, uint32_t name_len)
+{
+    struct io_uring_sqe *s;
+    struct tx_slot *t;
+    uint16_t slot;
+    int err = m_tx_error;
+
+    if (err) {
+        m_tx_error = 0;
+        throw std::system_error(err, std::system_category(),
+                                "unable to send packet");
+    }
+
+    if (m_tx_free.empty())
+        return false;
+
+    slot = m_tx_free.back();
+    m_tx_free.pop_back();
+    t = &m_tx[slot];
+    t->data.assign(data, data + len);
+
+    s = m_ring->sqe();
+    s->fd = m_fd;
+    s->user_data = uring_backend::file_data(m_index, slot);
+    m_inflight++;
+
+    if (!m_socket) {
+        s->opcode = IORING_OP_WRITE;
+        s->addr = reinterpret_cast<uint64_t>(t->data.data());
+        s->len = static_cast<uint32_t>(len);
+        s->off = static_cast<uint64_t>(-1);
+        return true;
+    }
+
+    memset(&t->msg, 0, sizeof(t->msg));
+    t->iov.iov_base = t->data.data();
+    t->iov.iov_len = len;
+    t->msg.msg_iov = &t->iov;
+    t->msg.msg_iovlen = 1;
+
+    if (name) {
+        name_len = std::min<uint32_t>(name_len, sizeof(t->name));
+        memcpy(&t->name, name, name_len);
+        t->msg.msg_name = &t->name;
+        t->msg.msg_namelen = name_len;
+    }
+
+    s->opcode = IORING_OP_SENDMSG;
+    s->addr = reinterpret_cast<uint64_t>(&t->msg);
+    s->len = 1;
+
+    return true;
+}
+
+typedef io_reactor<uring_backend> io_ring;
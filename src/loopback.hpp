@@ -0,0 +1,224 @@
+#pragma once
+
+#include <linux/if_ether.h>
+#include <netinet/ether.h>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <vector>
+
+#include "kwargs.hpp"
+
+/* An ethernet segment in memory. Every packet sent is copied to the
+ * queue of each other stack attached whose address is the destination,
+ * or to all of them when promiscuous, and copied out again when read;
+ * the same copies a socket does. Not thread safe: all stacks on a wire
+ * are driven from one loop. */
+class loopback_wire
+{
+    struct endpoint {
+        uint8_t address[ETH_ALEN];
+        bool promisc;
+        std::deque<std::vector<uint8_t>> queue;
+    };
+
+    std::vector<struct endpoint> m_endpoints;
+
+    /* packet storage to reuse */
+    std::vector<std::vector<uint8_t>> m_free;
+
+    size_t m_packets = 0;
+    size_t m_bytes = 0;
+
+    static bool is_for(const struct endpoint &e, const uint8_t *data)
+    {
+        const struct ethhdr *hdr = reinterpret_cast<const struct ethhdr *>(data);
+
+        return e.promisc || memcmp(hdr->h_dest, e.address, ETH_ALEN) == 0;
+    }
+
+    std::vector<uint8_t> packet(const uint8_t *data, size_t len)
+    {
+        std::vector<uint8_t> pkt;
+
+        if (!m_free.empty()) {
+            pkt.swap(m_free.back());
+            m_free.pop_back();
+        }
+
+        pkt.assign(data, data + len);
+
+        return pkt;
+    }
+
+  public:
+    size_t attach(const uint8_t *address, bool promisc)
+    {
+        struct endpoint e;
+
+        memcpy(e.address, address, ETH_ALEN);
+        e.promisc = promisc;
+        m_endpoints.push_back(std::move(e));
+
+        return m_endpoints.size() - 1;
+    }
+
+    void send(size_t from, const uint8_t *data, size_t len)
+    {
+        if (len < ETH_HLEN)
+            throw std::runtime_error("loopback packet without header");
+
+        for (size_t i = 0; i < m_endpoints.size(); ++i) {
+            if (i == from || !is_for(m_endpoints[i], data))
+                continue;
+
+            m_endpoints[i].queue.push_back(packet(data, len));
+        }
+
+        m_packets++;
+        m_bytes += len;
+    }
+
+    /* copy the next packet for an endpoint to data; returns its length,
+     * or 0 if none is queued */
+    size_t recv(size_t to, uint8_t *data, size_t max)
+    {
+        auto &queue = m_endpoints[to].queue;
+        size_t len;
+
+        if (queue.empty())
+            return 0;
+
+        len = queue.front().size();
+
+        if (len > max)
+            throw std::runtime_error("loopback packet exceeds buffer");
+
+        memcpy(data, queue.front().data(), len);
+        m_free.push_back(std::move(queue.front()));
+        queue.pop_front();
+
+        return len;
+    }
+
+    /* packets queued for an endpoint */
+    size_t pending(size_t to) const
+    {
+        return m_endpoints[to].queue.size();
+    }
+
+    size_t packets() const
+    {
+        return m_packets;
+    }
+
+    size_t bytes() const
+    {
+        return m_bytes;
+    }
+};
+
+struct loopback_args
+{
+    static const Kwarg<loopback_wire *> wire;
+    static const Kwarg<const char *> wire_address;
+    static const Kwarg<int> promisc;
+};
+
+decltype(loopback_args::wire) loopback_args::wire;
+decltype(loopback_args::wire_address) loopback_args::wire_address;
+decltype(loopback_args::promisc) loopback_args::promisc;
+
+/* Stand-in for eth_sock attaching a stack to a loopback_wire, so stacks
+ * are wired together without sockets, e.g. for benchmarks. */
+template<class super>
+class loopback : public super, public loopback_args
+{
+    typedef typename super::buffer_ptr buf_ptr;
+
+    static const uint16_t m_proto = 0x4307;
+    static const size_t m_mtu = 1500;
+
+    loopback_wire *m_wire;
+    uint8_t m_address[ETH_ALEN];
+    size_t m_id;
+    size_t m_read = 0;
+    size_t m_written = 0;
+
+  public:
+    template<typename... Args> explicit
+    loopback(const Args&... args)
+        : super(args...),
+          m_wire(kwget(wire, static_cast<loopback_wire *>(NULL), args...))
+    {
+        const char *def = NULL;
+        const char *addr = kwget(wire_address, def, args...);
+        struct ether_addr *a;
+
+        if (!m_wire)
+            throw std::runtime_error("loopback without wire");
+
+        if (!addr || !(a = ether_aton(addr)))
+            throw std::runtime_error("invalid loopback address");
+
+        memcpy(m_address, a->ether_addr_octet, ETH_ALEN);
+        m_id = m_wire->attach(m_address, kwget(promisc, 0, args...));
+    }
+
+    int fd()
+    {
+        return -1;
+    }
+
+    uint16_t proto()
+    {
+        return m_proto;
+    }
+
+    size_t data_size_max()
+    {
+        return m_mtu + ETH_HLEN;
+    }
+
+    const uint8_t *interface_address() const
+    {
+        return m_address;
+    }
+
+    /* packets waiting to be read */
+    size_t read_pending() const
+    {
+        return m_wire->pending(m_id);
+    }
+
+    bool read_pkt(buf_ptr &buf)
+    {
+        size_t len = m_wire->recv(m_id, buf->head(), buf->max_len());
+
+        if (!len)
+            return false;
+
+        buf->push(len);
+        m_read++;
+
+        return true;
+    }
+
+    bool write_pkt(buf_ptr &buf)
+    {
+        m_wire->send(m_id, buf->head(), buf->len());
+        m_written++;
+
+        return true;
+    }
+
+    size_t packets_read() const
+    {
+        return m_read;
+    }
+
+    size_t packets_written() const
+    {
+        return m_written;
+    }
+};
@@ -0,0 +1,364 @@
+#pragma once
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <linux/if_ether.h>
+#include <netinet/ether.h>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+
+#include "kwargs.hpp"
+#include "spsc_ring.hpp"
+
+/* An ethernet segment in memory, shared by stacks running in different
+ * threads of one process.
+ *
+ * Every node has a single producer, single consumer ring from each of
+ * the other nodes, so sending and receiving take no locks. A packet sent
+ * is copied to the ring of every node whose address is the destination,
+ * or of every promiscuous node; when a ring is full the copy is dropped,
+ * like a socket buffer overflowing. Packet storage goes back to the
+ * sender through a second ring on the same link to be reused.
+ *
+ * Each node has an eventfd to wait on. Readers arm it once they found
+ * their rings empty, and the next packet sent to them signals it, so a
+ * busy segment costs no syscalls. All nodes are attached before traffic
+ * starts. */
+class mem_segment
+{
+    typedef std::vector<uint8_t> packet;
+
+    struct link {
+        spsc_ring<packet> pkts;
+        spsc_ring<packet> free;
+
+        explicit link(size_t size)
+            : pkts(size),
+              free(size)
+        {}
+
+        /* plain new only aligns to 16 bytes before C++17, which would put
+         * the ring indexes back on shared cache lines */
+        static void *operator new(size_t size)
+        {
+            void *mem;
+
+            if (posix_memalign(&mem, alignof(struct link), size))
+                throw std::bad_alloc();
+
+            return mem;
+        }
+
+        static void operator delete(void *mem)
+        {
+            ::free(mem);
+        }
+    };
+
+    struct node {
+        uint8_t address[ETH_ALEN];
+        bool promisc;
+        int fd;
+        std::atomic<bool> armed;
+
+        /* incoming link from each node, by sender */
+        std::vector<std::unique_ptr<struct link>> links;
+
+        /* link to read first, so no sender starves the others */
+        size_t next = 0;
+    };
+
+    std::vector<std::unique_ptr<struct node>> m_nodes;
+    size_t m_ring_size;
+
+    static int event_open()
+    {
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        if (fd < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to create segment eventfd");
+
+        return fd;
+    }
+
+    static void event_set(int fd)
+    {
+        uint64_t val = 1;
+
+        if (write(fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to signal segment");
+    }
+
+    static void event_clear(int fd)
+    {
+        uint64_t val;
+
+        if (read(fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to read segment event");
+    }
+
+    static bool is_for(const struct node &n, const uint8_t *data)
+    {
+        const struct ethhdr *hdr = reinterpret_cast<const struct ethhdr *>(data);
+
+        return n.promisc || memcmp(hdr->h_dest, n.address, ETH_ALEN) == 0;
+    }
+
+    /* copy the next packet from any link to data */
+    size_t pop(struct node &n, uint8_t *data, size_t max)
+    {
+        size_t count = n.links.size();
+        size_t len;
+        packet pkt;
+
+        for (size_t i = 0; i < count; ++i) {
+            size_t from = (n.next + i) % count;
+            struct link *l = n.links[from].get();
+
+            if (!l || !l->pkts.pop(pkt))
+                continue;
+
+            if (pkt.size() > max)
+                throw std::runtime_error("segment packet exceeds buffer");
+
+            len = pkt.size();
+            memcpy(data, pkt.data(), len);
+            n.next = from + 1;
+            l->free.push(pkt);
+
+            return len;
+        }
+
+        return 0;
+    }
+
+  public:
+    explicit mem_segment(size_t ring_size = 1024)
+        : m_ring_size(ring_size)
+    {}
+
+    ~mem_segment()
+    {
+        for (auto &n : m_nodes)
+            close(n->fd);
+    }
+
+    mem_segment(const mem_segment &) = delete;
+    mem_segment &operator=(const mem_segment &) = delete;
+
+    size_t attach(const uint8_t *address, bool promisc)
+    {
+        std::unique_ptr<struct node> n(new struct node);
+        size_t id = m_nodes.size();
+
+        memcpy(n->address, address, ETH_ALEN);
+        n->promisc = promisc;
+        n->fd = event_open();
+        n->armed = true;
+
+        /* no link to itself */
+        for (size_t i = 0; i <= id; ++i) {
+            if (i < id)
+                n->links.emplace_back(new struct link(m_ring_size));
+            else
+                n->links.emplace_back();
+        }
+
+        for (auto &other : m_nodes)
+            other->links.emplace_back(new struct link(m_ring_size));
+
+        m_nodes.push_back(std::move(n));
+
+        return id;
+    }
+
+    int fd(size_t id) const
+    {
+        return m_nodes[id]->fd;
+    }
+
+    /* queue a copy for each receiver; returns the copies dropped */
+    size_t send(size_t from, const uint8_t *data, size_t len)
+    {
+        size_t drops = 0;
+
+        if (len < ETH_HLEN)
+            throw std::runtime_error("segment packet without header");
+
+        for (size_t i = 0; i < m_nodes.size(); ++i) {
+            struct node &n = *m_nodes[i];
+            packet pkt;
+
+            if (i == from || !is_for(n, data))
+                continue;
+
+            struct link &l = *n.links[from];
+
+            l.free.pop(pkt);
+            pkt.assign(data, data + len);
+
+            if (!l.pkts.push(pkt)) {
+                drops++;
+                continue;
+            }
+
+            /* pairs with the fence in recv() */
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            if (n.armed.exchange(false))
+                event_set(n.fd);
+        }
+
+        return drops;
+    }
+
+    /* copy the next packet for a node to data; returns its length, or 0
+     * with the node armed when none is queued */
+    size_t recv(size_t to, uint8_t *data, size_t max)
+    {
+        struct node &n = *m_nodes[to];
+        size_t len = pop(n, data, max);
+
+        if (len)
+            return len;
+
+        event_clear(n.fd);
+        n.armed = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        /* sent while arming; keep the event up for the rest */
+        len = pop(n, data, max);
+
+        if (len && n.armed.exchange(false))
+            event_set(n.fd);
+
+        return len;
+    }
+};
+
+struct mem_sock_args
+{
+    static const Kwarg<mem_segment *> segment;
+    static const Kwarg<const char *> segment_address;
+    static const Kwarg<int> promisc;
+};
+
+decltype(mem_sock_args::segment) mem_sock_args::segment;
+decltype(mem_sock_args::segment_address) mem_sock_args::segment_address;
+decltype(mem_sock_args::promisc) mem_sock_args::promisc;
+
+/* Stand-in for eth_sock attaching a stack to a mem_segment, so whole
+ * topologies run in one process without interfaces or privileges. The
+ * fd is readable when packets are queued; writes never block. */
+template<class super>
+class mem_sock : public super, public mem_sock_args
+{
+    typedef typename super::buffer_ptr buf_ptr;
+
+    static const uint16_t m_proto = 0x4307;
+    static const size_t m_mtu = 1500;
+
+    mem_segment *m_segment;
+    uint8_t m_address[ETH_ALEN];
+    size_t m_id;
+    size_t m_drops = 0;
+
+  public:
+    template<typename... Args> explicit
+    mem_sock(const Args&... args)
+        : super(args...),
+          m_segment(kwget(segment, static_cast<mem_segment *>(NULL), args...))
+    {
+        const char *def = NULL;
+        const char *addr = kwget(segment_address, def, args...);
+        struct ether_addr *a;
+
+        if (!m_segment)
+            throw std::runtime_error("mem_sock without segment");
+
+        if (!addr || !(a = ether_aton(addr)))
+            throw std::runtime_error("invalid mem_sock address");
+
+        memcpy(m_address, a->ether_addr_octet, ETH_ALEN);
+        m_id = m_segment->attach(m_address, kwget(promisc, 0, args...));
+    }
+
+    int fd()
+    {
+        return m_segment->fd(m_id);
+    }
+
+    uint16_t proto()
+    {
+        return m_proto;
+    }
+
+    size_t data_size_max()
+    {
+        return m_mtu + ETH_HLEN;
+    }
+
+    const uint8_t *interface_address() const
+    {
+        return m_address;
+    }
+
+    /* copies dropped on full rings of the receivers */
+    size_t drops() const
+    {
+        return m_drops;
+    }
+
+    bool read_pkt(buf_ptr &buf)
+    {
+        size_t len = m_segment->recv(m_id, buf->head(), buf->max_len());
+
+        if (!len)
+            return false;
+
+        buf->push(len);
+
+        return true;
+    }
+
+    size_t read_pkts(std::vector<buf_ptr> &bufs, size_t len)
+    {
+        size_t count = 0;
+
+        for (auto &b : bufs) {
+            size_t res = m_segment->recv(m_id, b->head(), len);
+
+            if (!res)
+                break;
+
+            b->push(res);
+            count++;
+        }
+
+        return count;
+    }
+
+    bool write_pkt(buf_ptr &buf)
+    {
+        m_drops += m_segment->send(m_id, buf->head(), buf->len());
+
+        return true;
+    }
+
+    size_t write_pkts(std::vector<buf_ptr> &bufs, size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+            write_pkt(bufs[i]);
+
+        return count;
+    }
+};
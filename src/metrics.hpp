@@ -0,0 +1,373 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+/* Counters, gauges and latency histograms shared by all threads of the
+ * process.
+ *
+ * Metrics are registered by name when the handle owning them is created
+ * (metric_counter, metric_gauge, metric_histogram) and stay registered
+ * after it is gone, so they can still be reported at exit. A metric whose
+ * handle is gone is taken over by the next handle created with the same
+ * name and kind, so stacks built over and over (as in the benchmarks)
+ * add up in one metric instead of piling up new ones.
+ *
+ * Counters and histograms are split in shards on their own cache lines,
+ * and each thread adds to the shard picked for it, so increments are a
+ * relaxed add on a line no other thread writes. Reading sums the shards;
+ * snapshot() can be called at any time from any thread. */
+class metrics
+{
+  public:
+    enum kind_type {
+        counter_kind,
+        gauge_kind,
+        histogram_kind
+    };
+
+    static constexpr size_t shards = 16;
+
+    /* log-linear histogram: values below 2^sub_bits have a bucket each,
+     * larger ones 2^sub_bits buckets per power of two, so a bucket is
+     * within 1/2^sub_bits of the value */
+    static constexpr size_t sub_bits = 3;
+    static constexpr size_t sub_buckets = 1 << sub_bits;
+    static constexpr size_t buckets = (64 - sub_bits + 1)*sub_buckets;
+
+    struct snapshot_type {
+        std::string name;
+        kind_type kind;
+
+        /* counter value, or number of values in a histogram */
+        uint64_t value;
+
+        int64_t level;
+
+        /* histograms only */
+        uint64_t sum;
+        std::vector<uint64_t> counts;
+
+        /* lower bound of the bucket holding the q quantile */
+        uint64_t quantile(double q) const
+        {
+            uint64_t rank = q*value, seen = 0;
+
+            for (size_t i = 0; i < counts.size(); ++i) {
+                seen += counts[i];
+
+                if (seen > rank)
+                    return bucket_floor(i);
+            }
+
+            return 0;
+        }
+    };
+
+    static size_t bucket(uint64_t v)
+    {
+        size_t e;
+
+        if (v < sub_buckets)
+            return v;
+
+        e = 63 - __builtin_clzll(v);
+
+        return (e - sub_bits + 1)*sub_buckets +
+               ((v >> (e - sub_bits)) & (sub_buckets - 1));
+    }
+
+    static uint64_t bucket_floor(size_t i)
+    {
+        size_t e;
+
+        if (i < sub_buckets)
+            return i;
+
+        e = i/sub_buckets + sub_bits - 1;
+
+        return (sub_buckets + i % sub_buckets) << (e - sub_bits);
+    }
+
+    /* shard of the calling thread */
+    static size_t shard()
+    {
+        static std::atomic<size_t> next(0);
+        static thread_local size_t index = next++ % shards;
+
+        return index;
+    }
+
+    class entry
+    {
+        friend class metrics;
+
+        /* a shard of a counter or histogram, alone on its cache line(s) */
+        struct alignas(64) cell {
+            std::atomic<uint64_t> value;
+            std::atomic<uint64_t> sum;
+        };
+
+        cell m_cells[shards];
+        std::atomic<int64_t> m_level;
+        std::unique_ptr<std::atomic<uint64_t>[]> m_counts;
+        std::string m_name;
+        kind_type m_kind;
+        bool m_live = true;
+
+        /* histogram counts, padded to whole cache lines per shard */
+        static constexpr size_t m_stride = (buckets + 7) & ~size_t(7);
+
+        entry(const std::string &name, kind_type kind)
+            : m_level(0),
+              m_name(name),
+              m_kind(kind)
+        {
+            for (auto &c : m_cells) {
+                c.value = 0;
+                c.sum = 0;
+            }
+
+            if (kind == histogram_kind)
+                m_counts.reset(new std::atomic<uint64_t>[shards*m_stride]());
+        }
+
+      public:
+        /* plain new only aligns to 16 bytes before C++17 */
+        static void *operator new(size_t size)
+        {
+            void *mem;
+
+            if (posix_memalign(&mem, alignof(entry), size))
+                throw std::bad_alloc();
+
+            return mem;
+        }
+
+        static void operator delete(void *mem)
+        {
+            free(mem);
+        }
+
+        const std::string &name() const
+        {
+            return m_name;
+        }
+
+        void add(uint64_t n)
+        {
+            m_cells[shard()].value.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        uint64_t value() const
+        {
+            uint64_t v = 0;
+
+            for (auto &c : m_cells)
+                v += c.value.load(std::memory_order_relaxed);
+
+            return v;
+        }
+
+        void set(int64_t v)
+        {
+            m_level.store(v, std::memory_order_relaxed);
+        }
+
+        void add_level(int64_t v)
+        {
+            m_level.fetch_add(v, std::memory_order_relaxed);
+        }
+
+        int64_t level() const
+        {
+            return m_level.load(std::memory_order_relaxed);
+        }
+
+        void record(uint64_t v)
+        {
+            size_t s = shard();
+
+            m_counts[s*m_stride + bucket(v)].fetch_add(
+                1, std::memory_order_relaxed);
+            m_cells[s].value.fetch_add(1, std::memory_order_relaxed);
+            m_cells[s].sum.fetch_add(v, std::memory_order_relaxed);
+        }
+
+        snapshot_type snapshot() const
+        {
+            snapshot_type s;
+
+            s.name = m_name;
+            s.kind = m_kind;
+            s.value = value();
+            s.level = level();
+            s.sum = 0;
+
+            if (m_kind != histogram_kind)
+                return s;
+
+            s.counts.assign(buckets, 0);
+
+            for (size_t i = 0; i < shards; ++i) {
+                s.sum += m_cells[i].sum.load(std::memory_order_relaxed);
+
+                for (size_t b = 0; b < buckets; ++b)
+                    s.counts[b] += m_counts[i*m_stride + b].load(
+                        std::memory_order_relaxed);
+            }
+
+            return s;
+        }
+    };
+
+  private:
+    std::mutex m_lock;
+    std::vector<std::unique_ptr<entry>> m_entries;
+
+    metrics()
+    {}
+
+  public:
+    metrics(const metrics &) = delete;
+    metrics &operator=(const metrics &) = delete;
+
+    /* never destroyed, so handles in static objects can outlive main() */
+    static metrics &registry()
+    {
+        static metrics *m = new metrics;
+
+        return *m;
+    }
+
+    entry *acquire(const std::string &name, kind_type kind)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+
+        for (auto &e : m_entries) {
+            if (e->m_live || e->m_kind != kind || e->m_name != name)
+                continue;
+
+            e->m_live = true;
+
+            return e.get();
+        }
+
+        m_entries.emplace_back(new entry(name, kind));
+
+        return m_entries.back().get();
+    }
+
+    void release(entry *e)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+
+        e->m_live = false;
+    }
+
+    /* all metrics, in the order they were first registered */
+    std::vector<snapshot_type> snapshot()
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        std::vector<snapshot_type> all;
+
+        all.reserve(m_entries.size());
+
+        for (auto &e : m_entries)
+            all.push_back(e->snapshot());
+
+        return all;
+    }
+};
+
+/* handles registering a metric for as long as they live */
+template<metrics::kind_type kind>
+class metric_handle
+{
+  protected:
+    metrics::entry *m_entry;
+
+  public:
+    metric_handle(const std::string &name)
+        : m_entry(metrics::registry().acquire(name, kind))
+    {}
+
+    metric_handle(const metric_handle &) = delete;
+    metric_handle &operator=(const metric_handle &) = delete;
+
+    ~metric_handle()
+    {
+        metrics::registry().release(m_entry);
+    }
+
+    const std::string &name() const
+    {
+        return m_entry->name();
+    }
+};
+
+class metric_counter : public metric_handle<metrics::counter_kind>
+{
+  public:
+    metric_counter(const std::string &name)
+        : metric_handle(name)
+    {}
+
+    void add(uint64_t n = 1)
+    {
+        m_entry->add(n);
+    }
+
+    uint64_t value() const
+    {
+        return m_entry->value();
+    }
+};
+
+class metric_gauge : public metric_handle<metrics::gauge_kind>
+{
+  public:
+    metric_gauge(const std::string &name)
+        : metric_handle(name)
+    {}
+
+    void set(int64_t v)
+    {
+        m_entry->set(v);
+    }
+
+    void add(int64_t v)
+    {
+        m_entry->add_level(v);
+    }
+
+    int64_t value() const
+    {
+        return m_entry->level();
+    }
+};
+
+class metric_histogram : public metric_handle<metrics::histogram_kind>
+{
+  public:
+    metric_histogram(const std::string &name)
+        : metric_handle(name)
+    {}
+
+    void record(uint64_t v)
+    {
+        m_entry->record(v);
+    }
+
+    metrics::snapshot_type snapshot() const
+    {
+        return m_entry->snapshot();
+    }
+};
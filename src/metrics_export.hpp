@@ -0,0 +1,344 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "metrics.hpp"
+#include "timer_wheel.hpp"
+
+/* Serve the metrics of the process in the Prometheus text format on a
+ * Unix domain socket, from the io loop the exporter is registered on.
+ *
+ * A client connects and sends a request: an HTTP GET (any path, as from
+ * curl --unix-socket) is answered with an HTTP response, any other line
+ * or a shutdown of the sending side with the bare text, e.g.
+ *
+ *     echo | nc -U /run/netmix.sock
+ *
+ * Counters are exported as <name>_total, together with a <name>_rate
+ * gauge of their increase per second over the last rate interval, sampled
+ * from a timer on the loop. Gauges are exported as they are, histograms
+ * with the buckets holding values. Names are prefixed with netmix_ and
+ * anything but letters and digits turned into '_'; metrics of the same
+ * name are summed.
+ *
+ * The data path is never stopped: the snapshot only reads the relaxed
+ * atomics of the metrics, and the registry lock it takes is not used by
+ * updates. Clients are served without blocking the loop, and a client not
+ * reading its response only holds its own buffer. Put the exporter on the
+ * I/O loop of a pipelined program to keep it off the coding threads. */
+template<class reactor>
+class metrics_export
+{
+    typedef std::chrono::steady_clock clock;
+
+    struct client {
+        std::string in;
+        std::string out;
+        size_t sent = 0;
+    };
+
+    /* refuse more, rather than let stray clients eat memory */
+    static constexpr size_t m_max_clients = 16;
+    static constexpr size_t m_max_request = 4096;
+
+    reactor &m_loop;
+    std::string m_path;
+    int m_fd;
+
+    std::map<int, struct client> m_clients;
+
+    wheel_timer m_sample;
+    uint64_t m_interval;
+    clock::time_point m_sampled;
+    std::map<std::string, uint64_t> m_last;
+    std::map<std::string, double> m_rates;
+
+    static std::string sanitize(const std::string &name)
+    {
+        std::string res = "netmix_";
+        bool sep = false;
+
+        for (char c : name) {
+            if (isalnum(static_cast<unsigned char>(c))) {
+                if (sep && res.back() != '_')
+                    res += '_';
+
+                res += tolower(static_cast<unsigned char>(c));
+                sep = false;
+            } else {
+                sep = true;
+            }
+        }
+
+        return res;
+    }
+
+    /* snapshot with equally named metrics summed, in registration order */
+    static std::vector<metrics::snapshot_type> merged()
+    {
+        std::vector<metrics::snapshot_type> res;
+
+        for (auto &s : metrics::registry().snapshot()) {
+            auto it = res.begin();
+
+            for (; it != res.end(); ++it)
+                if (it->name == s.name && it->kind == s.kind)
+                    break;
+
+            if (it == res.end()) {
+                res.push_back(s);
+                continue;
+            }
+
+            it->value += s.value;
+            it->level += s.level;
+            it->sum += s.sum;
+
+            for (size_t i = 0; i < s.counts.size(); ++i)
+                it->counts[i] += s.counts[i];
+        }
+
+        return res;
+    }
+
+    void sample()
+    {
+        clock::time_point now = clock::now();
+        double secs = std::chrono::duration<double>(now - m_sampled).count();
+
+        for (auto &s : merged()) {
+            if (s.kind != metrics::counter_kind)
+                continue;
+
+            auto last = m_last.find(s.name);
+
+            if (last != m_last.end() && secs > 0)
+                m_rates[s.name] = (s.value - last->second)/secs;
+
+            m_last[s.name] = s.value;
+        }
+
+        m_sampled = now;
+        m_loop.add_timer(m_sample, m_interval);
+    }
+
+    void histogram(std::ostream &o, const std::string &name,
+                   const metrics::snapshot_type &s)
+    {
+        uint64_t seen = 0;
+
+        for (size_t i = 0; i < s.counts.size(); ++i) {
+            if (!s.counts[i])
+                continue;
+
+            seen += s.counts[i];
+            o << name << "_bucket{le=\"" << metrics::bucket_floor(i + 1) - 1
+              << "\"} " << seen << "\n";
+        }
+
+        o << name << "_bucket{le=\"+Inf\"} " << s.value << "\n"
+          << name << "_sum " << s.sum << "\n"
+          << name << "_count " << s.value << "\n";
+    }
+
+    std::string render()
+    {
+        std::ostringstream o;
+
+        for (auto &s : merged()) {
+            std::string name = sanitize(s.name);
+
+            switch (s.kind) {
+                case metrics::counter_kind:
+                    o << "# TYPE " << name << "_total counter\n"
+                      << name << "_total " << s.value << "\n"
+                      << "# TYPE " << name << "_rate gauge\n"
+                      << name << "_rate " << m_rates[s.name] << "\n";
+                    break;
+                case metrics::gauge_kind:
+                    o << "# TYPE " << name << " gauge\n"
+                      << name << " " << s.level << "\n";
+                    break;
+                case metrics::histogram_kind:
+                    o << "# TYPE " << name << " histogram\n";
+                    histogram(o, name, s);
+                    break;
+            }
+        }
+
+        return o.str();
+    }
+
+    void respond(int fd, struct client &c)
+    {
+        std::string body = render();
+
+        if (c.in.compare(0, 4, "GET ") == 0)
+            c.out = "HTTP/1.0 200 OK\r\n"
+                    "Content-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                    "Connection: close\r\n\r\n";
+
+        c.out += body;
+        m_loop.disable_read(fd);
+
+        /* right away, as a client gone already is hung up on by the loop
+         * after this callback */
+        write_client(fd);
+    }
+
+    /* a whole HTTP request, or a line of anything else */
+    static bool complete(const std::string &in)
+    {
+        if (in.compare(0, 4, "GET ") != 0)
+            return in.find('\n') != std::string::npos;
+
+        return in.find("\r\n\r\n") != std::string::npos ||
+               in.find("\n\n") != std::string::npos;
+    }
+
+    void drop(int fd)
+    {
+        m_loop.del_cb(fd);
+        close(fd);
+        m_clients.erase(fd);
+    }
+
+    void read_client(int fd)
+    {
+        struct client &c = m_clients[fd];
+        char buf[512];
+        ssize_t res;
+
+        while ((res = read(fd, buf, sizeof(buf))) > 0) {
+            c.in.append(buf, res);
+
+            if (complete(c.in))
+                return respond(fd, c);
+
+            if (c.in.size() > m_max_request)
+                return drop(fd);
+        }
+
+        /* the client is done sending */
+        if (res == 0)
+            return respond(fd, c);
+
+        if (errno != EAGAIN)
+            drop(fd);
+    }
+
+    void write_client(int fd)
+    {
+        struct client &c = m_clients[fd];
+        ssize_t res;
+
+        while (c.sent < c.out.size()) {
+            res = send(fd, c.out.data() + c.sent, c.out.size() - c.sent,
+                       MSG_NOSIGNAL);
+
+            if (res < 0 && errno == EAGAIN)
+                return m_loop.enable_write(fd);
+
+            if (res < 0)
+                break;
+
+            c.sent += res;
+        }
+
+        drop(fd);
+    }
+
+    void accept_client(int)
+    {
+        int fd;
+
+        while ((fd = accept4(m_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+            if (m_clients.size() >= m_max_clients) {
+                close(fd);
+                continue;
+            }
+
+            m_clients[fd];
+            m_loop.template add_cb<metrics_export,
+                                   &metrics_export::read_client,
+                                   &metrics_export::write_client>(fd, this);
+            m_loop.disable_write(fd);
+        }
+
+        if (errno != EAGAIN && errno != EINTR)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to accept metrics client");
+    }
+
+  public:
+    metrics_export(reactor &loop, const std::string &path,
+                   uint64_t rate_interval = 1000)
+        : m_loop(loop),
+          m_path(path),
+          m_sample(std::bind(&metrics_export::sample, this)),
+          m_interval(rate_interval),
+          m_sampled(clock::now())
+    {
+        struct sockaddr_un sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+
+        if (path.size() >= sizeof(sa.sun_path))
+            throw std::runtime_error("metrics socket path too long: " + path);
+
+        strncpy(sa.sun_path, path.c_str(), sizeof(sa.sun_path) - 1);
+
+        if ((m_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to create metrics socket");
+
+        /* left behind by an earlier run */
+        unlink(sa.sun_path);
+
+        if (bind(m_fd, reinterpret_cast<struct sockaddr *>(&sa),
+                 sizeof(sa)) < 0 || listen(m_fd, m_max_clients) < 0) {
+            int err = errno;
+
+            close(m_fd);
+            throw std::system_error(err, std::system_category(),
+                                    "unable to listen on metrics socket");
+        }
+
+        m_loop.template add_cb<metrics_export,
+                               &metrics_export::accept_client>(m_fd, this);
+        sample();
+    }
+
+    metrics_export(const metrics_export &) = delete;
+    metrics_export &operator=(const metrics_export &) = delete;
+
+    ~metrics_export()
+    {
+        for (auto &c : m_clients) {
+            m_loop.del_cb(c.first);
+            close(c.first);
+        }
+
+        m_loop.del_cb(m_fd);
+        close(m_fd);
+        unlink(m_path.c_str());
+    }
+
+    const std::string &path() const
+    {
+        return m_path;
+    }
+};
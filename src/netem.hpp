@@ -0,0 +1,267 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <functional>
+#include <random>
+#include <vector>
+
+#include "kwargs.hpp"
+#include "timers.hpp"
+#include "timer_wheel.hpp"
+
+struct netem_args
+{
+    static const Kwarg<double> netem_rate;
+    static const Kwarg<double> netem_delay;
+    static const Kwarg<double> netem_jitter;
+    static const Kwarg<double> netem_reorder;
+    static const Kwarg<size_t> netem_limit;
+    static const Kwarg<double> netem_ge_p;
+    static const Kwarg<double> netem_ge_r;
+    static const Kwarg<double> netem_ge_good_loss;
+    static const Kwarg<double> netem_ge_bad_loss;
+    static const Kwarg<size_t> netem_seed;
+};
+
+decltype(netem_args::netem_rate) netem_args::netem_rate;
+decltype(netem_args::netem_delay) netem_args::netem_delay;
+decltype(netem_args::netem_jitter) netem_args::netem_jitter;
+decltype(netem_args::netem_reorder) netem_args::netem_reorder;
+decltype(netem_args::netem_limit) netem_args::netem_limit;
+decltype(netem_args::netem_ge_p) netem_args::netem_ge_p;
+decltype(netem_args::netem_ge_r) netem_args::netem_ge_r;
+decltype(netem_args::netem_ge_good_loss) netem_args::netem_ge_good_loss;
+decltype(netem_args::netem_ge_bad_loss) netem_args::netem_ge_bad_loss;
+decltype(netem_args::netem_seed) netem_args::netem_seed;
+
+/* Emulate the link a stack sends on, like the netem qdisc: packets
+ * written are dropped by a Gilbert-Elliott loss model, shaped to
+ * netem_rate bits per second, held back netem_delay plus or minus a
+ * uniform netem_jitter milliseconds and then written to the layer below.
+ * With probability netem_reorder a packet skips the delay and overtakes
+ * the ones held; large jitter reorders packets too. At most netem_limit
+ * packets are held, further ones are dropped as by a full qdisc.
+ *
+ * The Gilbert-Elliott channel moves from its good to its bad state with
+ * probability netem_ge_p and back with netem_ge_r before each packet, and
+ * loses it with netem_ge_good_loss or netem_ge_bad_loss depending on the
+ * state. The default p of 0 gives i.i.d. loss of netem_ge_good_loss.
+ *
+ * Held packets are released from a timer on the wheel given to the stack
+ * (timers_args::wheel), or else from timer() and later writes. Insert
+ * directly above the socket layer (or burst_write) of each end whose
+ * outgoing link is emulated. As with burst_write, written buffers are
+ * swapped into the queue, so it must not be used below layers that keep
+ * the sent buffer (plain_hdr). */
+template<class super>
+class netem : public super, public netem_args
+{
+    typedef typename super::buffer_ptr buf_ptr;
+    typedef std::chrono::steady_clock clock;
+
+    struct held {
+        uint64_t due;
+        uint64_t seq;
+        buf_ptr buf;
+    };
+
+    /* min-heap on the release time, in write order for equal times */
+    struct later {
+        bool operator()(const struct held &a, const struct held &b) const
+        {
+            return a.due > b.due || (a.due == b.due && a.seq > b.seq);
+        }
+    };
+
+    std::vector<struct held> m_queue;
+    std::mt19937_64 m_rng;
+    std::uniform_real_distribution<double> m_uniform{0, 1};
+
+    timer_wheel *m_wheel;
+    wheel_timer m_release;
+
+    /* nanoseconds to serialize one byte, 0 for no shaping */
+    double m_byte_time;
+    uint64_t m_delay;
+    uint64_t m_jitter;
+    double m_reorder;
+    size_t m_limit;
+    double m_ge_p;
+    double m_ge_r;
+    double m_ge_good_loss;
+    double m_ge_bad_loss;
+    bool m_bad = false;
+
+    /* when the emulated link has sent what was written so far */
+    uint64_t m_link_free = 0;
+    uint64_t m_seq = 0;
+
+    size_t m_lost = 0;
+    size_t m_overflows = 0;
+    size_t m_reordered = 0;
+
+    static uint64_t now()
+    {
+        auto t = clock::now().time_since_epoch();
+
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(t).count();
+    }
+
+    static uint64_t ms_to_ns(double ms)
+    {
+        return ms > 0 ? static_cast<uint64_t>(ms*1e6) : 0;
+    }
+
+    bool chance(double p)
+    {
+        return p > 0 && m_uniform(m_rng) < p;
+    }
+
+    bool ge_lost()
+    {
+        if (m_bad && chance(m_ge_r))
+            m_bad = false;
+        else if (!m_bad && chance(m_ge_p))
+            m_bad = true;
+
+        return chance(m_bad ? m_ge_bad_loss : m_ge_good_loss);
+    }
+
+    uint64_t delay()
+    {
+        double offset;
+
+        if (!m_jitter)
+            return m_delay;
+
+        offset = (2*m_uniform(m_rng) - 1)*m_jitter;
+
+        if (offset < 0 && static_cast<uint64_t>(-offset) > m_delay)
+            return 0;
+
+        return m_delay + offset;
+    }
+
+    void arm(uint64_t t)
+    {
+        uint64_t ms;
+
+        if (!m_wheel || m_queue.empty())
+            return;
+
+        /* round up, so the packet is due once the timer fires */
+        ms = m_queue.front().due > t ?
+             (m_queue.front().due - t + 999999)/1000000 : 1;
+        m_wheel->schedule(m_release, ms);
+    }
+
+    void release()
+    {
+        uint64_t t = now();
+
+        while (!m_queue.empty() && m_queue.front().due <= t) {
+            std::pop_heap(m_queue.begin(), m_queue.end(), later());
+
+            /* socket full; retry with the next release */
+            if (!super::write_pkt(m_queue.back().buf)) {
+                std::push_heap(m_queue.begin(), m_queue.end(), later());
+                break;
+            }
+
+            m_queue.pop_back();
+        }
+
+        arm(t);
+    }
+
+  public:
+    template<typename... Args> explicit
+    netem(const Args&... args)
+        : super(args...),
+          m_rng(kwget(netem_seed, static_cast<size_t>(time(0)), args...)),
+          m_wheel(kwget(timers_args::wheel, static_cast<timer_wheel *>(NULL),
+                        args...)),
+          m_release(std::bind(&netem::release, this)),
+          m_delay(ms_to_ns(kwget(netem_delay, 0.0, args...))),
+          m_jitter(ms_to_ns(kwget(netem_jitter, 0.0, args...))),
+          m_reorder(kwget(netem_reorder, 0.0, args...)),
+          m_limit(kwget(netem_limit, 1000, args...)),
+          m_ge_p(kwget(netem_ge_p, 0.0, args...)),
+          m_ge_r(kwget(netem_ge_r, 1.0, args...)),
+          m_ge_good_loss(kwget(netem_ge_good_loss, 0.0, args...)),
+          m_ge_bad_loss(kwget(netem_ge_bad_loss, 1.0, args...))
+    {
+        double rate = kwget(netem_rate, 0.0, args...);
+
+        m_byte_time = rate > 0 ? 8e9/rate : 0;
+        m_queue.reserve(m_limit);
+    }
+
+    void timer()
+    {
+        super::timer();
+        release();
+    }
+
+    /* packets held back */
+    size_t netem_pending() const
+    {
+        return m_queue.size();
+    }
+
+    size_t netem_lost() const
+    {
+        return m_lost;
+    }
+
+    size_t netem_overflows() const
+    {
+        return m_overflows;
+    }
+
+    size_t netem_reordered() const
+    {
+        return m_reordered;
+    }
+
+    bool write_pkt(buf_ptr &buf)
+    {
+        uint64_t t = now();
+        uint64_t due;
+
+        if (!m_queue.empty())
+            release();
+
+        if (ge_lost()) {
+            m_lost++;
+            return true;
+        }
+
+        if (m_queue.size() >= m_limit) {
+            m_overflows++;
+            return true;
+        }
+
+        m_link_free = std::max(t, m_link_free) + buf->len()*m_byte_time;
+        due = m_link_free;
+
+        if (chance(m_reorder) && !m_queue.empty())
+            m_reordered++;
+        else
+            due += delay();
+
+        /* nothing to wait for */
+        if (due <= t)
+            return super::write_pkt(buf);
+
+        m_queue.push_back({due, m_seq++, buf_ptr()});
+        m_queue.back().buf.swap(buf);
+        std::push_heap(m_queue.begin(), m_queue.end(), later());
+        buf = super::buffer();
+        arm(t);
+
+        return true;
+    }
+};
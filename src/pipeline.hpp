@@ -0,0 +1,233 @@
+#pragma once
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <atomic>
+#include <system_error>
+
+#include "kwargs.hpp"
+#include "spsc_ring.hpp"
+
+struct pipeline_args
+{
+    static const Kwarg<int> pipelined;
+    static const Kwarg<size_t> pipe_size;
+};
+
+decltype(pipeline_args::pipelined) pipeline_args::pipelined;
+decltype(pipeline_args::pipe_size) pipeline_args::pipe_size;
+
+/* Splits a stack between two threads.
+ *
+ * The layers above run in a coding thread and see read_pkt()/write_pkt()
+ * backed by two single producer, single consumer rings. The layers below
+ * (headers and socket) are driven by an I/O thread through the pump_*()
+ * calls, which move packets between the rings and the socket.
+ *
+ * Each side waits on an eventfd that the other side signals from its
+ * *_flush() call (hook it up with io::add_flush_cb()) whenever it added
+ * packets to, or made room in, a ring. Buffers cross threads, so the
+ * stack must use a thread safe pool like slab_pool, and layers that lend
+ * out their own memory (eth_ring, xdp_sock) can't sit below this one.
+ *
+ * Without the pipelined argument the layer passes everything straight
+ * through, so the same stack can run in a single io loop. */
+template<class super>
+class pipeline : public super, public pipeline_args
+{
+    typedef typename super::buffer_ptr buf_ptr;
+
+    bool m_pipelined;
+    spsc_ring<buf_ptr> m_rx, m_tx;
+    int m_pipe_fd, m_pump_fd;
+    std::atomic<bool> m_pipe_signal, m_pump_signal;
+    bool m_rx_blocked = false;
+
+    static int event_open()
+    {
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        if (fd < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to create pipeline eventfd");
+
+        return fd;
+    }
+
+    static void event_set(int fd)
+    {
+        uint64_t val = 1;
+
+        if (write(fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to signal pipeline");
+    }
+
+    static void event_signal(int fd, std::atomic<bool> &pending)
+    {
+        if (pending.exchange(false))
+            event_set(fd);
+    }
+
+    static void event_clear(int fd)
+    {
+        uint64_t val;
+
+        if (read(fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to read pipeline event");
+    }
+
+  public:
+    template<typename... Args> explicit
+    pipeline(const Args&... args)
+        : super(args...),
+          m_pipelined(kwget(pipelined, 0, args...)),
+          m_rx(kwget(pipe_size, 256, args...)),
+          m_tx(kwget(pipe_size, 256, args...)),
+          m_pipe_fd(event_open()),
+          m_pump_fd(event_open()),
+          m_pipe_signal(false),
+          m_pump_signal(false)
+    {}
+
+    ~pipeline()
+    {
+        close(m_pipe_fd);
+        close(m_pump_fd);
+    }
+
+    /* coding thread */
+
+    int pipe_fd()
+    {
+        return m_pipe_fd;
+    }
+
+    void pipe_flush()
+    {
+        event_signal(m_pump_fd, m_pump_signal);
+    }
+
+    bool read_pkt(buf_ptr &buf)
+    {
+        size_t reserved;
+
+        if (!m_pipelined)
+            return super::read_pkt(buf);
+
+        reserved = buf->head_len();
+
+        if (!m_rx.pop(buf)) {
+            /* the event is only cleared once the ring is seen empty after
+             * clearing it; otherwise set it again for the packets left */
+            event_clear(m_pipe_fd);
+
+            if (!m_rx.pop(buf))
+                return false;
+
+            event_set(m_pipe_fd);
+        }
+
+        /* keep the head room the layers above reserved */
+        buf->head_reserve(reserved);
+        m_pump_signal = true;
+
+        return true;
+    }
+
+    bool write_pkt(buf_ptr &buf)
+    {
+        if (!m_pipelined)
+            return super::write_pkt(buf);
+
+        if (!m_tx.push(buf))
+            return false;
+
+        buf = super::buffer();
+        m_pump_signal = true;
+
+        return true;
+    }
+
+    /* the layers below belong to the I/O thread; see pump_timer() */
+    void timer()
+    {
+        if (!m_pipelined)
+            super::timer();
+    }
+
+    /* I/O thread */
+
+    int pump_fd()
+    {
+        return m_pump_fd;
+    }
+
+    void pump_flush()
+    {
+        event_signal(m_pipe_fd, m_pipe_signal);
+    }
+
+    void pump_clear()
+    {
+        event_clear(m_pump_fd);
+    }
+
+    /* read from the socket until it is empty or the ring is full; returns
+     * false in the latter case, so the caller can stop polling the socket
+     * until the coding thread made room */
+    bool pump_read()
+    {
+        buf_ptr buf = super::buffer();
+
+        m_rx_blocked = false;
+
+        while (!m_rx.full()) {
+            if (!super::read_pkt(buf))
+                return true;
+
+            m_rx.push(buf);
+            m_pipe_signal = true;
+            buf = super::buffer();
+        }
+
+        m_rx_blocked = true;
+
+        return false;
+    }
+
+    bool pump_blocked() const
+    {
+        return m_rx_blocked && !m_rx.full();
+    }
+
+    /* write queued packets until the ring is empty or the socket is full;
+     * returns false in the latter case */
+    bool pump_write()
+    {
+        buf_ptr *buf;
+
+        while ((buf = m_tx.front())) {
+            if (!super::write_pkt(*buf)) {
+                /* layers like tcp_hdr may keep a partly sent packet */
+                if (!*buf) {
+                    m_tx.discard();
+                    m_pipe_signal = true;
+                }
+
+                return false;
+            }
+
+            m_tx.discard();
+            m_pipe_signal = true;
+        }
+
+        return true;
+    }
+
+    void pump_timer()
+    {
+        super::timer();
+    }
+};
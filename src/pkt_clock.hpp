@@ -0,0 +1,22 @@
+#pragma once
+
+#include <time.h>
+#include <cstdint>
+
+/* Clock of the packet timestamps: CLOCK_MONOTONIC_RAW in nanoseconds.
+ *
+ * It is read through the vDSO, is the same in every thread and process
+ * of a host and isn't slewed by NTP, so differences between stamps taken
+ * on one host are true durations. Stamps of different hosts differ by the
+ * offset of their clocks. */
+struct pkt_clock
+{
+    static uint64_t now()
+    {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+
+        return static_cast<uint64_t>(ts.tv_sec)*1000000000 + ts.tv_nsec;
+    }
+};
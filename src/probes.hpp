@@ -0,0 +1,44 @@
+#pragma once
+
+/* Static tracepoints at the events of the data path, for tracing a
+ * running program, e.g. why its throughput dropped, without rebuilding it
+ * or logging.
+ *
+ * Built with NETMIX_USDT defined, e.g.
+ *
+ *     CXXFLAGS=-DNETMIX_USDT make
+ *
+ * the probes are USDT probes of provider netmix, from sys/sdt.h (the
+ * header of systemtap, which needs nothing at run time). An unused probe
+ * is a nop and the reads of its arguments. List and attach with e.g.
+ *
+ *     bpftrace -l 'usdt:./rlnc_dencoder:netmix:*'
+ *     bpftrace -e 'usdt:./rlnc_dencoder:netmix:dec_linear
+ *                  { @[arg0] = count(); }'
+ *
+ * Without NETMIX_USDT the probes are left out entirely, arguments
+ * included. The probes and their arguments:
+ *
+ *     sock_recv, sock_send    fd, length      packet read or sent by sock
+ *     enc_symbol              block, index    symbol added to the encoder
+ *     dec_rank, rec_rank      block, rank     rank increased by a packet
+ *     dec_linear, rec_linear  block, rank     linearly dependent packet
+ *     dec_ack                 block, rank     ack sent by the decoder
+ *     enc_ack, rec_ack,
+ *     hlp_ack                 block, rank     ack processed
+ *     generation              block           next block started
+ *     budget_spend            budget          packet of the budget sent,
+ *                                             whole packets left */
+#ifdef NETMIX_USDT
+
+#include <sys/sdt.h>
+
+#define NETMIX_PROBE1(name, a) STAP_PROBE1(netmix, name, a)
+#define NETMIX_PROBE2(name, a, b) STAP_PROBE2(netmix, name, a, b)
+
+#else
+
+#define NETMIX_PROBE1(name, a) do {} while (0)
+#define NETMIX_PROBE2(name, a, b) do {} while (0)
+
+#endif
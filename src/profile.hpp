@@ -0,0 +1,246 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "metrics.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_RDTSC
+#else
+#include "pkt_clock.hpp"
+#endif
+
+/* Cycle accounting per layer of a stack, to tell which of the nested
+ * mix-ins the time goes to when a profiler only shows inlined templates.
+ *
+ * profile<name, super> can be put anywhere in a stack and counts the
+ * calls of read_pkt, write_pkt and timer on the layer below it, and the
+ * TSC cycles spent in them, less those spent in any profile further down.
+ * The cycles of a profile are thus those of the layers between it and the
+ * next profile below, e.g.
+ *
+ *     static const char enc_coder[] = "enc coder";
+ *     static const char enc_link[] = "enc link";
+ *
+ *     profile<enc_coder, len_hdr<rlnc_data_enc<...,
+ *     rlnc_hdr<...
+ *     profile<enc_link, netem<...
+ *
+ * counts the coding and headers in "enc coder" and the emulated link and
+ * socket in "enc link". The counts are metrics ("prof <name> <op> calls"
+ * and "prof <name> <op> cycles"), shown live by the exporter and summed
+ * per layer by profile_report.
+ *
+ * Profiling is built in with NETMIX_PROFILE defined, e.g.
+ *
+ *     CXXFLAGS=-DNETMIX_PROFILE make
+ *
+ * and profile<name, super> is super otherwise. The cycles are those of the
+ * TSC, counting at the nominal clock whatever the core runs at; the cost
+ * of the accounting itself, some 50 cycles a call, lands on the layer
+ * above. */
+#ifdef NETMIX_PROFILE
+
+struct profile_clock
+{
+    static uint64_t cycles()
+    {
+#ifdef PROFILE_RDTSC
+        return __rdtsc();
+#else
+        return pkt_clock::now();
+#endif
+    }
+
+    /* cycles spent in profiles below the running one, per thread */
+    static uint64_t &inner()
+    {
+        static thread_local uint64_t cycles = 0;
+
+        return cycles;
+    }
+};
+
+template<const char *name, class super>
+class profile : public super
+{
+    typedef typename super::buffer_ptr buf_ptr;
+
+    struct op {
+        metric_counter calls;
+        metric_counter cycles;
+
+        op(const std::string &prefix)
+            : calls(prefix + " calls"),
+              cycles(prefix + " cycles")
+        {}
+    };
+
+    /* time a call, handing its cycles to the profile above when done */
+    class scope
+    {
+        op &m_op;
+        uint64_t m_outer;
+        uint64_t m_start;
+
+      public:
+        scope(op &o)
+            : m_op(o),
+              m_outer(profile_clock::inner())
+        {
+            profile_clock::inner() = 0;
+            m_start = profile_clock::cycles();
+        }
+
+        ~scope()
+        {
+            uint64_t elapsed = profile_clock::cycles() - m_start;
+
+            m_op.calls.add();
+            m_op.cycles.add(elapsed - profile_clock::inner());
+            profile_clock::inner() = m_outer + elapsed;
+        }
+    };
+
+    op m_read = {std::string("prof ") + name + " read"};
+    op m_write = {std::string("prof ") + name + " write"};
+    op m_timer = {std::string("prof ") + name + " timer"};
+
+  public:
+    template<typename... Args> explicit
+    profile(const Args&... args)
+        : super(args...)
+    {}
+
+    using super::read_pkt;
+    using super::write_pkt;
+
+    bool read_pkt(buf_ptr &buf)
+    {
+        scope s(m_read);
+
+        return super::read_pkt(buf);
+    }
+
+    bool write_pkt(buf_ptr &buf)
+    {
+        scope s(m_write);
+
+        return super::write_pkt(buf);
+    }
+
+    void timer()
+    {
+        scope s(m_timer);
+
+        super::timer();
+    }
+};
+
+#else
+
+template<const char *name, class super>
+using profile = super;
+
+#endif
+
+/* Cost breakdown of the profiled layers, one line per layer and call, e.g.
+ *
+ *     std::cout << profile_report;
+ *
+ * Layers are summed over the stacks using the name. Prints nothing when
+ * nothing was profiled. */
+inline std::ostream &profile_report(std::ostream &stream)
+{
+    static const char *ops[] = {"read", "write", "timer"};
+    static const std::string prefix = "prof ";
+
+    struct layer {
+        std::string name;
+        uint64_t calls[3];
+        uint64_t cycles[3];
+    };
+
+    std::vector<struct layer> layers;
+    uint64_t total = 0;
+    size_t width = 5;
+
+    for (auto &s : metrics::registry().snapshot()) {
+        if (s.kind != metrics::counter_kind ||
+            s.name.compare(0, prefix.size(), prefix) != 0)
+            continue;
+
+        /* prof <name> <op> calls|cycles */
+        size_t unit = s.name.rfind(' ');
+        size_t op = s.name.rfind(' ', unit - 1);
+        size_t i;
+
+        if (op < prefix.size())
+            continue;
+
+        std::string name = s.name.substr(prefix.size(), op - prefix.size());
+        std::string what = s.name.substr(op + 1, unit - op - 1);
+
+        for (i = 0; i < 3 && what != ops[i]; ++i);
+
+        if (i == 3)
+            continue;
+
+        auto l = layers.begin();
+
+        for (; l != layers.end() && l->name != name; ++l);
+
+        if (l == layers.end()) {
+            layers.push_back({name, {0, 0, 0}, {0, 0, 0}});
+            l = layers.end() - 1;
+            width = std::max(width, name.size());
+        }
+
+        if (s.name.compare(unit + 1, std::string::npos, "calls") == 0) {
+            l->calls[i] += s.value;
+        } else {
+            l->cycles[i] += s.value;
+            total += s.value;
+        }
+    }
+
+    if (layers.empty())
+        return stream;
+
+    std::ios::fmtflags flags = stream.flags();
+    std::streamsize precision = stream.precision();
+
+    stream << std::left << std::setw(width + 2) << "layer"
+           << std::setw(7) << "call" << std::right
+           << std::setw(12) << "calls"
+           << std::setw(16) << "cycles"
+           << std::setw(12) << "cycles/call"
+           << std::setw(8) << "share" << std::endl;
+
+    for (auto &l : layers) {
+        for (size_t i = 0; i < 3; ++i) {
+            if (!l.calls[i])
+                continue;
+
+            stream << std::left << std::setw(width + 2) << l.name
+                   << std::setw(7) << ops[i] << std::right
+                   << std::setw(12) << l.calls[i]
+                   << std::setw(16) << l.cycles[i]
+                   << std::setw(12) << l.cycles[i]/l.calls[i]
+                   << std::setw(7) << std::fixed << std::setprecision(1)
+                   << (total ? 100.0*l.cycles[i]/total : 0) << "%"
+                   << std::endl;
+        }
+    }
+
+    stream.flags(flags);
+    stream.precision(precision);
+
+    return stream;
+}
@@ -0,0 +1,558 @@
+#pragma once
+
+#include <endian.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "gf_kernels.hpp"
+
+/* Random linear network coders on the gf256 kernels, usable in place of
+ * the kodo sliding window coders by the rlnc_data_* layers.
+ *
+ * Packets carry the encoder rank, the index of a systematic symbol (or
+ * 0xffff if coded), and for coded packets the coefficients of the
+ * symbols the encoder had, in one bit (GF(2)) or byte (GF(2^8)) each.
+ * Coefficients are kept as one byte per symbol in memory for both
+ * fields; GF(2) only draws them from 0 and 1.
+ *
+ * Decoders keep their rows fully reduced, so symbols are handed out as
+ * soon as they are decoded, and send which ones are in their feedback.
+ * Encoders leave those out of the packets they code. */
+
+struct gf_binary
+{
+    static constexpr uint8_t max_coefficient = 1;
+
+    static size_t coefficients_len(size_t symbols)
+    {
+        return (symbols + 7)/8;
+    }
+
+    static void write_coefficients(uint8_t *out, const uint8_t *c, size_t n)
+    {
+        memset(out, 0, coefficients_len(n));
+
+        for (size_t i = 0; i < n; ++i)
+            out[i/8] |= c[i] << (i % 8);
+    }
+
+    static void read_coefficients(uint8_t *c, const uint8_t *in, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            c[i] = (in[i/8] >> (i % 8)) & 1;
+    }
+};
+
+struct gf_binary8
+{
+    static constexpr uint8_t max_coefficient = 255;
+
+    static size_t coefficients_len(size_t symbols)
+    {
+        return symbols;
+    }
+
+    static void write_coefficients(uint8_t *out, const uint8_t *c, size_t n)
+    {
+        memcpy(out, c, n);
+    }
+
+    static void read_coefficients(uint8_t *c, const uint8_t *in, size_t n)
+    {
+        memcpy(c, in, n);
+    }
+};
+
+template<class field>
+class rlnc_coder_base
+{
+  protected:
+    struct coding_hdr {
+        uint16_t rank;
+        uint16_t index;
+        uint8_t coefficients[];
+    } __attribute__((packed));
+
+    static constexpr uint16_t m_coded = 0xffff;
+
+    size_t m_symbols;
+    size_t m_symbol_size;
+    uint64_t m_random;
+
+    /* xorshift64*; no need for more than unpredictable coefficients */
+    uint64_t random()
+    {
+        m_random ^= m_random >> 12;
+        m_random ^= m_random << 25;
+        m_random ^= m_random >> 27;
+
+        return m_random*0x2545f4914f6cdd1dull;
+    }
+
+    /* random coefficients for symbols [0, n), zero where flags[i] is
+     * skip, and at least one of them not zero */
+    void random_coefficients(uint8_t *c, size_t n, const uint8_t *flags,
+                             uint8_t skip)
+    {
+        size_t last = n;
+        uint64_t r = 0;
+
+        for (size_t i = 0; i < n; ++i) {
+            if (i % 8 == 0)
+                r = random();
+
+            if (flags[i] == skip) {
+                c[i] = 0;
+                continue;
+            }
+
+            c[i] = (r >> 8*(i % 8)) & field::max_coefficient;
+            last = i;
+        }
+
+        if (last == n)
+            return;
+
+        for (size_t i = 0; i < n; ++i)
+            if (c[i])
+                return;
+
+        c[last] = 1;
+    }
+
+    static struct coding_hdr *header(uint8_t *payload)
+    {
+        return reinterpret_cast<struct coding_hdr *>(payload);
+    }
+
+    rlnc_coder_base(size_t symbols, size_t symbol_size)
+        : m_symbols(symbols),
+          m_symbol_size(symbol_size),
+          m_random(reinterpret_cast<uintptr_t>(this) | 1)
+    {
+        if (symbols == 0 || symbols >= m_coded)
+            throw std::runtime_error("invalid number of symbols");
+    }
+
+  public:
+    class factory
+    {
+        size_t m_symbols;
+        size_t m_symbol_size;
+
+      public:
+        factory(size_t symbols, size_t symbol_size)
+            : m_symbols(symbols),
+              m_symbol_size(symbol_size)
+        {}
+
+        size_t symbols() const
+        {
+            return m_symbols;
+        }
+
+        size_t symbol_size() const
+        {
+            return m_symbol_size;
+        }
+    };
+
+    size_t symbols() const
+    {
+        return m_symbols;
+    }
+
+    size_t symbol_size() const
+    {
+        return m_symbol_size;
+    }
+
+    size_t payload_size() const
+    {
+        return sizeof(struct coding_hdr) +
+               field::coefficients_len(m_symbols) + m_symbol_size;
+    }
+
+    /* one bit per symbol decoded */
+    size_t feedback_size() const
+    {
+        return (m_symbols + 7)/8;
+    }
+};
+
+template<class field>
+class rlnc_encoder : public rlnc_coder_base<field>
+{
+    typedef rlnc_coder_base<field> base;
+
+    std::vector<const uint8_t *> m_data;
+    std::vector<size_t> m_len;
+    std::vector<uint8_t> m_decoded;
+    std::vector<uint8_t> m_coefficients;
+    size_t m_initialized = 0;
+    size_t m_systematic_sent = 0;
+    bool m_systematic = true;
+
+    void reset()
+    {
+        m_data.assign(base::m_symbols, NULL);
+        m_len.assign(base::m_symbols, 0);
+        m_decoded.assign(base::m_symbols, 0);
+        m_coefficients.assign(base::m_symbols, 0);
+        m_initialized = 0;
+        m_systematic_sent = 0;
+    }
+
+  public:
+    typedef std::shared_ptr<rlnc_encoder> pointer;
+
+    struct factory : public base::factory
+    {
+        factory(size_t symbols, size_t symbol_size)
+            : base::factory(symbols, symbol_size)
+        {}
+
+        pointer build()
+        {
+            return pointer(new rlnc_encoder(*this));
+        }
+    };
+
+    explicit rlnc_encoder(const typename base::factory &f)
+        : base(f.symbols(), f.symbol_size())
+    {
+        reset();
+    }
+
+    void initialize(const typename base::factory &f)
+    {
+        base::m_symbols = f.symbols();
+        base::m_symbol_size = f.symbol_size();
+        reset();
+    }
+
+    /* the symbol is not copied and must stay until the block is done;
+     * shorter ones are coded as if padded with zeros */
+    template<class storage>
+    void set_symbol(size_t i, const storage &symbol)
+    {
+        m_data[i] = symbol.m_data;
+        m_len[i] = std::min<size_t>(symbol.m_size, base::m_symbol_size);
+        m_initialized = std::max(m_initialized, i + 1);
+    }
+
+    size_t symbols_initialized() const
+    {
+        return m_initialized;
+    }
+
+    size_t rank() const
+    {
+        return m_initialized;
+    }
+
+    void set_systematic_off()
+    {
+        m_systematic = false;
+    }
+
+    void set_systematic_on()
+    {
+        m_systematic = true;
+    }
+
+    size_t encode(uint8_t *payload)
+    {
+        auto hdr = base::header(payload);
+        size_t n = m_initialized;
+        size_t coefficients_len = field::coefficients_len(n);
+        uint8_t *symbol = hdr->coefficients + coefficients_len;
+
+        hdr->rank = htobe16(n);
+
+        if (m_systematic && m_systematic_sent < n) {
+            size_t i = m_systematic_sent++;
+
+            hdr->index = htobe16(i);
+            symbol = hdr->coefficients;
+            memcpy(symbol, m_data[i], m_len[i]);
+            memset(symbol + m_len[i], 0, base::m_symbol_size - m_len[i]);
+
+            return sizeof(*hdr) + base::m_symbol_size;
+        }
+
+        hdr->index = htobe16(base::m_coded);
+        base::random_coefficients(&m_coefficients[0], n, &m_decoded[0], 1);
+        field::write_coefficients(hdr->coefficients, &m_coefficients[0], n);
+        memset(symbol, 0, base::m_symbol_size);
+
+        for (size_t i = 0; i < n; ++i)
+            gf256::mul_add(symbol, m_data[i], m_coefficients[i], m_len[i]);
+
+        return sizeof(*hdr) + coefficients_len + base::m_symbol_size;
+    }
+
+    void read_feedback(const uint8_t *feedback)
+    {
+        for (size_t i = 0; i < base::m_symbols; ++i)
+            m_decoded[i] = (feedback[i/8] >> (i % 8)) & 1;
+    }
+};
+
+template<class field>
+class rlnc_decoder : public rlnc_coder_base<field>
+{
+    typedef rlnc_coder_base<field> base;
+
+    /* rows of coefficients and data, by pivot; one spare row to reduce
+     * incoming packets in */
+    std::vector<uint8_t> m_storage;
+    std::vector<uint8_t *> m_coefficient_rows;
+    std::vector<uint8_t *> m_data_rows;
+    uint8_t *m_spare_coefficients;
+    uint8_t *m_spare_data;
+
+    std::vector<uint8_t> m_pivot;
+    std::vector<uint8_t> m_decoded;
+    std::vector<uint8_t> m_recode;
+    size_t m_rank = 0;
+    size_t m_remote_rank = 0;
+    size_t m_symbols_decoded = 0;
+
+    size_t row_size() const
+    {
+        return base::m_symbols + base::m_symbol_size;
+    }
+
+    void reset()
+    {
+        size_t rows = base::m_symbols + 1;
+
+        m_storage.assign(rows*row_size(), 0);
+        m_coefficient_rows.resize(base::m_symbols);
+        m_data_rows.resize(base::m_symbols);
+
+        for (size_t i = 0; i < base::m_symbols; ++i) {
+            m_coefficient_rows[i] = &m_storage[i*row_size()];
+            m_data_rows[i] = m_coefficient_rows[i] + base::m_symbols;
+        }
+
+        m_spare_coefficients = &m_storage[base::m_symbols*row_size()];
+        m_spare_data = m_spare_coefficients + base::m_symbols;
+        m_pivot.assign(base::m_symbols, 0);
+        m_decoded.assign(base::m_symbols, 0);
+        m_recode.assign(base::m_symbols, 0);
+        m_rank = 0;
+        m_remote_rank = 0;
+        m_symbols_decoded = 0;
+    }
+
+    /* row -= c*src, for the coefficients and the data */
+    void row_mul_add(size_t row, const uint8_t *coefficients,
+                     const uint8_t *data, uint8_t c)
+    {
+        gf256::mul_add(m_coefficient_rows[row], coefficients, c,
+                       base::m_symbols);
+        gf256::mul_add(m_data_rows[row], data, c, base::m_symbol_size);
+    }
+
+    void check_decoded(size_t row)
+    {
+        const uint8_t *c = m_coefficient_rows[row];
+
+        if (m_decoded[row])
+            return;
+
+        for (size_t i = 0; i < base::m_symbols; ++i)
+            if (c[i] && i != row)
+                return;
+
+        m_decoded[row] = 1;
+        m_symbols_decoded++;
+    }
+
+    /* reduce the spare row by the pivots; it is then either zero or has a
+     * new pivot, which is removed from the other rows */
+    void insert()
+    {
+        uint8_t *c = m_spare_coefficients;
+        size_t pivot = base::m_symbols;
+
+        for (size_t i = 0; i < base::m_symbols; ++i) {
+            uint8_t f = c[i];
+
+            if (!f || !m_pivot[i])
+                continue;
+
+            gf256::mul_add(c, m_coefficient_rows[i], f, base::m_symbols);
+            gf256::mul_add(m_spare_data, m_data_rows[i], f,
+                           base::m_symbol_size);
+        }
+
+        for (size_t i = 0; i < base::m_symbols && pivot == base::m_symbols; ++i)
+            if (c[i])
+                pivot = i;
+
+        if (pivot == base::m_symbols)
+            return;
+
+        if (c[pivot] != 1) {
+            uint8_t inv = gf256::inv(c[pivot]);
+
+            gf256::mul(c, inv, base::m_symbols);
+            gf256::mul(m_spare_data, inv, base::m_symbol_size);
+        }
+
+        for (size_t i = 0; i < base::m_symbols; ++i) {
+            uint8_t f = m_coefficient_rows[i][pivot];
+
+            if (!m_pivot[i] || !f)
+                continue;
+
+            row_mul_add(i, c, m_spare_data, f);
+            check_decoded(i);
+        }
+
+        std::swap(m_coefficient_rows[pivot], m_spare_coefficients);
+        std::swap(m_data_rows[pivot], m_spare_data);
+        m_pivot[pivot] = 1;
+        m_rank++;
+        check_decoded(pivot);
+    }
+
+  public:
+    typedef std::shared_ptr<rlnc_decoder> pointer;
+
+    struct factory : public base::factory
+    {
+        factory(size_t symbols, size_t symbol_size)
+            : base::factory(symbols, symbol_size)
+        {}
+
+        pointer build()
+        {
+            return pointer(new rlnc_decoder(*this));
+        }
+    };
+
+    explicit rlnc_decoder(const typename base::factory &f)
+        : base(f.symbols(), f.symbol_size())
+    {
+        reset();
+    }
+
+    void initialize(const typename base::factory &f)
+    {
+        base::m_symbols = f.symbols();
+        base::m_symbol_size = f.symbol_size();
+        reset();
+    }
+
+    size_t rank() const
+    {
+        return m_rank;
+    }
+
+    /* rank of the encoder, as of the latest packet */
+    size_t remote_rank() const
+    {
+        return m_remote_rank;
+    }
+
+    size_t symbols_decoded() const
+    {
+        return m_symbols_decoded;
+    }
+
+    bool is_symbol_decoded(size_t i) const
+    {
+        return i < base::m_symbols && m_decoded[i];
+    }
+
+    bool is_complete() const
+    {
+        return m_rank == base::m_symbols;
+    }
+
+    uint8_t *symbol(size_t i)
+    {
+        return m_data_rows[i];
+    }
+
+    /* recoded packets are always coded */
+    void set_systematic_off()
+    {}
+
+    void decode(uint8_t *payload)
+    {
+        auto hdr = base::header(payload);
+        size_t n = std::min<size_t>(be16toh(hdr->rank), base::m_symbols);
+        size_t index = be16toh(hdr->index);
+        const uint8_t *symbol = hdr->coefficients;
+
+        m_remote_rank = std::max(m_remote_rank, n);
+        memset(m_spare_coefficients, 0, base::m_symbols);
+
+        if (index == base::m_coded) {
+            field::read_coefficients(m_spare_coefficients, hdr->coefficients,
+                                     n);
+            symbol += field::coefficients_len(n);
+        } else if (index < base::m_symbols) {
+            if (m_decoded[index])
+                return;
+
+            m_spare_coefficients[index] = 1;
+        } else {
+            return;
+        }
+
+        memcpy(m_spare_data, symbol, base::m_symbol_size);
+        insert();
+    }
+
+    /* a random combination of the rows received so far */
+    size_t recode(uint8_t *payload)
+    {
+        auto hdr = base::header(payload);
+        size_t n = m_remote_rank;
+        uint8_t *symbol = hdr->coefficients + field::coefficients_len(n);
+
+        hdr->rank = htobe16(n);
+        hdr->index = htobe16(base::m_coded);
+        memset(m_spare_coefficients, 0, base::m_symbols);
+        memset(symbol, 0, base::m_symbol_size);
+        base::random_coefficients(&m_recode[0], base::m_symbols, &m_pivot[0],
+                                 0);
+
+        for (size_t i = 0; i < base::m_symbols; ++i) {
+            if (!m_pivot[i] || !m_recode[i])
+                continue;
+
+            gf256::mul_add(m_spare_coefficients, m_coefficient_rows[i],
+                           m_recode[i], base::m_symbols);
+            gf256::mul_add(symbol, m_data_rows[i], m_recode[i],
+                           base::m_symbol_size);
+        }
+
+        field::write_coefficients(hdr->coefficients, m_spare_coefficients, n);
+
+        return sizeof(*hdr) + field::coefficients_len(n) + base::m_symbol_size;
+    }
+
+    void write_feedback(uint8_t *feedback) const
+    {
+        memset(feedback, 0, base::feedback_size());
+
+        for (size_t i = 0; i < base::m_symbols; ++i)
+            feedback[i/8] |= m_decoded[i] << (i % 8);
+    }
+
+    /* acks seen by recoders; recoding mixes all rows regardless */
+    void read_feedback(const uint8_t *)
+    {}
+};
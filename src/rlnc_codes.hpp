@@ -4,3 +4,21 @@
 #include "kodo/rlnc/on_the_fly_codes.hpp"
 #include "kodo/rlnc/sliding_window_decoder.hpp"
 #include "kodo/rlnc/sliding_window_encoder.hpp"
+
+#include "rlnc_coder.hpp"
+
+/* coders of the stacks, picked with -coder at run time; all nodes of a
+ * flow must use the same */
+struct kodo_codes
+{
+    typedef kodo::sliding_window_encoder<fifi::binary> encoder;
+    typedef kodo::sliding_window_decoder<fifi::binary> decoder;
+};
+
+/* the netmix coders, on the SIMD kernel chosen for this CPU */
+template<class field>
+struct gf_codes
+{
+    typedef rlnc_encoder<field> encoder;
+    typedef rlnc_decoder<field> decoder;
+};
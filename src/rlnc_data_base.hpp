@@ -1,29 +1,50 @@
 #pragma once
 
+#include <algorithm>
+#include <vector>
+
 #include "kwargs.hpp"
 
 template<class coder>
 class rlnc_data_base
 {
     typedef typename coder::factory coder_factory;
-    typedef typename coder::pointer coder_pointer;
     typedef uint16_t rank_type;
 
   protected:
+    typedef typename coder::pointer coder_pointer;
+
     struct rank_hdr {
         rank_type rank;
         uint8_t status[];
     } __attribute__((packed));
 
     static constexpr size_t m_hdr_len = sizeof(rank_hdr);
+    static constexpr size_t m_blocks = 16;
     coder_factory m_factory;
     coder_pointer m_coder;
 
+  private:
+    /* idle coders, and the coder of each block id in flight */
+    std::vector<coder_pointer> m_pool;
+    coder_pointer m_active[m_blocks];
+
+    /* ingress times of the symbols of each block in flight, as far as
+     * they were heard of; 0 if unknown */
+    std::vector<uint64_t> m_stamps[m_blocks];
+    size_t m_stamp_newest[m_blocks] = {0};
+    size_t m_symbols;
+
   protected:
-    rlnc_data_base(size_t s, size_t size)
+    rlnc_data_base(size_t s, size_t size, size_t generations = 1)
         : m_factory(s, size),
-          m_coder(m_factory.build())
+          m_coder(m_factory.build()),
+          m_symbols(s)
     {
+        m_active[0] = m_coder;
+
+        for (size_t i = 1; i < generations; ++i)
+            m_pool.push_back(m_factory.build());
     }
 
     void increment(size_t b = 0)
@@ -32,25 +53,133 @@ class rlnc_data_base
         m_coder->initialize(m_factory);
     }
 
+    /* index of a block in per block arrays */
+    static size_t slot(size_t b)
+    {
+        return b % m_blocks;
+    }
+
+    /* coder for a block in flight, or NULL */
+    coder_pointer &block_coder(size_t b)
+    {
+        return m_active[slot(b)];
+    }
+
+    /* coder for a block, taken from the pool if the block is new; NULL if
+     * all coders are busy with other blocks */
+    coder_pointer &coder_acquire(size_t b)
+    {
+        coder_pointer &c = block_coder(b);
+
+        if (c || m_pool.empty())
+            return c;
+
+        c = m_pool.back();
+        m_pool.pop_back();
+        c->initialize(m_factory);
+
+        return c;
+    }
+
+    void coder_release(size_t b)
+    {
+        coder_pointer &c = block_coder(b);
+
+        if (!c)
+            return;
+
+        m_pool.push_back(c);
+        c.reset();
+        stamp_clear(b);
+    }
+
+    /* remember the ingress time of a symbol read from a timestamp
+     * extension */
+    void stamp_put(size_t b, size_t index, uint64_t time)
+    {
+        std::vector<uint64_t> &stamps = m_stamps[slot(b)];
+        size_t &newest = m_stamp_newest[slot(b)];
+
+        if (!time || index >= m_symbols)
+            return;
+
+        if (stamps.empty())
+            stamps.assign(m_symbols, 0);
+
+        if (index > newest || !stamps[newest])
+            newest = index;
+
+        stamps[index] = time;
+    }
+
+    uint64_t stamp_get(size_t b, size_t index)
+    {
+        std::vector<uint64_t> &stamps = m_stamps[slot(b)];
+
+        return index < stamps.size() ? stamps[index] : 0;
+    }
+
+    /* the latest symbol of a block whose time is known, to pass on */
+    bool stamp_newest(size_t b, size_t *index, uint64_t *time)
+    {
+        *index = m_stamp_newest[slot(b)];
+        *time = stamp_get(b, *index);
+
+        return *time != 0;
+    }
+
+    /* time of the first symbol of a block heard of */
+    uint64_t stamp_first(size_t b)
+    {
+        for (uint64_t time : m_stamps[slot(b)])
+            if (time)
+                return time;
+
+        return 0;
+    }
+
+    void stamp_clear(size_t b)
+    {
+        std::vector<uint64_t> &stamps = m_stamps[slot(b)];
+
+        std::fill(stamps.begin(), stamps.end(), 0);
+        m_stamp_newest[slot(b)] = 0;
+    }
+
+    size_t coders_free() const
+    {
+        return m_pool.size();
+    }
+
     static struct rank_hdr *header(uint8_t *data)
     {
         return reinterpret_cast<struct rank_hdr *>(data);
     }
 
     void get_status(uint8_t *data, size_t rank)
+    {
+        get_status(m_coder, data, rank);
+    }
+
+    void get_status(coder_pointer &c, uint8_t *data, size_t rank)
     {
         auto hdr = header(data);
 
         hdr->rank = htobe16(rank);
-        m_coder->write_feedback(hdr->status);
+        c->write_feedback(hdr->status);
     }
 
     void put_status(uint8_t *data, size_t *decoder_rank)
+    {
+        put_status(m_coder, data, decoder_rank);
+    }
+
+    void put_status(coder_pointer &c, uint8_t *data, size_t *decoder_rank)
     {
         auto hdr = header(data);
 
         *decoder_rank = be16toh(hdr->rank);
-        m_coder->read_feedback(hdr->status);
+        c->read_feedback(hdr->status);
     }
 
     static size_t read_rank(uint8_t *data)
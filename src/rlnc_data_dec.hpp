@@ -1,9 +1,17 @@
 #pragma once
 
 #include <cstring>
-
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "flight_recorder.hpp"
+#include "metrics.hpp"
+#include "pkt_clock.hpp"
+#include "probes.hpp"
 #include "rlnc_data_base.hpp"
 #include "stat_counter.hpp"
+#include "timer_wheel.hpp"
 
 template<class dec, class super>
 class rlnc_data_dec : public super, public rlnc_data_base<dec>
@@ -11,6 +19,18 @@ class rlnc_data_dec : public super, public rlnc_data_base<dec>
     typedef rlnc_data_base<dec> base;
     typedef typename super::buffer_ptr buf_ptr;
 
+    /* coders with mutable symbol storage decode straight into pool
+     * buffers, which are then handed out without a copy */
+    template<class coder> static auto
+    mutable_symbols(int) -> decltype(std::declval<coder &>().set_mutable_symbol(
+                                     0, sak::storage(static_cast<uint8_t *>(NULL),
+                                                     0)),
+                                     std::true_type());
+
+    template<class coder> static std::false_type mutable_symbols(...);
+
+    typedef decltype(mutable_symbols<dec>(0)) zero_copy;
+
     stat_counter m_block_count = {"dec blocks"};
     stat_counter m_decoded_count = {"dec packets"};
     stat_counter m_linear_count = {"dec linear"};
@@ -22,12 +42,44 @@ class rlnc_data_dec : public super, public rlnc_data_base<dec>
     stat_counter m_enc_count = {"dec recv enc"};
     stat_counter m_lin_5 = {"dec 5 linear"};
     stat_counter m_lin_10 = {"dec 10 linear"};
+    stat_counter m_ahead_count = {"dec ahead"};
+    stat_counter m_status_count = {"dec status"};
+
+    /* microseconds from ingress at the encoder to in order delivery here,
+     * and to the decoding of the whole block; from the timestamps in the
+     * rlnc headers (hdr_stamps), so only meaningful if the encoder runs
+     * on the same host or on a synchronized clock */
+    metric_histogram m_delivery = {"dec delivery us"};
+    metric_histogram m_generation = {"dec generation us"};
 
+    /* reports the rank of a block the encoder went quiet on */
+    wheel_timer m_status;
+
+    /* symbol buffers of each block in flight */
+    std::vector<buf_ptr> m_symbols[base::m_blocks];
     size_t m_decoded = 0;
     size_t m_linear = 0;
     size_t m_linear_block = 0;
     size_t m_late_pkts = 0;
 
+    /* ingress time of the last symbol handed out */
+    uint64_t m_delivered_stamp = 0;
+
+    static void record(metric_histogram &h, uint64_t stamp)
+    {
+        uint64_t now = pkt_clock::now();
+
+        if (now > stamp)
+            h.record((now - stamp)/1000);
+    }
+
+    static void flight(flight_recorder::event_type type, size_t block,
+                       size_t rank, size_t value = 0)
+    {
+        flight_recorder::record(flight_recorder::dec_layer, type, block, rank,
+                                value);
+    }
+
     bool validate_block(size_t block)
     {
         size_t diff = super::rlnc_hdr_block_diff(block);
@@ -35,12 +87,20 @@ class rlnc_data_dec : public super, public rlnc_data_base<dec>
         if (diff)
             ++m_diff_count;
 
-        if (diff > 8)
-            return false;
-        else if (diff)
-            throw std::runtime_error("off block");
+        return diff <= 8;
+    }
 
-        return true;
+    /* coder for a block at or after the one being output; blocks are
+     * decoded in any order but handed out in order */
+    typename base::coder_pointer &coder_get(size_t block)
+    {
+        bool fresh = !base::block_coder(block);
+        auto &coder = base::coder_acquire(block);
+
+        if (fresh && coder)
+            symbols_setup(block, zero_copy());
+
+        return coder;
     }
 
     bool validate_type(buf_ptr &buf)
@@ -94,55 +154,163 @@ class rlnc_data_dec : public super, public rlnc_data_base<dec>
     void send_ack(size_t b, size_t r)
     {
         buf_ptr buf = super::buffer();
+        auto &coder = base::block_coder(b);
 
         super::rlnc_hdr_add_ack(buf, b);
-        base::get_status(buf->data_put(base::hdr_len()), r);
+        base::get_status(coder ? coder : base::m_coder,
+                         buf->data_put(base::hdr_len()), r);
         super::write_pkt(buf);
+        NETMIX_PROBE2(dec_ack, b, r);
+        flight(flight_recorder::ack_sent_event, b, r);
         ++m_ack_count;
     }
 
-    void get_pkt(buf_ptr &buf)
+    void symbols_setup(size_t block, std::true_type)
+    {
+        auto &coder = base::block_coder(block);
+        auto &symbols = m_symbols[base::slot(block)];
+        size_t size = coder->symbol_size();
+
+        /* buffers still held by the writer belong to an old block and are
+         * returned to the pool once it lets go of them */
+        symbols.resize(coder->symbols());
+
+        for (size_t i = 0; i < symbols.size(); ++i) {
+            symbols[i] = super::buffer(size);
+            coder->set_mutable_symbol(i, sak::storage(symbols[i]->data(),
+                                                      size));
+        }
+    }
+
+    void symbols_setup(size_t, std::false_type)
+    {}
+
+    /* hand out the symbol with the head reserve of the caller, as the
+     * copy below does; the symbol stays where it was decoded, so the
+     * caller's offsets are not copied with reset(layout) */
+    void get_symbol(buf_ptr &buf, size_t size, std::true_type)
     {
-        size_t size = base::m_coder->symbol_size();
+        size_t reserved = buf->head_len();
+
+        buf = m_symbols[base::slot(super::rlnc_hdr_block())][m_decoded];
+        buf->reset();
+        buf->head_reserve(reserved);
+        buf->trim(size);
+    }
 
-        memcpy(buf->head(), base::m_coder->symbol(m_decoded++), size);
+    void get_symbol(buf_ptr &buf, size_t size, std::false_type)
+    {
+        memcpy(buf->head(), base::m_coder->symbol(m_decoded), size);
         buf->trim(size);
+    }
+
+    /* symbols whose time wasn't heard of take that of the one before,
+     * or of the first one known in the block */
+    void stamp_delivery(buf_ptr &buf)
+    {
+        size_t block = super::rlnc_hdr_block();
+        uint64_t stamp = base::stamp_get(block, m_decoded);
+
+        if (!stamp)
+            stamp = m_delivered_stamp;
+
+        if (!stamp)
+            stamp = base::stamp_first(block);
+
+        if (!stamp)
+            return;
+
+        record(m_delivery, stamp);
+        buf->stamp(stamp);
+        m_delivered_stamp = stamp;
+    }
+
+    void get_pkt(buf_ptr &buf)
+    {
+        get_symbol(buf, base::m_coder->symbol_size(), zero_copy());
+        stamp_delivery(buf);
+        m_decoded++;
         ++m_decoded_count;
     }
 
     void put_pkt(buf_ptr &buf)
     {
-        size_t rank;
+        size_t rank, index;
         size_t block = super::rlnc_hdr_block(buf);
+        uint64_t time;
+        bool complete;
 
         if (!validate_block(block)) {
+            flight(flight_recorder::late_event, block, 0);
+
             if (m_late_pkts++ % 5 == 1)
                 send_ack(block, base::m_coder->symbols());
             return;
         }
 
+        auto &coder = coder_get(block);
+
+        /* too far ahead of the block being output; the encoder resends */
+        if (!coder) {
+            flight(flight_recorder::ahead_event, block, 0);
+            ++m_ahead_count;
+            return;
+        }
+
         assert(buf->data_val() % 4u == 0);
         assert(buf->data_len() >= super::rlnc_symbol_size());
 
-        rank = base::m_coder->rank();
+        if (super::rlnc_hdr_get_stamp(buf, &index, &time))
+            base::stamp_put(block, index, time);
+
+        rank = coder->rank();
+        complete = coder->is_complete();
         super::rlnc_hdr_del(buf);
-        base::m_coder->decode(buf->head());
+        coder->decode(buf->head());
 
-        assert(base::m_coder->rank() <= base::m_coder->remote_rank());
+        if (!complete && coder->is_complete() &&
+            (time = base::stamp_first(block)))
+            record(m_generation, time);
 
-        if (base::m_coder->rank() == rank) {
+        assert(coder->rank() <= coder->remote_rank());
+
+        if (block == super::rlnc_hdr_block())
+            super::timer_start(m_status);
+
+        /* let the encoder retire blocks completed out of order; the block
+         * being output is acked from read_pkt() */
+        if (block != super::rlnc_hdr_block() && coder->is_complete())
+            send_ack(block, coder->rank());
+
+        if (coder->rank() == rank) {
+            NETMIX_PROBE2(dec_linear, block, rank);
+            flight(flight_recorder::linear_event, block, rank,
+                   coder->remote_rank());
             ++m_linear;
             ++m_linear_block;
             ++m_linear_count;
         } else {
+            NETMIX_PROBE2(dec_rank, block, coder->rank());
+            flight(flight_recorder::rank_event, block, coder->rank(),
+                   coder->remote_rank());
             m_linear = 0;
         }
 
         if (m_linear < 50)
             return;
 
-        std::cout << "emergency ack " << base::m_coder->rank() << std::endl;
+        std::cout << "emergency ack " << coder->rank() << std::endl;
+        flight(flight_recorder::emergency_event, block, coder->rank());
+        send_ack(block, coder->rank());
+    }
+
+    void status()
+    {
+        if (is_complete() || !base::m_coder->rank())
+            return;
+
         send_ack(super::rlnc_hdr_block(), base::m_coder->rank());
+        ++m_status_count;
     }
 
     void process_rank()
@@ -153,8 +321,12 @@ class rlnc_data_dec : public super, public rlnc_data_base<dec>
 
     void increment()
     {
-        base::increment();
+        size_t block = super::rlnc_hdr_block();
+
+        base::coder_release(block);
+        m_symbols[base::slot(block)].clear();
         super::increment();
+        base::m_coder = coder_get(super::rlnc_hdr_block());
 
         if (m_linear_block >= 10)
             ++m_lin_10;
@@ -165,26 +337,33 @@ class rlnc_data_dec : public super, public rlnc_data_base<dec>
         m_linear = 0;
         m_linear_block = 0;
         m_late_pkts = 0;
+        m_delivered_stamp = 0;
         ++m_block_count;
+        flight(flight_recorder::increment_event, super::rlnc_hdr_block(), 0);
     }
 
   public:
     template<typename... Args> explicit
     rlnc_data_dec(const Args&... args)
         : super(args...),
-          base(super::rlnc_symbols(), super::rlnc_symbol_size())
-    {}
+          base(super::rlnc_symbols(), super::rlnc_symbol_size(),
+               super::rlnc_generations())
+    {
+        symbols_setup(super::rlnc_hdr_block(), zero_copy());
+        m_status.callback([this]() { status(); });
+    }
 
     bool read_pkt(buf_ptr &buf_out)
     {
         buf_ptr buf_in = super::buffer();
 
-        if (!is_done() && is_partial_complete()) {
+        /* the next block may already be decoded */
+        if (is_done())
+            increment();
+
+        if (is_partial_complete()) {
             get_pkt(buf_out);
             return true;
-        } else if (is_done()) {
-            increment();
-            return false;
         }
 
         while (true) {
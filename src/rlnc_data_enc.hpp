@@ -1,7 +1,14 @@
 #pragma once
 
+#include <algorithm>
+#include <vector>
+
+#include "flight_recorder.hpp"
+#include "pkt_clock.hpp"
+#include "probes.hpp"
 #include "rlnc_data_base.hpp"
 #include "stat_counter.hpp"
+#include "timer_wheel.hpp"
 
 template<class enc, class super>
 class rlnc_data_enc : public super, public rlnc_data_base<enc>
@@ -17,31 +24,71 @@ class rlnc_data_enc : public super, public rlnc_data_base<enc>
     stat_counter m_timeout_count = {"enc timeouts"};
     stat_counter m_interrupted = {"enc interrupted"};
 
-    size_t m_decoder_rank = 0;
+    /* buffers handed to a coder are kept until its block is acked */
+    std::vector<buf_ptr> m_symbols[base::m_blocks];
+    size_t m_decoder_rank[base::m_blocks] = {0};
+    size_t m_oldest = 0;
     bool m_stopped = false;
 
-    bool validate_block(size_t block)
+    /* ack timeout of each block in flight */
+    wheel_timer m_repair[base::m_blocks];
+    static constexpr size_t m_repair_max = 5;
+
+    /* ends a stop the relay didn't follow up with an ack in time */
+    wheel_timer m_stop;
+
+    static void flight(flight_recorder::event_type type, size_t block,
+                       size_t rank, size_t value = 0)
     {
-        size_t diff = super::rlnc_hdr_block_diff(block);
+        flight_recorder::record(flight_recorder::enc_layer, type, block, rank,
+                                value);
+    }
 
-        if (diff)
-            ++m_late_count;
+    size_t block_next(size_t b)
+    {
+        return b + 1;
+    }
 
-        if (diff > 8)
-            return false;
-        else if (diff == 0)
-            return true;
+    size_t block_span(size_t from, size_t to)
+    {
+        return to - from;
+    }
 
-        throw std::runtime_error("off block");
+    bool in_flight(size_t b)
+    {
+        size_t span = block_span(m_oldest, super::rlnc_hdr_block());
+
+        return block_span(m_oldest, b) <= span && base::block_coder(b);
     }
 
-    void get_pkt(buf_ptr &buf)
+    /* packets of a block being filled carry the ingress time of its
+     * newest symbol, the ones sent after it is full that of the first */
+    void add_stamp(buf_ptr &buf, size_t block)
     {
-        size_t len, max_len = base::m_coder->payload_size();
+        auto &symbols = m_symbols[base::slot(block)];
+        size_t index = 0;
+
+        if (symbols.empty())
+            return;
+
+        if (symbols.size() < super::rlnc_symbols())
+            index = symbols.size() - 1;
+
+        super::rlnc_hdr_add_stamp(buf, index, symbols[index]->stamp());
+    }
 
-        len = base::m_coder->encode(buf->data_put(max_len));
+    void get_pkt(buf_ptr &buf, size_t block)
+    {
+        auto &coder = base::block_coder(block);
+        size_t len, max_len = coder->payload_size();
+
+        len = coder->encode(buf->data_put(max_len));
         buf->data_trim(len);
-        super::rlnc_hdr_add_enc(buf);
+        super::rlnc_hdr_add_enc(buf, block);
+
+        if (super::rlnc_hdr_stamping())
+            add_stamp(buf, block);
+
         ++m_pkt_count;
     }
 
@@ -50,43 +97,159 @@ class rlnc_data_enc : public super, public rlnc_data_base<enc>
         assert(buf->head_val() % 4u == 0);
 
         sak::const_storage symbol(buf->head(), buf->len());
+        size_t index = base::m_coder->symbols_initialized();
 
-        base::m_coder->set_symbol(base::m_coder->symbols_initialized(), symbol);
+        base::m_coder->set_symbol(index, symbol);
+        NETMIX_PROBE2(enc_symbol, super::rlnc_hdr_block(), index);
+        flight(flight_recorder::symbol_event, super::rlnc_hdr_block(),
+               base::m_coder->rank(), index);
         super::increase_budget();
+
+        /* take the buffer and give the caller a fresh one to read into */
+        m_symbols[base::slot(super::rlnc_hdr_block())].push_back(buf);
+        buf = super::buffer();
     }
 
+    /* blocks are retired as soon as they are acked, even if older ones are
+     * still in flight */
+    void retire(size_t block)
+    {
+        size_t current = super::rlnc_hdr_block();
+
+        flight(flight_recorder::retire_event, block,
+               m_decoder_rank[base::slot(block)]);
+        super::timer_stop(m_repair[base::slot(block)]);
+        base::coder_release(block);
+        m_symbols[base::slot(block)].clear();
+        m_decoder_rank[base::slot(block)] = 0;
+        ++m_block_count;
+
+        while (m_oldest != current && !base::block_coder(m_oldest))
+            m_oldest = block_next(m_oldest);
+    }
+
+    /* start the next block once the current one is full, a coder is free
+     * and the oldest block in flight is within the generations the decoder
+     * holds coders for, counted from the block it outputs next */
     void increment()
     {
-        m_stopped = false;
-        m_decoder_rank = 0;
-        base::increment();
+        size_t next = block_next(super::rlnc_hdr_block());
+
+        if (base::m_coder->rank() < base::m_coder->symbols())
+            return;
+
+        if (!base::coders_free())
+            return;
+
+        if (!base::block_coder(m_oldest))
+            m_oldest = next;
+
+        if (block_span(m_oldest, next) >= super::rlnc_generations())
+            return;
+
         super::increment();
-        ++m_block_count;
+        base::m_coder = base::coder_acquire(next);
+        m_stopped = false;
+        super::timer_stop(m_stop);
+        flight(flight_recorder::increment_event, next, 0);
     }
 
     void process_ack(buf_ptr &buf)
     {
         size_t block = super::rlnc_hdr_block(buf);
+        size_t *rank = &m_decoder_rank[base::slot(block)];
 
-        if (!validate_block(block)) {
+        if (!in_flight(block)) {
+            flight(flight_recorder::late_event, block, 0);
+            ++m_late_count;
             return;
         }
 
         ++m_ack_count;
-        base::put_status(buf->data(), &m_decoder_rank);
+        base::put_status(base::block_coder(block), buf->data(), rank);
+        NETMIX_PROBE2(enc_ack, block, *rank);
+        flight(flight_recorder::ack_event, block, *rank);
 
-        if (m_decoder_rank < super::rlnc_symbols())
+        if (*rank < super::rlnc_symbols()) {
+            super::timer_start(m_repair[base::slot(block)]);
             return;
+        }
 
+        retire(block);
         increment();
     }
 
+    /* top up a block the decoder hasn't acked in time with what it is
+     * known to be missing */
+    void repair(size_t block)
+    {
+        auto &coder = base::block_coder(block);
+        size_t missing;
+        buf_ptr buf;
+
+        if (!coder || coder->symbols_initialized() == 0)
+            return;
+
+        /* try again once the stop is over */
+        if (m_stopped) {
+            super::timer_start(m_repair[base::slot(block)]);
+            return;
+        }
+
+        missing = coder->rank() - m_decoder_rank[base::slot(block)];
+
+        if (!missing)
+            return;
+
+        for (size_t i = 0; i < std::min(missing, m_repair_max); ++i) {
+            buf = super::buffer();
+            get_pkt(buf, block);
+            super::write_pkt(buf);
+        }
+
+        flight(flight_recorder::timeout_event, block,
+               m_decoder_rank[base::slot(block)],
+               std::min(missing, m_repair_max));
+        ++m_timeout_count;
+        super::timer_start(m_repair[base::slot(block)]);
+    }
+
+    void repair_slot(size_t slot)
+    {
+        size_t end = block_next(super::rlnc_hdr_block());
+
+        for (size_t b = m_oldest; b != end; b = block_next(b))
+            if (base::slot(b) == slot)
+                repair(b);
+    }
+
+    /* the ack that would have released a stop was lost on its way back;
+     * repair the blocks in flight until the relay acks or stops again */
+    void resume()
+    {
+        size_t end = block_next(super::rlnc_hdr_block());
+
+        m_stopped = false;
+
+        for (size_t b = m_oldest; b != end; b = block_next(b))
+            repair(b);
+    }
+
   public:
     template<typename... Args> explicit
     rlnc_data_enc(const Args&... args)
         : super(args...),
-          base(super::rlnc_symbols(), super::rlnc_symbol_size())
-    {}
+          base(super::rlnc_symbols(), super::rlnc_symbol_size(),
+               super::rlnc_generations())
+    {
+        for (auto &symbols : m_symbols)
+            symbols.reserve(super::rlnc_symbols());
+
+        for (size_t i = 0; i < base::m_blocks; ++i)
+            m_repair[i].callback([this, i]() { repair_slot(i); });
+
+        m_stop.callback([this]() { resume(); });
+    }
 
     size_t data_size_max()
     {
@@ -106,10 +269,16 @@ class rlnc_data_enc : public super, public rlnc_data_base<enc>
     bool write_pkt(buf_ptr &buf_in)
     {
         buf_ptr buf_out = super::buffer();
+        size_t block = super::rlnc_hdr_block();
+
+        /* not stamped by the layer it was read from */
+        if (super::rlnc_hdr_stamping() && !buf_in->stamp())
+            buf_in->stamp(pkt_clock::now());
+
         put_pkt(buf_in);
 
         if (base::m_coder->rank() < super::rlnc_symbols()) {
-            get_pkt(buf_out);
+            get_pkt(buf_out, block);
             if (!super::write_pkt(buf_out)) {
                 ++m_pkt_fail;
                 return false;
@@ -128,7 +297,11 @@ class rlnc_data_enc : public super, public rlnc_data_base<enc>
                 break;
             }
 
-            get_pkt(buf_out);
+            /* acked while spending the budget */
+            if (!base::block_coder(block))
+                break;
+
+            get_pkt(buf_out, block);
 
             if (!super::write_pkt(buf_out)) {
                 ++m_pkt_fail;
@@ -137,6 +310,11 @@ class rlnc_data_enc : public super, public rlnc_data_base<enc>
 
         } while (super::decrease_budget());
 
+        if (base::block_coder(block))
+            super::timer_start(m_repair[base::slot(block)]);
+
+        increment();
+
         return true;
     }
 
@@ -155,7 +333,10 @@ class rlnc_data_enc : public super, public rlnc_data_base<enc>
 
             case super::rlnc_stop:
                 std::cout << "enc stopped" << std::endl;
+                flight(flight_recorder::stop_event, super::rlnc_hdr_block(),
+                       base::m_coder->rank());
                 m_stopped = true;
+                super::timer_start(m_stop);
                 return false;
 
             default:
@@ -169,24 +350,40 @@ class rlnc_data_enc : public super, public rlnc_data_base<enc>
 
     void timer()
     {
+        size_t end = block_next(super::rlnc_hdr_block());
+        bool sent = false;
         buf_ptr buf;
+
         super::timer();
 
-        if (base::m_coder->symbols_initialized() == 0)
+        /* blocks are repaired from their own timers */
+        if (super::timers_enabled())
             return;
 
-        if (m_decoder_rank == base::m_coder->rank())
-            return;
+        /* idle while stopped, so the ack releasing the stop was lost */
+        m_stopped = false;
 
-        if (m_stopped)
-            return;
+        for (size_t b = m_oldest; b != end; b = block_next(b)) {
+            auto &coder = base::block_coder(b);
 
-        for (size_t i = 0; i < 5; ++i) {
-            buf = super::buffer();
-            get_pkt(buf);
-            super::write_pkt(buf);
+            if (!coder || coder->symbols_initialized() == 0)
+                continue;
+
+            if (m_decoder_rank[base::slot(b)] == coder->rank())
+                continue;
+
+            for (size_t i = 0; i < 5; ++i) {
+                buf = super::buffer();
+                get_pkt(buf, b);
+                super::write_pkt(buf);
+            }
+
+            flight(flight_recorder::timeout_event, b,
+                   m_decoder_rank[base::slot(b)], 5);
+            sent = true;
         }
 
-        ++m_timeout_count;
+        if (sent)
+            ++m_timeout_count;
     }
 };
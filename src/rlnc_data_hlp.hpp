@@ -1,5 +1,7 @@
 #pragma once
 
+#include "flight_recorder.hpp"
+#include "probes.hpp"
 #include "rlnc_data_base.hpp"
 #include "stat_counter.hpp"
 
@@ -8,6 +10,7 @@ class rlnc_data_hlp : public super, public rlnc_data_base<recoder>
 {
     typedef rlnc_data_base<recoder> base;
     typedef typename super::buffer_ptr buf_ptr;
+    typedef typename base::coder_pointer coder_pointer;
 
     stat_counter m_enc_count = {"hlp recv packets"};
     stat_counter m_hlp_count = {"hlp send packets"};
@@ -18,88 +21,126 @@ class rlnc_data_hlp : public super, public rlnc_data_base<recoder>
     stat_counter m_off_count = {"hlp off block"};
 
     size_t m_decoder_rank = 0;
-    size_t m_hlp_packets = 0;
+    size_t m_hlp_packets[base::m_blocks] = {0};
+
+    static void flight(flight_recorder::event_type type, size_t block,
+                       size_t rank, size_t value = 0)
+    {
+        flight_recorder::record(flight_recorder::hlp_layer, type, block, rank,
+                                value);
+    }
 
     bool validate_block(size_t block)
     {
         size_t diff = super::rlnc_hdr_block_diff(block);
 
         if (diff > 8) {
+            flight(flight_recorder::late_event, block, 0);
             ++m_late_count;
             return false;
-        } else if (diff) {
-            ++m_off_count;
-            increment(block);
-            return false;
         }
 
         return true;
     }
 
-    void put_pkt(buf_ptr &buf)
+    /* coder for a block, giving up the oldest blocks when the encoder has
+     * moved on and all coders are taken */
+    coder_pointer &coder_get(size_t block)
     {
-        size_t rank = base::m_coder->rank();
+        bool fresh = !base::block_coder(block);
+
+        while (!base::coder_acquire(block)) {
+            ++m_off_count;
+            increment();
+        }
+
+        coder_pointer &coder = base::block_coder(block);
+
+        if (fresh)
+            coder->set_systematic_off();
+
+        return coder;
+    }
+
+    void put_pkt(coder_pointer &coder, size_t block, buf_ptr &buf)
+    {
+        size_t rank = coder->rank();
+        size_t index;
+        uint64_t time;
+
+        /* passed on in the helper packets */
+        if (super::rlnc_hdr_get_stamp(buf, &index, &time))
+            base::stamp_put(block, index, time);
 
         super::rlnc_hdr_del(buf);
-        base::m_coder->decode(buf->data());
+        coder->decode(buf->data());
         ++m_enc_count;
 
-        if (base::m_coder->rank() > rank &&
-            base::m_coder->rank() > super::threshold())
+        if (coder->rank() > rank && coder->rank() > super::threshold())
             super::increase_budget();
 
-        if (base::m_coder->rank() == rank)
+        if (coder->rank() == rank) {
+            flight(flight_recorder::linear_event, block, rank,
+                   coder->remote_rank());
             ++m_linear_count;
+        } else {
+            flight(flight_recorder::rank_event, block, coder->rank(),
+                   coder->remote_rank());
+        }
     }
 
-    void get_pkt(buf_ptr &buf)
+    void get_pkt(coder_pointer &coder, size_t block, buf_ptr &buf)
     {
-        size_t len, max_len = base::m_coder->payload_size();
+        size_t len, max_len = coder->payload_size();
+        size_t index;
+        uint64_t time;
 
-        len = base::m_coder->recode(buf->data_put(max_len));
+        len = coder->recode(buf->data_put(max_len));
         buf->data_trim(len);
-        super::rlnc_hdr_add_hlp(buf);
+        super::rlnc_hdr_add_hlp(buf, block);
+
+        if (base::stamp_newest(block, &index, &time))
+            super::rlnc_hdr_add_stamp(buf, index, time);
+
         ++m_hlp_count;
-        ++m_hlp_packets;
+        ++m_hlp_packets[base::slot(block)];
     }
 
     void process_ack(buf_ptr &buf)
     {
         size_t block = super::rlnc_hdr_block(buf);
+        coder_pointer &coder = base::block_coder(block);
 
-        if (!validate_block(block))
+        if (!validate_block(block) || !coder)
             return;
 
-        base::put_status(buf->data(), &m_decoder_rank);
+        base::put_status(coder, buf->data(), &m_decoder_rank);
+        NETMIX_PROBE2(hlp_ack, block, m_decoder_rank);
+        flight(flight_recorder::ack_event, block, m_decoder_rank);
         ++m_ack_count;
     }
 
+    /* drop the oldest block; the budget is shared by all blocks */
     void increment()
     {
-        base::increment();
-        super::increment();
-        base::m_coder->set_systematic_off();
-        m_decoder_rank = 0;
-        m_hlp_packets = 0;
-        ++m_block_count;
-    }
+        size_t block = super::rlnc_hdr_block();
 
-    void increment(size_t block)
-    {
-        base::increment(block);
-        super::increment(block);
-        base::m_coder->set_systematic_off();
+        base::coder_release(block);
+        super::increment();
         m_decoder_rank = 0;
-        m_hlp_packets = 0;
+        m_hlp_packets[base::slot(block)] = 0;
         ++m_block_count;
+        flight(flight_recorder::increment_event, super::rlnc_hdr_block(), 0);
     }
 
   public:
     template<typename... Args> explicit
     rlnc_data_hlp(const Args&... args)
         : super(args...),
-          base(super::rlnc_symbols(), super::rlnc_symbol_size())
+          base(super::rlnc_symbols(), super::rlnc_symbol_size(),
+               super::rlnc_generations())
     {
+        base::m_coder->set_systematic_off();
     }
 
     bool write_pkt(buf_ptr &buf_in)
@@ -116,18 +157,20 @@ class rlnc_data_hlp : public super, public rlnc_data_base<recoder>
         if (!validate_block(block))
             return false;
 
-        put_pkt(buf_in);
+        coder_pointer &coder = coder_get(block);
+
+        put_pkt(coder, block, buf_in);
 
-        if (base::m_coder->rank() < super::threshold())
+        if (coder->rank() < super::threshold())
             return true;
 
-        if (m_hlp_packets > super::budget_max())
+        if (m_hlp_packets[base::slot(block)] > super::budget_max())
             return true;
 
         buf_out = super::buffer();
 
         do {
-            get_pkt(buf_out);
+            get_pkt(coder, block, buf_out);
             super::write_pkt(buf_out);
             buf_out->reset();
         } while (super::decrease_budget());
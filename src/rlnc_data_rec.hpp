@@ -1,120 +1,201 @@
 #pragma once
 
+#include <cstdint>
+
+#include "flight_recorder.hpp"
 #include "rlnc_data_base.hpp"
 #include "kwargs.hpp"
+#include "probes.hpp"
+#include "timer_wheel.hpp"
 
 template<class recoder, class super>
 class rlnc_data_rec : public super, public rlnc_data_base<recoder>
 {
     typedef typename super::buffer_ptr buf_ptr;
     typedef rlnc_data_base<recoder> base;
+    typedef typename base::coder_pointer coder_pointer;
+
+    static constexpr size_t m_window = 8;
 
-    size_t m_encoder_rank = 0;
-    size_t m_decoder_rank = 0;
+    /* blocks acked before the older ones, skipped when those complete */
+    uint16_t m_retired = 0;
+    size_t m_encoder_rank[base::m_blocks] = {0};
+    size_t m_decoder_rank[base::m_blocks] = {0};
     size_t m_linear = 0;
+    size_t m_late_pkts = 0;
     bool m_stopped = false;
 
+    /* fires when a block went quiet before the decoder caught up */
+    wheel_timer m_repair[base::m_blocks];
+
+    static void flight(flight_recorder::event_type type, size_t block,
+                       size_t rank, size_t value = 0)
+    {
+        flight_recorder::record(flight_recorder::rec_layer, type, block, rank,
+                                value);
+    }
+
+    static uint16_t block_bit(size_t block)
+    {
+        return 1u << base::slot(block);
+    }
+
     bool validate_block(size_t block)
     {
         size_t diff = super::rlnc_hdr_block_diff(block);
 
-        if (diff > 8)
+        if (diff > m_window)
             return false;
-        else if (diff)
-            throw std::runtime_error("off block");
 
-        return true;
+        return !(m_retired & block_bit(block));
     }
 
-    bool is_complete() const
-    {
-        return base::m_coder->is_complete();
-    }
-
-    void spend_budget()
+    /* the budget is shared by all blocks in flight */
+    void spend_budget(coder_pointer &coder, size_t block)
     {
         buf_ptr buf = super::buffer();
 
         do {
-            get_pkt(buf);
+            get_pkt(coder, block, buf);
             super::write_pkt(buf);
             buf->reset();
         } while (super::decrease_budget());
     }
 
-    void put_pkt(buf_ptr &buf)
+    void put_pkt(coder_pointer &coder, size_t block, buf_ptr &buf)
     {
-        size_t rank = base::m_coder->rank();
+        size_t rank = coder->rank();
+        size_t index;
+        uint64_t time;
+
+        /* passed on in the recoded packets */
+        if (super::rlnc_hdr_get_stamp(buf, &index, &time))
+            base::stamp_put(block, index, time);
 
         super::rlnc_hdr_del(buf);
-        base::m_coder->decode(buf->data());
-        m_encoder_rank = base::m_coder->remote_rank();
+        coder->decode(buf->data());
+        m_encoder_rank[base::slot(block)] = coder->remote_rank();
 
-        if (base::m_coder->rank() > rank) {
+        if (coder->rank() > rank) {
+            NETMIX_PROBE2(rec_rank, block, coder->rank());
+            flight(flight_recorder::rank_event, block, coder->rank(),
+                   coder->remote_rank());
             super::increase_budget();
             m_linear = 0;
         } else {
+            NETMIX_PROBE2(rec_linear, block, rank);
+            flight(flight_recorder::linear_event, block, rank,
+                   coder->remote_rank());
             m_linear++;
         }
     }
 
-    void get_pkt(buf_ptr &buf)
+    void get_pkt(coder_pointer &coder, size_t block, buf_ptr &buf)
     {
-        size_t len, max_len = base::m_coder->payload_size();
+        size_t len, max_len = coder->payload_size();
+        size_t index;
+        uint64_t time;
 
-        len = base::m_coder->recode(buf->data_put(max_len));
+        len = coder->recode(buf->data_put(max_len));
         buf->data_trim(len);
-        super::rlnc_hdr_add_rec(buf);
+        super::rlnc_hdr_add_rec(buf, block);
+
+        if (base::stamp_newest(block, &index, &time))
+            super::rlnc_hdr_add_stamp(buf, index, time);
     }
 
     void process_ack(buf_ptr &buf)
     {
         size_t block = super::rlnc_hdr_block(buf);
+        coder_pointer &coder = base::block_coder(block);
 
-        if (!validate_block(block))
+        if (!validate_block(block) || !coder)
             return;
 
-        base::put_status(buf->data(), &m_decoder_rank);
-        std::cout << "rec ack rank " << m_decoder_rank << std::endl;
+        size_t *rank = &m_decoder_rank[base::slot(block)];
 
-        if (m_decoder_rank < super::rlnc_symbols())
+        base::put_status(coder, buf->data(), rank);
+        NETMIX_PROBE2(rec_ack, block, *rank);
+        flight(flight_recorder::ack_event, block, *rank);
+        std::cout << "rec ack rank " << *rank << std::endl;
+
+        if (*rank < super::rlnc_symbols())
             return;
 
         std::cout << "rec ack block " << block << std::endl;
-        increment();
+        retire(block);
     }
 
     void process_stop(buf_ptr &buf)
     {
         std::cout << "rec stopped" << std::endl;
+        flight(flight_recorder::stop_event, super::rlnc_hdr_block(), 0);
         m_stopped = true;
     }
 
-    void increment()
+    void retire(size_t block)
     {
-        base::increment();
-        super::increment();
-        m_decoder_rank = 0;
-        m_encoder_rank = 0;
-        m_stopped = false;
+        flight(flight_recorder::retire_event, block,
+               m_decoder_rank[base::slot(block)]);
+        super::timer_stop(m_repair[base::slot(block)]);
+        base::coder_release(block);
+        m_decoder_rank[base::slot(block)] = 0;
+        m_encoder_rank[base::slot(block)] = 0;
+        m_retired |= block_bit(block);
+
+        while (m_retired & block_bit(super::rlnc_hdr_block()))
+            increment();
     }
 
-    void increment(size_t block)
+    bool repair(size_t b)
     {
-        base::increment(block);
-        super::increment(block);
-        m_decoder_rank = 0;
-        m_encoder_rank = 0;
-        m_stopped = false;
+        coder_pointer &coder = base::block_coder(b);
+
+        if (!coder || m_decoder_rank[base::slot(b)] ==
+                      m_encoder_rank[base::slot(b)])
+            return false;
+
+        flight(flight_recorder::timeout_event, b,
+               m_decoder_rank[base::slot(b)]);
+        super::increase_budget();
+        spend_budget(coder, b);
+
+        return true;
+    }
+
+    void repair_slot(size_t slot)
+    {
+        size_t block = super::rlnc_hdr_block();
+
+        for (size_t i = 0; i <= m_window; ++i) {
+            if (base::slot(block + i) != slot)
+                continue;
+
+            if (repair(block + i))
+                super::timer_start(m_repair[slot]);
+
+            return;
+        }
     }
 
+    void increment()
+    {
+        m_retired &= ~block_bit(super::rlnc_hdr_block());
+        super::increment();
+        m_stopped = false;
+        flight(flight_recorder::increment_event, super::rlnc_hdr_block(), 0);
+    }
 
   public:
     template<typename... Args> explicit
     rlnc_data_rec(const Args&... args)
         : super(args...),
-          base(super::rlnc_symbols(), super::rlnc_symbol_size())
-    {}
+          base(super::rlnc_symbols(), super::rlnc_symbol_size(),
+               super::rlnc_generations())
+    {
+        for (size_t i = 0; i < base::m_blocks; ++i)
+            m_repair[i].callback([this, i]() { repair_slot(i); });
+    }
 
     void stop()
     {
@@ -124,9 +205,22 @@ class rlnc_data_rec : public super, public rlnc_data_base<recoder>
         super::write_pkt(buf);
     }
 
+    /* no room for another block until one of the complete ones is acked */
     bool is_full()
     {
-        return base::m_coder->is_complete();
+        size_t block = super::rlnc_hdr_block();
+
+        if (base::coders_free())
+            return false;
+
+        for (size_t i = 0; i <= m_window; ++i) {
+            coder_pointer &coder = base::block_coder(block + i);
+
+            if (coder && !coder->is_complete())
+                return false;
+        }
+
+        return true;
     }
 
     bool write_pkt(buf_ptr &buf)
@@ -148,18 +242,34 @@ class rlnc_data_rec : public super, public rlnc_data_base<recoder>
                 return false;
         }
 
-        if (!validate_block(block))
+        /* the decoder acked this block already, but the encoder still
+         * sends it, so the ack forwarded to it may have been lost: pass
+         * some of its packets on for the decoder to ack again */
+        if (!validate_block(block)) {
+            flight(flight_recorder::late_event, block, 0);
+
+            if (m_late_pkts++ % 5 == 0)
+                return super::write_pkt(buf);
+
+            return false;
+        }
+
+        coder_pointer &coder = base::coder_acquire(block);
+
+        /* every coder is busy with an older block */
+        if (!coder)
             return false;
 
-        if (is_full())
+        if (coder->is_complete())
             return true;
 
-        put_pkt(buf);
+        put_pkt(coder, block, buf);
+        super::timer_start(m_repair[base::slot(block)]);
 
         if (m_stopped)
             return true;
 
-        spend_budget();
+        spend_budget(coder, block);
 
         return true;
     }
@@ -194,12 +304,14 @@ class rlnc_data_rec : public super, public rlnc_data_base<recoder>
 
     void timer()
     {
+        size_t block = super::rlnc_hdr_block();
+
         super::timer();
 
-        if (m_decoder_rank == m_encoder_rank)
+        if (super::timers_enabled())
             return;
 
-        super::increase_budget();
-        spend_budget();
+        for (size_t i = 0; i <= m_window; ++i)
+            repair(block + i);
     }
 };
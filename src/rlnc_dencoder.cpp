@@ -1,6 +1,7 @@
 #include <functional>
 #include <cstring>
 #include <getopt.h>
+#include <thread>
 
 #include "signal.hpp"
 #include "rlnc_codes.hpp"
@@ -9,19 +10,26 @@
 #include "rlnc_data_enc.hpp"
 #include "rlnc_data_dec.hpp"
 #include "rlnc_hdr.hpp"
+#include "timers.hpp"
 #include "budgets.hpp"
 #include "loss.hpp"
 #include "eth_hdr.hpp"
+#include "error_estimator.hpp"
 #include "eth_topology.hpp"
 #include "eth_sock.hpp"
+#include "burst_read.hpp"
+#include "burst_write.hpp"
+#include "pipeline.hpp"
 #include "tcp_hdr.hpp"
 #include "tcp_sock.hpp"
 #include "error_info.hpp"
 #include "rlnc_info.hpp"
 #include "buffer_pkt.hpp"
-#include "buffer_pool.hpp"
+#include "slab_pool.hpp"
 #include "final_layer.hpp"
+#include "flight_recorder.hpp"
 #include "io.hpp"
+#include "metrics_export.hpp"
 #include "stat_counter.hpp"
 
 struct args
@@ -58,6 +66,35 @@ struct args
 
     /* ratio to multiply source budget with */
     double overshoot            = 1.05;
+
+    /* weight of the newest packet in the error estimates (0 keeps the
+     * error probabilities above) */
+    double estimate             = .01;
+
+    /* coding threads next to the I/O thread (0 runs all in one loop) */
+    size_t  threads             = 0;
+
+    /* blocks in flight at a time */
+    size_t  generations         = 1;
+
+    /* header format to negotiate (0 compact, 1 16 bit, 2 32 bit) */
+    int     hdr_format          = 0;
+
+    /* carry ingress timestamps in the headers, if the peers ask too */
+    int     hdr_stamps          = 0;
+
+    /* flow id carried in the wide header formats */
+    size_t  flow_id             = 0;
+
+    /* coder to use (kodo, binary or binary8) */
+    char    coder[10]           = "kodo";
+
+    /* Unix socket to serve metrics on while running (none if NULL) */
+    char    *metrics            = NULL;
+
+    /* file to dump the flight recorder to, on SIGUSR2, on failure and at
+     * exit (not recording if NULL) */
+    char    *flight             = NULL;
 };
 
 static struct option options[] = {
@@ -75,57 +112,106 @@ static struct option options[] = {
     {"e4",          required_argument, NULL, 12},
     {"timeout",     required_argument, NULL, 13},
     {"overshoot",   required_argument, NULL, 14},
+    {"threads",     required_argument, NULL, 15},
+    {"generations", required_argument, NULL, 16},
+    {"hdr_format",  required_argument, NULL, 17},
+    {"flow_id",     required_argument, NULL, 18},
+    {"coder",       required_argument, NULL, 19},
+    {"estimate",    required_argument, NULL, 20},
+    {"metrics",     required_argument, NULL, 21},
+    {"hdr_stamps",  required_argument, NULL, 22},
+    {"flight",      required_argument, NULL, 23},
     {0}
 };
 
-typedef tcp_hdr<
+typedef pipeline<
+        tcp_hdr<
         tcp_sock_client<
-        buffer_pool<buffer_pkt,
+        slab_pool<buffer_pkt,
         final_layer
-        >>> client_stack;
+        >>>> client_stack;
 
-typedef eth_filter_enc<
+template<class codes>
+using enc_stack = eth_filter_enc<
         len_hdr<
-        rlnc_data_enc<kodo::sliding_window_encoder<fifi::binary>,
+        rlnc_data_enc<typename codes::encoder,
         rlnc_hdr<
+        timers<
         source_budgets<
+        pipeline<
         eth_hdr<
+        error_estimator<
         eth_topology<
+        burst_read<
+        burst_write<
         eth_sock<
         error_info<
         rlnc_info<
-        buffer_pool<buffer_pkt,
+        slab_pool<buffer_pkt,
         final_layer
-        >>>>>>>>>>> enc_stack;
+        >>>>>>>>>>>>>>>>;
 
-typedef eth_filter_dec<
+template<class codes>
+using dec_stack = eth_filter_dec<
         len_hdr<
-        rlnc_data_dec<kodo::sliding_window_decoder<fifi::binary>,
+        rlnc_data_dec<typename codes::decoder,
         rlnc_hdr<
+        timers<
+        pipeline<
         eth_hdr<
         loss_dec<
         eth_topology<
+        burst_read<
         eth_sock<
         error_info<
         rlnc_info<
-        buffer_pool<buffer_pkt,
+        slab_pool<buffer_pkt,
         final_layer
-        >>>>>>>>>>> dec_stack;
+        >>>>>>>>>>>>>>;
 
+template<class codes>
 class rlnc_dencoder : public signal, public io
 {
+    typedef ::enc_stack<codes> enc_stack;
+    typedef ::dec_stack<codes> dec_stack;
+
     int m_timeout;
+    size_t m_threads;
+
+    /* loops running the coding side of each stack; this one when all runs
+     * in a single thread */
+    io m_coders[2];
+    io *m_enc_io = this;
+    io *m_dec_io = this;
+
     client_stack m_client;
     enc_stack m_enc;
     dec_stack m_dec;
+    int m_client_fd, m_enc_fd, m_dec_fd;
+    bool m_enc_blocked = false;
+
+    /* on this loop, which is the I/O thread when pipelined */
+    std::unique_ptr<metrics_export<io>> m_metrics;
+
+    void block_enc()
+    {
+        m_enc_io->disable_read(m_client_fd);
+
+        /* a pipe has room again when the pump signals it, not when epoll
+         * reports it writable */
+        if (m_threads)
+            m_enc_blocked = true;
+        else
+            io::enable_write(m_enc_fd);
+    }
 
     void read_client(int)
     {
-        buffer_pkt::pointer buf = m_client.buffer();
+        client_stack::buffer_ptr buf = m_client.buffer();
 
         while (true) {
             if (m_enc.is_full()) {
-                io::disable_read(m_client.fd());
+                m_enc_io->disable_read(m_client_fd);
                 break;
             }
 
@@ -133,8 +219,7 @@ class rlnc_dencoder : public signal, public io
                 break;
 
             if (!m_enc.write_pkt(buf)) {
-                io::enable_write(m_enc.fd());
-                io::disable_read(m_client.fd());
+                block_enc();
                 break;
             }
 
@@ -142,9 +227,9 @@ class rlnc_dencoder : public signal, public io
         }
     }
 
-    void read_enc(int)
+    void read_enc(int fd)
     {
-        buffer_pkt::pointer buf = m_enc.buffer();
+        typename enc_stack::buffer_ptr buf = m_enc.buffer();
         bool res, was_full;
 
         while (true) {
@@ -152,24 +237,42 @@ class rlnc_dencoder : public signal, public io
             res = m_enc.read_pkt(buf);
 
             if (was_full && !m_enc.is_full())
-                io::enable_read(m_client.fd());
+                m_enc_io->enable_read(m_client_fd);
 
             if (!res)
                 break;
 
             buf->reset();
         }
+
+        if (m_enc_blocked)
+            write_enc(fd);
     }
 
     void write_enc(int)
     {
-        io::disable_write(m_enc.fd());
-        io::enable_read(m_client.fd());
+        /* packets left queued by the last flush go first */
+        if (!m_threads && !m_enc.flush())
+            return;
+
+        if (!m_threads)
+            io::disable_write(m_enc_fd);
+
+        m_enc_blocked = false;
+        m_enc_io->enable_read(m_client_fd);
+    }
+
+    /* flush once per loop iteration, waiting for the socket to take what
+     * is left; its write callback is that of the pump with threads */
+    void flush_enc()
+    {
+        if (!m_enc.flush())
+            io::enable_write(m_enc.fd());
     }
 
-    void read_dec(int)
+    void read_dec(int fd)
     {
-        buffer_pkt::pointer buf = m_dec.buffer();
+        typename dec_stack::buffer_ptr buf = m_dec.buffer();
 
         while (m_dec.read_pkt(buf)) {
             if (!m_client.write_pkt(buf)) {
@@ -177,14 +280,122 @@ class rlnc_dencoder : public signal, public io
             }
             buf->reset();
         }
+
+        /* packets left in the burst don't make the fd readable again; with
+         * threads the burst belongs to the pump */
+        if (!m_threads && m_dec.burst_pending())
+            io::pending(fd);
+    }
+
+    /* move packets between the sockets and the pipes of a stack */
+    template<class stack>
+    void add_pump(stack &s)
+    {
+        int fd = s.fd();
+
+        auto rd = [this, &s, fd](int) {
+            if (!s.pump_read())
+                io::disable_read(fd);
+        };
+        auto wr = [this, &s, fd](int) {
+            if (s.pump_write())
+                io::disable_write(fd);
+        };
+        auto ev = [this, &s, fd](int) {
+            s.pump_clear();
+
+            if (!s.pump_write())
+                io::enable_write(fd);
+
+            /* the socket may have nothing new while the burst holds
+             * packets */
+            if (s.pump_blocked()) {
+                io::enable_read(fd);
+                io::pending(fd);
+            }
+        };
+
+        io::add_cb(fd, rd, wr);
+        io::add_cb(s.pump_fd(), ev, NULL);
+        io::add_flush_cb(std::bind(&stack::pump_flush, &s));
+        io::disable_write(fd);
+    }
+
+    /* loop running the encoder or decoder, whose timers live there too */
+    io *coder_io(bool dec)
+    {
+        if (!m_threads)
+            return this;
+
+        return &m_coders[dec && m_threads > 1];
+    }
+
+    void add_coders()
+    {
+        using std::placeholders::_1;
+
+        auto rc = std::bind(&rlnc_dencoder::read_client, this, _1);
+        auto re = std::bind(&rlnc_dencoder::read_enc, this, _1);
+        auto rd = std::bind(&rlnc_dencoder::read_dec, this, _1);
+        auto fc = std::bind(&client_stack::pipe_flush, &m_client);
+
+        m_enc_io = coder_io(false);
+        m_dec_io = coder_io(true);
+        m_client_fd = m_client.pipe_fd();
+        m_enc_fd = m_enc.pipe_fd();
+        m_dec_fd = m_dec.pipe_fd();
+
+        m_enc_io->add_cb(m_client_fd, rc, NULL);
+        m_enc_io->add_cb(m_enc_fd, re, NULL);
+        m_enc_io->add_flush_cb(fc);
+        m_enc_io->add_flush_cb(std::bind(&enc_stack::pipe_flush, &m_enc));
+
+        m_dec_io->add_cb(m_dec_fd, rd, NULL);
+        m_dec_io->add_flush_cb(std::bind(&dec_stack::pipe_flush, &m_dec));
+
+        if (m_dec_io != m_enc_io)
+            m_dec_io->add_flush_cb(fc);
+
+        add_pump(m_client);
+        add_pump(m_enc);
+        add_pump(m_dec);
+    }
+
+    void run_coder(io *loop, bool enc, bool dec)
+    {
+        int res;
+
+        try {
+            while (signal::running()) {
+                res = loop->wait(m_timeout);
+
+                if (res < 0)
+                    break;
+
+                if (res > 0)
+                    continue;
+
+                if (dec)
+                    m_dec.timer();
+
+                if (enc)
+                    m_enc.timer();
+            }
+        } catch (const std::runtime_error &re) {
+            std::cout << re.what() << std::endl;
+        }
+
+        signal::stop();
     }
 
   public:
     rlnc_dencoder(const struct args &args)
         : m_timeout(args.timeout),
+          m_threads(args.threads),
           m_client(
                    client_stack::remote_address=args.address,
-                   client_stack::port=args.port
+                   client_stack::port=args.port,
+                   client_stack::pipelined=(args.threads > 0)
           ),
           m_enc(
                 enc_stack::interface=args.interface,
@@ -193,8 +404,16 @@ class rlnc_dencoder : public signal, public io
                 enc_stack::two_hop=args.two_hop,
                 enc_stack::symbols=args.symbols,
                 enc_stack::symbol_size=args.symbol_size,
+                enc_stack::generations=args.generations,
+                enc_stack::hdr_format=args.hdr_format,
+                enc_stack::hdr_stamps=args.hdr_stamps,
+                enc_stack::flow_id=args.flow_id,
                 enc_stack::errors=args.errors,
-                enc_stack::overshoot=args.overshoot
+                enc_stack::overshoot=args.overshoot,
+                enc_stack::estimate_weight=args.estimate,
+                enc_stack::pipelined=(args.threads > 0),
+                enc_stack::wheel=coder_io(false)->timers(),
+                enc_stack::repair_timeout=static_cast<size_t>(args.timeout)
           ),
           m_dec(
                 dec_stack::interface=args.interface,
@@ -203,8 +422,18 @@ class rlnc_dencoder : public signal, public io
                 dec_stack::two_hop=args.two_hop,
                 dec_stack::symbols=args.symbols,
                 dec_stack::symbol_size=args.symbol_size,
-                dec_stack::errors=args.errors
-          )
+                dec_stack::generations=args.generations,
+                dec_stack::hdr_format=args.hdr_format,
+                dec_stack::hdr_stamps=args.hdr_stamps,
+                dec_stack::flow_id=args.flow_id,
+                dec_stack::errors=args.errors,
+                dec_stack::pipelined=(args.threads > 0),
+                dec_stack::wheel=coder_io(true)->timers(),
+                dec_stack::repair_timeout=static_cast<size_t>(args.timeout)
+          ),
+          m_client_fd(m_client.fd()),
+          m_enc_fd(m_enc.fd()),
+          m_dec_fd(m_dec.fd())
     {
         using std::placeholders::_1;
 
@@ -212,18 +441,41 @@ class rlnc_dencoder : public signal, public io
         auto re = std::bind(&rlnc_dencoder::read_enc, this, _1);
         auto we = std::bind(&rlnc_dencoder::write_enc, this, _1);
         auto rd = std::bind(&rlnc_dencoder::read_dec, this, _1);
+        auto fe = std::bind(&rlnc_dencoder::flush_enc, this);
+
+        io::add_flush_cb(fe);
 
-        io::add_cb(m_client.fd(), rc, NULL);
-        io::add_cb(m_enc.fd(), re, we);
-        io::add_cb(m_dec.fd(), rd, NULL);
+        if (args.metrics)
+            m_metrics.reset(new metrics_export<io>(*this, args.metrics));
 
-        io::disable_write(m_enc.fd());
+        if (m_threads) {
+            add_coders();
+            return;
+        }
+
+        io::add_cb(m_client_fd, rc, NULL);
+        io::add_cb(m_enc_fd, re, we);
+        io::add_cb(m_dec_fd, rd, NULL);
+
+        io::disable_write(m_enc_fd);
     }
 
     void run()
     {
+        std::vector<std::thread> coders;
         int res;
 
+        if (m_threads == 1)
+            coders.emplace_back(&rlnc_dencoder::run_coder, this,
+                                &m_coders[0], true, true);
+
+        if (m_threads > 1) {
+            coders.emplace_back(&rlnc_dencoder::run_coder, this,
+                                &m_coders[0], true, false);
+            coders.emplace_back(&rlnc_dencoder::run_coder, this,
+                                &m_coders[1], false, true);
+        }
+
         while (signal::running()) {
             res = io::wait(m_timeout);
 
@@ -233,12 +485,36 @@ class rlnc_dencoder : public signal, public io
             if (res > 0)
                 continue;
 
+            if (m_threads) {
+                m_client.pump_timer();
+                m_enc.pump_timer();
+                m_dec.pump_timer();
+                continue;
+            }
+
             m_dec.timer();
             m_enc.timer();
         }
+
+        signal::stop();
+
+        for (auto &t : coders)
+            t.join();
     }
 };
 
+template<class codes>
+static void run(const struct args &args)
+{
+    rlnc_dencoder<codes> de(args);
+
+    try {
+        de.run();
+    } catch (const std::runtime_error &re) {
+        std::cout << re.what() << std::endl;
+    }
+}
+
 int main(int argc, char **argv)
 {
     struct args args;
@@ -288,19 +564,53 @@ int main(int argc, char **argv)
             case 14:
                 args.overshoot = strtod(optarg, NULL);
                 break;
+            case 15:
+                args.threads = atoi(optarg);
+                break;
+            case 16:
+                args.generations = atoi(optarg);
+                break;
+            case 17:
+                args.hdr_format = atoi(optarg);
+                break;
+            case 18:
+                args.flow_id = atoi(optarg);
+                break;
+            case 19:
+                strncpy(args.coder, optarg, sizeof(args.coder) - 1);
+                break;
+            case 20:
+                args.estimate = strtod(optarg, NULL);
+                break;
+            case 21:
+                args.metrics = optarg;
+                break;
+            case 22:
+                args.hdr_stamps = atoi(optarg);
+                break;
+            case 23:
+                args.flight = optarg;
+                break;
             case '?':
                 return EXIT_FAILURE;
         }
     }
 
-    rlnc_dencoder de(args);
-
-    try {
-        de.run();
-    } catch (const std::runtime_error &re) {
-        std::cout << re.what() << std::endl;
+    if (args.flight)
+        flight_recorder::recorder().enable(args.flight);
+
+    if (strcmp(args.coder, "kodo") == 0) {
+        run<kodo_codes>(args);
+    } else if (strcmp(args.coder, "binary") == 0) {
+        run<gf_codes<gf_binary>>(args);
+    } else if (strcmp(args.coder, "binary8") == 0) {
+        run<gf_codes<gf_binary8>>(args);
+    } else {
+        std::cerr << "unknown coder: " << args.coder << std::endl;
+        return EXIT_FAILURE;
     }
 
+    flight_recorder::recorder().dump();
     std::cout << stat_counter::all;
 
     return EXIT_SUCCESS;
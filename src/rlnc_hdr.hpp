@@ -1,17 +1,56 @@
 #pragma once
 
+#include <stdexcept>
+
+#include "kwargs.hpp"
 #include "rlnc_hdr_base.hpp"
+#include "stat_counter.hpp"
+
+struct rlnc_hdr_args
+{
+    static const Kwarg<int> hdr_format;
+    static const Kwarg<size_t> flow_id;
+    static const Kwarg<int> hdr_stamps;
+};
+
+decltype(rlnc_hdr_args::hdr_format) rlnc_hdr_args::hdr_format;
+decltype(rlnc_hdr_args::flow_id) rlnc_hdr_args::flow_id;
+decltype(rlnc_hdr_args::hdr_stamps) rlnc_hdr_args::hdr_stamps;
 
 template<class super>
-class rlnc_hdr : public super, public rlnc_hdr_base<typename super::buffer_type>
+class rlnc_hdr : public super,
+                 public rlnc_hdr_base<typename super::buffer_type>,
+                 public rlnc_hdr_args
 {
     typedef rlnc_hdr_base<typename super::buffer_type> base;
+    typedef typename super::buffer_ptr buf_ptr;
+
+    stat_counter m_foreign_count = {"hdr foreign flow"};
+    stat_counter m_hello_count = {"hdr hello"};
+
+    void send_hello()
+    {
+        buf_ptr buf = super::buffer();
+
+        base::rlnc_hdr_add_hello(buf);
+        super::write_pkt(buf);
+    }
 
   protected:
     template<typename... Args> explicit
     rlnc_hdr(const Args&... args)
-        : super(args...)
-    {}
+        : super(args...),
+          base(static_cast<typename base::rlnc_format>(
+                    kwget(hdr_format, 0, args...)),
+               kwget(flow_id, 0, args...),
+               kwget(hdr_stamps, 0, args...))
+    {
+        if (kwget(hdr_format, 0, args...) > base::rlnc_wide32)
+            throw std::runtime_error("unknown rlnc header format");
+
+        if (base::rlnc_hdr_hello_pending())
+            send_hello();
+    }
 
     size_t data_size_max()
     {
@@ -29,4 +68,38 @@ class rlnc_hdr : public super, public rlnc_hdr_base<typename super::buffer_type>
         super::increment(b);
         base::increment(b);
     }
+
+  public:
+    /* hellos and packets of other flows are handled here */
+    bool read_pkt(buf_ptr &buf)
+    {
+        size_t reserved = buf->head_len();
+
+        while (super::read_pkt(buf)) {
+            if (base::rlnc_hdr_is_foreign(buf)) {
+                ++m_foreign_count;
+            } else if (base::rlnc_hdr_is_hello(buf)) {
+                ++m_hello_count;
+
+                if (base::rlnc_hdr_hello(buf))
+                    send_hello();
+            } else {
+                base::rlnc_hdr_received(buf);
+                return true;
+            }
+
+            buf->reset();
+            buf->head_reserve(reserved);
+        }
+
+        return false;
+    }
+
+    void timer()
+    {
+        super::timer();
+
+        if (base::rlnc_hdr_hello_pending())
+            send_hello();
+    }
 };
@@ -1,7 +1,12 @@
 #pragma once
 
+#include <endian.h>
+#include <algorithm>
+#include <cstring>
 #include <memory>
 
+#include "probes.hpp"
+
 class rlnc_types {
   protected:
     enum rlnc_t : uint8_t {
@@ -11,12 +16,48 @@ class rlnc_types {
         rlnc_hlp   = 3,
         rlnc_ack   = 4,
         rlnc_stop  = 5,
+        rlnc_hello = 6,
     };
 
+    /* flags of the wide formats and of timestamp extensions in the type
+     * byte, and the bits left for the type, e.g. for packet filters
+     * matching on it */
+    static constexpr uint8_t rlnc_wide_flag = 0x80;
+    static constexpr uint8_t rlnc_stamp_flag = 0x40;
+    static constexpr uint8_t rlnc_type_mask = 0x3f;
+
     typedef uint16_t sequence_t;
     typedef uint8_t id_t;
+
+  public:
+    /* header formats, in the order they are preferred */
+    enum rlnc_format : uint8_t {
+        rlnc_compact = 0,   /* 4 bytes: 4 bit group and block */
+        rlnc_wide16  = 1,   /* 8 bytes: flow id, 16 bit generation */
+        rlnc_wide32  = 2,   /* 12 bytes: flow id, 32 bit generation */
+    };
 };
 
+/* Packet header of the rlnc stacks.
+ *
+ * The compact form is the original 4 byte header, understood by every
+ * node. The wide forms have the top bit of the type set and carry a flow
+ * id and a 16 or 32 bit generation number, so late packets are told apart
+ * from packets of a block ahead even when the window is deep.
+ *
+ * Every node reads all forms, but sends compact ones until the peer
+ * answered a hello: nodes configured for a wide form send hellos until
+ * they see one from the peer, and then agree on the narrowest wide form
+ * both asked for. Old nodes ignore hellos, so links to them stay compact.
+ *
+ * Block numbers handed to and from the data layers are full counters;
+ * short wire numbers are expanded relative to the current block.
+ *
+ * A header of any form may be followed by a timestamp extension, flagged
+ * in the type byte, carrying the ingress time (pkt_clock) of one symbol of
+ * the block. Nodes asking for it say so in their hellos, and add it once
+ * the peer asked for it too; the data layers decide which packets carry
+ * it (rlnc_hdr_add_stamp). */
 template<class buffer>
 class rlnc_hdr_base : public rlnc_types
 {
@@ -26,23 +67,116 @@ class rlnc_hdr_base : public rlnc_types
         sequence_t seq;
     } __attribute__((packed));
 
+    struct hdr16 {
+        uint8_t type;
+        uint8_t format;
+        uint16_t flow;
+        uint16_t generation;
+        uint16_t seq;
+    } __attribute__((packed));
+
+    struct hdr32 {
+        uint8_t type;
+        uint8_t format;
+        uint16_t flow;
+        uint32_t generation;
+        uint32_t seq;
+    } __attribute__((packed));
+
+    struct stamp_ext {
+        uint32_t index;
+        uint64_t time;
+    } __attribute__((packed));
+
     typedef typename buffer::pointer buf_ptr;
 
-    size_t m_group = 0;
-    size_t m_block = 0;
-    sequence_t m_sequence = 0;
+    static constexpr uint8_t m_wide = rlnc_wide_flag;
+    static constexpr uint8_t m_stamped = rlnc_stamp_flag;
     static constexpr size_t m_hdr_len = sizeof(struct hdr);
+    static constexpr size_t m_hellos = 10;
 
-    struct hdr *header(uint8_t *data)
+    size_t m_group = 0;
+    size_t m_block = 0;
+    size_t m_sequence = 0;
+    size_t m_flow = 0;
+    rlnc_format m_want = rlnc_compact;
+    rlnc_format m_format = rlnc_compact;
+    size_t m_hellos_sent = 0;
+    bool m_agreed = false;
+    bool m_want_stamps = false;
+    bool m_stamps = false;
+
+    static struct hdr *header(uint8_t *data)
     {
         return reinterpret_cast<struct hdr *>(data);
     }
 
+    static struct hdr16 *header16(uint8_t *data)
+    {
+        return reinterpret_cast<struct hdr16 *>(data);
+    }
+
+    static struct hdr32 *header32(uint8_t *data)
+    {
+        return reinterpret_cast<struct hdr32 *>(data);
+    }
+
     id_t id(size_t g, size_t b)
     {
         return (g << 4) | (b & 0x0F);
     }
 
+    static bool is_wide(uint8_t *data)
+    {
+        return header(data)->type & m_wide;
+    }
+
+    static bool is_stamped(uint8_t *data)
+    {
+        return header(data)->type & m_stamped;
+    }
+
+    static rlnc_format format(uint8_t *data)
+    {
+        if (!is_wide(data))
+            return rlnc_compact;
+
+        return header16(data)->format == rlnc_wide16 ? rlnc_wide16
+                                                     : rlnc_wide32;
+    }
+
+    static size_t format_len(rlnc_format f)
+    {
+        switch (f) {
+            case rlnc_wide16:
+                return sizeof(struct hdr16);
+            case rlnc_wide32:
+                return sizeof(struct hdr32);
+            default:
+                return sizeof(struct hdr);
+        }
+    }
+
+    /* generation numbers on the wire wrap at the width of the format */
+    static size_t format_mask(rlnc_format f)
+    {
+        switch (f) {
+            case rlnc_wide16:
+                return UINT16_MAX;
+            case rlnc_wide32:
+                return UINT32_MAX;
+            default:
+                return 0x0F;
+        }
+    }
+
+    /* how far ahead of the current block a packet may be; anything further
+     * is taken to be late */
+    static size_t format_window(rlnc_format f)
+    {
+        return f == rlnc_compact ? 8 : format_mask(f)/2;
+    }
+
     size_t group(uint8_t *data)
     {
         struct hdr *hdr = header(data);
@@ -52,9 +186,58 @@ class rlnc_hdr_base : public rlnc_types
 
     size_t block(uint8_t *data)
     {
-        struct hdr *hdr = header(data);
+        rlnc_format f = format(data);
+        size_t mask = format_mask(f);
+        size_t wire, diff;
+
+        switch (f) {
+            case rlnc_wide16:
+                wire = be16toh(header16(data)->generation);
+                break;
+            case rlnc_wide32:
+                wire = be32toh(header32(data)->generation);
+                break;
+            default:
+                wire = header(data)->id & 0x0F;
+                break;
+        }
+
+        diff = (wire - m_block) & mask;
+
+        if (diff > format_window(f))
+            return m_block - (mask + 1 - diff);
+
+        return m_block + diff;
+    }
 
-        return hdr->id & 0x0F;
+    size_t flow(uint8_t *data)
+    {
+        if (!is_wide(data))
+            return m_flow;
+
+        return be16toh(header16(data)->flow);
+    }
+
+    bool hello_wanted() const
+    {
+        return m_want != rlnc_compact || m_want_stamps;
+    }
+
+    /* put the extension between the header just added and the payload */
+    void stamp_insert(buf_ptr &buf, size_t index, uint64_t time)
+    {
+        uint8_t *hdr = buf->head();
+        size_t len = format_len(format(hdr));
+        uint8_t *data = buf->head_push(sizeof(struct stamp_ext));
+        struct stamp_ext *ext;
+
+        memmove(data, hdr, len);
+        ext = reinterpret_cast<struct stamp_ext *>(data + len);
+
+        /* the type byte comes first in every form */
+        data[0] |= m_stamped;
+        ext->index = htobe32(index);
+        ext->time = htobe64(time);
     }
 
   public:
@@ -65,19 +248,57 @@ class rlnc_hdr_base : public rlnc_types
         : m_group(g)
     {}
 
-    static size_t hdr_len()
+    rlnc_hdr_base(rlnc_format want, size_t flow, bool stamps = false)
+        : m_flow(flow),
+          m_want(want),
+          m_want_stamps(stamps)
+    {}
+
+    /* room needed in front of the payload by the widest format in use */
+    size_t hdr_len() const
     {
-        return m_hdr_len;
+        return format_len(m_want) + (m_want_stamps ? sizeof(stamp_ext) : 0);
+    }
+
+    rlnc_format rlnc_hdr_format() const
+    {
+        return m_format;
+    }
+
+    /* true once the peer agreed on timestamp extensions */
+    bool rlnc_hdr_stamping() const
+    {
+        return m_stamps;
     }
 
     size_t rlnc_hdr_type(buf_ptr &buf)
     {
-        return header(buf->head())->type;
+        return header(buf->head())->type & rlnc_type_mask;
+    }
+
+    /* length and sequence number of a header in any format, for layers
+     * below this one that look at packets before it is parsed */
+    static size_t header_len(uint8_t *data)
+    {
+        return format_len(format(data)) +
+               (is_stamped(data) ? sizeof(stamp_ext) : 0);
+    }
+
+    static size_t sequence(uint8_t *data)
+    {
+        switch (format(data)) {
+            case rlnc_wide16:
+                return be16toh(header16(data)->seq);
+            case rlnc_wide32:
+                return be32toh(header32(data)->seq);
+            default:
+                return header(data)->seq;
+        }
     }
 
     size_t rlnc_hdr_seq(buf_ptr &buf)
     {
-        return header(buf->data())->seq;
+        return sequence(buf->head());
     }
 
     size_t rlnc_hdr_block(buf_ptr &buf)
@@ -87,7 +308,18 @@ class rlnc_hdr_base : public rlnc_types
 
     bool rlnc_hdr_is_ack(buf_ptr &buf)
     {
-        return header(buf->head())->type == rlnc_ack;
+        return rlnc_hdr_type(buf) == rlnc_ack;
+    }
+
+    bool rlnc_hdr_is_hello(buf_ptr &buf)
+    {
+        return rlnc_hdr_type(buf) == rlnc_hello;
+    }
+
+    /* packets of other flows sharing the link */
+    bool rlnc_hdr_is_foreign(buf_ptr &buf)
+    {
+        return flow(buf->head()) != m_flow;
     }
 
     size_t rlnc_hdr_seq()
@@ -97,31 +329,99 @@ class rlnc_hdr_base : public rlnc_types
 
     size_t rlnc_hdr_block()
     {
-        return m_block & 0x0F;
+        return m_block;
     }
 
+    /* distance from the current block; blocks behind come out large */
     size_t rlnc_hdr_block_diff(size_t remote)
     {
-        return (remote - m_block) & 0x0f;
+        return remote - m_block;
+    }
+
+    /* symbol index and ingress time carried by a packet, if any */
+    bool rlnc_hdr_get_stamp(buf_ptr &buf, size_t *index, uint64_t *time)
+    {
+        uint8_t *data = buf->head();
+        struct stamp_ext *ext;
+
+        if (!is_stamped(data))
+            return false;
+
+        ext = reinterpret_cast<struct stamp_ext *>(
+                data + format_len(format(data)));
+        *index = be32toh(ext->index);
+        *time = be64toh(ext->time);
+
+        return true;
+    }
+
+    /* add a timestamp extension to the header just added, if the peer
+     * agreed to them */
+    void rlnc_hdr_add_stamp(buf_ptr &buf, size_t index, uint64_t time)
+    {
+        if (m_stamps)
+            stamp_insert(buf, index, time);
     }
 
     void rlnc_hdr_del(buf_ptr &buf)
     {
-        buf->head_pull(m_hdr_len);
+        buf->head_pull(header_len(buf->head()));
     }
 
+    /* the compact length is reserved; see rlnc_hdr_received() */
     void rlnc_hdr_reserve(buf_ptr &buf)
     {
         buf->head_reserve(m_hdr_len);
     }
 
+    /* move the data offset past a wide header read into a buffer that was
+     * reserved for a compact one */
+    void rlnc_hdr_received(buf_ptr &buf)
+    {
+        size_t len = header_len(buf->head());
+
+        if (len > buf->head_len())
+            buf->head_reserve(len - buf->head_len());
+    }
+
+    void rlnc_hdr_add(buf_ptr &buf, enum rlnc_t type, size_t b, size_t g)
+    {
+        uint8_t *data = buf->head_push(format_len(m_format));
+
+        switch (m_format) {
+            case rlnc_wide16:
+                header16(data)->type = type | m_wide;
+                header16(data)->format = m_format;
+                header16(data)->flow = htobe16(m_flow);
+                header16(data)->generation = htobe16(b);
+                header16(data)->seq = htobe16(m_sequence++);
+                break;
+
+            case rlnc_wide32:
+                header32(data)->type = type | m_wide;
+                header32(data)->format = m_format;
+                header32(data)->flow = htobe16(m_flow);
+                header32(data)->generation = htobe32(b);
+                header32(data)->seq = htobe32(m_sequence++);
+                break;
+
+            default:
+                header(data)->type = type;
+                header(data)->id   = id(g, b);
+                header(data)->seq  = m_sequence++;
+                break;
+        }
+    }
+
     void rlnc_hdr_add(buf_ptr &buf, enum rlnc_t type)
     {
-        struct hdr *hdr = header(buf->head_push(m_hdr_len));
+        rlnc_hdr_add(buf, type, m_block, m_group);
+    }
 
-        hdr->type = type;
-        hdr->id   = id(m_group, m_block);
-        hdr->seq  = m_sequence++;
+    /* header for a packet of a block other than the current one */
+    void rlnc_hdr_add(buf_ptr &buf, enum rlnc_t type, size_t b)
+    {
+        rlnc_hdr_add(buf, type, b, m_group);
     }
 
     void rlnc_hdr_add_enc(buf_ptr &buf)
@@ -129,10 +429,14 @@ class rlnc_hdr_base : public rlnc_types
         rlnc_hdr_add(buf, rlnc_enc);
     }
 
+    void rlnc_hdr_add_enc(buf_ptr &buf, size_t b)
+    {
+        rlnc_hdr_add(buf, rlnc_enc, b);
+    }
+
     void rlnc_hdr_add_ack(buf_ptr &buf, size_t b)
     {
-        rlnc_hdr_add(buf, rlnc_ack);
-        header(buf->head())->id = id(0, b);
+        rlnc_hdr_add(buf, rlnc_ack, b, 0);
     }
 
     void rlnc_hdr_add_rec(buf_ptr &buf)
@@ -140,23 +444,72 @@ class rlnc_hdr_base : public rlnc_types
         rlnc_hdr_add(buf, rlnc_rec);
     }
 
+    void rlnc_hdr_add_rec(buf_ptr &buf, size_t b)
+    {
+        rlnc_hdr_add(buf, rlnc_rec, b);
+    }
+
     void rlnc_hdr_add_hlp(buf_ptr &buf)
     {
         rlnc_hdr_add(buf, rlnc_hlp);
     }
 
+    void rlnc_hdr_add_hlp(buf_ptr &buf, size_t b)
+    {
+        rlnc_hdr_add(buf, rlnc_hlp, b);
+    }
+
     void rlnc_hdr_add_stop(buf_ptr &buf)
     {
         rlnc_hdr_add(buf, rlnc_stop);
     }
 
+    /* hellos always go out in the wanted format, with an empty extension
+     * if stamps are wanted */
+    void rlnc_hdr_add_hello(buf_ptr &buf)
+    {
+        rlnc_format current = m_format;
+
+        m_format = m_want;
+        rlnc_hdr_add(buf, rlnc_hello);
+        m_format = current;
+        ++m_hellos_sent;
+
+        if (m_want_stamps)
+            stamp_insert(buf, 0, 0);
+    }
+
+    /* true while a hello should be sent on the next timeout */
+    bool rlnc_hdr_hello_pending() const
+    {
+        return hello_wanted() && !m_agreed && m_hellos_sent < m_hellos;
+    }
+
+    /* switch to a wide format and stamps both sides asked for; returns
+     * true if the peer's hello should be answered */
+    bool rlnc_hdr_hello(buf_ptr &buf)
+    {
+        bool answer = !m_agreed;
+
+        if (!hello_wanted())
+            return false;
+
+        m_format = std::min(m_want, format(buf->head()));
+        m_stamps = m_want_stamps && is_stamped(buf->head());
+        m_agreed = true;
+
+        return answer;
+    }
+
     void increment()
     {
         m_block++;
+        NETMIX_PROBE1(generation, m_block);
     }
 
     void increment(size_t b)
     {
         m_block = b;
+        NETMIX_PROBE1(generation, m_block);
     }
 };
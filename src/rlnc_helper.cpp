@@ -8,15 +8,19 @@
 #include "rlnc_hdr.hpp"
 #include "budgets.hpp"
 #include "eth_hdr.hpp"
+#include "error_estimator.hpp"
 #include "loss.hpp"
 #include "eth_topology.hpp"
 #include "eth_sock.hpp"
+#include "eth_ring.hpp"
 #include "rlnc_info.hpp"
 #include "error_info.hpp"
 #include "buffer_pkt.hpp"
-#include "buffer_pool.hpp"
+#include "slab_pool.hpp"
 #include "final_layer.hpp"
+#include "flight_recorder.hpp"
 #include "io.hpp"
+#include "metrics_export.hpp"
 #include "stat_counter.hpp"
 
 struct args {
@@ -35,11 +39,37 @@ struct args {
     /* synthetic error probabilities */
     std::vector<double> errors = {0.1, 0.1, 0.5, 0.75};
 
+    /* weight of the newest packet in the error estimates (0 keeps the
+     * error probabilities above) */
+    double estimate            = .01;
+
     /* number of symbols in a block */
     size_t symbols             = 100;
 
     /* size of each symbol */
     size_t symbol_size         = 1450;
+
+    /* blocks in flight at a time */
+    size_t generations         = 1;
+
+    /* header format to negotiate (0 compact, 1 16 bit, 2 32 bit) */
+    int hdr_format             = 0;
+
+    /* carry ingress timestamps in the headers, if the peers ask too */
+    int hdr_stamps             = 0;
+
+    /* flow id carried in the wide header formats */
+    size_t flow_id             = 0;
+
+    /* coder to use (kodo, binary or binary8) */
+    char coder[10]             = "kodo";
+
+    /* Unix socket to serve metrics on while running (none if NULL) */
+    char *metrics              = NULL;
+
+    /* file to dump the flight recorder to, on SIGUSR2, on failure and at
+     * exit (not recording if NULL) */
+    char *flight               = NULL;
 };
 
 static struct option options[] = {
@@ -53,44 +83,106 @@ static struct option options[] = {
     {"e4",          required_argument, NULL, 8},
     {"symbols",     required_argument, NULL, 9},
     {"symbol_size", required_argument, NULL, 10},
+    {"generations", required_argument, NULL, 11},
+    {"hdr_format",  required_argument, NULL, 12},
+    {"flow_id",     required_argument, NULL, 13},
+    {"coder",       required_argument, NULL, 14},
+    {"estimate",    required_argument, NULL, 15},
+    {"metrics",     required_argument, NULL, 16},
+    {"hdr_stamps",  required_argument, NULL, 17},
+    {"flight",      required_argument, NULL, 18},
     {0}
 };
 
-typedef eth_filter_hlp<
-        rlnc_data_hlp<kodo::sliding_window_decoder<fifi::binary>,
+template<class codes>
+using hlp_stack = eth_filter_hlp<
+        rlnc_data_hlp<typename codes::decoder,
         rlnc_hdr<
         helper_budgets<
         eth_hdr<
+        error_estimator<
         loss_hlp<
         eth_topology<
+        eth_ring<
         eth_sock<
         error_info<
         rlnc_info<
-        buffer_pool<buffer_pkt,
+        slab_pool<buffer_pkt,
         final_layer
-        >>>>>>>>>>> hlp_stack;
+        >>>>>>>>>>>>>;
 
+template<class codes>
 class rlnc_helper : public signal, public io
 {
+    typedef ::hlp_stack<codes> hlp_stack;
+
     hlp_stack m_a;
     hlp_stack m_b;
+    std::unique_ptr<metrics_export<io>> m_metrics;
+
+    /* a side the kernel couldn't take all queued packets from is flushed
+     * again from its write callback; the other side isn't read meanwhile,
+     * as that would only queue more */
+    bool flush_a()
+    {
+        if (m_a.flush())
+            return true;
+
+        io::enable_write(m_a.fd());
+        io::disable_read(m_b.fd());
+
+        return false;
+    }
+
+    bool flush_b()
+    {
+        if (m_b.flush())
+            return true;
+
+        io::enable_write(m_b.fd());
+        io::disable_read(m_a.fd());
+
+        return false;
+    }
+
+    void write_a(int)
+    {
+        if (!m_a.flush())
+            return;
+
+        io::disable_write(m_a.fd());
+        io::enable_read(m_b.fd());
+    }
+
+    void write_b(int)
+    {
+        if (!m_b.flush())
+            return;
+
+        io::disable_write(m_b.fd());
+        io::enable_read(m_a.fd());
+    }
 
     void read_a(int)
     {
-        buffer_pkt::pointer buf(m_a.buffer());
+        typename hlp_stack::buffer_ptr buf(m_a.buffer());
 
         while (m_a.read_pkt(buf)) {
-            m_b.write_pkt(buf);
+            if (!m_b.write_pkt(buf) && !flush_b())
+                break;
+
             buf->reset();
         }
     }
 
     void read_b(int)
     {
-        buffer_pkt::pointer buf(m_b.buffer());
+        typename hlp_stack::buffer_ptr buf(m_b.buffer());
 
         while (m_b.read_pkt(buf)) {
-            m_a.write_pkt(buf);
+            if (!m_a.write_pkt(buf) && !flush_a())
+                break;
+
             buf->reset();
         }
     }
@@ -104,7 +196,12 @@ class rlnc_helper : public signal, public io
               hlp_stack::destination=args.a_neighbor,
               hlp_stack::symbols=args.symbols,
               hlp_stack::symbol_size=args.symbol_size,
+              hlp_stack::generations=args.generations,
+              hlp_stack::hdr_format=args.hdr_format,
+              hlp_stack::hdr_stamps=args.hdr_stamps,
+              hlp_stack::flow_id=args.flow_id,
               hlp_stack::errors=args.errors,
+              hlp_stack::estimate_weight=args.estimate,
               hlp_stack::promisc=1
              ),
           m_b(
@@ -114,7 +211,12 @@ class rlnc_helper : public signal, public io
               hlp_stack::destination=args.b_neighbor,
               hlp_stack::symbols=args.symbols,
               hlp_stack::symbol_size=args.symbol_size,
+              hlp_stack::generations=args.generations,
+              hlp_stack::hdr_format=args.hdr_format,
+              hlp_stack::hdr_stamps=args.hdr_stamps,
+              hlp_stack::flow_id=args.flow_id,
               hlp_stack::errors=args.errors,
+              hlp_stack::estimate_weight=args.estimate,
               hlp_stack::promisc=1
              )
     {
@@ -122,9 +224,20 @@ class rlnc_helper : public signal, public io
 
         auto ra = std::bind(&rlnc_helper::read_a, this, _1);
         auto rb = std::bind(&rlnc_helper::read_b, this, _1);
+        auto wa = std::bind(&rlnc_helper::write_a, this, _1);
+        auto wb = std::bind(&rlnc_helper::write_b, this, _1);
+        auto fa = std::bind(&rlnc_helper::flush_a, this);
+        auto fb = std::bind(&rlnc_helper::flush_b, this);
+
+        io::add_cb(m_a.fd(), ra, wa);
+        io::add_cb(m_b.fd(), rb, wb);
+        io::disable_write(m_a.fd());
+        io::disable_write(m_b.fd());
+        io::add_flush_cb(fa);
+        io::add_flush_cb(fb);
 
-        io::add_cb(m_a.fd(), ra, NULL);
-        io::add_cb(m_b.fd(), rb, NULL);
+        if (args.metrics)
+            m_metrics.reset(new metrics_export<io>(*this, args.metrics));
     }
 
     void run()
@@ -143,6 +256,13 @@ class rlnc_helper : public signal, public io
     }
 };
 
+template<class codes>
+static void run(const struct args &args)
+{
+    rlnc_helper<codes> h(args);
+    h.run();
+}
+
 int main(int argc, char **argv)
 {
     struct args args;
@@ -180,14 +300,50 @@ int main(int argc, char **argv)
             case 10:
                 args.symbol_size = atoi(optarg);
                 break;
+            case 11:
+                args.generations = atoi(optarg);
+                break;
+            case 12:
+                args.hdr_format = atoi(optarg);
+                break;
+            case 13:
+                args.flow_id = atoi(optarg);
+                break;
+            case 14:
+                strncpy(args.coder, optarg, sizeof(args.coder) - 1);
+                break;
+            case 15:
+                args.estimate = strtod(optarg, NULL);
+                break;
+            case 16:
+                args.metrics = optarg;
+                break;
+            case 17:
+                args.hdr_stamps = atoi(optarg);
+                break;
+            case 18:
+                args.flight = optarg;
+                break;
             case '?':
                 return EXIT_FAILURE;
         }
     }
 
-    rlnc_helper h(args);
-    h.run();
+    if (args.flight)
+        flight_recorder::recorder().enable(args.flight);
+
+    if (strcmp(args.coder, "kodo") == 0) {
+        run<kodo_codes>(args);
+    } else if (strcmp(args.coder, "binary") == 0) {
+        run<gf_codes<gf_binary>>(args);
+    } else if (strcmp(args.coder, "binary8") == 0) {
+        run<gf_codes<gf_binary8>>(args);
+    } else {
+        std::cerr << "unknown coder: " << args.coder << std::endl;
+        return EXIT_FAILURE;
+    }
 
+    flight_recorder::recorder().dump();
     std::cout << stat_counter::all;
 
     return EXIT_SUCCESS;
@@ -1,15 +1,19 @@
 #pragma once
 
+#include <stdexcept>
+
 #include "kwargs.hpp"
 
 struct rlnc_info_args
 {
     static const Kwarg<size_t> symbols;
     static const Kwarg<size_t> symbol_size;
+    static const Kwarg<size_t> generations;
 };
 
 decltype(rlnc_info_args::symbols)     rlnc_info_args::symbols;
 decltype(rlnc_info_args::symbol_size) rlnc_info_args::symbol_size;
+decltype(rlnc_info_args::generations) rlnc_info_args::generations;
 
 template<class super>
 class rlnc_info :
@@ -18,6 +22,7 @@ class rlnc_info :
 {
     size_t m_symbols;
     size_t m_symbol_size;
+    size_t m_generations;
 
   protected:
     size_t rlnc_symbols()
@@ -30,11 +35,22 @@ class rlnc_info :
         return m_symbol_size;
     }
 
+    /* blocks in flight at once; late packets are told apart from new ones
+     * by the 4 bit block id, so at most 8 */
+    size_t rlnc_generations()
+    {
+        return m_generations;
+    }
+
   public:
     template<typename... Args> explicit
     rlnc_info(const Args&... args)
         : super(args...),
           m_symbols(kwget(symbols, 100, args...)),
-          m_symbol_size(kwget(symbol_size, 1450, args...))
-    {}
+          m_symbol_size(kwget(symbol_size, 1450, args...)),
+          m_generations(kwget(generations, 1, args...))
+    {
+        if (m_generations < 1 || m_generations > 8)
+            throw std::runtime_error("generations must be between 1 and 8");
+    }
 };
@@ -4,21 +4,27 @@
 #include <iostream>
 
 #include "io.hpp"
+#include "metrics_export.hpp"
 #include "signal.hpp"
 #include "rlnc_codes.hpp"
 #include "eth_filter.hpp"
 #include "rlnc_data_rec.hpp"
 #include "rlnc_hdr.hpp"
+#include "timers.hpp"
 #include "budgets.hpp"
 #include "eth_hdr.hpp"
+#include "error_estimator.hpp"
 #include "loss.hpp"
 #include "eth_topology.hpp"
 #include "eth_sock.hpp"
+#include "eth_ring.hpp"
+#include "xdp_sock.hpp"
 #include "error_info.hpp"
 #include "rlnc_info.hpp"
 #include "buffer_pkt.hpp"
-#include "buffer_pool.hpp"
+#include "slab_pool.hpp"
 #include "final_layer.hpp"
+#include "flight_recorder.hpp"
 
 struct side_args {
     /* interface to use */
@@ -55,6 +61,36 @@ struct args {
 
     /* ratio to multiply source budget with */
     double overshoot            = 1.05;
+
+    /* weight of the newest packet in the error estimates (0 keeps the
+     * error probabilities above) */
+    double estimate             = .01;
+
+    /* blocks in flight at a time */
+    size_t generations = 1;
+
+    /* header format to negotiate (0 compact, 1 16 bit, 2 32 bit) */
+    int hdr_format = 0;
+
+    /* carry ingress timestamps in the headers, if the peers ask too */
+    int hdr_stamps = 0;
+
+    /* flow id carried in the wide header formats */
+    size_t flow_id = 0;
+
+    /* coder to use (kodo, binary or binary8) */
+    char coder[10] = "kodo";
+
+    /* Unix socket to serve metrics on while running (none if NULL) */
+    char *metrics = NULL;
+
+    /* file to dump the flight recorder to, on SIGUSR2, on failure and at
+     * exit (not recording if NULL) */
+    char *flight = NULL;
+
+    /* sockets to use (0 packet sockets with rings, 1 AF_XDP, 2 AF_XDP in
+     * copy mode for drivers without zero-copy support) */
+    int xdp = 0;
 };
 
 struct option options[] = {
@@ -74,35 +110,100 @@ struct option options[] = {
     {"e4",          required_argument, NULL, 14},
     {"timeout",     required_argument, NULL, 15},
     {"overshoot",   required_argument, NULL, 16},
+    {"generations", required_argument, NULL, 17},
+    {"hdr_format",  required_argument, NULL, 18},
+    {"flow_id",     required_argument, NULL, 19},
+    {"coder",       required_argument, NULL, 20},
+    {"estimate",    required_argument, NULL, 21},
+    {"metrics",     required_argument, NULL, 22},
+    {"hdr_stamps",  required_argument, NULL, 23},
+    {"flight",      required_argument, NULL, 24},
+    {"xdp",         required_argument, NULL, 25},
     {0}
 };
 
-typedef eth_filter_rec<
-        rlnc_data_rec<kodo::sliding_window_decoder<fifi::binary>,
+/* packet sockets with memory mapped rings, the default of -xdp */
+template<class super>
+using ring_sock = eth_ring<eth_sock<super>>;
+
+template<class codes, template<class> class sock>
+using rec_stack = eth_filter_rec<
+        rlnc_data_rec<typename codes::decoder,
         rlnc_hdr<
+        timers<
         relay_budgets<
         eth_hdr<
+        error_estimator<
         loss_dec<
         eth_topology<
-        eth_sock<
+        sock<
         error_info<
         rlnc_info<
-        buffer_pool<buffer_pkt,
+        slab_pool<buffer_pkt,
         final_layer
-        >>>>>>>>>>> rec_stack;
+        >>>>>>>>>>>>>;
 
+template<class codes, template<class> class sock>
 class rlnc_recoder : public signal, public io
 {
+    typedef ::rec_stack<codes, sock> rec_stack;
+
     size_t m_timeout;
     rec_stack m_a;
     rec_stack m_b;
+    std::unique_ptr<metrics_export<io>> m_metrics;
+
+    /* a side the kernel couldn't take all queued packets from is flushed
+     * again from its write callback; the other side isn't read meanwhile,
+     * as that would only queue more */
+    bool flush_a()
+    {
+        if (m_a.flush())
+            return true;
+
+        io::enable_write(m_a.fd());
+        io::disable_read(m_b.fd());
+
+        return false;
+    }
+
+    bool flush_b()
+    {
+        if (m_b.flush())
+            return true;
+
+        io::enable_write(m_b.fd());
+        io::disable_read(m_a.fd());
+
+        return false;
+    }
+
+    void write_a(int)
+    {
+        if (!m_a.flush())
+            return;
+
+        io::disable_write(m_a.fd());
+        io::enable_read(m_b.fd());
+    }
+
+    void write_b(int)
+    {
+        if (!m_b.flush())
+            return;
+
+        io::disable_write(m_b.fd());
+        io::enable_read(m_a.fd());
+    }
 
     void read_a(int)
     {
-        buffer_pkt::pointer buf = m_a.buffer();
+        typename rec_stack::buffer_ptr buf = m_a.buffer();
 
         while (m_a.read_pkt(buf)) {
-            m_b.write_pkt(buf);
+            if (!m_b.write_pkt(buf) && !flush_b())
+                break;
+
             buf->reset();
 
             if (m_b.is_full())
@@ -112,10 +213,12 @@ class rlnc_recoder : public signal, public io
 
     void read_b(int)
     {
-        buffer_pkt::pointer buf(m_b.buffer());
+        typename rec_stack::buffer_ptr buf(m_b.buffer());
 
         while (m_b.read_pkt(buf)) {
-            m_a.write_pkt(buf);
+            if (!m_a.write_pkt(buf) && !flush_a())
+                break;
+
             buf->reset();
 
             if (m_a.is_full()) {
@@ -135,8 +238,16 @@ class rlnc_recoder : public signal, public io
               rec_stack::two_hop=args.a.two_hop,
               rec_stack::symbols=args.symbols,
               rec_stack::symbol_size=args.symbol_size,
+              rec_stack::generations=args.generations,
+              rec_stack::hdr_format=args.hdr_format,
+              rec_stack::hdr_stamps=args.hdr_stamps,
+              rec_stack::flow_id=args.flow_id,
               rec_stack::errors=args.errors,
-              rec_stack::overshoot=args.overshoot
+              rec_stack::overshoot=args.overshoot,
+              rec_stack::estimate_weight=args.estimate,
+              rec_stack::wheel=io::timers(),
+              rec_stack::repair_timeout=args.timeout,
+              xdp_sock_args::xdp_copy=static_cast<int>(args.xdp == 2)
              ),
           m_b(
               rec_stack::interface=args.b.interface,
@@ -145,17 +256,36 @@ class rlnc_recoder : public signal, public io
               rec_stack::two_hop=args.b.two_hop,
               rec_stack::symbols=args.symbols,
               rec_stack::symbol_size=args.symbol_size,
+              rec_stack::generations=args.generations,
+              rec_stack::hdr_format=args.hdr_format,
+              rec_stack::hdr_stamps=args.hdr_stamps,
+              rec_stack::flow_id=args.flow_id,
               rec_stack::errors=args.errors,
-              rec_stack::overshoot=args.overshoot
+              rec_stack::overshoot=args.overshoot,
+              rec_stack::estimate_weight=args.estimate,
+              rec_stack::wheel=io::timers(),
+              rec_stack::repair_timeout=args.timeout,
+              xdp_sock_args::xdp_copy=static_cast<int>(args.xdp == 2)
              )
     {
         using std::placeholders::_1;
 
         auto ra = std::bind(&rlnc_recoder::read_a, this, _1);
         auto rb = std::bind(&rlnc_recoder::read_b, this, _1);
-
-        io::add_cb(m_a.fd(), ra, NULL);
-        io::add_cb(m_b.fd(), rb, NULL);
+        auto wa = std::bind(&rlnc_recoder::write_a, this, _1);
+        auto wb = std::bind(&rlnc_recoder::write_b, this, _1);
+        auto fa = std::bind(&rlnc_recoder::flush_a, this);
+        auto fb = std::bind(&rlnc_recoder::flush_b, this);
+
+        io::add_cb(m_a.fd(), ra, wa);
+        io::add_cb(m_b.fd(), rb, wb);
+        io::disable_write(m_a.fd());
+        io::disable_write(m_b.fd());
+        io::add_flush_cb(fa);
+        io::add_flush_cb(fb);
+
+        if (args.metrics)
+            m_metrics.reset(new metrics_export<io>(*this, args.metrics));
     }
 
     void run()
@@ -177,6 +307,22 @@ class rlnc_recoder : public signal, public io
     }
 };
 
+template<class codes, template<class> class sock>
+static void run(const struct args &args)
+{
+    rlnc_recoder<codes, sock> r(args);
+    r.run();
+}
+
+template<class codes>
+static void run(const struct args &args)
+{
+    if (args.xdp)
+        run<codes, xdp_sock>(args);
+    else
+        run<codes, ring_sock>(args);
+}
+
 int main(int argc, char **argv)
 {
     struct args args;
@@ -232,13 +378,53 @@ int main(int argc, char **argv)
             case 16:
                 args.overshoot = strtod(optarg, NULL);
                 break;
+            case 17:
+                args.generations = atoi(optarg);
+                break;
+            case 18:
+                args.hdr_format = atoi(optarg);
+                break;
+            case 19:
+                args.flow_id = atoi(optarg);
+                break;
+            case 20:
+                strncpy(args.coder, optarg, sizeof(args.coder) - 1);
+                break;
+            case 21:
+                args.estimate = strtod(optarg, NULL);
+                break;
+            case 22:
+                args.metrics = optarg;
+                break;
+            case 23:
+                args.hdr_stamps = atoi(optarg);
+                break;
+            case 24:
+                args.flight = optarg;
+                break;
+            case 25:
+                args.xdp = atoi(optarg);
+                break;
             default:
                 return EXIT_FAILURE;
         }
     }
 
-    rlnc_recoder r(args);
-    r.run();
+    if (args.flight)
+        flight_recorder::recorder().enable(args.flight);
+
+    if (strcmp(args.coder, "kodo") == 0) {
+        run<kodo_codes>(args);
+    } else if (strcmp(args.coder, "binary") == 0) {
+        run<gf_codes<gf_binary>>(args);
+    } else if (strcmp(args.coder, "binary8") == 0) {
+        run<gf_codes<gf_binary8>>(args);
+    } else {
+        std::cerr << "unknown coder: " << args.coder << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    flight_recorder::recorder().dump();
 
     return EXIT_SUCCESS;
 }
@@ -2,12 +2,13 @@
 
 #include <csignal>
 #include <cstring>
+#include <atomic>
 #include <system_error>
 #include <functional>
 
 class signal
 {
-    static bool m_running;
+    static std::atomic<bool> m_running;
 
     static void install_signals()
     {
@@ -44,6 +45,12 @@ class signal
     {
         return m_running;
     }
+
+    /* stop all loops, e.g. from a worker thread that failed */
+    static void stop()
+    {
+        m_running = false;
+    }
 };
 
-bool signal::m_running = true;
+std::atomic<bool> signal::m_running(true);
@@ -0,0 +1,504 @@
+#pragma once
+
+#include <stdlib.h>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <system_error>
+#include <utility>
+
+#include "kwargs.hpp"
+
+template<class buf> class buffer_slab;
+
+/* Intrusive reference counted handle to a slab buffer. Copies share the
+ * buffer, the last one to go hands it back to its slab. */
+template<class node>
+class slab_ptr
+{
+    node *m_node;
+
+  public:
+    slab_ptr()
+        : m_node(NULL)
+    {}
+
+    slab_ptr(std::nullptr_t)
+        : m_node(NULL)
+    {}
+
+    /* adopts the reference held by n */
+    explicit slab_ptr(node *n)
+        : m_node(n)
+    {}
+
+    slab_ptr(const slab_ptr &p)
+        : m_node(p.m_node)
+    {
+        if (m_node)
+            m_node->ref();
+    }
+
+    slab_ptr(slab_ptr &&p)
+        : m_node(p.m_node)
+    {
+        p.m_node = NULL;
+    }
+
+    ~slab_ptr()
+    {
+        if (m_node)
+            m_node->unref();
+    }
+
+    slab_ptr &operator=(slab_ptr p)
+    {
+        swap(p);
+
+        return *this;
+    }
+
+    void swap(slab_ptr &p)
+    {
+        std::swap(m_node, p.m_node);
+    }
+
+    void reset()
+    {
+        slab_ptr().swap(*this);
+    }
+
+    node *get() const
+    {
+        return m_node;
+    }
+
+    node *operator->() const
+    {
+        return m_node;
+    }
+
+    node &operator*() const
+    {
+        return *m_node;
+    }
+
+    explicit operator bool() const
+    {
+        return m_node != NULL;
+    }
+
+    long use_count() const
+    {
+        return m_node ? m_node->use_count() : 0;
+    }
+
+    friend bool operator==(const slab_ptr &a, const slab_ptr &b)
+    {
+        return a.m_node == b.m_node;
+    }
+
+    friend bool operator!=(const slab_ptr &a, const slab_ptr &b)
+    {
+        return a.m_node != b.m_node;
+    }
+};
+
+/* A buffer living in a slab chunk (or on the heap when the slab is out of
+ * buffers or the requested length is above the largest size class). */
+template<class buf>
+class slab_buf : public buf
+{
+    friend class buffer_slab<buf>;
+
+    std::atomic<uint32_t> m_refs;
+    std::atomic<uint32_t> m_next;
+    buffer_slab<buf> *m_slab;
+    uint8_t *m_chunk;
+    size_t m_chunk_len;
+    uint32_t m_class;
+
+  public:
+    typedef slab_ptr<slab_buf> pointer;
+
+    explicit slab_buf(size_t len)
+        : buf(len),
+          m_refs(1),
+          m_next(0),
+          m_slab(NULL),
+          m_chunk(NULL),
+          m_chunk_len(0),
+          m_class(0)
+    {}
+
+    slab_buf(buffer_slab<buf> *slab, uint32_t cls, uint8_t *chunk,
+             size_t chunk_len)
+        : buf(chunk, chunk_len, chunk_len - buf::storage_len(0)),
+          m_refs(0),
+          m_next(0),
+          m_slab(slab),
+          m_chunk(chunk),
+          m_chunk_len(chunk_len),
+          m_class(cls)
+    {}
+
+    void ref()
+    {
+        m_refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void unref()
+    {
+        if (m_refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            return;
+
+        if (m_slab)
+            m_slab->put(this);
+        else
+            delete this;
+    }
+
+    long use_count() const
+    {
+        return m_refs.load(std::memory_order_relaxed);
+    }
+};
+
+/* Fixed set of buffers carved out of one 64 byte aligned allocation and
+ * split in power of two size classes. Each class keeps its free buffers on
+ * a lock-free stack, so one slab can be shared by stacks running in
+ * different threads.
+ *
+ * Buffers travel between stacks and may outlive the stack whose pool
+ * handed them out, so the slab is reference counted: it is created with
+ * new, its owner drops it with release() (or holds it in an owner_ptr),
+ * and it is freed once the owner and every buffer handed out are gone. */
+template<class buf>
+class buffer_slab
+{
+  public:
+    typedef slab_buf<buf> node;
+
+  private:
+    static constexpr size_t m_align = 64;
+    static constexpr uint32_t m_empty = UINT32_MAX;
+
+    struct size_class {
+        /* free list head: tag in the upper half against ABA, index of the
+         * first free node in the lower half */
+        std::atomic<uint64_t> head;
+        std::atomic<size_t> used;
+        std::atomic<size_t> high;
+        node *nodes;
+        size_t len;
+        size_t chunk_len;
+    };
+
+    size_t m_buffers;
+    size_t m_min_len;
+    size_t m_classes;
+    std::unique_ptr<size_class[]> m_class;
+    std::atomic<size_t> m_overflow;
+    std::atomic<size_t> m_refs;
+    uint8_t *m_storage = NULL;
+    node *m_nodes = NULL;
+
+    static size_t align(size_t len)
+    {
+        return (len + m_align - 1) & ~(m_align - 1);
+    }
+
+    static size_t pow2(size_t len)
+    {
+        size_t p = 1;
+
+        while (p < len)
+            p <<= 1;
+
+        return p;
+    }
+
+    size_t class_index(size_t len) const
+    {
+        size_t c = 0;
+
+        while (c < m_classes && m_class[c].len < len)
+            c++;
+
+        return c;
+    }
+
+    void push(size_class &c, node *n)
+    {
+        uint32_t idx = n - c.nodes;
+        uint64_t head = c.head.load(std::memory_order_relaxed);
+        uint64_t next;
+
+        do {
+            n->m_next.store(static_cast<uint32_t>(head),
+                           std::memory_order_relaxed);
+            next = ((head >> 32) + 1) << 32 | idx;
+        } while (!c.head.compare_exchange_weak(head, next,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed));
+    }
+
+    node *pop(size_class &c)
+    {
+        uint64_t head = c.head.load(std::memory_order_acquire);
+        uint64_t next;
+        uint32_t idx;
+
+        do {
+            idx = static_cast<uint32_t>(head);
+
+            if (idx == m_empty)
+                return NULL;
+
+            next = ((head >> 32) + 1) << 32 |
+                   c.nodes[idx].m_next.load(std::memory_order_relaxed);
+        } while (!c.head.compare_exchange_weak(head, next,
+                                               std::memory_order_acquire,
+                                               std::memory_order_acquire));
+
+        return &c.nodes[idx];
+    }
+
+    void unref()
+    {
+        if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete this;
+    }
+
+    ~buffer_slab()
+    {
+        for (size_t i = 0; i < m_classes; ++i)
+            assert(m_class[i].used.load() == 0);
+
+        for (size_t i = 0; i < m_classes*m_buffers; ++i)
+            m_nodes[i].~node();
+
+        ::operator delete(m_nodes);
+        free(m_storage);
+    }
+
+    void used_inc(size_class &c)
+    {
+        size_t used = c.used.fetch_add(1, std::memory_order_relaxed) + 1;
+        size_t high = c.high.load(std::memory_order_relaxed);
+
+        while (used > high &&
+               !c.high.compare_exchange_weak(high, used,
+                                             std::memory_order_relaxed))
+            ;
+    }
+
+  public:
+    struct release_fn {
+        void operator()(buffer_slab *s) const
+        {
+            s->release();
+        }
+    };
+
+    typedef std::unique_ptr<buffer_slab, release_fn> owner_ptr;
+
+    buffer_slab(size_t buffers, size_t min_len, size_t max_len)
+        : m_buffers(buffers),
+          m_min_len(pow2(min_len)),
+          m_classes(0),
+          m_overflow(0),
+          m_refs(1)
+    {
+        size_t total = 0, len, i;
+        uint8_t *chunk;
+        void *mem;
+
+        for (len = m_min_len; len <= pow2(max_len); len <<= 1)
+            m_classes++;
+
+        m_class.reset(new size_class[m_classes]);
+
+        for (i = 0, len = m_min_len; i < m_classes; ++i, len <<= 1) {
+            m_class[i].len = len;
+            m_class[i].chunk_len = align(buf::storage_len(len));
+            total += m_class[i].chunk_len*m_buffers;
+        }
+
+        if (posix_memalign(&mem, m_align, total))
+            throw std::system_error(ENOMEM, std::system_category(),
+                                    "unable to allocate buffer slab");
+
+        m_storage = reinterpret_cast<uint8_t *>(mem);
+        m_nodes = reinterpret_cast<node *>(
+                        ::operator new(sizeof(node)*m_classes*m_buffers));
+        chunk = m_storage;
+
+        for (i = 0; i < m_classes; ++i) {
+            size_class &c = m_class[i];
+
+            c.head.store(m_empty);
+            c.used.store(0);
+            c.high.store(0);
+            c.nodes = m_nodes + i*m_buffers;
+
+            for (size_t n = 0; n < m_buffers; ++n) {
+                new (&c.nodes[n]) node(this, i, chunk, c.chunk_len);
+                chunk += c.chunk_len;
+            }
+
+            /* push in reverse so the first buffers are handed out first */
+            for (size_t n = m_buffers; n > 0; --n)
+                push(c, &c.nodes[n - 1]);
+        }
+    }
+
+    buffer_slab(const buffer_slab &) = delete;
+    buffer_slab &operator=(const buffer_slab &) = delete;
+
+    /* drop the reference of the owner */
+    void release()
+    {
+        unref();
+    }
+
+    node *get(size_t len)
+    {
+        size_t i = class_index(len);
+        node *n;
+
+        if (i == m_classes || !(n = pop(m_class[i]))) {
+            m_overflow.fetch_add(1, std::memory_order_relaxed);
+            return new node(len);
+        }
+
+        used_inc(m_class[i]);
+        m_refs.fetch_add(1, std::memory_order_relaxed);
+
+        if (n->storage() != n->m_chunk)
+            n->storage(n->m_chunk, n->m_chunk_len);
+
+        n->m_refs.store(1, std::memory_order_relaxed);
+        n->reset(len);
+
+        return n;
+    }
+
+    void put(node *n)
+    {
+        size_class &c = m_class[n->m_class];
+
+        c.used.fetch_sub(1, std::memory_order_relaxed);
+        push(c, n);
+        unref();
+    }
+
+    size_t classes() const
+    {
+        return m_classes;
+    }
+
+    size_t class_len(size_t c) const
+    {
+        return m_class[c].len;
+    }
+
+    size_t class_buffers() const
+    {
+        return m_buffers;
+    }
+
+    size_t in_use(size_t c) const
+    {
+        return m_class[c].used.load(std::memory_order_relaxed);
+    }
+
+    size_t high_water(size_t c) const
+    {
+        return m_class[c].high.load(std::memory_order_relaxed);
+    }
+
+    /* buffers that had to be allocated outside the slab */
+    size_t overflows() const
+    {
+        return m_overflow.load(std::memory_order_relaxed);
+    }
+
+    friend std::ostream &operator<<(std::ostream &out, const buffer_slab &s)
+    {
+        for (size_t c = 0; c < s.classes(); ++c)
+            out << "slab " << s.class_len(c) << ": "
+                << s.in_use(c) << " used, "
+                << s.high_water(c) << "/" << s.class_buffers()
+                << " high" << std::endl;
+
+        return out << "slab overflows: " << s.overflows() << std::endl;
+    }
+};
+
+struct slab_pool_args
+{
+    static const Kwarg<size_t> slab_buffers;
+    static const Kwarg<size_t> slab_min_len;
+    static const Kwarg<size_t> slab_max_len;
+};
+
+decltype(slab_pool_args::slab_buffers) slab_pool_args::slab_buffers;
+decltype(slab_pool_args::slab_min_len) slab_pool_args::slab_min_len;
+decltype(slab_pool_args::slab_max_len) slab_pool_args::slab_max_len;
+
+/* Drop-in replacement for buffer_pool backed by a buffer_slab. The slab is
+ * owned by the layer unless one is passed with the slab argument, which
+ * lets several stacks (and threads) draw from the same buffers. Either way
+ * buffers still out when the layer goes keep their slab alive. */
+template<class buf, class super>
+class slab_pool : public super, public slab_pool_args
+{
+  public:
+    typedef slab_buf<buf> buffer_type;
+    typedef typename buffer_type::pointer buffer_ptr;
+    typedef buffer_slab<buf> slab_type;
+
+    static const Kwarg<slab_type *> slab;
+
+  private:
+    typename slab_type::owner_ptr m_own;
+    slab_type *m_slab;
+
+  public:
+    template<typename... Args> explicit
+    slab_pool(const Args&... args)
+        : super(args...),
+          m_slab(kwget(slab, static_cast<slab_type *>(NULL), args...))
+    {
+        if (m_slab)
+            return;
+
+        m_own.reset(new slab_type(kwget(slab_buffers, 512, args...),
+                                  kwget(slab_min_len, 256, args...),
+                                  kwget(slab_max_len, buf::default_len(),
+                                        args...)));
+        m_slab = m_own.get();
+    }
+
+    buffer_ptr buffer(size_t max)
+    {
+        return buffer_ptr(m_slab->get(max));
+    }
+
+    buffer_ptr buffer()
+    {
+        return buffer_ptr(m_slab->get(buf::default_len()));
+    }
+
+    const slab_type &pool_slab() const
+    {
+        return *m_slab;
+    }
+};
+
+template<class buf, class super>
+const Kwarg<buffer_slab<buf> *> slab_pool<buf, super>::slab;
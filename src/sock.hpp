@@ -4,15 +4,33 @@
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <linux/sockios.h>
+#include <algorithm>
+#include <cstring>
 #include <string>
 #include <system_error>
 #include <vector>
 
+#include "probes.hpp"
+
 template<class buffer_ptr>
 class sock
 {
     typedef buffer_ptr buf_ptr;
 
+    std::vector<struct mmsghdr> m_msgs;
+    std::vector<struct iovec> m_iovs;
+    std::vector<struct sockaddr_storage> m_names;
+
+    void msgs_resize(size_t count)
+    {
+        if (m_msgs.size() >= count)
+            return;
+
+        m_msgs.resize(count);
+        m_iovs.resize(count);
+        m_names.resize(count);
+    }
+
   protected:
     virtual int fd() = 0;
 
@@ -59,6 +77,7 @@ class sock
 
         if (res > 0) {
             buf->push(res);
+            NETMIX_PROBE2(sock_recv, fd(), res);
             return true;
         }
 
@@ -72,12 +91,102 @@ class sock
                                 "unable to recv packet");
     }
 
+    /* receive up to bufs.size() packets with a single syscall; each buffer is
+     * filled at its head like read_pkt() does. Returns the number of buffers
+     * filled, or zero if the socket is drained. */
+    size_t read_pkts(std::vector<buf_ptr> &bufs, size_t len)
+    {
+        struct sockaddr *sa = sa_recv();
+        size_t count = bufs.size();
+        int res;
+
+        msgs_resize(count);
+
+        for (size_t i = 0; i < count; ++i) {
+            m_iovs[i].iov_base = bufs[i]->head();
+            m_iovs[i].iov_len = len;
+
+            memset(&m_msgs[i], 0, sizeof(m_msgs[i]));
+            m_msgs[i].msg_hdr.msg_iov = &m_iovs[i];
+            m_msgs[i].msg_hdr.msg_iovlen = 1;
+
+            if (!sa)
+                continue;
+
+            m_msgs[i].msg_hdr.msg_name = &m_names[i];
+            m_msgs[i].msg_hdr.msg_namelen = sizeof(m_names[i]);
+        }
+
+        res = recvmmsg(fd(), &m_msgs[0], count, 0, NULL);
+
+        if (res > 0) {
+            for (int i = 0; i < res; ++i) {
+                bufs[i]->push(m_msgs[i].msg_len);
+                NETMIX_PROBE2(sock_recv, fd(), m_msgs[i].msg_len);
+            }
+
+            /* remember the latest sender like recvfrom() would */
+            if (sa) {
+                auto &hdr = m_msgs[res - 1].msg_hdr;
+                size_t sa_len = std::min<size_t>(hdr.msg_namelen,
+                                                 *sa_recv_len());
+
+                memcpy(sa, hdr.msg_name, sa_len);
+                *sa_recv_len() = sa_len;
+            }
+
+            return res;
+        }
+
+        if (res == 0 || errno == EAGAIN)
+            return 0;
+
+        throw std::system_error(errno, std::system_category(),
+                                "unable to recv packets");
+    }
+
+    /* send the first count buffers with a single syscall. Returns the number
+     * of buffers sent, or zero if the socket is out of buffer space. */
+    size_t write_pkts(std::vector<buf_ptr> &bufs, size_t count)
+    {
+        int res;
+
+        msgs_resize(count);
+
+        for (size_t i = 0; i < count; ++i) {
+            m_iovs[i].iov_base = bufs[i]->head();
+            m_iovs[i].iov_len = bufs[i]->len();
+
+            memset(&m_msgs[i], 0, sizeof(m_msgs[i]));
+            m_msgs[i].msg_hdr.msg_iov = &m_iovs[i];
+            m_msgs[i].msg_hdr.msg_iovlen = 1;
+            m_msgs[i].msg_hdr.msg_name = sa_send();
+            m_msgs[i].msg_hdr.msg_namelen = sa_send_len();
+        }
+
+        res = sendmmsg(fd(), &m_msgs[0], count, 0);
+
+        if (res > 0) {
+            for (int i = 0; i < res; ++i)
+                NETMIX_PROBE2(sock_send, fd(), m_msgs[i].msg_len);
+
+            return res;
+        }
+
+        if (res < 0 && (errno == EAGAIN || errno == ENOBUFS))
+            return 0;
+
+        throw std::system_error(errno, std::system_category(),
+                                "unable to write packets");
+    }
+
     bool write_pkt(buf_ptr &buf)
     {
         int res = sendto(fd(), buf->head(), buf->len(), 0,
                          sa_send(), sa_send_len());
 
         if (res > 0) {
+            NETMIX_PROBE2(sock_send, fd(), res);
             buf->pull(res);
             return true;
         }
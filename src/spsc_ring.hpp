@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+#include <vector>
+
+/* Bounded single producer, single consumer ring. Entries are moved in and
+ * out, so handles like buffer_ptr change owner without touching the
+ * refcount. The capacity is rounded up to a power of two. */
+template<class T>
+class spsc_ring
+{
+    std::vector<T> m_slots;
+    size_t m_mask;
+
+    /* producer and consumer indexes live on their own cache lines */
+    alignas(64) std::atomic<size_t> m_head;
+    alignas(64) std::atomic<size_t> m_tail;
+
+    static size_t pow2(size_t len)
+    {
+        size_t p = 1;
+
+        while (p < len)
+            p <<= 1;
+
+        return p;
+    }
+
+  public:
+    explicit spsc_ring(size_t size)
+        : m_slots(pow2(size)),
+          m_mask(m_slots.size() - 1),
+          m_head(0),
+          m_tail(0)
+    {}
+
+    size_t capacity() const
+    {
+        return m_slots.size();
+    }
+
+    size_t size() const
+    {
+        return m_tail.load(std::memory_order_acquire) -
+               m_head.load(std::memory_order_acquire);
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    bool full() const
+    {
+        return size() == capacity();
+    }
+
+    /* producer side */
+    bool push(T &val)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+
+        if (tail - m_head.load(std::memory_order_acquire) == capacity())
+            return false;
+
+        m_slots[tail & m_mask] = std::move(val);
+        m_tail.store(tail + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    /* consumer side */
+    T *front()
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+
+        if (head == m_tail.load(std::memory_order_acquire))
+            return NULL;
+
+        return &m_slots[head & m_mask];
+    }
+
+    void discard()
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+
+        m_slots[head & m_mask] = T();
+        m_head.store(head + 1, std::memory_order_release);
+    }
+
+    bool pop(T &val)
+    {
+        T *slot = front();
+
+        if (!slot)
+            return false;
+
+        val = std::move(*slot);
+        discard();
+
+        return true;
+    }
+};
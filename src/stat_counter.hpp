@@ -1,78 +1,77 @@
 #pragma once
 
-#include<string>
-#include<iostream>
-
+#include <algorithm>
 #include <iostream>
-#include <vector>
 #include <string>
-#include <algorithm>
-#include <cmath>
+#include <vector>
 
+#include "metrics.hpp"
+
+/* Named event counter of the layers, kept as a metric_counter so it can
+ * be bumped from any thread and read while running. stat_counter::all
+ * prints every metric of the process, counters or not. */
 class stat_counter
 {
-    typedef uint32_t counter_type;
-    typedef std::pair<std::string, counter_type> item_type;
-    typedef std::vector<item_type> vector_type;
-
-    static vector_type m_counters;
-    static counter_type m_max_count;
-    static size_t m_max_desc;
-    size_t m_index;
+    metric_counter m_counter;
 
-    static size_t count_width()
+    static std::string shown(const metrics::snapshot_type &s)
     {
-        if (!m_max_count)
-            return 1;
-
-        return log10(m_max_count) + 1;
-    }
+        if (s.kind == metrics::gauge_kind)
+            return std::to_string(s.level);
 
-    static size_t desc_width()
-    {
-        return m_max_desc;
+        return std::to_string(s.value);
     }
 
   public:
     stat_counter(const char *desc)
-        : m_index(m_counters.size())
-    {
-        m_counters.push_back(item_type(desc, 0));
-        m_max_desc = std::max(m_max_desc, m_counters.back().first.length());
-    }
+        : m_counter(desc)
+    {}
 
-    size_t operator++()
+    stat_counter &operator++()
     {
-        m_max_count = std::max(m_max_count, m_counters[m_index].second + 1);
+        m_counter.add();
 
-        return ++m_counters[m_index].second;
+        return *this;
     }
 
-    size_t operator+=(size_t i)
+    stat_counter &operator+=(size_t i)
     {
-        counter_type new_count(m_counters[m_index].second += i);
-        m_max_count = std::max(m_max_count, new_count);
+        m_counter.add(i);
 
-        return new_count;
+        return *this;
     }
 
     size_t count() const
     {
-        return m_counters[m_index].second;
+        return m_counter.value();
     }
 
-    std::string &description() const
+    const std::string &description() const
     {
-        return m_counters[m_index].first;
+        return m_counter.name();
     }
 
     static std::ostream &all(std::ostream &stream)
     {
-        for (auto &item : m_counters) {
-            stream.width(desc_width() + 2);
-            stream << std::left << item.first + ": ";
-            stream.width(count_width());
-            stream << std::right << item.second << std::endl;
+        auto all = metrics::registry().snapshot();
+        size_t desc_width = 0, count_width = 0;
+
+        for (auto &s : all) {
+            desc_width = std::max(desc_width, s.name.length());
+            count_width = std::max(count_width, shown(s).length());
+        }
+
+        for (auto &s : all) {
+            stream.width(desc_width + 2);
+            stream << std::left << s.name + ": ";
+            stream.width(count_width);
+            stream << std::right << shown(s);
+
+            if (s.kind == metrics::histogram_kind && s.value)
+                stream << " (p50 " << s.quantile(.5)
+                       << ", p99 " << s.quantile(.99) << ")";
+
+            stream << std::endl;
         }
 
         return stream;
@@ -80,15 +79,8 @@ class stat_counter
 
     friend std::ostream& operator<<(std::ostream &stream, const stat_counter &c)
     {
-        stream.width(desc_width() + 2);
-        stream << std::left << c.description() + ": ";
-        stream.width(count_width());
-        stream << c.count();
+        stream << c.description() << ": " << c.count();
 
         return stream;
     }
 };
-
-stat_counter::vector_type stat_counter::m_counters{};
-stat_counter::counter_type stat_counter::m_max_count{0};
-size_t stat_counter::m_max_desc{0};
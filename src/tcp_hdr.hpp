@@ -4,6 +4,8 @@
 #include <endian.h>
 #include <cassert>
 
+#include "pkt_clock.hpp"
+
 template<class super>
 class tcp_hdr : public super
 {
@@ -69,6 +71,7 @@ class tcp_hdr : public super
         assert(buf->len() == 0);
         assert(m_in_buf->len() == m_in_hdr.length);
         buf.swap(m_in_buf);
+        buf->stamp(pkt_clock::now());
         reset();
 
         return true;
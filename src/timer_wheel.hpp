@@ -0,0 +1,262 @@
+#pragma once
+
+#include <time.h>
+#include <cstdint>
+#include <functional>
+
+class timer_wheel;
+
+/* A timer owned by whoever needs it (e.g. one per generation) and linked
+ * into a timer_wheel while it is pending, so scheduling never allocates. */
+class wheel_timer
+{
+    friend class timer_wheel;
+
+    typedef std::function<void()> timer_cb;
+
+    wheel_timer *m_prev = this;
+    wheel_timer *m_next = this;
+    timer_wheel *m_wheel = NULL;
+    uint64_t m_expires = 0;
+    timer_cb m_cb;
+
+    void link(wheel_timer *head)
+    {
+        m_prev = head->m_prev;
+        m_next = head;
+        head->m_prev->m_next = this;
+        head->m_prev = this;
+    }
+
+    void unlink()
+    {
+        m_prev->m_next = m_next;
+        m_next->m_prev = m_prev;
+        m_prev = m_next = this;
+    }
+
+    bool empty() const
+    {
+        return m_next == this;
+    }
+
+  public:
+    wheel_timer()
+    {}
+
+    explicit wheel_timer(timer_cb cb)
+        : m_cb(cb)
+    {}
+
+    wheel_timer(const wheel_timer &) = delete;
+    wheel_timer &operator=(const wheel_timer &) = delete;
+
+    inline ~wheel_timer();
+
+    void callback(timer_cb cb)
+    {
+        m_cb = cb;
+    }
+
+    bool pending() const
+    {
+        return m_wheel != NULL;
+    }
+
+    inline void cancel();
+};
+
+/* Hierarchical timing wheel with millisecond ticks.
+ *
+ * Four levels of 64 slots cover about four and a half hours; timers
+ * further out are clamped. Timers due in the next 64 ticks sit in the
+ * first level and are fired from their slot, the others are moved one
+ * level down each time the wheel below has turned. Scheduling and
+ * cancelling are O(1).
+ *
+ * The wheel doesn't keep time by itself: advance() is called with the
+ * current tick (see io, which drives it from a timerfd armed for
+ * next_expiry()). */
+class timer_wheel
+{
+    friend class wheel_timer;
+
+    static constexpr size_t m_levels = 4;
+    static constexpr size_t m_bits = 6;
+    static constexpr size_t m_slots = 1 << m_bits;
+    static constexpr uint64_t m_mask = m_slots - 1;
+    static constexpr uint64_t m_max = (1ULL << (m_bits*m_levels)) - 1;
+
+    wheel_timer m_wheel[m_levels][m_slots];
+    struct timespec m_start;
+    uint64_t m_now = 0;
+    size_t m_pending = 0;
+
+    void place(wheel_timer &t)
+    {
+        uint64_t diff = t.m_expires - m_now;
+        size_t level = 0;
+
+        while (level < m_levels - 1 && diff >= 1ULL << (m_bits*(level + 1)))
+            level++;
+
+        t.link(&m_wheel[level][(t.m_expires >> (m_bits*level)) & m_mask]);
+    }
+
+    /* move the timers of a slot one level down once the level below is
+     * about to pass their expiry */
+    void cascade(size_t level)
+    {
+        wheel_timer *head;
+
+        if (level >= m_levels)
+            return;
+
+        head = &m_wheel[level][(m_now >> (m_bits*level)) & m_mask];
+
+        if (((m_now >> (m_bits*level)) & m_mask) == 0)
+            cascade(level + 1);
+
+        while (!head->empty()) {
+            wheel_timer *t = head->m_next;
+
+            t->unlink();
+            place(*t);
+        }
+    }
+
+    void tick()
+    {
+        wheel_timer *head = &m_wheel[0][m_now & m_mask];
+
+        if ((m_now & m_mask) == 0)
+            cascade(1);
+
+        /* timers rescheduled from a callback land in other slots */
+        while (!head->empty()) {
+            wheel_timer *t = head->m_next;
+
+            t->unlink();
+            t->m_wheel = NULL;
+            m_pending--;
+
+            if (t->m_cb)
+                t->m_cb();
+        }
+    }
+
+  public:
+    static constexpr uint64_t never = UINT64_MAX;
+
+    timer_wheel()
+    {
+        clock_gettime(CLOCK_MONOTONIC, &m_start);
+    }
+
+    timer_wheel(const timer_wheel &) = delete;
+    timer_wheel &operator=(const timer_wheel &) = delete;
+
+    ~timer_wheel()
+    {
+        for (auto &level : m_wheel)
+            for (auto &head : level)
+                while (!head.empty()) {
+                    head.m_next->m_wheel = NULL;
+                    head.m_next->unlink();
+                }
+    }
+
+    /* CLOCK_MONOTONIC time of tick 0 */
+    const struct timespec &start() const
+    {
+        return m_start;
+    }
+
+    uint64_t now() const
+    {
+        struct timespec ts;
+        int64_t ms;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ms = (ts.tv_sec - m_start.tv_sec)*1000 +
+             (ts.tv_nsec - m_start.tv_nsec)/1000000;
+
+        return ms;
+    }
+
+    size_t pending() const
+    {
+        return m_pending;
+    }
+
+    /* (re)start a timer to fire ms milliseconds from now */
+    void schedule(wheel_timer &t, uint64_t ms)
+    {
+        uint64_t expires = now() + (ms ? ms : 1);
+
+        if (t.pending())
+            t.cancel();
+
+        if (expires - m_now > m_max)
+            expires = m_now + m_max;
+
+        t.m_expires = expires;
+        t.m_wheel = this;
+        m_pending++;
+        place(t);
+    }
+
+    /* run the timers due up to and including the given tick */
+    void advance(uint64_t to)
+    {
+        while (m_now < to) {
+            if (!m_pending) {
+                m_now = to;
+                break;
+            }
+
+            m_now++;
+            tick();
+        }
+    }
+
+    void advance()
+    {
+        advance(now());
+    }
+
+    /* earliest tick at which advance() may have something to do */
+    uint64_t next_expiry() const
+    {
+        if (!m_pending)
+            return never;
+
+        for (size_t level = 0; level < m_levels; ++level) {
+            size_t shift = m_bits*level;
+
+            for (uint64_t i = 1; i <= m_slots; ++i) {
+                uint64_t t = ((m_now >> shift) + i) << shift;
+
+                if (!m_wheel[level][(t >> shift) & m_mask].empty())
+                    return t;
+            }
+        }
+
+        return never;
+    }
+};
+
+wheel_timer::~wheel_timer()
+{
+    cancel();
+}
+
+void wheel_timer::cancel()
+{
+    if (!m_wheel)
+        return;
+
+    unlink();
+    m_wheel->m_pending--;
+    m_wheel = NULL;
+}
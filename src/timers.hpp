@@ -0,0 +1,57 @@
+#pragma once
+
+#include "kwargs.hpp"
+#include "timer_wheel.hpp"
+
+struct timers_args
+{
+    static const Kwarg<timer_wheel *> wheel;
+    static const Kwarg<size_t> repair_timeout;
+};
+
+decltype(timers_args::wheel) timers_args::wheel;
+decltype(timers_args::repair_timeout) timers_args::repair_timeout;
+
+/* Gives the layers above per generation or per peer timers on the wheel
+ * of the io loop driving the stack (io::timers()). Without a wheel the
+ * timers never fire, and layers fall back to the periodic timer() call. */
+template<class super>
+class timers : public super, public timers_args
+{
+    timer_wheel *m_wheel;
+    size_t m_timeout;
+
+  public:
+    template<typename... Args> explicit
+    timers(const Args&... args)
+        : super(args...),
+          m_wheel(kwget(wheel, static_cast<timer_wheel *>(NULL), args...)),
+          m_timeout(kwget(repair_timeout, 20, args...))
+    {}
+
+    bool timers_enabled() const
+    {
+        return m_wheel != NULL;
+    }
+
+    size_t timers_timeout() const
+    {
+        return m_timeout;
+    }
+
+    void timer_start(wheel_timer &t, size_t ms)
+    {
+        if (m_wheel)
+            m_wheel->schedule(t, ms);
+    }
+
+    void timer_start(wheel_timer &t)
+    {
+        timer_start(t, m_timeout);
+    }
+
+    void timer_stop(wheel_timer &t)
+    {
+        t.cancel();
+    }
+};
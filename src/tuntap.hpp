@@ -7,13 +7,17 @@
 #include <linux/if_tun.h>
 #include <linux/if_ether.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <string>
+#include <vector>
 #include <cstring>
 #include <system_error>
 #include <cassert>
 
 #include "kwargs.hpp"
+#include "pkt_clock.hpp"
+#include "vnet_gso.hpp"
 
 static const char *tuntap_default_name = NULL;
 static const char *tuntap_default_type = "tun";
@@ -22,6 +26,8 @@ struct tuntap_args
 {
     static const Kwarg<const char *> interface;
     static const Kwarg<const char *> type;
+    static const Kwarg<int> multi_queue;
+    static const Kwarg<int> vnet_hdr;
 };
 
 enum tuntap_type {
@@ -32,6 +38,8 @@ enum tuntap_type {
 
 decltype(tuntap_args::interface) tuntap_args::interface;
 decltype(tuntap_args::type) tuntap_args::type;
+decltype(tuntap_args::multi_queue) tuntap_args::multi_queue;
+decltype(tuntap_args::vnet_hdr) tuntap_args::vnet_hdr;
 
 template<tuntap_type template_type, class super>
 class tuntap_base :
@@ -45,8 +53,15 @@ class tuntap_base :
     const char *m_interface = NULL;
     const char *m_type_str = NULL;
     int m_type;
+    bool m_multi_queue;
+    bool m_vnet_hdr;
     char m_tun[IFNAMSIZ];
 
+    /* super packets read in vnet mode, handed out a segment at a time */
+    std::vector<uint8_t> m_super;
+    uint64_t m_super_stamp = 0;
+    vnet_gso m_gso;
+
     int iface_type()
     {
         if (template_type != tuntap_arg)
@@ -62,6 +77,10 @@ class tuntap_base :
             throw std::runtime_error("invalid tuntap type string");
     }
 
+    /* With multi_queue, every instance opened on the same interface name
+     * is another queue of that interface: the first one creates it, the
+     * others attach to it. The kernel spreads the packets it sends out of
+     * the interface over the queues by flow hash. */
     void create()
     {
         struct ifreq ifr;
@@ -72,6 +91,8 @@ class tuntap_base :
 
         memset(&ifr, 0, sizeof(ifr));
         ifr.ifr_flags = m_type | IFF_NO_PI;
+        ifr.ifr_flags |= m_multi_queue ? IFF_MULTI_QUEUE : 0;
+        ifr.ifr_flags |= m_vnet_hdr ? IFF_VNET_HDR : 0;
 
         if (strncmp(m_interface, "lo", IFNAMSIZ) != 0)
             strncpy(ifr.ifr_name, m_interface, IFNAMSIZ);
@@ -81,6 +102,74 @@ class tuntap_base :
                                     "unable to create tun interface");
 
         strncpy(m_tun, ifr.ifr_name, IFNAMSIZ);
+
+        if (m_vnet_hdr)
+            offload();
+    }
+
+    /* let the kernel hand over TCP (and UDP, where known) super packets
+     * and partial checksums, which vnet_gso finishes */
+    void offload()
+    {
+        unsigned int flags = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 |
+                             TUN_F_TSO_ECN;
+
+#ifdef TUN_F_USO4
+        if (ioctl(m_fd, TUNSETOFFLOAD, flags | TUN_F_USO4 | TUN_F_USO6) == 0)
+            return;
+#endif
+
+        if (ioctl(m_fd, TUNSETOFFLOAD, flags) < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to set tun offloads");
+    }
+
+    bool read_vnet(buf_ptr &buf)
+    {
+        size_t len;
+        int res;
+
+        while (!(len = m_gso.next(buf->head(), buf->max_len()))) {
+            res = read(m_fd, m_super.data(), m_super.size());
+
+            if (res == 0 || (res < 0 && errno == EAGAIN))
+                return false;
+
+            if (res < 0)
+                throw std::system_error(errno, std::system_category(),
+                                        "unable to read pkt");
+
+            m_gso.load(m_super.data(), res);
+            m_super_stamp = pkt_clock::now();
+        }
+
+        buf->trim(len);
+        buf->stamp(m_super_stamp);
+
+        return true;
+    }
+
+    bool write_vnet(buf_ptr &buf)
+    {
+        uint8_t vnet[vnet_gso::vnet_len()] = {0};
+        struct iovec iov[2];
+        int res;
+
+        /* no offloads asked for on packets going to the kernel */
+        iov[0].iov_base = vnet;
+        iov[0].iov_len = sizeof(vnet);
+        iov[1].iov_base = buf->head();
+        iov[1].iov_len = buf->len();
+        res = writev(m_fd, iov, 2);
+
+        if (res == static_cast<int>(sizeof(vnet) + buf->len()))
+            return true;
+
+        if (res < 0 && errno == EAGAIN)
+            return false;
+
+        throw std::system_error(res < 0 ? errno : EIO, std::system_category(),
+                                "unable to write pkt");
     }
 
     void read_mtu()
@@ -108,7 +197,11 @@ class tuntap_base :
         : super(args...),
           m_interface(kwget(interface, tuntap_default_name, args...)),
           m_type_str(kwget(type, tuntap_default_type, args...)),
-          m_type(iface_type())
+          m_type(iface_type()),
+          m_multi_queue(kwget(multi_queue, 0, args...)),
+          m_vnet_hdr(kwget(vnet_hdr, 0, args...)),
+          m_super(m_vnet_hdr ? vnet_gso::max_len() : 0),
+          m_gso(m_type == tuntap_tap ? ETH_HLEN : 0)
     {
         create();
         read_mtu();
@@ -119,6 +212,11 @@ class tuntap_base :
         return m_fd;
     }
 
+    const char *interface_name()
+    {
+        return m_tun;
+    }
+
     size_t data_size_max()
     {
         return m_mtu;
@@ -128,10 +226,14 @@ class tuntap_base :
     {
         int res;
 
+        if (m_vnet_hdr)
+            return read_vnet(buf);
+
         res = read(m_fd, buf->head(), buf->max_len());
 
         if (res > 0) {
             buf->trim(res);
+            buf->stamp(pkt_clock::now());
             return true;
         }
 
@@ -147,6 +249,9 @@ class tuntap_base :
 
     bool write_pkt(buf_ptr &buf)
     {
+        if (m_vnet_hdr)
+            return write_vnet(buf);
+
         int len = buf->len();
         int res = write(m_fd, buf->head(), buf->len());
 
@@ -2,21 +2,166 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/udp.h>
+#include <vector>
 
 #include "inet_sock.hpp"
+#include "kwargs.hpp"
+
+struct udp_sock_args
+{
+    static const Kwarg<int> udp_gso;
+};
+
+decltype(udp_sock_args::udp_gso) udp_sock_args::udp_gso;
 
 template<class super>
-class udp_sock_client : public super, public inet_sock<typename super::buffer_ptr>
+class udp_sock_client :
+    public super,
+    public inet_sock<typename super::buffer_ptr>,
+    public udp_sock_args
 {
     typedef inet_sock<typename super::buffer_ptr> base;
+    typedef typename super::buffer_ptr buf_ptr;
+
+    /* limits of a single UDP_SEGMENT send */
+    static constexpr size_t m_gso_segments = 64;
+    static constexpr size_t m_gso_bytes = 65000;
+
+    union gso_cmsg {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    };
+
+    bool m_gso;
+    std::vector<struct mmsghdr> m_gso_msgs;
+    std::vector<struct iovec> m_gso_iovs;
+    std::vector<union gso_cmsg> m_gso_cmsgs;
+    std::vector<size_t> m_gso_counts;
+
+    /* older kernels don't know the option */
+    bool gso_probe()
+    {
+        int size = 0;
+
+        return setsockopt(base::fd(), SOL_UDP, UDP_SEGMENT, &size,
+                          sizeof(size)) == 0;
+    }
+
+    void gso_cmsg_add(struct msghdr *hdr, union gso_cmsg *c, uint16_t size)
+    {
+        struct cmsghdr *cm;
+
+        hdr->msg_control = c->buf;
+        hdr->msg_controllen = sizeof(c->buf);
+        cm = CMSG_FIRSTHDR(hdr);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        memcpy(CMSG_DATA(cm), &size, sizeof(size));
+    }
+
+    /* group runs of equally sized packets, the last of a run may be
+     * shorter, into one message each; returns the number of messages */
+    size_t gso_build(std::vector<buf_ptr> &bufs, size_t count)
+    {
+        size_t msgs = 0;
+        size_t i = 0;
+
+        if (m_gso_iovs.size() < count) {
+            m_gso_msgs.resize(count);
+            m_gso_iovs.resize(count);
+            m_gso_cmsgs.resize(count);
+            m_gso_counts.resize(count);
+        }
+
+        while (i < count) {
+            struct msghdr *hdr = &m_gso_msgs[msgs].msg_hdr;
+            size_t size = bufs[i]->len();
+            size_t bytes = 0;
+            size_t n = 0;
+
+            memset(&m_gso_msgs[msgs], 0, sizeof(m_gso_msgs[msgs]));
+            hdr->msg_iov = &m_gso_iovs[i];
+            hdr->msg_name = base::sa_send();
+            hdr->msg_namelen = base::sa_send_len();
+
+            while (i < count && n < m_gso_segments &&
+                   bufs[i]->len() <= size && bytes + size <= m_gso_bytes) {
+                size_t len = bufs[i]->len();
+
+                m_gso_iovs[i].iov_base = bufs[i]->head();
+                m_gso_iovs[i].iov_len = len;
+                bytes += len;
+                ++n;
+                ++i;
+
+                if (len < size)
+                    break;
+            }
+
+            hdr->msg_iovlen = n;
+            m_gso_counts[msgs] = n;
+
+            if (n > 1)
+                gso_cmsg_add(hdr, &m_gso_cmsgs[msgs], size);
+
+            msgs++;
+        }
+
+        return msgs;
+    }
 
   public:
     template<typename... Args> explicit
     udp_sock_client(const Args&... args)
         : super(args...),
-          base(args...)
+          base(args...),
+          m_gso(kwget(udp_gso, 0, args...))
     {
         base::sock_connect(SOCK_DGRAM);
+
+        if (m_gso && !gso_probe())
+            m_gso = false;
+    }
+
+    bool udp_gso_enabled() const
+    {
+        return m_gso;
+    }
+
+    /* with udp_gso, the packets queued by burst_write leave in a few
+     * UDP_SEGMENT sends, which the kernel (or the NIC) cuts into
+     * datagrams again; otherwise one datagram per message */
+    size_t write_pkts(std::vector<buf_ptr> &bufs, size_t count)
+    {
+        size_t msgs, sent = 0;
+        int res;
+
+        if (!m_gso)
+            return base::write_pkts(bufs, count);
+
+        msgs = gso_build(bufs, count);
+        res = sendmmsg(base::fd(), &m_gso_msgs[0], msgs, 0);
+
+        if (res > 0) {
+            for (int m = 0; m < res; ++m)
+                sent += m_gso_counts[m];
+
+            return sent;
+        }
+
+        if (res < 0 && (errno == EAGAIN || errno == ENOBUFS))
+            return 0;
+
+        /* e.g. a route without checksum offload; send them one by one */
+        if (res < 0 && (errno == EIO || errno == EINVAL)) {
+            m_gso = false;
+            return base::write_pkts(bufs, count);
+        }
+
+        throw std::system_error(errno, std::system_category(),
+                                "unable to write packets");
     }
 };
 
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <algorithm>
+#include <cstring>
+
+#include "io_ring.hpp"
+#include "kwargs.hpp"
+#include "pkt_clock.hpp"
+
+struct uring_io_args
+{
+    static const Kwarg<uring_backend *> uring;
+    static const Kwarg<size_t> uring_buffers;
+};
+
+decltype(uring_io_args::uring) uring_io_args::uring;
+decltype(uring_io_args::uring_buffers) uring_io_args::uring_buffers;
+
+/* the backend of an io_ring, or NULL for the io (epoll) reactor, for
+ * passing as uring= to the stacks it drives */
+template<class backend>
+static inline uring_backend *uring_of(io_reactor<backend> &)
+{
+    return NULL;
+}
+
+static inline uring_backend *uring_of(io_ring &r)
+{
+    return &r;
+}
+
+/* Lets the io_ring reactor receive and send the packets of the fd below
+ * (a UDP socket or a tun/tap device) with its own requests, see
+ * uring_file: a multishot receive into provided buffers, and sends
+ * submitted in a batch with the wait for the next events. The fd is
+ * ready for the reactor callbacks while packets are queued or send slots
+ * are free, and read_pkt()/write_pkt() then need no system call.
+ *
+ * Received packets are attached to the buffer passed to read_pkt() and
+ * stay valid until the next read_pkt(), like with eth_ring; sent ones are
+ * copied, so write_pkt() leaves the buffer to the caller.
+ *
+ * Without a uring= backend (the epoll reactor) the layers below do the
+ * work as before, so the same stack runs with either reactor; layers
+ * doing their own batching (burst_read, burst_write, UDP GSO) go below
+ * this one and are skipped with io_uring. Sockets of a server (the peer
+ * address is public, see udp_sock_server) take the sender of the last
+ * packet read as the peer to send to, like recvfrom(). */
+template<class super>
+class uring_io : public super, public uring_io_args
+{
+    typedef typename super::buffer_ptr buf_ptr;
+
+    uring_backend *m_uring;
+    uring_file *m_file = NULL;
+
+    template<class T>
+    static auto peer(T *t, int) -> decltype(t->sa_recv_len(), t->sa_recv())
+    {
+        return t->sa_recv();
+    }
+
+    template<class T>
+    static struct sockaddr *peer(T *, long)
+    {
+        return NULL;
+    }
+
+    template<class T>
+    static auto peer_len(T *t, int) -> decltype(t->sa_recv(), t->sa_recv_len())
+    {
+        return t->sa_recv_len();
+    }
+
+    template<class T>
+    static uint32_t *peer_len(T *, long)
+    {
+        return NULL;
+    }
+
+  public:
+    template<typename... Args> explicit
+    uring_io(const Args&... args)
+        : super(args...),
+          m_uring(kwget(uring, static_cast<uring_backend *>(NULL), args...))
+    {
+        buf_ptr buf;
+
+        if (!m_uring)
+            return;
+
+        buf = super::buffer();
+        m_file = m_uring->uring_open(super::fd(), buf->max_len(),
+                                     buf->max_head_len(),
+                                     peer<super>(this, 0) != NULL,
+                                     static_cast<unsigned>(
+                                         kwget(uring_buffers, 256, args...)));
+    }
+
+    ~uring_io()
+    {
+        if (m_file)
+            m_uring->uring_close(m_file);
+    }
+
+    bool uring_enabled() const
+    {
+        return m_file != NULL;
+    }
+
+    bool read_pkt(buf_ptr &buf)
+    {
+        struct sockaddr *sa = peer<super>(this, 0);
+        struct uring_file::pkt p;
+        uint32_t *sa_len;
+
+        if (!m_file)
+            return super::read_pkt(buf);
+
+        if (!m_file->recv(&p))
+            return false;
+
+        buf->attach(p.base, p.data, p.base + m_file->buf_len());
+        buf->trim(p.len);
+
+        if (!m_file->socket())
+            buf->stamp(pkt_clock::now());
+
+        if (!sa || !p.name_len)
+            return true;
+
+        sa_len = peer_len<super>(this, 0);
+        *sa_len = std::min(*sa_len, p.name_len);
+        memcpy(sa, p.name, *sa_len);
+
+        return true;
+    }
+
+    bool write_pkt(buf_ptr &buf)
+    {
+        uint32_t *sa_len = peer_len<super>(this, 0);
+
+        if (!m_file)
+            return super::write_pkt(buf);
+
+        return m_file->send(buf->head(), buf->len(), peer<super>(this, 0),
+                            sa_len ? *sa_len : 0);
+    }
+
+    /* queued sends leave with the next wait of the reactor */
+    bool flush()
+    {
+        if (!m_file)
+            return super::flush();
+
+        return true;
+    }
+};
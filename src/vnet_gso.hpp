@@ -0,0 +1,277 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <endian.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+/* Cuts packets read from a tun/tap device opened with IFF_VNET_HDR into
+ * packets of at most one MTU.
+ *
+ * With offloads enabled, the kernel hands over TCP super packets of up to
+ * 64 KB with a virtio_net_hdr in front, telling the segment size and
+ * where the transport header is. They are segmented here like a NIC
+ * would: the headers are copied to every segment, and the lengths, IPv4
+ * ids, TCP sequence numbers, flags and checksums are fixed up. Packets
+ * that are not GSO only get their partial checksum completed, if the
+ * kernel left it to us (VIRTIO_NET_HDR_F_NEEDS_CSUM). */
+class vnet_gso
+{
+    /* struct virtio_net_hdr; linux/virtio_net.h doesn't compile as C++ */
+    struct hdr {
+        uint8_t flags;
+        uint8_t gso_type;
+        uint16_t hdr_len;
+        uint16_t gso_size;
+        uint16_t csum_start;
+        uint16_t csum_offset;
+    } __attribute__((packed));
+
+    static constexpr uint8_t m_needs_csum = 1;
+    static constexpr uint8_t m_gso_none = 0;
+    static constexpr uint8_t m_gso_udp_l4 = 5;
+    static constexpr uint8_t m_gso_ecn = 0x80;
+
+    struct hdr m_vnet;
+    size_t m_l2_len;
+
+    uint8_t *m_pkt = NULL;
+    size_t m_len = 0;
+    size_t m_l4 = 0;
+    size_t m_hdr_len = 0;
+    size_t m_offset = 0;
+    size_t m_segment = 0;
+    bool m_done = true;
+
+    static constexpr uint8_t m_tcp_fin = 0x01;
+    static constexpr uint8_t m_tcp_psh = 0x08;
+    static constexpr uint8_t m_tcp_cwr = 0x80;
+
+    static uint16_t get16(const uint8_t *p)
+    {
+        return p[0] << 8 | p[1];
+    }
+
+    static void put16(uint8_t *p, uint16_t v)
+    {
+        p[0] = v >> 8;
+        p[1] = v;
+    }
+
+    static uint32_t get32(const uint8_t *p)
+    {
+        return static_cast<uint32_t>(get16(p)) << 16 | get16(p + 2);
+    }
+
+    static void put32(uint8_t *p, uint32_t v)
+    {
+        put16(p, v >> 16);
+        put16(p + 2, v);
+    }
+
+    static uint32_t csum_add(uint32_t sum, const uint8_t *data, size_t len)
+    {
+        for (; len > 1; len -= 2, data += 2)
+            sum += get16(data);
+
+        if (len)
+            sum += data[0] << 8;
+
+        return sum;
+    }
+
+    static uint16_t csum_fold(uint32_t sum)
+    {
+        while (sum >> 16)
+            sum = (sum & 0xffff) + (sum >> 16);
+
+        return ~sum;
+    }
+
+    bool is_ipv4(const uint8_t *pkt) const
+    {
+        return (pkt[m_l2_len] >> 4) == 4;
+    }
+
+    /* checksum of the IP pseudo header for a transport segment */
+    uint32_t csum_pseudo(const uint8_t *pkt, uint8_t proto, size_t len) const
+    {
+        const uint8_t *ip = pkt + m_l2_len;
+        uint32_t sum = proto + len;
+
+        if (is_ipv4(pkt))
+            return csum_add(sum, ip + 12, 8);
+
+        return csum_add(sum, ip + 8, 32);
+    }
+
+    void fix_ip(uint8_t *seg, size_t len, size_t segment) const
+    {
+        uint8_t *ip = seg + m_l2_len;
+        size_t ihl;
+
+        if (!is_ipv4(seg)) {
+            put16(ip + 4, len - m_l2_len - 40);
+            return;
+        }
+
+        ihl = (ip[0] & 0x0f)*4;
+        put16(ip + 2, len - m_l2_len);
+        put16(ip + 4, get16(ip + 4) + segment);
+        put16(ip + 10, 0);
+        put16(ip + 10, csum_fold(csum_add(0, ip, ihl)));
+    }
+
+    void fix_tcp(uint8_t *seg, size_t len, bool first, bool last) const
+    {
+        uint8_t *tcp = seg + m_l4;
+        uint32_t sum;
+
+        put32(tcp + 4, get32(tcp + 4) + m_offset);
+
+        if (!last)
+            tcp[13] &= ~(m_tcp_fin | m_tcp_psh);
+
+        if (!first)
+            tcp[13] &= ~m_tcp_cwr;
+
+        put16(tcp + 16, 0);
+        sum = csum_pseudo(seg, IPPROTO_TCP, len - m_l4);
+        put16(tcp + 16, csum_fold(csum_add(sum, tcp, len - m_l4)));
+    }
+
+    void fix_udp(uint8_t *seg, size_t len) const
+    {
+        uint8_t *udp = seg + m_l4;
+        uint16_t csum;
+
+        put16(udp + 4, len - m_l4);
+        put16(udp + 6, 0);
+        csum = csum_fold(csum_add(csum_pseudo(seg, IPPROTO_UDP, len - m_l4),
+                                  udp, len - m_l4));
+        put16(udp + 6, csum ? csum : 0xffff);
+    }
+
+    /* the kernel left the pseudo header sum in the checksum field */
+    void complete_csum(uint8_t *seg, size_t len) const
+    {
+        size_t start = m_vnet.csum_start;
+        size_t field = start + m_vnet.csum_offset;
+
+        if (!(m_vnet.flags & m_needs_csum))
+            return;
+
+        if (field + 2 > len)
+            throw std::runtime_error("vnet checksum out of packet");
+
+        put16(seg + field, csum_fold(csum_add(0, seg + start, len - start)));
+    }
+
+    uint8_t gso_type() const
+    {
+        return m_vnet.gso_type & ~m_gso_ecn;
+    }
+
+    bool is_udp() const
+    {
+        return gso_type() == m_gso_udp_l4;
+    }
+
+    void parse()
+    {
+        const uint8_t *ip = m_pkt + m_l2_len;
+
+        if (m_vnet.flags & m_needs_csum)
+            m_l4 = m_vnet.csum_start;
+        else if (is_ipv4(m_pkt))
+            m_l4 = m_l2_len + (ip[0] & 0x0f)*4;
+        else
+            m_l4 = m_l2_len + 40;
+
+        if (is_udp())
+            m_hdr_len = m_l4 + 8;
+        else
+            m_hdr_len = m_l4 + (m_pkt[m_l4 + 12] >> 4)*4;
+
+        if (m_hdr_len >= m_len || !m_vnet.gso_size)
+            throw std::runtime_error("invalid vnet gso packet");
+    }
+
+  public:
+    explicit vnet_gso(size_t l2_len)
+        : m_l2_len(l2_len)
+    {}
+
+    static constexpr size_t vnet_len()
+    {
+        return sizeof(struct hdr);
+    }
+
+    /* largest packet read from the device, including the vnet header */
+    static constexpr size_t max_len()
+    {
+        return vnet_len() + 65536;
+    }
+
+    /* take a packet read from the device; it must stay untouched until
+     * next() returned false */
+    void load(uint8_t *pkt, size_t len)
+    {
+        if (len < vnet_len())
+            throw std::runtime_error("short vnet packet");
+
+        memcpy(&m_vnet, pkt, vnet_len());
+        m_pkt = pkt + vnet_len();
+        m_len = len - vnet_len();
+        m_offset = 0;
+        m_segment = 0;
+        m_done = false;
+
+        if (gso_type() != m_gso_none)
+            parse();
+    }
+
+    /* copy the next segment to out and return its length, or 0 when the
+     * loaded packet is used up */
+    size_t next(uint8_t *out, size_t max)
+    {
+        size_t payload, seg_len, len;
+
+        if (m_done)
+            return 0;
+
+        if (gso_type() == m_gso_none) {
+            if (m_len > max)
+                throw std::runtime_error("vnet packet exceeds buffer");
+
+            memcpy(out, m_pkt, m_len);
+            complete_csum(out, m_len);
+            m_done = true;
+
+            return m_len;
+        }
+
+        payload = m_len - m_hdr_len;
+        seg_len = std::min<size_t>(m_vnet.gso_size, payload - m_offset);
+        len = m_hdr_len + seg_len;
+
+        if (len > max)
+            throw std::runtime_error("vnet segment exceeds buffer");
+
+        memcpy(out, m_pkt, m_hdr_len);
+        memcpy(out + m_hdr_len, m_pkt + m_hdr_len + m_offset, seg_len);
+        fix_ip(out, len, m_segment);
+
+        if (is_udp())
+            fix_udp(out, len);
+        else
+            fix_tcp(out, len, m_offset == 0, m_offset + seg_len == payload);
+
+        m_offset += seg_len;
+        m_segment++;
+        m_done = m_offset == payload;
+
+        return len;
+    }
+};
@@ -0,0 +1,702 @@
+#pragma once
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstring>
+#include <system_error>
+#include <vector>
+
+#include "kwargs.hpp"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+static constexpr char xdp_default_interface[] = "lo";
+
+struct xdp_sock_args
+{
+    static const Kwarg<const char *> interface;
+    static const Kwarg<int> promisc;
+    static const Kwarg<int> queue;
+    static const Kwarg<int> xdp_copy;
+    static const Kwarg<size_t> xdp_frames;
+};
+
+decltype(xdp_sock_args::interface) xdp_sock_args::interface;
+decltype(xdp_sock_args::promisc) xdp_sock_args::promisc;
+decltype(xdp_sock_args::queue) xdp_sock_args::queue;
+decltype(xdp_sock_args::xdp_copy) xdp_sock_args::xdp_copy;
+decltype(xdp_sock_args::xdp_frames) xdp_sock_args::xdp_frames;
+
+/* AF_XDP replacement for eth_sock.
+ *
+ * A small XDP program redirects frames with our ethertype arriving on the
+ * given interface queue to the socket; everything else goes to the kernel
+ * stack. Received frames are handed up without a copy (the buffer is
+ * attached to the umem frame until the next read_pkt()), sent frames are
+ * copied into umem and kicked once per flush() or half tx ring.
+ *
+ * Classic BPF programs attached by eth_filter_* are not applied by the kernel
+ * to XDP traffic, so they are read back from the socket and run here.
+ *
+ * Set xdp_copy=1 to attach in generic mode and force copy mode, e.g. on veth
+ * pairs. */
+template<class super>
+class xdp_sock :
+    public super,
+    public xdp_sock_args
+{
+    typedef typename super::buffer_ptr buf_ptr;
+
+    static const uint16_t m_proto = 0x4307;
+    static constexpr size_t m_frame_size = 2048; /* smallest umem chunk */
+
+    /* owners of the resources set up by the constructor, so that those
+     * set up before a failure are released again */
+    struct fd_owner {
+        int fd = -1;
+
+        fd_owner() {}
+        fd_owner(const fd_owner &) = delete;
+        fd_owner &operator=(const fd_owner &) = delete;
+
+        ~fd_owner()
+        {
+            if (fd >= 0)
+                close(fd);
+        }
+    };
+
+    struct map_owner {
+        void *addr = MAP_FAILED;
+        size_t len = 0;
+
+        map_owner() {}
+        map_owner(const map_owner &) = delete;
+        map_owner &operator=(const map_owner &) = delete;
+
+        ~map_owner()
+        {
+            if (addr != MAP_FAILED)
+                munmap(addr, len);
+        }
+    };
+
+    struct promisc_owner {
+        const char *interface = NULL;
+
+        promisc_owner() {}
+        promisc_owner(const promisc_owner &) = delete;
+        promisc_owner &operator=(const promisc_owner &) = delete;
+
+        ~promisc_owner()
+        {
+            if (!interface)
+                return;
+
+            try {
+                promisc_set(interface, false);
+            } catch (const std::system_error &) {
+                /* the interface may be gone already */
+            }
+        }
+    };
+
+    template<typename desc_type>
+    struct ring {
+        uint32_t *producer = NULL;
+        uint32_t *consumer = NULL;
+        uint32_t *flags = NULL;
+        desc_type *descs = NULL;
+        map_owner map;
+        uint32_t mask = 0;
+
+        uint32_t load(uint32_t *idx) const
+        {
+            return __atomic_load_n(idx, __ATOMIC_ACQUIRE);
+        }
+
+        void store(uint32_t *idx, uint32_t val)
+        {
+            __atomic_store_n(idx, val, __ATOMIC_RELEASE);
+        }
+
+        /* entries ready for the consumer side */
+        uint32_t ready() const
+        {
+            return load(producer) - load(consumer);
+        }
+
+        /* free entries for the producer side */
+        uint32_t space() const
+        {
+            return mask + 1 - ready();
+        }
+
+        bool need_wakeup() const
+        {
+            return load(flags) & XDP_RING_NEED_WAKEUP;
+        }
+    };
+
+    int m_index, m_mtu, m_queue;
+    const char *m_interface;
+    uint8_t m_address[ETH_ALEN];
+    bool m_promisc;
+    bool m_copy;
+
+    /* released in the reverse order: program first, promisc last */
+    promisc_owner m_promisc_owner;
+    map_owner m_umem_map;
+    fd_owner m_sock;
+    ring<uint64_t> m_fill, m_comp;
+    ring<struct xdp_desc> m_rx, m_tx;
+    fd_owner m_map;
+    fd_owner m_prog;
+    fd_owner m_link;
+
+    int m_fd = -1;
+    uint8_t *m_umem = NULL;
+    size_t m_frames;
+    std::vector<uint64_t> m_tx_free;
+    size_t m_tx_pending = 0;
+
+    uint64_t m_rx_hold;
+    bool m_rx_busy = false;
+
+    std::vector<struct sock_filter> m_filter;
+    bool m_filter_read = false;
+
+    static long bpf(int cmd, union bpf_attr *attr)
+    {
+        return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+    }
+
+    static void if_ioctl(const char *interface, unsigned long req,
+                         struct ifreq *ifr, const char *err)
+    {
+        int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+        if (sock < 0)
+            throw std::system_error(errno, std::system_category(), err);
+
+        strncpy(ifr->ifr_name, interface, IFNAMSIZ);
+
+        if (ioctl(sock, req, ifr) < 0) {
+            close(sock);
+            throw std::system_error(errno, std::system_category(), err);
+        }
+
+        close(sock);
+    }
+
+    void read_interface()
+    {
+        struct ifreq ifr;
+
+        memset(&ifr, 0, sizeof(ifr));
+        if_ioctl(m_interface, SIOCGIFHWADDR, &ifr,
+                 "unable to read interface address");
+        memcpy(m_address, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+        if_ioctl(m_interface, SIOCGIFINDEX, &ifr,
+                 "unable to read interface index");
+        m_index = ifr.ifr_ifindex;
+
+        if_ioctl(m_interface, SIOCGIFMTU, &ifr,
+                 "unable to read interface mtu");
+        m_mtu = ifr.ifr_mtu;
+    }
+
+    static void promisc_set(const char *interface, bool on)
+    {
+        struct ifreq ifr;
+
+        memset(&ifr, 0, sizeof(ifr));
+        if_ioctl(interface, SIOCGIFFLAGS, &ifr,
+                 "unable to read interface flags");
+
+        if (on)
+            ifr.ifr_flags |= IFF_PROMISC;
+        else
+            ifr.ifr_flags &= ~IFF_PROMISC;
+
+        if_ioctl(interface, SIOCSIFFLAGS, &ifr,
+                 "unable to set interface promisc");
+    }
+
+    void promisc_on()
+    {
+        promisc_set(m_interface, true);
+        m_promisc_owner.interface = m_interface;
+    }
+
+    void sock_open()
+    {
+        m_sock.fd = socket(AF_XDP, SOCK_RAW, 0);
+
+        if (m_sock.fd < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to open xdp socket");
+
+        m_fd = m_sock.fd;
+    }
+
+    void xdp_opt(int opt, const void *val, socklen_t len)
+    {
+        if (setsockopt(m_fd, SOL_XDP, opt, val, len) < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to configure xdp socket");
+    }
+
+    template<typename desc_type>
+    void ring_map(ring<desc_type> &r, const struct xdp_ring_offset &off,
+                  uint32_t size, off_t pgoff)
+    {
+        uint8_t *map;
+
+        r.map.len = off.desc + size*sizeof(desc_type);
+        r.map.addr = mmap(NULL, r.map.len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, m_fd, pgoff);
+
+        if (r.map.addr == MAP_FAILED)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to map xdp ring");
+
+        map = reinterpret_cast<uint8_t *>(r.map.addr);
+        r.producer = reinterpret_cast<uint32_t *>(map + off.producer);
+        r.consumer = reinterpret_cast<uint32_t *>(map + off.consumer);
+        r.flags = reinterpret_cast<uint32_t *>(map + off.flags);
+        r.descs = reinterpret_cast<desc_type *>(map + off.desc);
+        r.mask = size - 1;
+    }
+
+    void umem_setup()
+    {
+        struct xdp_umem_reg reg;
+        struct xdp_mmap_offsets off;
+        socklen_t off_len = sizeof(off);
+        uint32_t size = m_frames/2;
+
+        m_umem_map.len = m_frames*m_frame_size;
+        m_umem_map.addr = mmap(NULL, m_umem_map.len, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (m_umem_map.addr == MAP_FAILED)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to allocate umem");
+
+        m_umem = reinterpret_cast<uint8_t *>(m_umem_map.addr);
+
+        memset(&reg, 0, sizeof(reg));
+        reg.addr = reinterpret_cast<uint64_t>(m_umem);
+        reg.len = m_frames*m_frame_size;
+        reg.chunk_size = m_frame_size;
+        reg.headroom = 0;
+
+        xdp_opt(XDP_UMEM_REG, &reg, sizeof(reg));
+        xdp_opt(XDP_UMEM_FILL_RING, &size, sizeof(size));
+        xdp_opt(XDP_UMEM_COMPLETION_RING, &size, sizeof(size));
+        xdp_opt(XDP_RX_RING, &size, sizeof(size));
+        xdp_opt(XDP_TX_RING, &size, sizeof(size));
+
+        if (getsockopt(m_fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &off_len) < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to read xdp ring offsets");
+
+        ring_map(m_fill, off.fr, size, XDP_UMEM_PGOFF_FILL_RING);
+        ring_map(m_comp, off.cr, size, XDP_UMEM_PGOFF_COMPLETION_RING);
+        ring_map(m_rx, off.rx, size, XDP_PGOFF_RX_RING);
+        ring_map(m_tx, off.tx, size, XDP_PGOFF_TX_RING);
+
+        /* first half of umem is for receiving, second half for sending */
+        for (uint32_t i = 0; i < size; ++i)
+            m_fill.descs[i] = i*m_frame_size;
+
+        m_fill.store(m_fill.producer, size);
+
+        for (size_t i = size; i < m_frames; ++i)
+            m_tx_free.push_back(i*m_frame_size);
+    }
+
+    void sock_bind()
+    {
+        struct sockaddr_xdp sxdp;
+
+        memset(&sxdp, 0, sizeof(sxdp));
+        sxdp.sxdp_family = AF_XDP;
+        sxdp.sxdp_ifindex = m_index;
+        sxdp.sxdp_queue_id = m_queue;
+        sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP;
+
+        if (m_copy)
+            sxdp.sxdp_flags |= XDP_COPY;
+
+        if (bind(m_fd, reinterpret_cast<struct sockaddr *>(&sxdp),
+                 sizeof(sxdp)) < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to bind xdp socket");
+    }
+
+    void map_create()
+    {
+        union bpf_attr attr;
+        uint32_t key = m_queue;
+        uint32_t val = m_fd;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.map_type = BPF_MAP_TYPE_XSKMAP;
+        attr.key_size = sizeof(key);
+        attr.value_size = sizeof(val);
+        attr.max_entries = m_queue + 1;
+
+        if ((m_map.fd = bpf(BPF_MAP_CREATE, &attr)) < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to create xsk map");
+
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = m_map.fd;
+        attr.key = reinterpret_cast<uint64_t>(&key);
+        attr.value = reinterpret_cast<uint64_t>(&val);
+
+        if (bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to add socket to xsk map");
+    }
+
+    void prog_load()
+    {
+        union bpf_attr attr;
+        static const char license[] = "GPL";
+        struct bpf_insn prog[] = {
+            /* r6 = ctx */
+            { BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0 },
+            /* r2 = ctx->data, r3 = ctx->data_end */
+            { BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, 0, 0 },
+            { BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6, 4, 0 },
+            /* pass if shorter than an ethernet header */
+            { BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0 },
+            { BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, ETH_HLEN },
+            { BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 8, 0 },
+            /* pass if not our ethertype */
+            { BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 12, 0 },
+            { BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 6, htons(m_proto) },
+            /* return redirect_map(map, ctx->rx_queue_index, XDP_PASS) */
+            { BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, 16, 0 },
+            { BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0,
+              m_map.fd },
+            { 0, 0, 0, 0, 0 },
+            { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS },
+            { BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map },
+            { BPF_JMP | BPF_EXIT, 0, 0, 0, 0 },
+            /* return XDP_PASS */
+            { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS },
+            { BPF_JMP | BPF_EXIT, 0, 0, 0, 0 },
+        };
+
+        memset(&attr, 0, sizeof(attr));
+        attr.prog_type = BPF_PROG_TYPE_XDP;
+        attr.insns = reinterpret_cast<uint64_t>(prog);
+        attr.insn_cnt = sizeof(prog)/sizeof(prog[0]);
+        attr.license = reinterpret_cast<uint64_t>(license);
+
+        if ((m_prog.fd = bpf(BPF_PROG_LOAD, &attr)) < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to load xdp program");
+
+        memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd = m_prog.fd;
+        attr.link_create.target_ifindex = m_index;
+        attr.link_create.attach_type = BPF_XDP;
+        attr.link_create.flags = m_copy ? XDP_FLAGS_SKB_MODE : 0;
+
+        if ((m_link.fd = bpf(BPF_LINK_CREATE, &attr)) < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to attach xdp program");
+    }
+
+    /* fetch the classic filter attached by eth_filter_* (if any) */
+    void filter_read()
+    {
+        socklen_t len = 0;
+
+        m_filter_read = true;
+
+        if (getsockopt(m_fd, SOL_SOCKET, SO_GET_FILTER, NULL, &len) < 0 ||
+            len == 0)
+            return;
+
+        m_filter.resize(len);
+
+        if (getsockopt(m_fd, SOL_SOCKET, SO_GET_FILTER, &m_filter[0],
+                       &len) < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to read socket filter");
+    }
+
+    /* run the subset of classic BPF used by eth_filter_base */
+    bool filter_accept(const uint8_t *pkt, uint32_t len)
+    {
+        uint32_t a = 0;
+
+        if (!m_filter_read)
+            filter_read();
+
+        for (size_t pc = 0; pc < m_filter.size(); ++pc) {
+            const struct sock_filter &f = m_filter[pc];
+
+            switch (f.code) {
+                case BPF_LD | BPF_W | BPF_ABS:
+                    if (f.k + 4 > len)
+                        return false;
+                    a = ntohl(*reinterpret_cast<const uint32_t *>(pkt + f.k));
+                    break;
+
+                case BPF_LD | BPF_H | BPF_ABS:
+                    if (f.k + 2 > len)
+                        return false;
+                    a = ntohs(*reinterpret_cast<const uint16_t *>(pkt + f.k));
+                    break;
+
+                case BPF_LD | BPF_B | BPF_ABS:
+                    if (f.k + 1 > len)
+                        return false;
+                    a = pkt[f.k];
+                    break;
+
+                case BPF_LD | BPF_W | BPF_LEN:
+                    a = len;
+                    break;
+
+                case BPF_ALU | BPF_AND | BPF_K:
+                    a &= f.k;
+                    break;
+
+                case BPF_JMP | BPF_JEQ | BPF_K:
+                    pc += a == f.k ? f.jt : f.jf;
+                    break;
+
+                case BPF_JMP | BPF_JGT | BPF_K:
+                    pc += a > f.k ? f.jt : f.jf;
+                    break;
+
+                case BPF_JMP | BPF_JGE | BPF_K:
+                    pc += a >= f.k ? f.jt : f.jf;
+                    break;
+
+                case BPF_RET | BPF_K:
+                    return f.k != 0;
+
+                default:
+                    throw std::runtime_error("unsupported filter instruction");
+            }
+        }
+
+        return true;
+    }
+
+    void fill_put(uint64_t addr)
+    {
+        uint32_t idx = *m_fill.producer;
+
+        m_fill.descs[idx & m_fill.mask] = addr;
+        m_fill.store(m_fill.producer, idx + 1);
+
+        if (m_fill.need_wakeup())
+            recvfrom(m_fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+
+    /* frames are given back to the fill ring once the layers above are done
+     * with them, i.e. on the next read */
+    void rx_release()
+    {
+        if (!m_rx_busy)
+            return;
+
+        fill_put(m_rx_hold);
+        m_rx_busy = false;
+    }
+
+    void tx_complete()
+    {
+        uint32_t idx = *m_comp.consumer;
+        uint32_t count = m_comp.ready();
+
+        for (uint32_t i = 0; i < count; ++i)
+            m_tx_free.push_back(m_comp.descs[(idx + i) & m_comp.mask]);
+
+        m_comp.store(m_comp.consumer, idx + count);
+    }
+
+    /* copy mode sends a limited batch per syscall and returns EAGAIN if
+     * more is left, so keep kicking as long as the ring makes progress;
+     * false if the kernel left frames in the ring, which stay pending */
+    bool tx_kick()
+    {
+        uint32_t consumer;
+
+        while (m_tx.ready()) {
+            consumer = m_tx.load(m_tx.consumer);
+
+            if (sendto(m_fd, NULL, 0, MSG_DONTWAIT, NULL, 0) >= 0)
+                continue;
+
+            if (errno == EAGAIN && m_tx.load(m_tx.consumer) != consumer)
+                continue;
+
+            if (errno == EAGAIN || errno == EBUSY || errno == ENOBUFS)
+                return false;
+
+            /* the frames are sent once the interface is up again */
+            if (errno == ENETDOWN)
+                break;
+
+            throw std::system_error(errno, std::system_category(),
+                                    "unable to kick xdp tx ring");
+        }
+
+        m_tx_pending = 0;
+
+        return true;
+    }
+
+  public:
+    template<typename... Args> explicit
+    xdp_sock(const Args&... args)
+        : super(args...),
+          m_queue(kwget(queue, 0, args...)),
+          m_interface(kwget(interface, xdp_default_interface, args...)),
+          m_promisc(kwget(promisc, 0, args...)),
+          m_copy(kwget(xdp_copy, 0, args...)),
+          m_frames(kwget(xdp_frames, 4096, args...))
+    {
+        read_interface();
+
+        if (m_promisc)
+            promisc_on();
+
+        sock_open();
+        umem_setup();
+        sock_bind();
+        map_create();
+        prog_load();
+    }
+
+    int fd()
+    {
+        return m_fd;
+    }
+
+    uint16_t proto()
+    {
+        return m_proto;
+    }
+
+    size_t data_size_max()
+    {
+        return m_mtu + ETH_HLEN;
+    }
+
+    const uint8_t *interface_address() const
+    {
+        return m_address;
+    }
+
+    /* false while frames are left in the tx ring; as with eth_ring, the
+     * caller then flushes again from its write callback on fd() */
+    bool flush()
+    {
+        if (!m_tx_pending)
+            return true;
+
+        /* zero-copy drivers may pick up the tx ring without a syscall, copy
+         * mode always needs one */
+        if (m_copy || m_tx.need_wakeup())
+            return tx_kick();
+
+        m_tx_pending = 0;
+
+        return true;
+    }
+
+    bool read_pkt(buf_ptr &buf)
+    {
+        struct xdp_desc desc;
+        uint32_t idx;
+
+        while (true) {
+            rx_release();
+
+            if (!m_rx.ready())
+                return false;
+
+            idx = *m_rx.consumer;
+            desc = m_rx.descs[idx & m_rx.mask];
+            m_rx.store(m_rx.consumer, idx + 1);
+
+            m_rx_hold = desc.addr & ~static_cast<uint64_t>(m_frame_size - 1);
+            m_rx_busy = true;
+
+            if (filter_accept(m_umem + desc.addr, desc.len))
+                break;
+        }
+
+        buf->attach(m_umem + m_rx_hold, m_umem + desc.addr,
+                    m_umem + m_rx_hold + m_frame_size);
+        buf->push(desc.len);
+
+        return true;
+    }
+
+    bool write_pkt(buf_ptr &buf)
+    {
+        struct xdp_desc *desc;
+        uint64_t addr;
+        uint32_t idx;
+
+        tx_complete();
+
+        if (m_tx_free.empty() || !m_tx.space()) {
+            tx_kick();
+            tx_complete();
+
+            if (m_tx_free.empty() || !m_tx.space())
+                return false;
+        }
+
+        if (buf->len() > m_frame_size)
+            throw std::runtime_error("packet too large for umem frame");
+
+        addr = m_tx_free.back();
+        m_tx_free.pop_back();
+        memcpy(m_umem + addr, buf->head(), buf->len());
+
+        idx = *m_tx.producer;
+        desc = &m_tx.descs[idx & m_tx.mask];
+        desc->addr = addr;
+        desc->len = buf->len();
+        desc->options = 0;
+        m_tx.store(m_tx.producer, idx + 1);
+
+        if (++m_tx_pending >= (m_tx.mask + 1)/2)
+            tx_kick();
+
+        return true;
+    }
+};
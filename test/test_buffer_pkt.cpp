@@ -0,0 +1,28 @@
+#include <cstdint>
+
+#include <gtest/gtest.h>
+
+#include "buffer_pkt.hpp"
+
+/* a buffer attached to a frame of a packet ring reports the room left in
+ * that frame, and its own again once reset */
+TEST(buffer_pkt, attach_bounds)
+{
+    uint8_t frame[256];
+    buffer_pkt buf(1500);
+
+    buf.head_reserve(14);
+    buf.attach(frame, frame + 64, frame + sizeof(frame));
+    buf.push(100);
+
+    EXPECT_EQ(frame + 64, buf.head());
+    EXPECT_EQ(frame + 78, buf.data());
+    EXPECT_EQ(64U, buf.max_head_len());
+    EXPECT_EQ(sizeof(frame), buf.max_len());
+    EXPECT_EQ(sizeof(frame) - 78, buf.max_data_len());
+
+    buf.reset();
+
+    EXPECT_EQ(1500U, buf.max_len());
+    EXPECT_NE(frame, buf.head());
+}
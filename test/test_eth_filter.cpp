@@ -0,0 +1,105 @@
+#include <gtest/gtest.h>
+
+#include "veth_test.hpp"
+#include "eth_filter.hpp"
+#include "rlnc_hdr.hpp"
+#include "eth_hdr.hpp"
+#include "eth_topology.hpp"
+#include "eth_sock.hpp"
+#include "rlnc_info.hpp"
+#include "buffer_pkt.hpp"
+#include "slab_pool.hpp"
+#include "final_layer.hpp"
+
+/* The filters of the rlnc stacks on a veth pair, with the headers of the
+ * stacks above them. */
+
+template<template<class> class filter>
+using node = filter<
+        rlnc_hdr<
+        eth_hdr<
+        eth_topology<
+        eth_sock<
+        rlnc_info<
+        slab_pool<buffer_pkt,
+        final_layer
+        >>>>>>>;
+
+typedef node<eth_filter_enc> enc_node;
+typedef node<eth_filter_dec> dec_node;
+
+class eth_filter_test : public veth_test
+{
+};
+
+TEST_F(eth_filter_test, hello_exchange)
+{
+    enc_node enc(enc_node::interface=veth_a,
+                 enc_node::neighbor=m_addr_b.c_str(),
+                 enc_node::hdr_format=enc_node::rlnc_wide16);
+    dec_node dec(dec_node::interface=veth_b,
+                 dec_node::neighbor=m_addr_a.c_str(),
+                 dec_node::hdr_format=enc_node::rlnc_wide16);
+
+    nonblock(enc);
+    nonblock(dec);
+
+    /* the hello of the encoder went out before the decoder was there; the
+     * one of the decoder is answered */
+    pump(enc, dec);
+
+    EXPECT_EQ(enc_node::rlnc_wide16, enc.rlnc_hdr_format());
+    EXPECT_EQ(dec_node::rlnc_wide16, dec.rlnc_hdr_format());
+}
+
+TEST_F(eth_filter_test, wide_packets)
+{
+    enc_node enc(enc_node::interface=veth_a,
+                 enc_node::neighbor=m_addr_b.c_str(),
+                 enc_node::hdr_format=enc_node::rlnc_wide32);
+    dec_node dec(dec_node::interface=veth_b,
+                 dec_node::neighbor=m_addr_a.c_str(),
+                 dec_node::hdr_format=enc_node::rlnc_wide32);
+
+    nonblock(enc);
+    nonblock(dec);
+    pump(enc, dec);
+
+    ASSERT_EQ(enc_node::rlnc_wide32, enc.rlnc_hdr_format());
+
+    /* wide coded packets reach the decoder */
+    send(enc, [&](enc_node::buffer_ptr &b) { enc.rlnc_hdr_add_enc(b); });
+    EXPECT_EQ(1U, pump(dec, enc));
+
+    send(enc, [&](enc_node::buffer_ptr &b) { enc.rlnc_hdr_add_rec(b); });
+    EXPECT_EQ(1U, pump(dec, enc));
+
+    /* types not meant for the decoder are still filtered */
+    send(enc, [&](enc_node::buffer_ptr &b) { enc.rlnc_hdr_add_stop(b); });
+    EXPECT_EQ(0U, pump(dec, enc));
+}
+
+TEST_F(eth_filter_test, stamped_packets)
+{
+    enc_node enc(enc_node::interface=veth_a,
+                 enc_node::neighbor=m_addr_b.c_str(),
+                 enc_node::hdr_stamps=1);
+    dec_node dec(dec_node::interface=veth_b,
+                 dec_node::neighbor=m_addr_a.c_str(),
+                 dec_node::hdr_stamps=1);
+
+    nonblock(enc);
+    nonblock(dec);
+    pump(enc, dec);
+
+    /* compact headers, with only the stamp flag set */
+    ASSERT_EQ(enc_node::rlnc_compact, enc.rlnc_hdr_format());
+    ASSERT_TRUE(enc.rlnc_hdr_stamping());
+    ASSERT_TRUE(dec.rlnc_hdr_stamping());
+
+    send(enc, [&](enc_node::buffer_ptr &b) {
+        enc.rlnc_hdr_add_enc(b);
+        enc.rlnc_hdr_add_stamp(b, 1, 2);
+    });
+    EXPECT_EQ(1U, pump(dec, enc));
+}
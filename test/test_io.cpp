@@ -0,0 +1,181 @@
+#include <unistd.h>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "io.hpp"
+#include "io_ring.hpp"
+#include "uring_io.hpp"
+#include "udp_sock.hpp"
+#include "buffer_pool.hpp"
+#include "buffer_pkt.hpp"
+#include "final_layer.hpp"
+
+/* The reactor with both backends. */
+
+template<class reactor>
+class io_test : public ::testing::Test
+{
+};
+
+typedef uring_io<
+        udp_sock_client<
+        buffer_pool<buffer_pkt,
+        final_layer
+        >>> client_stack;
+
+typedef uring_io<
+        udp_sock_server<
+        buffer_pool<buffer_pkt,
+        final_layer
+        >>> server_stack;
+
+typedef ::testing::Types<io, io_ring> reactors;
+TYPED_TEST_SUITE(io_test, reactors);
+
+/* timers of the wheel don't count as handled fds, so callers still see
+ * the idle returns they run their own timeouts from */
+TYPED_TEST(io_test, timers_return_idle)
+{
+    TypeParam r;
+    wheel_timer t;
+    bool fired = false;
+    int res = 1;
+
+    t.callback([&fired]() { fired = true; });
+    r.add_timer(t, 5);
+
+    for (size_t i = 0; i < 10 && !fired; ++i)
+        res = r.wait(1000);
+
+    EXPECT_TRUE(fired);
+    EXPECT_EQ(0, res);
+}
+
+TYPED_TEST(io_test, fds_counted)
+{
+    TypeParam r;
+    int fds[2];
+    char c = 0;
+
+    ASSERT_EQ(0, pipe(fds));
+    r.add_cb(fds[0], [&](int fd) { EXPECT_EQ(1, read(fd, &c, 1)); }, NULL);
+    ASSERT_EQ(1, write(fds[1], "x", 1));
+
+    EXPECT_EQ(1, r.wait(1000));
+    EXPECT_EQ('x', c);
+
+    r.del_cb(fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* packets through uring_io and back; the io_ring moves them with its own
+ * requests, the server answering the sender of the last packet */
+TYPED_TEST(io_test, udp_echo)
+{
+    TypeParam r;
+    const bool ring = std::is_same<TypeParam, io_ring>::value;
+    std::string port = ring ? "18932" : "18931";
+    server_stack s(server_stack::local_address="127.0.0.1",
+                   server_stack::port=port.c_str(),
+                   server_stack::uring=uring_of(r));
+    client_stack c(client_stack::remote_address="127.0.0.1",
+                   client_stack::port=port.c_str(),
+                   client_stack::uring=uring_of(r));
+    std::vector<uint8_t> echoed;
+    const uint8_t count = 64;
+
+    EXPECT_EQ(ring, s.uring_enabled());
+
+    r.add_cb(s.fd(), [&](int) {
+        auto buf = s.buffer();
+
+        while (s.read_pkt(buf)) {
+            EXPECT_TRUE(s.write_pkt(buf));
+            buf->reset();
+        }
+    }, NULL);
+
+    r.add_cb(c.fd(), [&](int) {
+        auto buf = c.buffer();
+
+        while (c.read_pkt(buf)) {
+            EXPECT_EQ(3U, buf->len());
+            echoed.push_back(buf->head()[0]);
+            buf->reset();
+        }
+    }, NULL);
+
+    for (uint8_t i = 0; i < count; ++i) {
+        auto buf = c.buffer();
+
+        memset(buf->data_put(3), i, 3);
+        ASSERT_TRUE(c.write_pkt(buf));
+    }
+
+    for (size_t i = 0; i < 100 && echoed.size() < count; ++i)
+        r.wait(100);
+
+    ASSERT_EQ(count, echoed.size());
+
+    for (uint8_t i = 0; i < count; ++i)
+        EXPECT_EQ(i, echoed[i]);
+
+    r.del_cb(s.fd());
+    r.del_cb(c.fd());
+}
+
+/* other files than sockets are read into the provided buffers too */
+TEST(io_ring_test, file_read)
+{
+    io_ring r;
+    uring_file *f;
+    struct uring_file::pkt p;
+    std::string got;
+    int fds[2];
+
+    ASSERT_EQ(0, pipe(fds));
+    f = r.uring_open(fds[0], 64, 16, false, 4);
+    r.add_cb(fds[0], [&](int) {
+        while (f->recv(&p))
+            got.append(reinterpret_cast<char *>(p.data), p.len);
+    }, NULL);
+
+    /* more writes than buffers, so they are given back and reused */
+    for (const char *s : {"abc", "def", "ghi", "jkl", "mno", "pqr"}) {
+        size_t len = got.size() + 3;
+
+        ASSERT_EQ(3, write(fds[1], s, 3));
+
+        for (size_t i = 0; i < 10 && got.size() < len; ++i)
+            r.wait(100);
+    }
+
+    EXPECT_EQ("abcdefghijklmnopqr", got);
+
+    /* the receive runs out of buffers while nothing is read, and is
+     * armed again once they come back */
+    got.clear();
+    r.disable_read(fds[0]);
+
+    for (const char *s : {"abc", "def", "ghi", "jkl", "mno", "pqr"}) {
+        ASSERT_EQ(3, write(fds[1], s, 3));
+        r.wait(10);
+    }
+
+    EXPECT_EQ("", got);
+    r.enable_read(fds[0]);
+
+    for (size_t i = 0; i < 10 && got.size() < 18; ++i)
+        r.wait(100);
+
+    EXPECT_EQ("abcdefghijklmnopqr", got);
+
+    r.del_cb(fds[0]);
+    r.uring_close(f);
+    close(fds[0]);
+    close(fds[1]);
+}
@@ -0,0 +1,214 @@
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "gf_kernels.hpp"
+#include "rlnc_coder.hpp"
+
+/* Round trips through the netmix coders over both fields, on each gf256
+ * kernel this CPU runs: the decoded data is the encoded data, also with
+ * packets lost and recoded on the way. */
+
+struct symbol_storage {
+    const uint8_t *m_data;
+    size_t m_size;
+};
+
+template<class field>
+class rlnc_coder_test : public ::testing::Test
+{
+  protected:
+    typedef rlnc_encoder<field> encoder;
+    typedef rlnc_decoder<field> decoder;
+
+    /* odd sizes, so the kernels run their unaligned tails too */
+    static constexpr size_t m_symbols = 37;
+    static constexpr size_t m_symbol_size = 1001;
+    static constexpr size_t m_short = 333;
+
+    typename encoder::factory m_enc_factory{m_symbols, m_symbol_size};
+    typename decoder::factory m_dec_factory{m_symbols, m_symbol_size};
+    std::vector<uint8_t> m_data;
+    std::vector<uint8_t> m_pkt;
+    std::vector<uint8_t> m_recoded;
+    unsigned m_seed = 1;
+
+    void SetUp()
+    {
+        m_data.resize(m_symbols*m_symbol_size);
+
+        for (auto &b : m_data)
+            b = rand_r(&m_seed);
+    }
+
+    void TearDown()
+    {
+        gf256::select(gf256::kernels().back().name);
+    }
+
+    bool lost(double p)
+    {
+        return rand_r(&m_seed) < p*RAND_MAX;
+    }
+
+    /* the last symbol is short, and coded as if padded with zeros */
+    typename encoder::pointer build_encoder()
+    {
+        auto enc = m_enc_factory.build();
+
+        for (size_t i = 0; i < m_symbols; ++i) {
+            size_t len = i + 1 < m_symbols ? m_symbol_size : m_short;
+
+            enc->set_symbol(i, symbol_storage{&m_data[i*m_symbol_size], len});
+        }
+
+        m_pkt.resize(enc->payload_size());
+        m_recoded.resize(enc->payload_size());
+
+        return enc;
+    }
+
+    void expect_data(decoder &dec)
+    {
+        std::vector<uint8_t> zeros(m_symbol_size - m_short);
+
+        ASSERT_TRUE(dec.is_complete());
+
+        for (size_t i = 0; i + 1 < m_symbols; ++i)
+            EXPECT_EQ(0, memcmp(dec.symbol(i), &m_data[i*m_symbol_size],
+                                m_symbol_size)) << "symbol " << i;
+
+        EXPECT_EQ(0, memcmp(dec.symbol(m_symbols - 1),
+                            &m_data[(m_symbols - 1)*m_symbol_size], m_short));
+        EXPECT_EQ(0, memcmp(dec.symbol(m_symbols - 1) + m_short, &zeros[0],
+                            zeros.size()));
+    }
+
+    /* encoder to decoder, feedback going back after each packet */
+    void round_trip(bool systematic, double loss)
+    {
+        auto enc = build_encoder();
+        auto dec = m_dec_factory.build();
+        std::vector<uint8_t> feedback(dec->feedback_size());
+        size_t sent = 0;
+
+        if (!systematic)
+            enc->set_systematic_off();
+
+        while (!dec->is_complete() && sent++ < 20*m_symbols) {
+            enc->encode(&m_pkt[0]);
+
+            if (lost(loss))
+                continue;
+
+            dec->decode(&m_pkt[0]);
+            dec->write_feedback(&feedback[0]);
+            enc->read_feedback(&feedback[0]);
+        }
+
+        expect_data(*dec);
+    }
+
+    /* encoder to recoder to decoder, losing packets on both hops; the
+     * recoder sends from whatever rank it has so far */
+    void recode(double loss)
+    {
+        auto enc = build_encoder();
+        auto rec = m_dec_factory.build();
+        auto dec = m_dec_factory.build();
+        size_t sent = 0;
+
+        while (!dec->is_complete() && sent++ < 40*m_symbols) {
+            enc->encode(&m_pkt[0]);
+
+            if (!lost(loss))
+                rec->decode(&m_pkt[0]);
+
+            if (!rec->rank())
+                continue;
+
+            rec->recode(&m_recoded[0]);
+
+            if (!lost(loss))
+                dec->decode(&m_recoded[0]);
+        }
+
+        expect_data(*rec);
+        expect_data(*dec);
+    }
+};
+
+typedef ::testing::Types<gf_binary, gf_binary8> fields;
+TYPED_TEST_SUITE(rlnc_coder_test, fields);
+
+TYPED_TEST(rlnc_coder_test, systematic)
+{
+    for (const auto &k : gf256::kernels()) {
+        SCOPED_TRACE(k.name);
+        gf256::select(k.name);
+        this->round_trip(true, .3);
+    }
+}
+
+TYPED_TEST(rlnc_coder_test, coded)
+{
+    for (const auto &k : gf256::kernels()) {
+        SCOPED_TRACE(k.name);
+        gf256::select(k.name);
+        this->round_trip(false, .3);
+    }
+}
+
+TYPED_TEST(rlnc_coder_test, recoded)
+{
+    for (const auto &k : gf256::kernels()) {
+        SCOPED_TRACE(k.name);
+        gf256::select(k.name);
+        this->recode(.3);
+    }
+}
+
+/* the SIMD kernels give what the scalar one does, for any length and
+ * alignment */
+TEST(gf_kernels_test, match_scalar)
+{
+    const struct gf_kernel &ref = gf256::kernels().front();
+    std::vector<uint8_t> src(300), dst(300), out(300), exp(300);
+    unsigned seed = 1;
+
+    for (auto &b : src)
+        b = rand_r(&seed);
+
+    for (auto &b : dst)
+        b = rand_r(&seed);
+
+    for (const auto &k : gf256::kernels()) {
+        SCOPED_TRACE(k.name);
+
+        for (size_t off : {0, 1, 7}) {
+            for (size_t len : {0, 1, 15, 16, 17, 31, 32, 33, 100, 255}) {
+                for (unsigned c : {0, 1, 2, 0x53, 0xff}) {
+                    out = dst;
+                    exp = dst;
+                    k.mul_add(&out[off], &src[off], c, len);
+                    ref.mul_add(&exp[off], &src[off], c, len);
+                    EXPECT_EQ(exp, out) << "mul_add " << c << " " << len;
+
+                    out = dst;
+                    exp = dst;
+                    k.mul(&out[off], c, len);
+                    ref.mul(&exp[off], c, len);
+                    EXPECT_EQ(exp, out) << "mul " << c << " " << len;
+                }
+
+                out = dst;
+                exp = dst;
+                k.add(&out[off], &src[off], len);
+                ref.add(&exp[off], &src[off], len);
+                EXPECT_EQ(exp, out) << "add " << len;
+            }
+        }
+    }
+}
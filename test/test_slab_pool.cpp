@@ -0,0 +1,40 @@
+#include <gtest/gtest.h>
+
+#include "buffer_pkt.hpp"
+#include "slab_pool.hpp"
+#include "final_layer.hpp"
+
+typedef slab_pool<buffer_pkt, final_layer> pool;
+
+/* buffers handed to another stack outlive the pool they came from */
+TEST(slab_pool, buffer_outlives_pool)
+{
+    pool::buffer_ptr buf;
+
+    {
+        pool p;
+
+        buf = p.buffer();
+        EXPECT_EQ(1U, p.pool_slab().in_use(p.pool_slab().classes() - 1));
+    }
+
+    memset(buf->data_put(16), 0, 16);
+    buf.reset();
+}
+
+/* a shared slab is freed by the last of its owner and buffers */
+TEST(slab_pool, shared_slab)
+{
+    pool::slab_type *slab = new pool::slab_type(4, 256, 2048);
+    pool::buffer_ptr buf;
+
+    {
+        pool p(pool::slab=slab);
+
+        buf = p.buffer(100);
+        EXPECT_EQ(1U, slab->in_use(0));
+    }
+
+    slab->release();
+    buf.reset();
+}
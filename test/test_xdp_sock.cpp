@@ -0,0 +1,180 @@
+#include <memory>
+#include <system_error>
+
+#include <gtest/gtest.h>
+
+#include "veth_test.hpp"
+#include "eth_filter.hpp"
+#include "rlnc_data_rec.hpp"
+#include "rlnc_coder.hpp"
+#include "rlnc_hdr.hpp"
+#include "timers.hpp"
+#include "budgets.hpp"
+#include "eth_hdr.hpp"
+#include "error_estimator.hpp"
+#include "loss.hpp"
+#include "eth_topology.hpp"
+#include "xdp_sock.hpp"
+#include "error_info.hpp"
+#include "rlnc_info.hpp"
+#include "buffer_pkt.hpp"
+#include "slab_pool.hpp"
+#include "final_layer.hpp"
+
+/* The rlnc stacks with xdp_sock in place of eth_sock, in copy mode on a veth
+ * pair. Skipped where AF_XDP sockets or programs are unavailable. */
+
+template<template<class> class filter>
+using node = filter<
+        rlnc_hdr<
+        eth_hdr<
+        eth_topology<
+        xdp_sock<
+        rlnc_info<
+        slab_pool<buffer_pkt,
+        final_layer
+        >>>>>>>;
+
+typedef node<eth_filter_enc> enc_node;
+typedef node<eth_filter_dec> dec_node;
+
+/* the stack of rlnc_recoder -xdp */
+typedef eth_filter_rec<
+        rlnc_data_rec<rlnc_decoder<gf_binary8>,
+        rlnc_hdr<
+        timers<
+        relay_budgets<
+        eth_hdr<
+        error_estimator<
+        loss_dec<
+        eth_topology<
+        xdp_sock<
+        error_info<
+        rlnc_info<
+        slab_pool<buffer_pkt,
+        final_layer
+        >>>>>>>>>>>>> rec_node;
+
+class xdp_sock_test : public veth_test
+{
+  protected:
+    std::unique_ptr<enc_node> m_enc;
+    std::unique_ptr<dec_node> m_dec;
+
+    /* both ends, or false if the kernel refuses to set them up */
+    bool open(int hdr_format)
+    {
+        try {
+            m_enc.reset(new enc_node(enc_node::interface=veth_a,
+                                     enc_node::neighbor=m_addr_b.c_str(),
+                                     enc_node::hdr_format=hdr_format,
+                                     enc_node::xdp_copy=1,
+                                     enc_node::xdp_frames=size_t(256)));
+            m_dec.reset(new dec_node(dec_node::interface=veth_b,
+                                     dec_node::neighbor=m_addr_a.c_str(),
+                                     dec_node::hdr_format=hdr_format,
+                                     dec_node::xdp_copy=1,
+                                     dec_node::xdp_frames=size_t(256)));
+        } catch (const std::system_error &e) {
+            m_enc.reset();
+            m_dec.reset();
+            m_skip = e.what();
+
+            return false;
+        }
+
+        return true;
+    }
+
+    /* pump, with the packets queued by the nodes in between kicked out;
+     * answers to hellos are only queued while reading */
+    template<class count_node, class other_node>
+    size_t exchange(count_node &n, other_node &o)
+    {
+        size_t count = 0;
+
+        for (size_t i = 0; i < 4; ++i) {
+            n.flush();
+            o.flush();
+            count += pump(n, o);
+        }
+
+        return count;
+    }
+
+    std::string m_skip;
+};
+
+TEST_F(xdp_sock_test, hello_exchange)
+{
+    if (!open(enc_node::rlnc_wide16))
+        GTEST_SKIP() << m_skip;
+
+    exchange(*m_enc, *m_dec);
+
+    EXPECT_EQ(enc_node::rlnc_wide16, m_enc->rlnc_hdr_format());
+    EXPECT_EQ(dec_node::rlnc_wide16, m_dec->rlnc_hdr_format());
+}
+
+TEST_F(xdp_sock_test, filtered_packets)
+{
+    if (!open(enc_node::rlnc_wide32))
+        GTEST_SKIP() << m_skip;
+
+    exchange(*m_enc, *m_dec);
+
+    ASSERT_EQ(enc_node::rlnc_wide32, m_enc->rlnc_hdr_format());
+
+    /* coded packets reach the decoder, packets not meant for it are
+     * dropped by the filter run on the umem frames */
+    send(*m_enc, [&](enc_node::buffer_ptr &b) { m_enc->rlnc_hdr_add_enc(b); });
+    EXPECT_EQ(1U, exchange(*m_dec, *m_enc));
+
+    send(*m_enc, [&](enc_node::buffer_ptr &b) { m_enc->rlnc_hdr_add_stop(b); });
+    EXPECT_EQ(0U, exchange(*m_dec, *m_enc));
+}
+
+TEST_F(xdp_sock_test, constructor_failure)
+{
+    /* a failing constructor must not leave the interface promiscuous */
+    EXPECT_THROW(enc_node(enc_node::interface=veth_a,
+                          enc_node::neighbor=m_addr_b.c_str(),
+                          enc_node::promisc=1,
+                          enc_node::xdp_copy=1,
+                          enc_node::queue=1000),
+                 std::system_error);
+
+    std::ifstream f(std::string("/sys/class/net/") + veth_a + "/flags");
+    unsigned long flags = 0;
+
+    f >> std::hex >> flags;
+    EXPECT_EQ(0UL, flags & 0x100); /* IFF_PROMISC */
+}
+
+TEST_F(xdp_sock_test, recoder_stack)
+{
+    std::unique_ptr<rec_node> rec;
+
+    try {
+        rec.reset(new rec_node(rec_node::interface=veth_a,
+                               rec_node::neighbor=m_addr_b.c_str(),
+                               rec_node::hdr_format=rec_node::rlnc_wide16,
+                               rec_node::symbols=size_t(8),
+                               rec_node::symbol_size=size_t(100),
+                               rec_node::xdp_copy=1,
+                               rec_node::xdp_frames=size_t(256)));
+        m_dec.reset(new dec_node(dec_node::interface=veth_b,
+                                 dec_node::neighbor=m_addr_a.c_str(),
+                                 dec_node::hdr_format=dec_node::rlnc_wide16,
+                                 dec_node::xdp_copy=1,
+                                 dec_node::xdp_frames=size_t(256)));
+    } catch (const std::system_error &e) {
+        GTEST_SKIP() << e.what();
+    }
+
+    exchange(*rec, *m_dec);
+
+    EXPECT_EQ(rec_node::rlnc_wide16, rec->rlnc_hdr_format());
+    EXPECT_EQ(dec_node::rlnc_wide16, m_dec->rlnc_hdr_format());
+    EXPECT_TRUE(rec->flush());
+}
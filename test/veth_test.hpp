@@ -0,0 +1,99 @@
+#pragma once
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include <gtest/gtest.h>
+
+/* Fixture creating a veth pair for the stacks under test to talk over.
+ * Needs root to create the pair; the tests are skipped otherwise. */
+
+static const char *veth_a = "nmtest0";
+static const char *veth_b = "nmtest1";
+
+class veth_test : public ::testing::Test
+{
+  protected:
+    std::string m_addr_a;
+    std::string m_addr_b;
+
+    static std::string address(const char *iface)
+    {
+        std::ifstream f(std::string("/sys/class/net/") + iface + "/address");
+        std::string addr;
+
+        f >> addr;
+
+        return addr;
+    }
+
+    void SetUp()
+    {
+        std::string cmd = std::string("ip link add ") + veth_a +
+                          " type veth peer name " + veth_b +
+                          " 2>/dev/null && ip link set " + veth_a +
+                          " up && ip link set " + veth_b + " up";
+
+        if (system(cmd.c_str()) != 0)
+            GTEST_SKIP() << "unable to create veth pair (not root?)";
+
+        m_addr_a = address(veth_a);
+        m_addr_b = address(veth_b);
+    }
+
+    void TearDown()
+    {
+        std::string cmd = std::string("ip link del ") + veth_a +
+                          " 2>/dev/null";
+
+        if (system(cmd.c_str()) != 0)
+            return;
+    }
+
+    /* read what arrives at the nodes until nothing did for a while;
+     * returns the packets handed up by the node given as count */
+    template<class count_node, class other_node>
+    size_t pump(count_node &n, other_node &o)
+    {
+        struct pollfd fds[2] = {{n.fd(), POLLIN, 0}, {o.fd(), POLLIN, 0}};
+        size_t count = 0;
+
+        while (poll(fds, 2, 100) > 0) {
+            auto buf = n.buffer();
+            auto other = o.buffer();
+
+            while (n.read_pkt(buf)) {
+                ++count;
+                buf = n.buffer();
+            }
+
+            while (o.read_pkt(other))
+                other = o.buffer();
+        }
+
+        return count;
+    }
+
+    template<class stack>
+    static void nonblock(stack &n)
+    {
+        fcntl(n.fd(), F_SETFL, fcntl(n.fd(), F_GETFL) | O_NONBLOCK);
+    }
+
+    /* send a packet with the header added by add */
+    template<class stack, class function>
+    static void send(stack &n, function add)
+    {
+        auto buf = n.buffer();
+
+        buf->head_reserve(64);
+        memset(buf->data_put(16), 0, 16);
+        add(buf);
+        n.write_pkt(buf);
+    }
+};